@@ -4,6 +4,9 @@
 #include <sstream>
 #include <filesystem>
 
+#include "..\libs\file_operations\file_operations.h"
+#include "arg_validator.h"
+
 /**
  * @file arg_validator.cpp
  *
@@ -21,12 +24,13 @@ void printHelp();
  * Checks if the given filename has a valid extension.
  *
  * This function checks if the filename ends with either ".mrimgx" or ".mrbakx".
- * The check is case-insensitive.
+ * The check is case-insensitive. Any URL query string is ignored.
  *
- * @param filename The filename to check.
+ * @param path The filename or URL to check.
  * @return true if the filename has a valid extension, false otherwise.
  */
-bool isValidExtension(const std::wstring& filename) {
+bool isValidExtension(const std::wstring& path) {
+	std::wstring filename = path.substr(0, path.find(L'?'));
 	if (filename.length() < 7) { // Minimum length to hold either extension
 		return false;
 	}
@@ -63,29 +67,72 @@ std::string convertToUtf8(const std::wstring& wstr)
     return strTo;
 }
 
+/**
+ * Checks if a raw output already exists and can keep its data.
+ *
+ * Memory and streams start empty every time. Windows device paths are not files, and are always
+ * written in place, so they are taken to exist.
+ *
+ * @param path The raw output given with -r.
+ * @return true if the raw output is an existing image file or device, false otherwise.
+ */
+static bool isExistingTarget(const std::wstring& path) {
+    if (path == L"memory:" || path == L"stdout:" || path.rfind(L"\\\\.\\pipe\\", 0) == 0) {
+        return false;
+    }
+    if (path.rfind(L"\\\\.\\", 0) == 0) {
+        return true;
+    }
+    std::error_code error;
+    std::filesystem::file_status status = std::filesystem::status(std::filesystem::path(path), error);
+    return std::filesystem::exists(status) && status.type() != std::filesystem::file_type::fifo;
+}
 
 
 /**
  * @brief Parses command line parameters.
  *
- * This function parses command line parameters and returns a tuple containing the filename, password, output path, and disk number.
+ * This function parses command line parameters and returns a CommandLineParameters struct.
  * The filename is required, while the password, output path, and disk number are optional.
- * The function checks if the filename has a valid extension and if the file exists.
+ * The function checks if the filename has a valid extension and, for local files, if the file exists.
  * If the `-p` parameter is provided, the next parameter is the password.
  * If the `-o` parameter is provided, the next parameter is the output path.
  * If the `-d` parameter is provided, the next parameter is the disk number.
  * If the `-k` parameter is provided, the keepDiskId boolean is set to true.
  * if the 'describe' parameter is provided, a boolean is set to true.
  * if the 'json' parameter is provided, a boolean is set to true.
+ * if the 'verify' or 'verify_all' parameter is provided, a boolean is set to true.
+ * If the `-t` parameter is provided, the next parameter is the number of worker threads.
+ * if the 'native' parameter is provided, a boolean is set to true.
+ * If the `-r` parameter is provided, the next parameter is the raw image file, device, "memory:" or "stdout:" to restore to. Each `-r` after the first adds another raw output.
+ * if the 'qcow2' parameter is provided, a boolean is set to true.
+ * if the 'zstd' parameter is provided, a boolean is set to true.
+ * if the 'chain' parameter is provided, a boolean is set to true.
+ * if the 'fast_copy' parameter is provided, a boolean is set to true.
+ * if the 'mmap' parameter is provided, a boolean is set to true.
+ * if the 'skip_unchanged' parameter is provided, a boolean is set to true. It requires a single existing raw output.
+ * If the `-u` parameter is provided, the next parameter is the earlier backup file the raw output already holds. It requires a single existing raw output.
+ * if the 'verify_target' parameter is provided, a boolean is set to true.
+ * If the `-l` parameter is provided, the next parameter is the journal file of a raw output.
+ * if the 'resume' parameter is provided, a boolean is set to true. It requires a journal file and an existing raw output.
+ * if the 'all_disks' parameter is provided, a boolean is set to true.
+ * If the `-x` parameter is provided, the next parameter is the file the bad block map of a salvaged restore is written to. It cannot be used with all_disks, chain or several raw outputs.
+ * If the `-hc` parameter is provided, the next parameter is when block hashes are checked: inline, deferred or sampled.
+ * If the `-wb` parameter is provided, the next parameter is none, final, or the megabytes written between periodic write-backs.
+ * if the 'keep_cache' parameter is provided, a boolean is set to true.
+ * If the `-rl` parameter is provided, the next parameter is the MB/s the job may read and write, or backup.
+ * If the `-pr` parameter is provided, the next parameter is the priority of the job: idle, below_normal, normal, above_normal or backup.
+ * If the `-cf` parameter is provided, the next parameter is the control file watched for new limits while the job runs.
  * If the `-h` parameter is provided, an exception is thrown to indicate that help is requested.
  * If an unknown parameter is provided, an exception is thrown.
  *
  * @param argc The number of command line parameters.
  * @param argv The command line parameters.
- * @return A tuple containing the filename, password, output path, disk number, keepDiskId, describe, and jsonDump.
- * @throws std::invalid_argument if no filename is provided, if the filename has an invalid extension, if the file does not exist, if help is requested, or if an unknown parameter is provided.
+ * @return The parsed parameters.
+ * @throws std::invalid_argument if no filename is provided, if the filename has an invalid extension, if the file does not exist, if help is requested, if an unknown parameter is provided, if resume is given without a journal file or an existing raw output, if several raw outputs are verified or journaled,
+ *         if skip_unchanged or update_from is given without a single existing raw output, if salvage is given with all_disks, chain or several raw outputs, or if the hash check, write-back mode, rate limit or priority is unknown.
  */
-std::tuple<std::wstring, std::wstring, std::wstring, int, bool, bool, bool> parseCommandLineParameters(int argc, wchar_t* argv[])
+CommandLineParameters parseCommandLineParameters(int argc, wchar_t* argv[])
 {
     // Check if the help parameter is provided
     for (int i = 1; i < argc; i++) {
@@ -99,50 +146,159 @@ std::tuple<std::wstring, std::wstring, std::wstring, int, bool, bool, bool> pars
         throw std::invalid_argument("No filename provided.");
     }
 
+    CommandLineParameters parameters;
     std::wstring filename = argv[1];
     if (!isValidExtension(filename)) {
         throw std::invalid_argument("Invalid file extension. Only .mrimgx and .mrbakx are allowed.");
     }
 
-    // Check if the file exists
+    // Check if the file exists. URLs are checked when the file is first read.
 	std::filesystem::path path = filename;
-	if (!std::filesystem::exists(path)) {
+	if (!isRemotePath(filename) && !std::filesystem::exists(path)) {
 		throw std::invalid_argument("File does not exist.");
 	}
 
-    std::wstring password;
-    std::wstring outputPath;
-    int diskNumber = -1; // Default disk number
-    bool describe = false; // Default describe value
-    bool jsonDump = false; // Default json value
-    bool keepDiskId = false;
+    parameters.filename = filename;
 
     // Parse the optional parameters
     for (int i = 2; i < argc; i++) {
         if ((std::wstring(argv[i]) == L"-p" || std::wstring(argv[i]) == L"password") && i + 1 < argc) {
-            password = argv[++i];
+            parameters.password = argv[++i];
         }
         else if ((std::wstring(argv[i]) == L"-o" || std::wstring(argv[i]) == L"output_path") && i + 1 < argc) {
-            outputPath = argv[++i];
+            parameters.outputPath = argv[++i];
         }
         else if ((std::wstring(argv[i]) == L"-d" || std::wstring(argv[i]) == L"disk") && i + 1 < argc) {
-            diskNumber = std::stoi(argv[++i]);
+            parameters.diskNumber = std::stoi(argv[++i]);
         }
         else if (std::wstring(argv[i]) == L"-desc" || std::wstring(argv[i]) == L"describe") {
-            describe = true;
+            parameters.describe = true;
         }
         else if (std::wstring(argv[i]) == L"-j" || std::wstring(argv[i]) == L"json") {
-            jsonDump = true;
+            parameters.jsonDump = true;
         }
         else if (std::wstring(argv[i]) == L"-k" || std::wstring(argv[i]) == L"keep_id") {
-            keepDiskId = true;
+            parameters.keepDiskId = true;
+        }
+        else if (std::wstring(argv[i]) == L"-v" || std::wstring(argv[i]) == L"verify") {
+            parameters.verify = true;
+        }
+        else if (std::wstring(argv[i]) == L"-va" || std::wstring(argv[i]) == L"verify_all") {
+            parameters.verifyAll = true;
+        }
+        else if ((std::wstring(argv[i]) == L"-t" || std::wstring(argv[i]) == L"threads") && i + 1 < argc) {
+            parameters.threadCount = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if (std::wstring(argv[i]) == L"-n" || std::wstring(argv[i]) == L"native") {
+            parameters.nativeVhdx = true;
+        }
+        else if ((std::wstring(argv[i]) == L"-r" || std::wstring(argv[i]) == L"raw") && i + 1 < argc) {
+            if (parameters.rawOutput.empty()) {
+                parameters.rawOutput = argv[++i];
+            }
+            else {
+                parameters.extraRawOutputs.push_back(argv[++i]);
+            }
+        }
+        else if (std::wstring(argv[i]) == L"-q" || std::wstring(argv[i]) == L"qcow2") {
+            parameters.qcow2 = true;
+        }
+        else if (std::wstring(argv[i]) == L"-z" || std::wstring(argv[i]) == L"zstd") {
+            parameters.seekableZstd = true;
+        }
+        else if (std::wstring(argv[i]) == L"-c" || std::wstring(argv[i]) == L"chain") {
+            parameters.vhdxChain = true;
+        }
+        else if (std::wstring(argv[i]) == L"-f" || std::wstring(argv[i]) == L"fast_copy") {
+            parameters.kernelCopy = true;
+        }
+        else if (std::wstring(argv[i]) == L"-m" || std::wstring(argv[i]) == L"mmap") {
+            parameters.mappedOutput = true;
+        }
+        else if (std::wstring(argv[i]) == L"-s" || std::wstring(argv[i]) == L"skip_unchanged") {
+            parameters.skipUnchanged = true;
+        }
+        else if ((std::wstring(argv[i]) == L"-u" || std::wstring(argv[i]) == L"update_from") && i + 1 < argc) {
+            parameters.syncFrom = argv[++i];
+        }
+        else if (std::wstring(argv[i]) == L"-vt" || std::wstring(argv[i]) == L"verify_target") {
+            parameters.verifyRawOutput = true;
+        }
+        else if ((std::wstring(argv[i]) == L"-l" || std::wstring(argv[i]) == L"journal") && i + 1 < argc) {
+            parameters.journalPath = argv[++i];
+        }
+        else if (std::wstring(argv[i]) == L"-rs" || std::wstring(argv[i]) == L"resume") {
+            parameters.resume = true;
+        }
+        else if (std::wstring(argv[i]) == L"-a" || std::wstring(argv[i]) == L"all_disks") {
+            parameters.allDisks = true;
+        }
+        else if ((std::wstring(argv[i]) == L"-x" || std::wstring(argv[i]) == L"salvage") && i + 1 < argc) {
+            parameters.salvageMap = argv[++i];
+        }
+        else if ((std::wstring(argv[i]) == L"-hc" || std::wstring(argv[i]) == L"hash_check") && i + 1 < argc) {
+            parameters.hashCheck = argv[++i];
+            if (parameters.hashCheck != L"inline" && parameters.hashCheck != L"deferred" && parameters.hashCheck != L"sampled") {
+                throw std::invalid_argument("Unknown hash check " + convertToUtf8(parameters.hashCheck) + ". Use inline, deferred or sampled.");
+            }
+        }
+        else if ((std::wstring(argv[i]) == L"-wb" || std::wstring(argv[i]) == L"write_back") && i + 1 < argc) {
+            parameters.writeBack = argv[++i];
+            if (parameters.writeBack != L"none" && parameters.writeBack != L"final"
+                && (parameters.writeBack.find_first_not_of(L"0123456789") != std::wstring::npos || std::stoul(parameters.writeBack) == 0)) {
+                throw std::invalid_argument("Unknown write-back " + convertToUtf8(parameters.writeBack) + ". Use none, final or a number of megabytes.");
+            }
+        }
+        else if (std::wstring(argv[i]) == L"-kc" || std::wstring(argv[i]) == L"keep_cache") {
+            parameters.keepCache = true;
+        }
+        else if ((std::wstring(argv[i]) == L"-rl" || std::wstring(argv[i]) == L"rate_limit") && i + 1 < argc) {
+            parameters.rateLimit = argv[++i];
+            if (parameters.rateLimit != L"backup"
+                && (parameters.rateLimit.find_first_not_of(L"0123456789") != std::wstring::npos || std::stoul(parameters.rateLimit) == 0)) {
+                throw std::invalid_argument("Unknown rate limit " + convertToUtf8(parameters.rateLimit) + ". Use backup or a number of megabytes per second.");
+            }
+        }
+        else if ((std::wstring(argv[i]) == L"-pr" || std::wstring(argv[i]) == L"priority") && i + 1 < argc) {
+            parameters.priority = argv[++i];
+            if (parameters.priority != L"idle" && parameters.priority != L"below_normal" && parameters.priority != L"normal"
+                && parameters.priority != L"above_normal" && parameters.priority != L"backup") {
+                throw std::invalid_argument("Unknown priority " + convertToUtf8(parameters.priority) + ". Use idle, below_normal, normal, above_normal or backup.");
+            }
+        }
+        else if ((std::wstring(argv[i]) == L"-cf" || std::wstring(argv[i]) == L"control_file") && i + 1 < argc) {
+            parameters.controlFile = argv[++i];
         }
         else {
              throw std::invalid_argument("Unknown parameter " + convertToUtf8(argv[i]));
         }
     }
 
-    return std::make_tuple(filename, password, outputPath, diskNumber, keepDiskId, describe, jsonDump);
+    if (parameters.resume && parameters.journalPath.empty()) {
+        throw std::invalid_argument("A restore can only be resumed from a journal file.");
+    }
+    // A resumed restore relies on the blocks the journal lists still being on the target
+    if (parameters.resume && (parameters.rawOutput.empty() || !isExistingTarget(parameters.rawOutput))) {
+        throw std::invalid_argument("A restore can only be resumed to a raw output that already exists.");
+    }
+    if (!parameters.extraRawOutputs.empty() && (parameters.verifyRawOutput || !parameters.journalPath.empty())) {
+        throw std::invalid_argument("A target can only be verified or journaled on its own.");
+    }
+    // Skipping unchanged blocks and updating from an earlier backup build on the data already in a single raw output
+    if (parameters.skipUnchanged || !parameters.syncFrom.empty()) {
+        if (parameters.rawOutput.empty() || !parameters.extraRawOutputs.empty() || parameters.verifyRawOutput) {
+            throw std::invalid_argument("skip_unchanged and update_from need a single raw output given with -r.");
+        }
+        if (!isExistingTarget(parameters.rawOutput)) {
+            throw std::invalid_argument("skip_unchanged and update_from need a raw output that already exists.");
+        }
+    }
+    // Only a restore of one disk to one target zeroes the bad blocks and writes their map
+    if (!parameters.salvageMap.empty() && (parameters.allDisks || parameters.vhdxChain || !parameters.extraRawOutputs.empty())) {
+        throw std::invalid_argument("salvage cannot be used with all_disks, chain or several raw outputs.");
+    }
+
+    return parameters;
 }
 
 
@@ -150,27 +306,21 @@ std::tuple<std::wstring, std::wstring, std::wstring, int, bool, bool, bool> pars
  * @brief Handles command line parameters.
  *
  * This function uses the parseCommandLineParameters function to parse the command line parameters.
- * It then returns a tuple containing the filename, password, output path, disk number, keepDiskId, describe, and jsonDump.
+ * It then returns the parsed parameters.
  * If the `-h` or `help` parameter is provided, it calls the printHelp function and rethrows the exception.
  * If any other invalid argument exception is thrown, it prints an error message and rethrows the exception.
  *
  * @param argc The number of command line parameters.
  * @param argv The command line parameters.
- * @return A tuple containing the filename, password, output path, disk number, keepDiskId, describe, and jsonDump.
+ * @return The parsed parameters.
  * @throws std::invalid_argument if an error occurs while parsing the command line parameters.
  */
-std::tuple<std::wstring, std::wstring, std::wstring, int, bool, bool, bool> handleCommandLineParameters(int argc, wchar_t* argv[]) {
-	std::wstring filename;
-	std::wstring password;
-	std::wstring outputPath;
-    bool describe = false;
-    bool jsonDump = false;
-    bool keepDiskId = false;
-    int diskNumber = -1;
+CommandLineParameters handleCommandLineParameters(int argc, wchar_t* argv[]) {
+	CommandLineParameters parameters;
 
 	try {
 		// Parse the command line parameters
-		std::tie(filename, password, outputPath, diskNumber, keepDiskId, describe, jsonDump) = parseCommandLineParameters(argc, argv);
+		parameters = parseCommandLineParameters(argc, argv);
 	}
 	catch (const std::invalid_argument& e) {
 		if (std::string(e.what()) == "Help requested.") {
@@ -182,5 +332,5 @@ std::tuple<std::wstring, std::wstring, std::wstring, int, bool, bool, bool> hand
 		throw;
 	}
 
-	return { filename, password, outputPath, diskNumber, keepDiskId, describe, jsonDump };
-}
\ No newline at end of file
+	return parameters;
+}
@@ -1,7 +1,81 @@
 #pragma once
 
+#include <string>
+#include <vector>
+
+/**
+ * @struct CommandLineParameters
+ * @brief The parsed command-line parameters.
+ *
+ * @var filename The backup file to process.
+ * @var password The password for the backup file.
+ * @var outputPath The folder for the VHDX file.
+ * @var diskNumber The disk number to restore. -1 for the first disk.
+ * @var keepDiskId Do not update the disk ID in the restored VHDX.
+ * @var describe Output the backup file's structure and content.
+ * @var jsonDump Output the backup file's json metadata.
+ * @var verify Verify the blocks a restore of the backup file would read, without restoring.
+ * @var verifyAll Verify the blocks in the index of every file in the backup set, without restoring.
+ * @var threadCount The number of worker threads. 0 uses one thread per logical processor, tuned to the throughput for a restore.
+ * @var nativeVhdx Write the VHDX file directly, without creating and mounting it with the virtual disk service.
+ * @var rawOutput A raw image file, device, named pipe, "memory:" or "stdout:" to restore to instead of a VHDX. Empty for a VHDX.
+ * @var extraRawOutputs The raw outputs given after the first, which the disk is restored to at the same time.
+ * @var qcow2 Write a qcow2 image instead of a VHDX.
+ * @var seekableZstd Write the raw disk as a seekable zstd file instead of a VHDX.
+ * @var vhdxChain Write a base VHDX for the full backup and a differencing VHDX for each incremental, instead of a single VHDX.
+ * @var kernelCopy Copy or clone the blocks of an uncompressed, unencrypted backup inside the file system, for a raw output.
+ * @var mappedOutput Write a raw image file through a memory mapping.
+ * @var skipUnchanged Keep the data of a raw output and only write the blocks whose hash differs from the backup.
+ * @var syncFrom An earlier backup file of the set that the raw output holds, to write only the blocks changed since. Empty for a full restore.
+ * @var verifyRawOutput Check the raw output against the backup instead of restoring to it.
+ * @var journalPath A journal file that records the blocks written to a raw output. Empty for no journal.
+ * @var resume Skip the blocks the journal records as written, to resume a failed restore to a raw output.
+ * @var allDisks Restore every disk of the backup at the same time, each to its own VHDX or qcow2 image.
+ * @var salvageMap The file the map of bad blocks is written to. Bad blocks are zeroed and the restore carries on. Empty to stop at the first bad block.
+ * @var hashCheck When the hashes of restored blocks are checked: "inline", "deferred" or "sampled".
+ * @var writeBack When restored data is moved to storage: "none", "final", or the megabytes between periodic write-backs.
+ * @var keepCache Leave the backup files in the system cache after their blocks are decoded.
+ * @var rateLimit The MB/s the job may read and may write, or "backup" for the rate limit of the backup definition. Empty for no limit.
+ * @var priority The CPU and I/O priority of the job: "idle", "below_normal", "normal", "above_normal", or "backup" for the priority of the backup definition. Empty to leave it.
+ * @var controlFile A file watched for new rate limits and priority while the job runs. Empty for none.
+ */
+struct CommandLineParameters
+{
+    std::wstring filename;
+    std::wstring password;
+    std::wstring outputPath;
+    int diskNumber = -1;
+    bool keepDiskId = false;
+    bool describe = false;
+    bool jsonDump = false;
+    bool verify = false;
+    bool verifyAll = false;
+    unsigned threadCount = 0;
+    bool nativeVhdx = false;
+    std::wstring rawOutput;
+    std::vector<std::wstring> extraRawOutputs;
+    bool qcow2 = false;
+    bool seekableZstd = false;
+    bool vhdxChain = false;
+    bool kernelCopy = false;
+    bool mappedOutput = false;
+    bool skipUnchanged = false;
+    std::wstring syncFrom;
+    bool verifyRawOutput = false;
+    std::wstring journalPath;
+    bool resume = false;
+    bool allDisks = false;
+    std::wstring salvageMap;
+    std::wstring hashCheck = L"inline";
+    std::wstring writeBack = L"final";
+    bool keepCache = false;
+    std::wstring rateLimit;
+    std::wstring priority;
+    std::wstring controlFile;
+};
+
 // Validates the command-line arguments.
-std::tuple<std::wstring, std::wstring, std::wstring, int, bool, bool, bool> handleCommandLineParameters(int argc, wchar_t* argv[]);
+CommandLineParameters handleCommandLineParameters(int argc, wchar_t* argv[]);
 
 // Converts a wide string to a UTF-8 string.
 std::string convertToUtf8(const std::wstring& wstr);
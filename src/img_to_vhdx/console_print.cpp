@@ -6,6 +6,7 @@
 #include "..\dependencies\include\nlohmann\json.hpp"
 #include "..\dependencies\include\zstd\zstd.h"
 #include "..\libs\file_reader\file_reader.h"
+#include "..\libs\restore\restore.h"
 
 /**
  * @file console_print.cpp
@@ -53,14 +54,37 @@ void printDisclaimer() {
  * each parameter and whether it is optional or required.
  */
 void printHelp() {
-	std::wcout << L"Usage: filename [-p password] [-d disk] [-k keep_id] [-o output_path] [-desc describe] [-j json] [-h help]\n";
-	std::wcout << L"filename: The name of the file to process.\n";
+	std::wcout << L"Usage: filename [-p password] [-d disk] [-k keep_id] [-o output_path] [-desc describe] [-j json] [-v verify] [-va verify_all] [-t threads] [-n native] [-q qcow2] [-z zstd] [-c chain] [-r raw] [-f fast_copy] [-m mmap] [-s skip_unchanged] [-u update_from] [-vt verify_target] [-l journal] [-rs resume] [-a all_disks] [-x salvage] [-hc hash_check] [-wb write_back] [-kc keep_cache] [-rl rate_limit] [-pr priority] [-cf control_file] [-h help]\n";
+	std::wcout << L"filename: The name of the file to process, or an http(s) URL of the file on an object store.\n";
 	std::wcout << L"-p password:\tThe password for the backup file (optional).\n";
 	std::wcout << L"-d disk:\tThe disk number to restore (defaults to first disk if not supplied).\n";
 	std::wcout << L"-k keep_id:\tDo not update the disk ID in the restored VHDX.\n";
-	std::wcout << L"-o output_path:\tThe path for the VHDX (optional, defaults to backup file location).\n";
+	std::wcout << L"-o output_path:\tThe path for the VHDX (optional, defaults to backup file location, or the current folder for a URL).\n";
 	std::wcout << L"-desc describe:\tOutputs the backup file's structure and content.\n";
 	std::wcout << L"-j json:\tOutputs the backup file's json metadata.\n";
+	std::wcout << L"-v verify:\tChecks every block a restore would read, without restoring.\n";
+	std::wcout << L"-va verify_all:\tChecks every block in every file of the backup set, without restoring.\n";
+	std::wcout << L"-t threads:\tThe number of threads used to restore or verify (defaults to one per processor, tuned to the throughput for a restore).\n";
+	std::wcout << L"-n native:\tWrite the VHDX directly, without mounting it. Administrator rights are not needed.\n";
+	std::wcout << L"-q qcow2:\tWrite a qcow2 image for QEMU and KVM instead of a VHDX. Compressed blocks are copied as they are.\n";
+	std::wcout << L"-z zstd:\tWrite the raw disk as a seekable zstd file instead of a VHDX. Compressed blocks are copied as they are.\n";
+	std::wcout << L"-c chain:\tWrite a base VHDX for the full backup and a differencing VHDX for each incremental.\n";
+	std::wcout << L"-r raw:\tRestore to a raw image file or disk device instead of a VHDX. \"memory:\" discards the data, to time a restore. \"stdout:\" streams the disk. Repeat to restore to several at once.\n";
+	std::wcout << L"-f fast_copy:\tWith -r, copy or clone the blocks of an uncompressed, unencrypted backup inside the file system. Their hashes are not checked.\n";
+	std::wcout << L"-m mmap:\tWith -r, write the raw image file through a memory mapping, so blocks are decoded straight into it.\n";
+	std::wcout << L"-s skip_unchanged:\tWith -r, keep the data already in the image file or on the device and only write the blocks that differ from the backup.\n";
+	std::wcout << L"-u update_from:\tWith -r, bring an image file or device that holds a restore of an earlier backup file of the set up to date, writing only the blocks changed since.\n";
+	std::wcout << L"-vt verify_target:\tWith -r, check a restored image file or device against the backup instead of restoring, and list the ranges that differ.\n";
+	std::wcout << L"-l journal:\tWith -r, record the blocks written in a journal file, so a failed restore can be resumed.\n";
+	std::wcout << L"-rs resume:\tWith -r and -l, skip the blocks the journal records as written and restore only the rest.\n";
+	std::wcout << L"-a all_disks:\tRestore every disk of the backup at the same time, each to its own VHDX, or qcow2 image with -q.\n";
+	std::wcout << L"-x salvage:\tZero the blocks that cannot be read or decoded and carry on, writing a JSON map of them to the given file. One disk to one target only.\n";
+	std::wcout << L"-hc hash_check:\tWhen restored blocks are hash checked: inline (default) before writing, deferred after writing on separate threads, or sampled, checking one block in 64.\n";
+	std::wcout << L"-wb write_back:\tWhen restored data is moved to storage: none (left to the system), final (default, one flush at the end) or N to write back every N MB written, keeping the cache small.\n";
+	std::wcout << L"-kc keep_cache:\tLeave the backup files in the system cache after a restore has read them, rather than dropping each block once decoded.\n";
+	std::wcout << L"-rl rate_limit:\tLimit the reads and the writes of a restore or verify to N MB/s each, or backup to use the rate limit of the backup definition.\n";
+	std::wcout << L"-pr priority:\tRun at idle, below_normal, normal or above_normal CPU and I/O priority, or backup to use the priority of the backup definition.\n";
+	std::wcout << L"-cf control_file:\tWatch the given file for new rate limits and priority while the restore or verify runs.\n";
 	std::wcout << L"-h help:\tDisplay this help message.\n";
 	std::wcout << L"\n";
 	std::wcout << L"Examples:\n";
@@ -70,6 +94,21 @@ void printHelp() {
 	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx\n";
 	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx describe\n";
 	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx json\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx verify_all -t 8\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx verify -rl 50 -pr idle -cf C:\\throttle.txt\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx native -o C:\\output\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup-02-02.mrimgx chain -o C:\\output\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup-02-02.mrimgx qcow2 chain -o C:\\output\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx zstd -o C:\\output\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx all_disks -o C:\\output\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx -r D:\\disk.img\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx -r D:\\disk.img fast_copy\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx -r D:\\disk.img salvage D:\\disk-bad-blocks.json\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx -r D:\\disk.img hash_check deferred\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx -r \\\\.\\PhysicalDrive2 write_back 64\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx -r \\\\.\\PhysicalDrive2 -r \\\\.\\PhysicalDrive3\n";
+	std::wcout << L"\timg_to_vhdx.exe c:\\backup.mrimgx -r stdout: | zstd -o C:\\output\\disk.img.zst\n";
+	std::wcout << L"\timg_to_vhdx.exe https://s3.example.com/bucket/backups/backup.mrimgx -o C:\\output\n";
 
 	// Exit the program
 	exit(0);
@@ -296,3 +335,141 @@ void outputProgress(const uint64_t totalBytes, uint64_t& bytesSoFar, std::chrono
 		lastUpdateTime = now;
 	}
 }
+
+/**
+ * @brief Prints the result of a verification.
+ *
+ * This function outputs the number of blocks and bytes checked, followed by one line for each
+ * bad block with the backup file, the offset of the block in the file, the disk and partition,
+ * the first sector of the block on the restored disk and the reason it failed.
+ *
+ * @param report The verification report.
+ */
+void printVerifyReport(const VerifyReport& report) {
+	std::cout << "\n\nBlocks checked:\t" << report.blocks_checked << " (" << formatBytes(report.bytes_checked) << ")\n";
+	if (report.bad_blocks.empty()) {
+		std::cout << "Verify successful. No bad blocks found.\n";
+		return;
+	}
+	std::cout << "Bad blocks:\t" << report.bad_blocks.size() << "\n\n";
+	for (const auto& badBlock : report.bad_blocks) {
+		std::wcout << badBlock.file_name;
+		std::cout << "\n\tFile offset: " << badBlock.file_position << ", length: " << badBlock.block_length
+			<< ", disk: " << badBlock.disk_number << ", partition: " << badBlock.partition_number
+			<< ", disk LBA: " << badBlock.disk_lba << "\n\t" << badBlock.error << "\n";
+	}
+}
+
+/**
+ * @brief Prints the result of a verification of a restored disk.
+ *
+ * This function outputs the number of blocks and bytes checked, followed by one line for each
+ * range of the disk that does not match the backup, with its offset, length and the reason.
+ *
+ * @param report The verification report.
+ */
+void printTargetVerifyReport(const TargetVerifyReport& report) {
+	std::cout << "\n\nBlocks checked:\t" << report.blocks_checked << " (" << formatBytes(report.bytes_checked) << ")\n";
+	if (report.mismatches.empty()) {
+		std::cout << "Verify successful. The target matches the backup.\n";
+		return;
+	}
+	std::cout << "Bad ranges:\t" << report.mismatches.size() << "\n\n";
+	for (const auto& mismatch : report.mismatches) {
+		std::cout << "Disk offset: " << mismatch.disk_offset << ", length: " << mismatch.length << "\n\t" << mismatch.error << "\n";
+	}
+}
+
+/**
+ * @brief Prints the result of a restore to several targets.
+ *
+ * This function outputs one line for each target, with the bytes written to it,
+ * or the error that made the restore drop it.
+ *
+ * @param outputs The paths of the targets.
+ * @param results The result for each target.
+ */
+void printFanOutReport(const std::vector<std::wstring>& outputs, const std::vector<FanOutResult>& results) {
+	std::cout << "\n\n";
+	for (size_t i = 0; i < outputs.size() && i < results.size(); ++i) {
+		if (results[i].error.empty()) {
+			std::wcout << L"Written:\t" << outputs[i];
+			std::cout << " (" << formatBytes(results[i].bytes_written) << ")\n";
+		}
+		else {
+			std::wcout << L"Failed:\t\t" << outputs[i];
+			std::cout << "\n\t" << results[i].error << "\n";
+		}
+	}
+}
+
+/**
+ * @brief Prints the progress of each target of a restore to several targets.
+ *
+ * This function overwrites one line with the percentage written to each target, in the order
+ * of the targets, or "failed" for a target the restore dropped.
+ *
+ * @param results The bytes written to each target so far, and why a target failed.
+ * @param totalBytes The number of bytes each target will be written.
+ */
+void printFanOutProgress(const std::vector<FanOutResult>& results, uint64_t totalBytes) {
+	std::ostringstream line;
+	line << "\rProgress:";
+	for (size_t i = 0; i < results.size(); ++i) {
+		line << " [" << (i + 1) << "] ";
+		if (!results[i].error.empty()) {
+			line << "failed";
+		}
+		else {
+			line << (totalBytes ? (int)((results[i].bytes_written * 100) / totalBytes) : 100) << "%";
+		}
+	}
+	std::cout << line.str() << "       " << std::flush;
+}
+
+/**
+ * @brief Prints the blocks a salvaged restore could not restore.
+ *
+ * This function outputs the number of bad blocks, which were zeroed on the restored disk, followed by
+ * one line for each block with its first sector, sector count, partition and the reason.
+ *
+ * @param badBlocks The bad blocks, in disk order.
+ * @param mapPath The file the bad block map was written to.
+ */
+void printSalvageReport(const std::vector<BadBlock>& badBlocks, const std::wstring& mapPath) {
+	std::cout << "\n\nRestore completed with bad blocks. They were zeroed on the restored disk.\n";
+	std::cout << "Bad blocks:\t" << badBlocks.size() << "\n\n";
+	for (const auto& badBlock : badBlocks) {
+		std::cout << "Disk LBA: " << badBlock.disk_lba << ", sectors: " << badBlock.sector_count
+			<< ", partition: " << badBlock.partition_number << "\n\t" << badBlock.error << "\n";
+	}
+	std::wcout << L"\nMap:\t\t" << mapPath << L"\n";
+}
+
+/**
+ * @brief Prints how a restore moved its data from the system cache to storage.
+ *
+ * This function outputs the write-back mode, the number of periodic write-backs, the most data that was
+ * dirty in the cache at once and, if the data was left for the system to write back, how much is still dirty.
+ *
+ * @param stats The write-back counts of the target.
+ * @param policy The write-back policy of the restore.
+ */
+void printWriteBackReport(const WriteBackStats& stats, const WriteBackPolicy& policy) {
+	std::cout << "\nWrite-back:\t";
+	switch (policy.durability) {
+	case Durability::eNone:
+		std::cout << "none\n";
+		break;
+	case Durability::eFinalFlush:
+		std::cout << "final flush\n";
+		break;
+	case Durability::ePeriodic:
+		std::cout << "every " << formatBytes(policy.interval_bytes) << ", " << stats.write_backs << " write-backs\n";
+		break;
+	}
+	std::cout << "Peak dirty:\t" << formatBytes(stats.peak_dirty_bytes) << "\n";
+	if (policy.durability == Durability::eNone) {
+		std::cout << "Left dirty:\t" << formatBytes(stats.dirty_bytes) << "\n";
+	}
+}
@@ -11,3 +11,21 @@ void describeFile(const file_structs::fileLayout& layout);
 
 // Outputs the progress of the restore.
 void outputProgress(const uint64_t totalBytes, uint64_t& bytesSoFar, std::chrono::steady_clock::time_point& lastUpdateTime);
+
+// Prints the result of a verification.
+void printVerifyReport(const VerifyReport& report);
+
+// Prints the result of a verification of a restored disk.
+void printTargetVerifyReport(const TargetVerifyReport& report);
+
+// Prints the blocks a salvaged restore could not restore.
+void printSalvageReport(const std::vector<BadBlock>& badBlocks, const std::wstring& mapPath);
+
+// Prints the result of a restore to several targets.
+void printFanOutReport(const std::vector<std::wstring>& outputs, const std::vector<FanOutResult>& results);
+
+// Prints the progress of each target of a restore to several targets.
+void printFanOutProgress(const std::vector<FanOutResult>& results, uint64_t totalBytes);
+
+// Prints how a restore moved its data from the system cache to storage.
+void printWriteBackReport(const WriteBackStats& stats, const WriteBackPolicy& policy);
@@ -34,10 +34,13 @@ The program uses the following libraries:
 #pragma comment(lib, "ws2_32.lib")
 #pragma comment(lib, "zlib.lib")
 #pragma comment(lib, "VirtDisk.lib")
+#pragma comment(lib, "winhttp.lib")
 
 
 #include <windows.h>
+#include <csignal>
 #include <iostream>
+#include <fstream>
 
 #include "..\libs\file_reader\file_reader.h"
 #include "..\libs\vhdx_manager\vhdx_manager.h"
@@ -53,6 +56,16 @@ The program uses the following libraries:
 // Function to read and parse the backup file
 file_structs::fileLayout handleBackupFile(const std::wstring& filename, const std::string& password);
 
+#ifndef _WIN32
+/**
+ * @brief Handles SIGHUP by asking the control file watcher to read its file again.
+ *
+ * @param signal The signal number.
+ */
+static void onHangup(int) {
+    ThrottleControl::requestReload();
+}
+#endif
 
 /**
  * @brief The main function of the program.
@@ -61,6 +74,18 @@ file_structs::fileLayout handleBackupFile(const std::wstring& filename, const st
  * page to UTF-8, prints a disclaimer, and then handles the command line
  * parameters, backup file, and VHDX file. If the 'describe' flag is set,
  * it outputs the backup file's structure and content and then exits the program.
+ * If a verify flag is set, it checks every block of the backup set and prints
+ * a report of any bad blocks. If a raw output is set, it restores the disk to
+ * that image file, device or memory target instead of a VHDX, decoding each
+ * block once for several raw outputs, or with the 'verify_target' flag checks
+ * that target against the backup. If the 'native'
+ * flag is set, it writes the VHDX file directly without mounting it. If the
+ * 'chain' flag is set, it writes a base VHDX file for the full backup and a
+ * differencing VHDX file for each incremental backup. If the 'all_disks' flag
+ * is set, it restores every disk at once, each to its own VHDX file. If the
+ * 'qcow2' flag is set, it writes qcow2 images instead, backed by one another
+ * for a chain. If the 'zstd' flag is set, it writes the raw disk as a
+ * seekable zstd file.
  * Otherwise, it restores the first disk (or entered disk number) to the VHDX
  * file and waits for the user to press any key before dismounting the VHDX
  * file and exiting the program. If any exceptions occur, it prints them to
@@ -68,26 +93,41 @@ file_structs::fileLayout handleBackupFile(const std::wstring& filename, const st
  *
  * @param argc The number of command line parameters.
  * @param argv The command line parameters.
- * @return 0 if the program runs successfully, or 1 if an exception occurs.
+ * @return 0 if the program runs successfully, 1 if an exception occurs, or 2 if verification finds bad blocks or mismatches,
+ *         or a salvaged restore zeroed bad blocks.
  */
 int wmain(int argc, wchar_t* argv[]) {
 
     // Set the console code page to UTF-8
     SetConsoleOutputCP(CP_UTF8);
 
+#ifndef _WIN32
+    // SIGHUP makes a control file be read again at once. It is installed once, here, as the libraries leave signals alone.
+    std::signal(SIGHUP, onHangup);
+#endif
+
     try {
         // Handle the command line parameters and get the filename, password, outputPath, diskNumber, and describe flag
-        auto [filename, password, outputPath, diskNumber, keepDiskId, describe, jsonDump] = handleCommandLineParameters(argc, argv);
+        CommandLineParameters parameters = handleCommandLineParameters(argc, argv);
+        const std::wstring& filename = parameters.filename;
+        int diskNumber = parameters.diskNumber;
+        bool keepDiskId = parameters.keepDiskId;
+
+        // A disk streamed to standard output must not be mixed with messages, so they are written to standard error
+        if (parameters.rawOutput == L"stdout:") {
+            std::cout.rdbuf(std::cerr.rdbuf());
+            std::wcout.rdbuf(std::wcerr.rdbuf());
+        }
 
         // Convert the password from wide string to UTF-8 format. This is necessary because the encryption functions
         // used later in the program expect the password to be in UTF-8 format.
-        auto passwordInUtf8Format = convertToUtf8(password);
+        auto passwordInUtf8Format = convertToUtf8(parameters.password);
 
         // Read the backup file and parse its JSON data into a backupFile object
         auto backupFile = handleBackupFile(filename, passwordInUtf8Format);
 
         // If the 'jsonDump' flag is set, output the JSON data from the backup file and exit the program
-        if (jsonDump) {
+        if (parameters.jsonDump) {
             std::cout << backupFile.jsonStr << std::endl;
             return 0;
         }
@@ -96,28 +136,202 @@ int wmain(int argc, wchar_t* argv[]) {
         printDisclaimer();
 
         // If the 'describe' flag is set, output the backup file's structure and content, then exit the program.
-        if (describe) {
+        if (parameters.describe) {
             describeFile(backupFile);
             return 0;
         }
+
+        // Throttle the job so it leaves room for other work: set its priority and rate limit, and watch the control file
+        // for new ones while it runs. "backup" takes them from the backup definition, whose rate limit is in KB/s.
+        const auto& backupDefinition = backupFile._auxiliary_data.backup_definition;
+        if (!parameters.priority.empty()) {
+            auto priority = parameters.priority == L"backup" ? backupDefinition.cpu_priority
+                : nlohmann::json(convertToUtf8(parameters.priority)).get<ImageEnums::CPUPrority>();
+            if (!applyPriority(priority)) {
+                std::cout << "Warning: the priority could only be partly applied.\n";
+            }
+        }
+        JobLimiters limiters;
+        if (!parameters.rateLimit.empty()) {
+            uint64_t rate = parameters.rateLimit == L"backup" ? static_cast<uint64_t>(std::max(0, backupDefinition.rate_limit)) * 1024
+                : std::stoull(parameters.rateLimit) * 1024 * 1024;
+            limiters.reads.setRate(rate);
+            limiters.writes.setRate(rate);
+        }
+        std::unique_ptr<ThrottleControl> throttleControl;
+        if (!parameters.controlFile.empty()) {
+            throttleControl = std::make_unique<ThrottleControl>(parameters.controlFile, limiters);
+        }
+
+        // If a verify flag is set, check every block of the backup set without restoring it, then exit the program.
+        if (parameters.verify || parameters.verifyAll) {
+            std::wcout << L"Verifying:\t" << filename << L"\n\n";
+            VerifyScope scope = parameters.verifyAll ? VerifyScope::eAllFiles : VerifyScope::eBackupSet;
+            auto report = verifyBackup(filename, passwordInUtf8Format, scope, parameters.threadCount, outputProgress, &limiters);
+            printVerifyReport(report);
+            // Return 2 to indicate that the backup set contains bad blocks
+            return report.bad_blocks.empty() ? 0 : 2;
+        }
+        RestoreOptions restoreOptions;
+        restoreOptions.disk_number = diskNumber;
+        restoreOptions.keep_disk_id = keepDiskId;
+        restoreOptions.thread_count = parameters.threadCount;
+        restoreOptions.kernel_copy = parameters.kernelCopy;
+        restoreOptions.skip_unchanged = parameters.skipUnchanged;
+        restoreOptions.sync_from = parameters.syncFrom;
+        restoreOptions.journal_path = parameters.journalPath;
+        restoreOptions.resume = parameters.resume;
+        restoreOptions.continue_on_error = !parameters.salvageMap.empty();
+        if (parameters.hashCheck == L"deferred") {
+            restoreOptions.hash_check = HashCheck::eDeferred;
+        }
+        else if (parameters.hashCheck == L"sampled") {
+            restoreOptions.hash_check = HashCheck::eSampled;
+        }
+        if (parameters.writeBack == L"none") {
+            restoreOptions.write_back.durability = Durability::eNone;
+        }
+        else if (parameters.writeBack != L"final") {
+            restoreOptions.write_back.durability = Durability::ePeriodic;
+            restoreOptions.write_back.interval_bytes = std::stoull(parameters.writeBack) * 1024 * 1024;
+        }
+        restoreOptions.drop_behind = !parameters.keepCache;
+        restoreOptions.limiters = &limiters;
+        // A thread count given on the command line is used as it is, rather than tuned
+        restoreOptions.autotune = parameters.threadCount == 0;
+
+        // Restores the disk to a target. With 'salvage', writes the map of the blocks that could not be restored,
+        // and returns 2 if there are any. With 'write_back', reports the data left dirty in the cache.
+        auto restoreToTarget = [&](RestoreTarget& target) {
+            auto badBlocks = restoreDisk(filename, passwordInUtf8Format, target, restoreOptions, outputProgress);
+            if (!parameters.salvageMap.empty()) {
+                std::ofstream map(std::filesystem::path(parameters.salvageMap), std::ios::binary);
+                map << formatBadBlockMap(badBlocks);
+                if (!map) {
+                    throw std::runtime_error("Failed to write the bad block map.");
+                }
+            }
+            int result = 0;
+            if (!badBlocks.empty()) {
+                printSalvageReport(badBlocks, parameters.salvageMap);
+                result = 2;
+            }
+            else {
+                std::cout << "\n\nRestore successful.\n";
+            }
+            if (parameters.writeBack != L"final") {
+                printWriteBackReport(target.getWriteBackStats(), restoreOptions.write_back);
+            }
+            return result;
+        };
+
+        // If a raw output is given, restore to the image file, device or memory instead of a VHDX, then exit the program.
+        if (!parameters.rawOutput.empty()) {
+            if (parameters.verifyRawOutput) {
+                std::wcout << L"Verifying:\t" << parameters.rawOutput << L"\n";
+                std::wcout << L"Against:\t" << filename << L"\n\n";
+                auto target = openRestoreTarget(parameters.rawOutput, false, false, true);
+                auto report = verifyTarget(filename, passwordInUtf8Format, *target, restoreOptions, outputProgress);
+                printTargetVerifyReport(report);
+                // Return 2 to indicate that the target does not match the backup
+                return report.mismatches.empty() ? 0 : 2;
+            }
+            // With several raw outputs, decode each block once and write it to all of them
+            if (!parameters.extraRawOutputs.empty()) {
+                std::vector<std::wstring> outputs{ parameters.rawOutput };
+                outputs.insert(outputs.end(), parameters.extraRawOutputs.begin(), parameters.extraRawOutputs.end());
+                std::vector<SharedTarget> targets;
+                std::wcout << L"Restoring:\t" << filename << L"\n";
+                for (const auto& output : outputs) {
+                    std::wcout << L"To:\t\t" << output << L"\n";
+                    targets.push_back(openRestoreTarget(output, false, parameters.mappedOutput));
+                }
+                std::wcout << L"\n";
+                // Each target is written at its own speed, so show the progress of each one
+                auto results = restoreDiskToTargets(filename, passwordInUtf8Format, targets, restoreOptions, nullptr, printFanOutProgress);
+                printFanOutReport(outputs, results);
+                // Return 1 to indicate that a target failed
+                bool anyFailed = std::any_of(results.begin(), results.end(), [](const FanOutResult& result) { return !result.error.empty(); });
+                std::cout << (anyFailed ? "\nRestore failed for some targets.\n" : "\nRestore successful.\n");
+                return anyFailed ? 1 : 0;
+            }
+            std::wcout << L"Restoring:\t" << filename << L"\n";
+            std::wcout << L"To:\t\t" << parameters.rawOutput << L"\n\n";
+            bool keepData = parameters.skipUnchanged || !parameters.syncFrom.empty() || parameters.resume;
+            auto target = openRestoreTarget(parameters.rawOutput, false, parameters.mappedOutput, keepData);
+            return restoreToTarget(*target);
+        }
+
+        // If the 'chain' flag is set, write a VHDX chain that mirrors the incremental chain, then exit the program.
+        if (parameters.vhdxChain) {
+            std::vector<std::wstring> vhdxNames;
+            auto openTarget = parameters.qcow2 ? makeQCOW2ChainFactory(parameters.outputPath, diskNumber, vhdxNames)
+                : makeVHDXChainFactory(parameters.outputPath, backupFile.disks[0]._geometry.bytes_per_sector, vhdxNames);
+            std::wcout << L"Restoring:\t" << filename << L"\n\n";
+            restoreChain(filename, passwordInUtf8Format, restoreOptions, openTarget, outputProgress);
+            std::cout << "\n\nRestore successful.\n";
+            for (const auto& vhdxName : vhdxNames) {
+                std::wcout << L"Written:\t" << vhdxName << L"\n";
+            }
+            return 0;
+        }
+
+        // If the 'all_disks' flag is set, restore every disk at once, each to its own image, then exit the program.
+        if (parameters.allDisks) {
+            std::vector<std::wstring> imageNames;
+            auto openTarget = makeAllDisksFactory(filename, parameters.outputPath, parameters.qcow2, imageNames);
+            std::wcout << L"Restoring:\t" << filename << L"\n\n";
+            restoreAllDisks(filename, passwordInUtf8Format, restoreOptions, openTarget, outputProgress);
+            std::cout << "\n\nRestore successful.\n";
+            for (const auto& imageName : imageNames) {
+                std::wcout << L"Written:\t" << imageName << L"\n";
+            }
+            return 0;
+        }
+
         // Prepare the VHDX file name
         std::wstring vhdxName;
+
+        // If the 'qcow2' flag is set, write a qcow2 image instead of a VHDX file, then exit the program.
+        if (parameters.qcow2) {
+            auto target = handleQCOW2File(filename, parameters.outputPath, vhdxName, backupFile, diskNumber);
+            std::wcout << L"Restoring:\t" << filename << L"\n";
+            std::wcout << L"To:\t\t" << vhdxName << L"\n\n";
+            return restoreToTarget(*target);
+        }
+
+        // If the 'zstd' flag is set, write the raw disk as a seekable zstd file instead of a VHDX file, then exit the program.
+        if (parameters.seekableZstd) {
+            auto target = handleSeekableZstdFile(filename, parameters.outputPath, vhdxName);
+            std::wcout << L"Restoring:\t" << filename << L"\n";
+            std::wcout << L"To:\t\t" << vhdxName << L"\n\n";
+            return restoreToTarget(*target);
+        }
+
+        // If the 'native' flag is set, write the VHDX file directly without mounting it, then exit the program.
+        if (parameters.nativeVhdx) {
+            auto target = handleNativeVHDXFile(filename, parameters.outputPath, vhdxName, backupFile);
+            std::wcout << L"Restoring:\t" << filename << L"\n";
+            std::wcout << L"To:\t\t" << vhdxName << L"\n\n";
+            return restoreToTarget(*target);
+        }
         // Create and mount the VHDX file
-        auto vhdxManager = handleVHDXFile(filename, outputPath, vhdxName, backupFile, diskNumber);
+        auto vhdxManager = handleVHDXFile(filename, parameters.outputPath, vhdxName, backupFile, diskNumber);
 
         // Print the restoring and to messages
         std::wcout << L"Restoring:\t" << filename << L"\n";
         std::wcout << L"To:\t\t" << vhdxName << L"\n\n";
         // Restore to the VHDX file
-        restoreDisk(filename, passwordInUtf8Format, vhdxManager.GetDiskPath(), diskNumber, keepDiskId, outputProgress);
+        auto target = openRestoreTarget(vhdxManager.GetDiskPath(), false);
+        int result = restoreToTarget(*target);
+        target.reset();
 
         // Update the properties of the VHDX file. This operation refreshes the system's view of the disk,
         // which is necessary after making changes to the disk, such as restoring a backup to it.
         if (!keepDiskId) {
             vhdxManager.UpdateDiskProperties(); // Only required if we're mounting the disk
         }
-        // Print the success message and wait for the user to press any key before dismounting the VHDX file and exiting the program
-        std::cout << "\n\nRestore successful.\n";
+        // Wait for the user to press any key before dismounting the VHDX file and exiting the program
         if (!keepDiskId) {
             std::cout << "The restored file system(s) can be viewed in Windows File Explorer.\n";
             std::cout << "If not visible, please check the Windows Disk Management Console\n";
@@ -125,6 +339,7 @@ int wmain(int argc, wchar_t* argv[]) {
             std::cout << "Press any key to dismount the VHDX and exit . . .\n";
             std::cin.get();
         }
+        return result;
     }
     catch (const std::exception& e) {
         // Print any exceptions that occur
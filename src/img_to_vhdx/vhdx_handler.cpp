@@ -2,6 +2,7 @@
 #include <windows.h>
 #include "..\libs\file_reader\file_reader.h"
 #include "..\libs\vhdx_manager\vhdx_manager.h"
+#include "..\libs\restore\restore.h"
 
 /**
  * @file vhdx_handler.cpp
@@ -18,31 +19,33 @@
  * @brief Prepares the VHDX file name.
  *
  * This function constructs the VHDX file name based on the provided filename and outputPath.
+ * For a URL, the VHDX file name is taken from the object name and placed in the current folder.
  * If the outputPath is not empty and valid, it replaces the path in vhdxName with outputPath.
  * If the outputPath is not empty but invalid, it throws a runtime error.
  * It also deletes the VHDX file if it already exists.
  *
  * @param filename The name of the file to process.
  * @param outputPath The path where the output should be written (optional).
+ * @param extension The extension of the output file, ".vhdx" unless another image format is written.
  * @return The prepared VHDX file name.
  * @throws std::runtime_error If the outputPath is not empty but invalid, or if failed to delete existing VHDX file.
  */
-std::wstring prepareVhdxFileName(const std::wstring& filename, const std::wstring& outputPath) {
-    // Initialize vhdxName with the filename
-    std::wstring vhdxName = filename;
+std::wstring prepareVhdxFileName(const std::wstring& filename, const std::wstring& outputPath, const std::wstring& extension = L".vhdx") {
+    // Initialize vhdxName with the filename, or the object name for a URL
+    std::wstring vhdxName = isRemotePath(filename) ? getSourceFileName(filename) : filename;
     // Find the position of ".mrimgx" in vhdxName
     std::wstring::size_type index = vhdxName.rfind(L".mrimgx");
 
     // If ".mrimgx" is found, replace it with ".vhdx"
     if (index != std::wstring::npos) {
-        vhdxName.replace(index, 7, L".vhdx");
+        vhdxName.replace(index, 7, extension);
     }
     else {
         // If ".mrimgx" is not found, find the position of ".mrbakx" in vhdxName
         index = vhdxName.rfind(L".mrbakx");
         // If ".mrbakx" is found, replace it with ".vhdx"
         if (index != std::wstring::npos) {
-            vhdxName.replace(index, 7, L".vhdx");
+            vhdxName.replace(index, 7, extension);
         }
     }
 
@@ -100,3 +103,184 @@ VHDXManager handleVHDXFile(const std::wstring& filename, const std::wstring& out
     // Return the VHDXManager object
     return vhdxManager;
 }
+
+
+/**
+ * @brief Creates a VHDX file that the restore writes directly.
+ *
+ * This function constructs the VHDX file name and creates a dynamic VHDX file with the sector size of the
+ * backed up disk. The VHDX is laid out by VHDXWriter, so the virtual disk service, administrator rights and
+ * a mount are not needed. The disk size is set when the restore prepares the target.
+ *
+ * @param filename The name of the backup file.
+ * @param outputPath The path where the output should be written (optional).
+ * @param vhdxName A reference to a string where the VHDX file name will be stored.
+ * @param backupFile The backupFile object that holds the parsed JSON data from the backup file.
+ * @return The VHDX writer to restore to.
+ */
+std::shared_ptr<VHDXWriter> handleNativeVHDXFile(const std::wstring& filename, const std::wstring& outputPath, std::wstring& vhdxName, const file_structs::fileLayout& backupFile) {
+    // Construct the .vhdx file name
+    vhdxName = prepareVhdxFileName(filename, outputPath);
+
+    // Create the VHDX file with the bytes per sector of the backed up disk
+    return std::make_shared<VHDXWriter>(vhdxName, backupFile.disks[0]._geometry.bytes_per_sector);
+}
+
+
+/**
+ * @brief Creates the factory that opens a native VHDX file for each backup file of an incremental chain.
+ *
+ * Each VHDX file is named after its backup file. The base VHDX, for the full backup, is a dynamic VHDX.
+ * Each newer VHDX is a differencing VHDX whose parent is the VHDX opened before it, so opening the
+ * newest VHDX presents the disk as it was at the newest backup, and each older VHDX presents an older
+ * point in time. Differencing VHDX files use the smaller block size Hyper-V uses for them.
+ *
+ * @param outputPath The path where the output should be written (optional).
+ * @param sectorSize The bytes per sector of the backed up disk.
+ * @param vhdxNames A reference to a vector where the VHDX file names will be stored, oldest first.
+ * @return The factory to pass to restoreChain.
+ */
+ChainTargetFactory makeVHDXChainFactory(const std::wstring& outputPath, uint32_t sectorSize, std::vector<std::wstring>& vhdxNames) {
+    auto previous = std::make_shared<std::shared_ptr<VHDXWriter>>();
+    return [=, &vhdxNames](const file_structs::fileLayout&, const std::wstring& backupFileName, bool base) -> SharedTarget {
+        // Construct the .vhdx file name from the backup file name
+        std::wstring vhdxName = prepareVhdxFileName(backupFileName, outputPath);
+        vhdxNames.push_back(vhdxName);
+
+        std::shared_ptr<VHDXWriter> writer;
+        if (base) {
+            writer = std::make_shared<VHDXWriter>(vhdxName, sectorSize);
+        }
+        else {
+            writer = std::make_shared<VHDXWriter>(vhdxName, sectorSize, false, VHDXWriter::DIFFERENCING_BLOCK_SIZE);
+            writer->setParent(**previous);
+        }
+        *previous = writer;
+        return writer;
+    };
+}
+
+
+/**
+ * @brief Chooses the qcow2 cluster size for a disk.
+ *
+ * Blocks that fill a whole cluster are copied into the qcow2 image as zstd compressed clusters
+ * without being decompressed, so the cluster size is the block size of the partition with the
+ * most blocks. The qcow2 default is used if that block size is not a valid cluster size.
+ *
+ * @param disk The disk to restore.
+ * @return The cluster size.
+ */
+static uint32_t getQCOW2ClusterSize(const file_structs::Disk::DiskLayout& disk) {
+    const file_structs::Partition::PartitionLayout* largest = nullptr;
+    for (const auto& partition : disk.partitions) {
+        if (largest == nullptr || partition.data_blocks.size() > largest->data_blocks.size()) {
+            largest = &partition;
+        }
+    }
+    uint32_t blockSize = largest ? largest->_header.block_size : 0;
+    if (blockSize < 4096 || blockSize > 2 * 1024 * 1024 || (blockSize & (blockSize - 1)) != 0) {
+        return QCOW2Writer::DEFAULT_CLUSTER_SIZE;
+    }
+    return blockSize;
+}
+
+
+/**
+ * @brief Creates a qcow2 image file that the restore writes directly.
+ *
+ * This function constructs the image file name and creates a qcow2 image with the block size
+ * of the backed up disk as its cluster size, so compressed blocks are stored as they are.
+ *
+ * @param filename The name of the backup file.
+ * @param outputPath The path where the output should be written (optional).
+ * @param imageName A reference to a string where the image file name will be stored.
+ * @param backupFile The backupFile object that holds the parsed JSON data from the backup file.
+ * @param diskNumber The number of the disk to be restored (-1 means the first disk in the backup file).
+ * @return The qcow2 writer to restore to.
+ */
+std::shared_ptr<QCOW2Writer> handleQCOW2File(const std::wstring& filename, const std::wstring& outputPath, std::wstring& imageName, const file_structs::fileLayout& backupFile, int diskNumber) {
+    file_structs::Disk::DiskLayout diskToRestore;
+    getDiskToRestoreFromDiskNumber(backupFile, diskNumber, diskToRestore);
+
+    // Construct the .qcow2 file name
+    imageName = prepareVhdxFileName(filename, outputPath, L".qcow2");
+    return std::make_shared<QCOW2Writer>(imageName, getQCOW2ClusterSize(diskToRestore));
+}
+
+
+/**
+ * @brief Creates the factory that opens an image for each disk of a backup, to restore every disk at once.
+ *
+ * Each image is named after the backup file and the disk number. The images are native VHDX files with
+ * the sector size of their disk, or qcow2 images with the block size of their disk as the cluster size.
+ *
+ * @param filename The name of the backup file.
+ * @param outputPath The path where the output should be written (optional).
+ * @param qcow2 True to write qcow2 images instead of VHDX files.
+ * @param imageNames A reference to a vector where the image file names will be stored, in disk order.
+ * @return The factory to pass to restoreAllDisks.
+ */
+DiskTargetFactory makeAllDisksFactory(const std::wstring& filename, const std::wstring& outputPath, bool qcow2, std::vector<std::wstring>& imageNames) {
+    return [=, &imageNames](const file_structs::Disk::DiskLayout& disk) -> SharedTarget {
+        // Construct the file name from the backup file name and the disk number
+        std::wstring suffix = L"-disk" + std::to_wstring(disk._header.disk_number) + (qcow2 ? L".qcow2" : L".vhdx");
+        std::wstring imageName = prepareVhdxFileName(filename, outputPath, suffix);
+        imageNames.push_back(imageName);
+
+        if (qcow2) {
+            return std::make_shared<QCOW2Writer>(imageName, getQCOW2ClusterSize(disk));
+        }
+        return std::make_shared<VHDXWriter>(imageName, disk._geometry.bytes_per_sector);
+    };
+}
+
+
+/**
+ * @brief Creates a seekable zstd file of the raw disk that the restore writes directly.
+ *
+ * This function constructs the file name and creates the writer, which copies the stored
+ * zstd frames of the blocks into the file without decompressing them.
+ *
+ * @param filename The name of the backup file.
+ * @param outputPath The path where the output should be written (optional).
+ * @param imageName A reference to a string where the file name will be stored.
+ * @return The seekable zstd writer to restore to.
+ */
+std::shared_ptr<SeekableZstdWriter> handleSeekableZstdFile(const std::wstring& filename, const std::wstring& outputPath, std::wstring& imageName) {
+    // Construct the .zst file name
+    imageName = prepareVhdxFileName(filename, outputPath, L".zst");
+    return std::make_shared<SeekableZstdWriter>(imageName);
+}
+
+
+/**
+ * @brief Creates the factory that opens a qcow2 image for each backup file of an incremental chain.
+ *
+ * Each image is named after its backup file. Each image after the base has the image opened before
+ * it as its backing file, so opening the newest image presents the disk as it was at the newest backup.
+ *
+ * @param outputPath The path where the output should be written (optional).
+ * @param diskNumber The number of the disk to be restored (-1 means the first disk in the backup file).
+ * @param imageNames A reference to a vector where the image file names will be stored, oldest first.
+ * @return The factory to pass to restoreChain.
+ */
+ChainTargetFactory makeQCOW2ChainFactory(const std::wstring& outputPath, int diskNumber, std::vector<std::wstring>& imageNames) {
+    auto previous = std::make_shared<std::shared_ptr<QCOW2Writer>>();
+    return [=, &imageNames](const file_structs::fileLayout& layout, const std::wstring& backupFileName, bool base) -> SharedTarget {
+        int layoutDiskNumber = diskNumber;
+        file_structs::Disk::DiskLayout disk;
+        getDiskToRestoreFromDiskNumber(layout, layoutDiskNumber, disk);
+
+        // Construct the .qcow2 file name from the backup file name
+        std::wstring imageName = prepareVhdxFileName(backupFileName, outputPath, L".qcow2");
+        imageNames.push_back(imageName);
+
+        auto writer = std::make_shared<QCOW2Writer>(imageName, getQCOW2ClusterSize(disk));
+        if (!base) {
+            writer->setBackingFile(*previous);
+        }
+        *previous = writer;
+        return writer;
+    };
+}
@@ -1,4 +1,22 @@
 #pragma once
 
+// Function to create a VHDX file written directly by the restore, without mounting it
+std::shared_ptr<VHDXWriter> handleNativeVHDXFile(const std::wstring& filename, const std::wstring& outputPath, std::wstring& vhdxName, const file_structs::fileLayout& backupFile);
+
+// Function to open a chain of native VHDX files, a base VHDX and a differencing VHDX for each incremental
+ChainTargetFactory makeVHDXChainFactory(const std::wstring& outputPath, uint32_t sectorSize, std::vector<std::wstring>& vhdxNames);
+
+// Function to create a qcow2 image written directly by the restore
+std::shared_ptr<QCOW2Writer> handleQCOW2File(const std::wstring& filename, const std::wstring& outputPath, std::wstring& imageName, const file_structs::fileLayout& backupFile, int diskNumber);
+
+// Function to open a chain of qcow2 images, a base image and an image backed by the one before it for each incremental
+ChainTargetFactory makeQCOW2ChainFactory(const std::wstring& outputPath, int diskNumber, std::vector<std::wstring>& imageNames);
+
+// Function to open a native VHDX or qcow2 image for each disk of a backup, to restore every disk at once
+DiskTargetFactory makeAllDisksFactory(const std::wstring& filename, const std::wstring& outputPath, bool qcow2, std::vector<std::wstring>& imageNames);
+
+// Function to create a seekable zstd file of the raw disk, which copies the stored zstd frames of the blocks
+std::shared_ptr<SeekableZstdWriter> handleSeekableZstdFile(const std::wstring& filename, const std::wstring& outputPath, std::wstring& imageName);
+
 // Function to handle VHDX file creation and mounting
 VHDXManager handleVHDXFile(const std::wstring& filename, const std::wstring& outputPath, std::wstring& vhdxName, const file_structs::fileLayout& backupFile, int diskNumber);
@@ -0,0 +1,115 @@
+#include "pch.h"
+#include "framework.h"
+#include "cpu_features.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_FEATURES_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+/**
+ * @file
+ * @brief This file implements runtime detection of the x86 instruction set extensions
+ * used by the SIMD hash and checksum kernels.
+ *
+ * @copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+ * @license MIT License
+ */
+
+#ifdef CPU_FEATURES_X86
+
+/**
+ * @brief Executes CPUID for the given leaf and subleaf.
+ *
+ * @param leaf The CPUID leaf (EAX).
+ * @param subleaf The CPUID subleaf (ECX).
+ * @param registers Receives EAX, EBX, ECX and EDX.
+ */
+static void _cpuid(uint32_t leaf, uint32_t subleaf, uint32_t registers[4])
+{
+#if defined(_MSC_VER)
+	int values[4];
+	__cpuidex(values, static_cast<int>(leaf), static_cast<int>(subleaf));
+	for (int i = 0; i < 4; ++i) {
+		registers[i] = static_cast<uint32_t>(values[i]);
+	}
+#else
+	__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+/**
+ * @brief Reads the XCR0 register, which reports the register state saved by the operating system.
+ */
+static uint64_t _readXCR0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+/**
+ * @brief Queries the CPU and the operating system for the supported extensions.
+ */
+static CpuFeatures _detectCpuFeatures()
+{
+	CpuFeatures features;
+	uint32_t registers[4];
+
+	_cpuid(0, 0, registers);
+	uint32_t maxLeaf = registers[0];
+	if (maxLeaf < 1) {
+		return features;
+	}
+
+	_cpuid(1, 0, registers);
+	features.sse42 = (registers[2] & (1u << 20)) != 0;
+	features.pclmul = (registers[2] & (1u << 1)) != 0;
+	bool osxsave = (registers[2] & (1u << 27)) != 0;
+	bool avx = (registers[2] & (1u << 28)) != 0;
+
+	// AVX registers are only usable if the operating system saves the YMM state (XCR0 bits 1 and 2),
+	// and AVX-512 registers only if it also saves the opmask and ZMM state (XCR0 bits 5, 6 and 7)
+	uint64_t xcr0 = osxsave ? _readXCR0() : 0;
+	bool ymmState = (xcr0 & 0x6) == 0x6;
+	bool zmmState = (xcr0 & 0xE6) == 0xE6;
+
+	if (maxLeaf >= 7) {
+		_cpuid(7, 0, registers);
+		features.avx2 = avx && ymmState && (registers[1] & (1u << 5)) != 0;
+		features.avx512f = zmmState && (registers[1] & (1u << 16)) != 0;
+		features.avx512vl = features.avx512f && (registers[1] & (1u << 31)) != 0;
+		features.vpclmulqdq = ymmState && (registers[2] & (1u << 10)) != 0;
+	}
+	return features;
+}
+
+#else
+
+static CpuFeatures _detectCpuFeatures()
+{
+	return CpuFeatures();
+}
+
+#endif
+
+/**
+ * @brief Returns the instruction set extensions available to this process.
+ *
+ * The CPU is queried on the first call. Initialization of the function-local static is thread-safe.
+ *
+ * @return The available extensions.
+ */
+const CpuFeatures& getCpuFeatures()
+{
+	static const CpuFeatures features = _detectCpuFeatures();
+	return features;
+}
@@ -0,0 +1,44 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief Runtime detection of the CPU instruction set extensions used by the SIMD kernels.
+ *
+ * The SIMD kernels are always compiled, and are selected at runtime only when both the CPU
+ * and the operating system support them. On other architectures every feature reports false.
+ */
+
+/**
+ * @struct CpuFeatures
+ * @brief The instruction set extensions available to this process.
+ *
+ * @var sse42 SSE4.2, including the CRC32 instruction.
+ * @var pclmul Carry-less multiplication (PCLMULQDQ).
+ * @var avx2 AVX2, with the AVX register state enabled by the operating system.
+ * @var avx512f AVX-512 Foundation, with the AVX-512 register state enabled by the operating system.
+ * @var avx512vl AVX-512 Vector Length extensions.
+ * @var vpclmulqdq Carry-less multiplication on 256-bit and 512-bit vectors.
+ */
+struct CpuFeatures
+{
+	bool sse42 = false;
+	bool pclmul = false;
+	bool avx2 = false;
+	bool avx512f = false;
+	bool avx512vl = false;
+	bool vpclmulqdq = false;
+};
+
+/**
+ * @brief Returns the instruction set extensions available to this process.
+ *
+ * The CPU is queried once. The function is thread-safe.
+ */
+const CpuFeatures& getCpuFeatures();
@@ -133,3 +133,38 @@ void getDerivedKey(const uint8_t(&imageid)[8], const std::string& strPassword, c
  * @throws std::runtime_error If an error occurs during hash computation.
  */
 std::array<uint8_t, MD5_LENGTH> computeMD5Hash(const uint8_t* inputData, size_t inputDataLength);
+
+/**
+ * @struct MD5Job
+ * @brief One message for `computeMD5HashBatch`.
+ *
+ * @var data The message.
+ * @var length The length of the message in bytes.
+ * @var hash Receives the MD5 hash of the message.
+ */
+struct MD5Job
+{
+	const uint8_t* data = nullptr;
+	size_t length = 0;
+	std::array<uint8_t, MD5_LENGTH> hash = {};
+};
+
+/**
+ * @brief Computes the MD5 hash of each of the given messages.
+ *
+ * The messages are independent and are hashed side by side using AVX2 or AVX-512 where the
+ * CPU supports it, or one at a time using OpenSSL otherwise. For the best throughput, pass
+ * at least `getMD5BatchWidth()` messages of similar length.
+ *
+ * @param jobs The messages. The hash of each is stored in its job.
+ * @param count The number of messages.
+ * @throws std::runtime_error If an error occurs during hash computation.
+ */
+void computeMD5HashBatch(MD5Job* jobs, size_t count);
+
+/**
+ * @brief Returns the number of messages `computeMD5HashBatch` hashes at once on this CPU.
+ *
+ * @return 16 with AVX-512, 8 with AVX2, otherwise 1.
+ */
+size_t getMD5BatchWidth();
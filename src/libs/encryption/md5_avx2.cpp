@@ -0,0 +1,79 @@
+#include "pch.h"
+#include "framework.h"
+#include <cstring>
+
+/**
+ * @file
+ * @brief This file implements the 8-lane AVX2 multi-buffer MD5 kernel.
+ *
+ * The kernel is compiled for AVX2 regardless of the compiler settings. It is only called
+ * when the CPU supports AVX2.
+ *
+ * @copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+ * @license MIT License
+ */
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#elif defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#endif
+
+#include "md5_lanes.h"
+
+namespace
+{
+
+	/**
+	 * @brief 32-bit lane operations on 256-bit AVX2 vectors.
+	 */
+	struct AVX2Ops
+	{
+		typedef __m256i Vec;
+		static constexpr int LANES = 8;
+
+		static Vec load(const uint32_t* p) { return _mm256_load_si256(reinterpret_cast<const __m256i*>(p)); }
+		static void store(uint32_t* p, Vec v) { _mm256_store_si256(reinterpret_cast<__m256i*>(p), v); }
+		static Vec set1(int value) { return _mm256_set1_epi32(value); }
+		static Vec add(Vec a, Vec b) { return _mm256_add_epi32(a, b); }
+
+		static Vec F(Vec b, Vec c, Vec d) { return _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d))); }
+		static Vec G(Vec b, Vec c, Vec d) { return _mm256_xor_si256(c, _mm256_and_si256(d, _mm256_xor_si256(b, c))); }
+		static Vec H(Vec b, Vec c, Vec d) { return _mm256_xor_si256(_mm256_xor_si256(b, c), d); }
+		static Vec I(Vec b, Vec c, Vec d) { return _mm256_xor_si256(c, _mm256_or_si256(b, _mm256_xor_si256(d, _mm256_set1_epi32(-1)))); }
+
+		template <int S>
+		static Vec rotl(Vec x) { return _mm256_or_si256(_mm256_slli_epi32(x, S), _mm256_srli_epi32(x, 32 - S)); }
+
+		static void loadBlocks(const uint8_t* const* blocks, Vec* words)
+		{
+			md5Transpose8(blocks, 0, words);
+			md5Transpose8(blocks, 32, words + 8);
+		}
+	};
+
+}
+
+/**
+ * @brief Hashes the messages using 8 AVX2 lanes.
+ *
+ * @param jobs The messages.
+ * @param count The number of messages.
+ */
+void md5HashLanesAVX2(const MD5LaneJob* jobs, size_t count)
+{
+	md5HashLanes<AVX2Ops>(jobs, count);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#elif defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif
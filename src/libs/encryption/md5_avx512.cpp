@@ -0,0 +1,89 @@
+#include "pch.h"
+#include "framework.h"
+#include <cstring>
+
+/**
+ * @file
+ * @brief This file implements the 16-lane AVX-512 multi-buffer MD5 kernel.
+ *
+ * The round functions use a single ternary logic instruction and the rotations a single
+ * rotate instruction, which AVX2 does not have. The kernel is compiled for AVX-512
+ * regardless of the compiler settings. It is only called when the CPU supports AVX2 and AVX-512F.
+ *
+ * @copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+ * @license MIT License
+ */
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC target("avx2,avx512f")
+#elif defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,avx512f"))), apply_to = function)
+#endif
+
+#include "md5_lanes.h"
+
+namespace
+{
+
+	/**
+	 * @brief 32-bit lane operations on 512-bit AVX-512 vectors.
+	 */
+	struct AVX512Ops
+	{
+		typedef __m512i Vec;
+		static constexpr int LANES = 16;
+
+		static Vec load(const uint32_t* p) { return _mm512_load_si512(p); }
+		static void store(uint32_t* p, Vec v) { _mm512_store_si512(p, v); }
+		static Vec set1(int value) { return _mm512_set1_epi32(value); }
+		static Vec add(Vec a, Vec b) { return _mm512_add_epi32(a, b); }
+
+		// The immediates are the truth tables of the round functions for the inputs (b, c, d)
+		static Vec F(Vec b, Vec c, Vec d) { return _mm512_ternarylogic_epi32(b, c, d, 0xCA); }
+		static Vec G(Vec b, Vec c, Vec d) { return _mm512_ternarylogic_epi32(b, c, d, 0xE4); }
+		static Vec H(Vec b, Vec c, Vec d) { return _mm512_ternarylogic_epi32(b, c, d, 0x96); }
+		static Vec I(Vec b, Vec c, Vec d) { return _mm512_ternarylogic_epi32(b, c, d, 0x39); }
+
+		template <int S>
+		static Vec rotl(Vec x) { return _mm512_rol_epi32(x, S); }
+
+		static void loadBlocks(const uint8_t* const* blocks, Vec* words)
+		{
+			// Transpose lanes 0-7 and 8-15 separately and join them
+			__m256i low[16];
+			__m256i high[16];
+			md5Transpose8(blocks, 0, low);
+			md5Transpose8(blocks, 32, low + 8);
+			md5Transpose8(blocks + 8, 0, high);
+			md5Transpose8(blocks + 8, 32, high + 8);
+			for (int i = 0; i < 16; ++i) {
+				words[i] = _mm512_inserti64x4(_mm512_zextsi256_si512(low[i]), high[i], 1);
+			}
+		}
+	};
+
+}
+
+/**
+ * @brief Hashes the messages using 16 AVX-512 lanes.
+ *
+ * @param jobs The messages.
+ * @param count The number of messages.
+ */
+void md5HashLanesAVX512(const MD5LaneJob* jobs, size_t count)
+{
+	md5HashLanes<AVX512Ops>(jobs, count);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#elif defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif
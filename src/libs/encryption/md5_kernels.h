@@ -0,0 +1,42 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief Internal interface between `computeMD5HashBatch` and the multi-buffer MD5 kernels.
+ *
+ * Each kernel hashes several independent messages at once, one message per SIMD lane.
+ * The kernels are compiled for their instruction set regardless of the compiler settings,
+ * so they must only be called after `getCpuFeatures` has confirmed support.
+ */
+
+/**
+ * @struct MD5LaneJob
+ * @brief One message for a multi-buffer MD5 kernel.
+ *
+ * @var data The message.
+ * @var length The length of the message in bytes.
+ * @var hash Receives the MD5_LENGTH byte digest.
+ */
+struct MD5LaneJob
+{
+	const uint8_t* data;
+	size_t length;
+	uint8_t* hash;
+};
+
+/**
+ * @brief Hashes the messages using 8 AVX2 lanes. Requires AVX2.
+ */
+void md5HashLanesAVX2(const MD5LaneJob* jobs, size_t count);
+
+/**
+ * @brief Hashes the messages using 16 AVX-512 lanes. Requires AVX2 and AVX-512F.
+ */
+void md5HashLanesAVX512(const MD5LaneJob* jobs, size_t count);
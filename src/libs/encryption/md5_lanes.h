@@ -0,0 +1,302 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief The lane scheduler and MD5 rounds shared by the multi-buffer MD5 kernels.
+ *
+ * This header is included only by the kernel source files, after the compiler has been
+ * told to target the kernel's instruction set. It must not include any standard library
+ * headers, and must not use any standard library templates: an instantiation compiled for
+ * AVX2 or AVX-512 could be picked by the linker for code that runs on any CPU.
+ *
+ * A kernel supplies an `Ops` type with:
+ * - `Vec`, the vector type, and `LANES`, the number of 32-bit lanes in it.
+ * - `load`, `store`, `set1` and `add` on 32-bit lanes.
+ * - The MD5 round functions `F`, `G`, `H` and `I`, and `rotl<S>`.
+ * - `loadBlocks`, which transposes one 64-byte block per lane into the 16 message words.
+ */
+
+#include "md5_kernels.h"
+
+constexpr size_t MD5_BLOCK_SIZE = 64;
+
+/**
+ * @brief Transposes 32 bytes from each of 8 blocks into 8 vectors of one word per block.
+ *
+ * @param blocks The 8 blocks.
+ * @param offset The offset of the 32 bytes in each block.
+ * @param words Receives the words. words[j] holds word j of the 32 bytes for blocks 0 to 7.
+ */
+static inline void md5Transpose8(const uint8_t* const* blocks, size_t offset, __m256i* words)
+{
+	__m256i r0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[0] + offset));
+	__m256i r1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[1] + offset));
+	__m256i r2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[2] + offset));
+	__m256i r3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[3] + offset));
+	__m256i r4 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[4] + offset));
+	__m256i r5 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[5] + offset));
+	__m256i r6 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[6] + offset));
+	__m256i r7 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks[7] + offset));
+
+	// Interleave pairs of blocks: words 0,1 (and 4,5 in the high half) and words 2,3 (and 6,7)
+	__m256i t0 = _mm256_unpacklo_epi32(r0, r1);
+	__m256i t1 = _mm256_unpackhi_epi32(r0, r1);
+	__m256i t2 = _mm256_unpacklo_epi32(r2, r3);
+	__m256i t3 = _mm256_unpackhi_epi32(r2, r3);
+	__m256i t4 = _mm256_unpacklo_epi32(r4, r5);
+	__m256i t5 = _mm256_unpackhi_epi32(r4, r5);
+	__m256i t6 = _mm256_unpacklo_epi32(r6, r7);
+	__m256i t7 = _mm256_unpackhi_epi32(r6, r7);
+
+	// Gather one word from four blocks in each 128-bit half
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	// Join the halves for blocks 0-3 and 4-7
+	words[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	words[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	words[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	words[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	words[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	words[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	words[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	words[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+#define MD5_STEP(f, a, b, c, d, w, k, s) \
+	a = Ops::add(b, Ops::template rotl<s>(Ops::add(Ops::add(a, Ops::f(b, c, d)), Ops::add(w, Ops::set1(static_cast<int>(k))))))
+
+/**
+ * @brief Applies the MD5 compression function to one block per lane.
+ *
+ * @param state The A, B, C and D state words, LANES per word.
+ * @param blocks One 64-byte block per lane.
+ */
+template <typename Ops>
+static void md5CompressLanes(uint32_t (*state)[Ops::LANES], const uint8_t* const* blocks)
+{
+	typedef typename Ops::Vec Vec;
+	Vec w[16];
+	Ops::loadBlocks(blocks, w);
+
+	Vec a = Ops::load(state[0]);
+	Vec b = Ops::load(state[1]);
+	Vec c = Ops::load(state[2]);
+	Vec d = Ops::load(state[3]);
+	Vec aa = a, bb = b, cc = c, dd = d;
+
+	MD5_STEP(F, a, b, c, d, w[0], 0xd76aa478, 7);
+	MD5_STEP(F, d, a, b, c, w[1], 0xe8c7b756, 12);
+	MD5_STEP(F, c, d, a, b, w[2], 0x242070db, 17);
+	MD5_STEP(F, b, c, d, a, w[3], 0xc1bdceee, 22);
+	MD5_STEP(F, a, b, c, d, w[4], 0xf57c0faf, 7);
+	MD5_STEP(F, d, a, b, c, w[5], 0x4787c62a, 12);
+	MD5_STEP(F, c, d, a, b, w[6], 0xa8304613, 17);
+	MD5_STEP(F, b, c, d, a, w[7], 0xfd469501, 22);
+	MD5_STEP(F, a, b, c, d, w[8], 0x698098d8, 7);
+	MD5_STEP(F, d, a, b, c, w[9], 0x8b44f7af, 12);
+	MD5_STEP(F, c, d, a, b, w[10], 0xffff5bb1, 17);
+	MD5_STEP(F, b, c, d, a, w[11], 0x895cd7be, 22);
+	MD5_STEP(F, a, b, c, d, w[12], 0x6b901122, 7);
+	MD5_STEP(F, d, a, b, c, w[13], 0xfd987193, 12);
+	MD5_STEP(F, c, d, a, b, w[14], 0xa679438e, 17);
+	MD5_STEP(F, b, c, d, a, w[15], 0x49b40821, 22);
+
+	MD5_STEP(G, a, b, c, d, w[1], 0xf61e2562, 5);
+	MD5_STEP(G, d, a, b, c, w[6], 0xc040b340, 9);
+	MD5_STEP(G, c, d, a, b, w[11], 0x265e5a51, 14);
+	MD5_STEP(G, b, c, d, a, w[0], 0xe9b6c7aa, 20);
+	MD5_STEP(G, a, b, c, d, w[5], 0xd62f105d, 5);
+	MD5_STEP(G, d, a, b, c, w[10], 0x02441453, 9);
+	MD5_STEP(G, c, d, a, b, w[15], 0xd8a1e681, 14);
+	MD5_STEP(G, b, c, d, a, w[4], 0xe7d3fbc8, 20);
+	MD5_STEP(G, a, b, c, d, w[9], 0x21e1cde6, 5);
+	MD5_STEP(G, d, a, b, c, w[14], 0xc33707d6, 9);
+	MD5_STEP(G, c, d, a, b, w[3], 0xf4d50d87, 14);
+	MD5_STEP(G, b, c, d, a, w[8], 0x455a14ed, 20);
+	MD5_STEP(G, a, b, c, d, w[13], 0xa9e3e905, 5);
+	MD5_STEP(G, d, a, b, c, w[2], 0xfcefa3f8, 9);
+	MD5_STEP(G, c, d, a, b, w[7], 0x676f02d9, 14);
+	MD5_STEP(G, b, c, d, a, w[12], 0x8d2a4c8a, 20);
+
+	MD5_STEP(H, a, b, c, d, w[5], 0xfffa3942, 4);
+	MD5_STEP(H, d, a, b, c, w[8], 0x8771f681, 11);
+	MD5_STEP(H, c, d, a, b, w[11], 0x6d9d6122, 16);
+	MD5_STEP(H, b, c, d, a, w[14], 0xfde5380c, 23);
+	MD5_STEP(H, a, b, c, d, w[1], 0xa4beea44, 4);
+	MD5_STEP(H, d, a, b, c, w[4], 0x4bdecfa9, 11);
+	MD5_STEP(H, c, d, a, b, w[7], 0xf6bb4b60, 16);
+	MD5_STEP(H, b, c, d, a, w[10], 0xbebfbc70, 23);
+	MD5_STEP(H, a, b, c, d, w[13], 0x289b7ec6, 4);
+	MD5_STEP(H, d, a, b, c, w[0], 0xeaa127fa, 11);
+	MD5_STEP(H, c, d, a, b, w[3], 0xd4ef3085, 16);
+	MD5_STEP(H, b, c, d, a, w[6], 0x04881d05, 23);
+	MD5_STEP(H, a, b, c, d, w[9], 0xd9d4d039, 4);
+	MD5_STEP(H, d, a, b, c, w[12], 0xe6db99e5, 11);
+	MD5_STEP(H, c, d, a, b, w[15], 0x1fa27cf8, 16);
+	MD5_STEP(H, b, c, d, a, w[2], 0xc4ac5665, 23);
+
+	MD5_STEP(I, a, b, c, d, w[0], 0xf4292244, 6);
+	MD5_STEP(I, d, a, b, c, w[7], 0x432aff97, 10);
+	MD5_STEP(I, c, d, a, b, w[14], 0xab9423a7, 15);
+	MD5_STEP(I, b, c, d, a, w[5], 0xfc93a039, 21);
+	MD5_STEP(I, a, b, c, d, w[12], 0x655b59c3, 6);
+	MD5_STEP(I, d, a, b, c, w[3], 0x8f0ccc92, 10);
+	MD5_STEP(I, c, d, a, b, w[10], 0xffeff47d, 15);
+	MD5_STEP(I, b, c, d, a, w[1], 0x85845dd1, 21);
+	MD5_STEP(I, a, b, c, d, w[8], 0x6fa87e4f, 6);
+	MD5_STEP(I, d, a, b, c, w[15], 0xfe2ce6e0, 10);
+	MD5_STEP(I, c, d, a, b, w[6], 0xa3014314, 15);
+	MD5_STEP(I, b, c, d, a, w[13], 0x4e0811a1, 21);
+	MD5_STEP(I, a, b, c, d, w[4], 0xf7537e82, 6);
+	MD5_STEP(I, d, a, b, c, w[11], 0xbd3af235, 10);
+	MD5_STEP(I, c, d, a, b, w[2], 0x2ad7d2bb, 15);
+	MD5_STEP(I, b, c, d, a, w[9], 0xeb86d391, 21);
+
+	Ops::store(state[0], Ops::add(a, aa));
+	Ops::store(state[1], Ops::add(b, bb));
+	Ops::store(state[2], Ops::add(c, cc));
+	Ops::store(state[3], Ops::add(d, dd));
+}
+
+#undef MD5_STEP
+
+/**
+ * @struct MD5Lane
+ * @brief The message being hashed in one lane.
+ *
+ * @var job The message, or nullptr if the lane is idle.
+ * @var next The next full block of the message.
+ * @var fullBlocks The number of full blocks left.
+ * @var tailBlocks The number of padded blocks at the end of the message, 1 or 2.
+ * @var tailDone The number of padded blocks hashed.
+ * @var tail The padded blocks: the last partial block, the 0x80 terminator and the bit length.
+ */
+struct MD5Lane
+{
+	const MD5LaneJob* job;
+	const uint8_t* next;
+	size_t fullBlocks;
+	size_t tailBlocks;
+	size_t tailDone;
+	uint8_t tail[2 * MD5_BLOCK_SIZE];
+};
+
+/**
+ * @brief Starts hashing a message in a lane.
+ *
+ * @param lane The lane.
+ * @param state The state words of all lanes.
+ * @param index The index of the lane.
+ * @param job The message.
+ */
+template <int LANES>
+static void md5StartLane(MD5Lane& lane, uint32_t (*state)[LANES], int index, const MD5LaneJob* job)
+{
+	lane.job = job;
+	lane.next = job->data;
+	lane.fullBlocks = job->length / MD5_BLOCK_SIZE;
+	lane.tailDone = 0;
+
+	size_t remainder = job->length % MD5_BLOCK_SIZE;
+	lane.tailBlocks = remainder < MD5_BLOCK_SIZE - 8 ? 1 : 2;
+	size_t tailLength = lane.tailBlocks * MD5_BLOCK_SIZE;
+	memset(lane.tail, 0, tailLength);
+	if (remainder > 0) {
+		memcpy(lane.tail, job->data + lane.fullBlocks * MD5_BLOCK_SIZE, remainder);
+	}
+	lane.tail[remainder] = 0x80;
+	uint64_t bitLength = static_cast<uint64_t>(job->length) * 8;
+	for (int i = 0; i < 8; ++i) {
+		lane.tail[tailLength - 8 + i] = static_cast<uint8_t>(bitLength >> (8 * i));
+	}
+
+	state[0][index] = 0x67452301;
+	state[1][index] = 0xefcdab89;
+	state[2][index] = 0x98badcfe;
+	state[3][index] = 0x10325476;
+}
+
+/**
+ * @brief Hashes the messages, one message per lane.
+ *
+ * Lanes are refilled with the next message as soon as they finish, so messages of different
+ * lengths keep every lane busy until the last few messages. Idle lanes hash a block of zeros.
+ *
+ * @param jobs The messages.
+ * @param count The number of messages.
+ */
+template <typename Ops>
+static void md5HashLanes(const MD5LaneJob* jobs, size_t count)
+{
+	constexpr int LANES = Ops::LANES;
+	alignas(64) uint32_t state[4][LANES] = {};
+	static const uint8_t zeroBlock[MD5_BLOCK_SIZE] = {};
+	MD5Lane lanes[LANES];
+	const uint8_t* blocks[LANES];
+
+	size_t nextJob = 0;
+	int activeLanes = 0;
+	for (int i = 0; i < LANES; ++i) {
+		lanes[i].job = nullptr;
+		if (nextJob < count) {
+			md5StartLane<LANES>(lanes[i], state, i, &jobs[nextJob++]);
+			++activeLanes;
+		}
+	}
+
+	while (activeLanes > 0) {
+		for (int i = 0; i < LANES; ++i) {
+			MD5Lane& lane = lanes[i];
+			if (!lane.job) {
+				blocks[i] = zeroBlock;
+			}
+			else if (lane.fullBlocks > 0) {
+				blocks[i] = lane.next;
+				lane.next += MD5_BLOCK_SIZE;
+				--lane.fullBlocks;
+			}
+			else {
+				blocks[i] = lane.tail + lane.tailDone * MD5_BLOCK_SIZE;
+				++lane.tailDone;
+			}
+		}
+
+		md5CompressLanes<Ops>(state, blocks);
+
+		for (int i = 0; i < LANES; ++i) {
+			MD5Lane& lane = lanes[i];
+			if (!lane.job || lane.fullBlocks > 0 || lane.tailDone < lane.tailBlocks) {
+				continue;
+			}
+
+			// The digest is the state words in little-endian order
+			for (int word = 0; word < 4; ++word) {
+				for (int byte = 0; byte < 4; ++byte) {
+					lane.job->hash[word * 4 + byte] = static_cast<uint8_t>(state[word][i] >> (8 * byte));
+				}
+			}
+
+			if (nextJob < count) {
+				md5StartLane<LANES>(lane, state, i, &jobs[nextJob++]);
+			}
+			else {
+				lane.job = nullptr;
+				--activeLanes;
+			}
+		}
+	}
+}
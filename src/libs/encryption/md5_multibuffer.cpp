@@ -0,0 +1,74 @@
+#include "pch.h"
+#include "framework.h"
+#include "cpu_features.h"
+#include "md5_kernels.h"
+
+/**
+ * @file
+ * @brief This file implements batch MD5 hashing of independent messages.
+ *
+ * MD5 is serial within one message, so a single core cannot hash one block faster than the
+ * scalar implementation in OpenSSL. The multi-buffer kernels instead hash one message in each
+ * SIMD lane, 8 at a time with AVX2 or 16 at a time with AVX-512. The kernel is chosen at
+ * runtime from the CPU features, and OpenSSL is used when no kernel is available.
+ *
+ * @copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+ * @license MIT License
+ */
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MD5_MULTIBUFFER
+#endif
+
+/**
+ * @brief Returns the number of messages the selected MD5 kernel hashes at once.
+ *
+ * @return 16 for AVX-512, 8 for AVX2, or 1 if there is no multi-buffer kernel for this CPU.
+ */
+size_t getMD5BatchWidth()
+{
+#ifdef MD5_MULTIBUFFER
+	const CpuFeatures& features = getCpuFeatures();
+	if (features.avx512f && features.avx2) {
+		return 16;
+	}
+	if (features.avx2) {
+		return 8;
+	}
+#endif
+	return 1;
+}
+
+/**
+ * @brief Computes the MD5 hash of each of the given messages.
+ *
+ * @param jobs The messages. The hash of each is stored in its job.
+ * @param count The number of messages.
+ * @throws std::runtime_error If OpenSSL is used and fails.
+ */
+void computeMD5HashBatch(MD5Job* jobs, size_t count)
+{
+	size_t width = getMD5BatchWidth();
+
+	// A single message is faster through OpenSSL than in one lane of a kernel
+	if (width == 1 || count < 2) {
+		for (size_t i = 0; i < count; ++i) {
+			jobs[i].hash = computeMD5Hash(jobs[i].data, jobs[i].length);
+		}
+		return;
+	}
+
+#ifdef MD5_MULTIBUFFER
+	std::vector<MD5LaneJob> laneJobs(count);
+	for (size_t i = 0; i < count; ++i) {
+		laneJobs[i] = { jobs[i].data, jobs[i].length, jobs[i].hash.data() };
+	}
+
+	if (width == 16) {
+		md5HashLanesAVX512(laneJobs.data(), count);
+	}
+	else {
+		md5HashLanesAVX2(laneJobs.data(), count);
+	}
+#endif
+}
@@ -0,0 +1,395 @@
+// backup_source.cpp : Local backends for backup file reads.
+//
+
+#include "pch.h"
+#include "framework.h"
+#include "file_operations.h"
+#include "http_source.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+
+This file implements the local file backend for BackupSource and BackupStore,
+the buffered SourceReader used by the metadata parser, and the read coalescing
+shared by all backends.
+===============================================================================
+*/
+
+// ==============================
+// BackupSource
+// ==============================
+
+/**
+ * @brief Reads a batch of ranges, one read per range.
+ *
+ * @param ranges The ranges to read.
+ * @throws std::runtime_error if any of the reads fail.
+ */
+void BackupSource::readRanges(std::vector<ReadRange>& ranges)
+{
+    for (auto& range : ranges) {
+        readAt(range.offset, range.buffer, range.length);
+    }
+}
+
+// ==============================
+// LocalFileSource
+// ==============================
+
+/**
+ * @brief Opens a local file for positional reads, advising the system that it is read sequentially.
+ *
+ * @param filePath The path of the file to open.
+ * @throws std::runtime_error if the file could not be opened.
+ */
+LocalFileSource::LocalFileSource(const std::wstring& filePath)
+{
+    if (filePath.empty()) {
+        throw std::invalid_argument("Filename cannot be empty.");
+    }
+    name = filePath;
+#ifdef _WIN32
+    HANDLE fileHandle = CreateFileW(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Could not open file: " + wideToString(filePath) + ". Error: " + std::to_string(GetLastError()));
+    }
+    handle = reinterpret_cast<intptr_t>(fileHandle);
+#else
+    int fd = open(std::filesystem::path(filePath).string().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open file: " + wideToString(filePath) + ". Error: " + strerror(errno));
+    }
+    handle = fd;
+#ifdef __linux__
+    // Blocks are read in runs in file order, so a larger readahead window pays off
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+}
+
+/**
+ * @brief Closes the native handle.
+ */
+LocalFileSource::~LocalFileSource()
+{
+#ifdef _WIN32
+    CloseHandle(reinterpret_cast<HANDLE>(handle));
+#else
+    close(static_cast<int>(handle));
+#endif
+}
+
+/**
+ * @brief Reads `length` bytes at `offset` without moving a shared file pointer.
+ *
+ * @param offset The offset of the first byte to read.
+ * @param buffer The buffer that receives the data.
+ * @param length The number of bytes to read.
+ * @throws std::runtime_error if the read fails or passes the end of the file.
+ */
+void LocalFileSource::readAt(uint64_t offset, void* buffer, size_t length)
+{
+    auto* out = static_cast<uint8_t*>(buffer);
+    while (length > 0) {
+#ifdef _WIN32
+        // ReadFile takes a DWORD length, so very large reads are split
+        DWORD toRead = static_cast<DWORD>(std::min<size_t>(length, 0x40000000));
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD bytesRead = 0;
+        if (!ReadFile(reinterpret_cast<HANDLE>(handle), out, toRead, &bytesRead, &overlapped) && GetLastError() != ERROR_HANDLE_EOF) {
+            throw std::runtime_error("Failed to read from file. Error: " + std::to_string(GetLastError()));
+        }
+        size_t transferred = bytesRead;
+#else
+        ssize_t result = pread(static_cast<int>(handle), out, length, static_cast<off_t>(offset));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to read from file. Error: ") + strerror(errno));
+        }
+        size_t transferred = static_cast<size_t>(result);
+#endif
+        if (transferred == 0) {
+            throw std::runtime_error("Failed to read from file. Attempted to read past the end of the file.");
+        }
+        out += transferred;
+        offset += transferred;
+        length -= transferred;
+    }
+}
+
+/**
+ * @brief Starts reading a range into the system cache with POSIX_FADV_WILLNEED, without waiting for it.
+ *
+ * Does nothing on Windows, which reads ahead of a file opened for sequential access on its own.
+ *
+ * @param offset The offset of the range.
+ * @param length The length of the range.
+ */
+void LocalFileSource::prefetch(uint64_t offset, uint64_t length)
+{
+#ifdef __linux__
+    posix_fadvise(static_cast<int>(handle), static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+#endif
+}
+
+/**
+ * @brief Drops the cached pages of a range with POSIX_FADV_DONTNEED, so the backup does not push other data out of the cache.
+ *
+ * Pages shared with a neighbouring range are kept. Does nothing on Windows, which releases the pages behind
+ * the reads of a file opened for sequential access.
+ *
+ * @param offset The offset of the range.
+ * @param length The length of the range.
+ */
+void LocalFileSource::release(uint64_t offset, uint64_t length)
+{
+#ifdef __linux__
+    posix_fadvise(static_cast<int>(handle), static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_DONTNEED);
+#endif
+}
+
+/**
+ * @brief Returns the size of the file in bytes.
+ *
+ * @throws std::runtime_error if the size could not be read.
+ */
+uint64_t LocalFileSource::getSize()
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(reinterpret_cast<HANDLE>(handle), &size)) {
+        throw std::runtime_error("Failed to get file size. Error: " + std::to_string(GetLastError()));
+    }
+    return static_cast<uint64_t>(size.QuadPart);
+#else
+    struct stat info;
+    if (fstat(static_cast<int>(handle), &info) != 0) {
+        throw std::runtime_error(std::string("Failed to get file size. Error: ") + strerror(errno));
+    }
+    return static_cast<uint64_t>(info.st_size);
+#endif
+}
+
+// ==============================
+// LocalDirectoryStore
+// ==============================
+
+/**
+ * @brief Lists the regular files in the folder with the given extension.
+ *
+ * @param extension The extension to match, including the dot.
+ * @return The full paths of the matching files.
+ */
+std::vector<std::wstring> LocalDirectoryStore::listFiles(const std::wstring& extension)
+{
+    std::vector<std::wstring> files;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.is_regular_file() && entry.path().extension() == extension) {
+            files.push_back(entry.path().wstring());
+        }
+    }
+    return files;
+}
+
+/**
+ * @brief Opens a file returned by `listFiles`.
+ *
+ * @param name The full path of the file.
+ * @return The opened source.
+ */
+SharedSource LocalDirectoryStore::openSource(const std::wstring& name)
+{
+    return std::make_shared<LocalFileSource>(name);
+}
+
+// ==============================
+// SourceReader
+// ==============================
+
+/**
+ * @brief Creates a cursor at the start of the source.
+ *
+ * @param source The source to read.
+ * @param windowSize The number of bytes fetched from the source at a time.
+ */
+SourceReader::SourceReader(BackupSource& source, uint32_t windowSize)
+    : source(source), sourceSize(source.getSize()), windowSize(windowSize)
+{
+}
+
+/**
+ * @brief Moves the cursor.
+ *
+ * @param offset The offset relative to `pos`.
+ * @param pos The origin of the seek: beginning, current position or end.
+ * @throws std::runtime_error if the new position is outside the file.
+ */
+void SourceReader::seek(int64_t offset, std::ios::seekdir pos)
+{
+    int64_t origin = 0;
+    if (pos == std::ios::cur) {
+        origin = static_cast<int64_t>(position);
+    }
+    else if (pos == std::ios::end) {
+        origin = static_cast<int64_t>(sourceSize);
+    }
+    int64_t newPosition = origin + offset;
+    if (newPosition < 0 || static_cast<uint64_t>(newPosition) > sourceSize) {
+        throw std::runtime_error("Failed to set file pointer.");
+    }
+    position = static_cast<uint64_t>(newPosition);
+}
+
+/**
+ * @brief Reads from the cursor position, refilling the window as needed.
+ *
+ * @param buffer The buffer that receives the data.
+ * @param length The number of bytes to read.
+ * @throws std::runtime_error if the read passes the end of the file.
+ */
+void SourceReader::read(void* buffer, size_t length)
+{
+    if (position + length > sourceSize) {
+        throw std::runtime_error("Failed to read from file. Attempted to read past the end of the file.");
+    }
+    auto* out = static_cast<uint8_t*>(buffer);
+    while (length > 0) {
+        bool inWindow = position >= windowOffset && position < windowOffset + window.size();
+        if (!inWindow) {
+            // Reads larger than the window bypass it
+            if (length >= windowSize) {
+                source.readAt(position, out, length);
+                position += length;
+                return;
+            }
+            windowOffset = position;
+            window.resize(static_cast<size_t>(std::min<uint64_t>(windowSize, sourceSize - position)));
+            source.readAt(windowOffset, window.data(), window.size());
+        }
+        size_t available = static_cast<size_t>(windowOffset + window.size() - position);
+        size_t toCopy = std::min(available, length);
+        memcpy(out, window.data() + (position - windowOffset), toCopy);
+        out += toCopy;
+        position += toCopy;
+        length -= toCopy;
+    }
+}
+
+// ==============================
+// Helpers
+// ==============================
+
+/**
+ * @brief Groups read requests into as few physical reads as possible.
+ *
+ * @param ranges The read requests.
+ * @param maxGap The largest gap that is read and discarded to join two ranges.
+ * @param maxLength The largest physical read to build.
+ * @return The physical reads, in offset order.
+ */
+std::vector<CoalescedRead> coalesceReadRanges(const std::vector<ReadRange>& ranges, uint32_t maxGap, uint64_t maxLength)
+{
+    std::vector<size_t> order(ranges.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&ranges](size_t a, size_t b) {
+        return ranges[a].offset < ranges[b].offset;
+    });
+
+    std::vector<CoalescedRead> reads;
+    for (size_t index : order) {
+        const ReadRange& range = ranges[index];
+        if (!reads.empty()) {
+            CoalescedRead& last = reads.back();
+            uint64_t lastEnd = last.offset + last.length;
+            uint64_t rangeEnd = range.offset + range.length;
+            // Overlapping or near ranges join the previous read if the result stays small enough
+            if (range.offset <= lastEnd + maxGap && std::max(lastEnd, rangeEnd) - last.offset <= maxLength) {
+                last.length = std::max(lastEnd, rangeEnd) - last.offset;
+                last.members.push_back(index);
+                continue;
+            }
+        }
+        CoalescedRead read;
+        read.offset = range.offset;
+        read.length = range.length;
+        read.members.push_back(index);
+        reads.push_back(std::move(read));
+    }
+    return reads;
+}
+
+/**
+ * @brief Returns true if the path is an http:// or https:// URL.
+ */
+bool isRemotePath(const std::wstring& path)
+{
+    auto startsWith = [&path](const wchar_t* prefix) {
+        size_t length = wcslen(prefix);
+        if (path.size() < length) {
+            return false;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            if (towlower(path[i]) != static_cast<wint_t>(prefix[i])) {
+                return false;
+            }
+        }
+        return true;
+    };
+    return startsWith(L"http://") || startsWith(L"https://");
+}
+
+/**
+ * @brief Opens a backup file, selecting the backend from the path.
+ *
+ * @param path A local file path or an http(s) URL.
+ * @return The opened source.
+ */
+SharedSource openBackupSource(const std::wstring& path)
+{
+    if (isRemotePath(path)) {
+        return std::make_shared<HttpRangeSource>(path);
+    }
+    return std::make_shared<LocalFileSource>(path);
+}
+
+/**
+ * @brief Opens the store that contains the given backup file.
+ *
+ * @param path A local file path or an http(s) URL.
+ * @return The store for the parent folder or bucket prefix.
+ */
+SharedStore openBackupStore(const std::wstring& path)
+{
+    if (isRemotePath(path)) {
+        return std::make_shared<HttpBackupStore>(path);
+    }
+    return std::make_shared<LocalDirectoryStore>(std::filesystem::path(path).parent_path().wstring());
+}
+
+/**
+ * @brief Returns the file name part of a path or URL, without any query string.
+ */
+std::wstring getSourceFileName(const std::wstring& path)
+{
+    std::wstring withoutQuery = path.substr(0, path.find(L'?'));
+    size_t separator = withoutQuery.find_last_of(L"/\\");
+    return separator == std::wstring::npos ? withoutQuery : withoutQuery.substr(separator + 1);
+}
@@ -0,0 +1,262 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief Pluggable read backends for Macrium Reflect X backup files.
+ *
+ * A backup file is only ever accessed with positional reads: the footer, the metadata
+ * blocks and the data blocks are all located by absolute file offsets. `BackupSource`
+ * captures exactly that, so a backup file can live on a local disk, a network share or
+ * an object store without the reader or the restore code knowing the difference.
+ *
+ * `BackupStore` is the matching abstraction for the folder (or bucket prefix) that holds
+ * the files of a backup set.
+ */
+
+#include <cstdint>
+#include <ios>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @struct ReadRange
+ * @brief A single positional read request.
+ *
+ * @var offset The offset of the first byte to read.
+ * @var length The number of bytes to read.
+ * @var buffer The buffer that receives the data. Must be at least `length` bytes.
+ */
+struct ReadRange
+{
+    uint64_t offset = 0;
+    uint32_t length = 0;
+    void* buffer = nullptr;
+};
+
+/**
+ * @struct CoalescedRead
+ * @brief A single physical read that satisfies one or more `ReadRange` requests.
+ *
+ * @var offset The offset of the physical read.
+ * @var length The length of the physical read, including any gaps between the members.
+ * @var members Indexes into the original `ReadRange` vector served by this read.
+ */
+struct CoalescedRead
+{
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    std::vector<size_t> members;
+};
+
+/**
+ * @class BackupSource
+ * @brief Read-only, positional access to a single backup file.
+ *
+ * Implementations must allow `readAt` and `readRanges` to be called concurrently
+ * from multiple threads.
+ */
+class BackupSource {
+public:
+    virtual ~BackupSource() = default;
+
+    /**
+     * @brief Reads `length` bytes at `offset` into `buffer`.
+     * @throws std::runtime_error if the read fails or is short.
+     */
+    virtual void readAt(uint64_t offset, void* buffer, size_t length) = 0;
+
+    /**
+     * @brief Reads a batch of ranges.
+     *
+     * The default implementation issues one `readAt` per range. Remote backends
+     * override this to merge neighbouring ranges and keep several requests in flight.
+     *
+     * @throws std::runtime_error if any of the reads fail.
+     */
+    virtual void readRanges(std::vector<ReadRange>& ranges);
+
+    /**
+     * @brief Hints that a range will be read soon, so the source can start fetching it without waiting.
+     *
+     * The default implementation does nothing.
+     */
+    virtual void prefetch(uint64_t offset, uint64_t length) {}
+
+    /**
+     * @brief Hints that a range has been read and will not be read again, so the system can drop it from its cache.
+     *
+     * The default implementation does nothing.
+     */
+    virtual void release(uint64_t offset, uint64_t length) {}
+
+    /**
+     * @brief Returns the size of the backup file in bytes.
+     */
+    virtual uint64_t getSize() = 0;
+
+    /**
+     * @brief Returns the name used to open the source (a file path or a URL).
+     */
+    const std::wstring& getName() const { return name; }
+
+protected:
+    std::wstring name;
+};
+
+// A shared pointer to a BackupSource. Sources are shared between merged (consolidated) file numbers.
+typedef std::shared_ptr<BackupSource> SharedSource;
+
+/**
+ * @class BackupStore
+ * @brief The location holding the files of a backup set (a folder or a bucket prefix).
+ */
+class BackupStore {
+public:
+    virtual ~BackupStore() = default;
+
+    /**
+     * @brief Lists the names of all files in the store with the given extension.
+     *
+     * The returned names can be passed to `openSource`.
+     *
+     * @param extension The extension to match, including the dot, for example L".mrimgx".
+     */
+    virtual std::vector<std::wstring> listFiles(const std::wstring& extension) = 0;
+
+    /**
+     * @brief Opens a file in the store for reading.
+     * @throws std::runtime_error if the file cannot be opened.
+     */
+    virtual SharedSource openSource(const std::wstring& name) = 0;
+};
+
+typedef std::shared_ptr<BackupStore> SharedStore;
+
+/**
+ * @class LocalFileSource
+ * @brief A `BackupSource` for a file on a local or network file system.
+ *
+ * Uses positional reads on a native handle, so concurrent reads do not share a file pointer.
+ * The file is opened for sequential access, so the system reads ahead of each run of reads.
+ */
+class LocalFileSource : public BackupSource {
+public:
+    explicit LocalFileSource(const std::wstring& filePath);
+    ~LocalFileSource() override;
+
+    LocalFileSource(const LocalFileSource&) = delete;
+    LocalFileSource& operator=(const LocalFileSource&) = delete;
+
+    void readAt(uint64_t offset, void* buffer, size_t length) override;
+    void prefetch(uint64_t offset, uint64_t length) override;
+    void release(uint64_t offset, uint64_t length) override;
+    uint64_t getSize() override;
+
+    /**
+     * @brief Returns the native handle (a HANDLE on Windows, a file descriptor elsewhere).
+     */
+    intptr_t getNativeHandle() const { return handle; }
+
+private:
+    intptr_t handle;
+};
+
+/**
+ * @class LocalDirectoryStore
+ * @brief A `BackupStore` for a folder on a local or network file system.
+ */
+class LocalDirectoryStore : public BackupStore {
+public:
+    explicit LocalDirectoryStore(const std::wstring& directory) : directory(directory) {}
+
+    std::vector<std::wstring> listFiles(const std::wstring& extension) override;
+    SharedSource openSource(const std::wstring& name) override;
+
+private:
+    std::wstring directory;
+};
+
+/**
+ * @class SourceReader
+ * @brief A sequential cursor over a `BackupSource`, used to parse the metadata blocks.
+ *
+ * Metadata is parsed with many small reads. The reader fetches a window of data at a time,
+ * so a remote source sees a handful of large range requests rather than hundreds of tiny ones.
+ */
+class SourceReader {
+public:
+    explicit SourceReader(BackupSource& source, uint32_t windowSize = 1024 * 1024);
+
+    /**
+     * @brief Moves the cursor, with the same semantics as std::istream::seekg.
+     * @throws std::runtime_error if the new position is outside the file.
+     */
+    void seek(int64_t offset, std::ios::seekdir pos);
+
+    /**
+     * @brief Returns the current cursor position.
+     */
+    uint64_t tell() const { return position; }
+
+    /**
+     * @brief Reads `length` bytes at the cursor and advances it.
+     * @throws std::runtime_error if the read fails or passes the end of the file.
+     */
+    void read(void* buffer, size_t length);
+
+private:
+    BackupSource& source;
+    uint64_t sourceSize;
+    uint64_t position = 0;
+    uint32_t windowSize;
+    uint64_t windowOffset = 0;
+    std::vector<uint8_t> window;
+};
+
+/**
+ * @brief Groups read requests into as few physical reads as possible.
+ *
+ * Ranges are sorted by offset and merged when the gap between them is no larger than `maxGap`
+ * and the merged read stays within `maxLength`. A single range larger than `maxLength` is never split.
+ *
+ * @param ranges The read requests.
+ * @param maxGap The largest gap, in bytes, that is read and discarded to join two ranges.
+ * @param maxLength The largest physical read to build.
+ * @return The physical reads, in offset order.
+ */
+std::vector<CoalescedRead> coalesceReadRanges(const std::vector<ReadRange>& ranges, uint32_t maxGap, uint64_t maxLength);
+
+/**
+ * @brief Returns true if the path is a URL handled by a remote backend (http:// or https://).
+ */
+bool isRemotePath(const std::wstring& path);
+
+/**
+ * @brief Opens a backup file, selecting the backend from the path.
+ *
+ * @param path A local file path, or an http(s) URL of an object.
+ * @return The opened source.
+ * @throws std::runtime_error if the file cannot be opened.
+ */
+SharedSource openBackupSource(const std::wstring& path);
+
+/**
+ * @brief Opens the store that contains the given backup file, selecting the backend from the path.
+ *
+ * @param path A local file path, or an http(s) URL of an object.
+ * @return The store for the parent folder or bucket prefix.
+ */
+SharedStore openBackupStore(const std::wstring& path);
+
+/**
+ * @brief Returns the file name part of a path or URL, without any query string.
+ */
+std::wstring getSourceFileName(const std::wstring& path);
@@ -51,9 +51,11 @@ typedef std::shared_ptr<std::fstream> SharedFile;
  * @ret
  */
 std::string wideToString(const std::wstring& wstr) {
-    std::string str(wstr.length(), ' ');
+    // Leave room for the terminating null, otherwise the last character is truncated
+    std::string str(wstr.length() + 1, ' ');
     size_t convertedChars = 0;
     wcstombs_s(&convertedChars, &str[0], str.size(), wstr.c_str(), _TRUNCATE);
+    str.resize(convertedChars > 0 ? convertedChars - 1 : 0);
     return str;
 }
 
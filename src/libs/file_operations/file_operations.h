@@ -23,11 +23,22 @@ Licensed under the MIT License.
  */
 
 #include <fstream>
+#include "backup_source.h"
+#include "http_source.h"
+#include "restore_target.h"
 
 
 // A typedef for a std::shared_ptr that holds a std::fstream and uses FileDeleter to automatically close the file when it's no longer in use.
 typedef std::shared_ptr<std::fstream> SharedFile;
 
+/**
+ * Converts a wide string to a string.
+ *
+ * @param wstr The wide string to convert.
+ * @return The converted string.
+ */
+std::string wideToString(const std::wstring& wstr);
+
 /**
  * Opens a file and returns a pointer to the file stream.
  *
@@ -8,4 +8,14 @@
 #include <string>
 #include <codecvt>
 #include <locale>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cwctype>
 
@@ -0,0 +1,906 @@
+// http_source.cpp : HTTP range-read backend for backup files on an object store.
+//
+
+#include "pch.h"
+#include "framework.h"
+#include "file_operations.h"
+#include "http_source.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winhttp.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+
+This file implements HttpRangeSource and HttpBackupStore. Only the small part
+of HTTP/1.1 needed for ranged GET requests and S3 ListObjectsV2 is implemented.
+===============================================================================
+*/
+
+// ==============================
+// Helper functions
+// ==============================
+
+/**
+ * @brief Percent-encodes a string for use in a URL.
+ *
+ * @param value The UTF-8 string to encode.
+ * @param keepSlash True to leave '/' unencoded, as needed for object key paths.
+ * @return The encoded string.
+ */
+static std::string percentEncode(const std::string& value, bool keepSlash)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    std::string encoded;
+    for (unsigned char c : value) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (keepSlash && c == '/')) {
+            encoded += static_cast<char>(c);
+        }
+        else {
+            encoded += '%';
+            encoded += hex[c >> 4];
+            encoded += hex[c & 0x0F];
+        }
+    }
+    return encoded;
+}
+
+/**
+ * @brief Decodes a percent-encoded URL component.
+ */
+static std::string percentDecode(const std::string& value)
+{
+    std::string decoded;
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '%' && i + 2 < value.size()) {
+            decoded += static_cast<char>(std::stoi(value.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        }
+        else {
+            decoded += value[i];
+        }
+    }
+    return decoded;
+}
+
+/**
+ * @brief Replaces the five predefined XML entities in a text node.
+ */
+static std::string xmlDecode(const std::string& value)
+{
+    static const std::pair<const char*, char> entities[] = {
+        { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' }, { "&apos;", '\'' }
+    };
+    std::string decoded;
+    for (size_t i = 0; i < value.size(); ++i) {
+        bool replaced = false;
+        if (value[i] == '&') {
+            for (const auto& entity : entities) {
+                size_t length = strlen(entity.first);
+                if (value.compare(i, length, entity.first) == 0) {
+                    decoded += entity.second;
+                    i += length - 1;
+                    replaced = true;
+                    break;
+                }
+            }
+        }
+        if (!replaced) {
+            decoded += value[i];
+        }
+    }
+    return decoded;
+}
+
+/**
+ * @brief Returns the text of every `<tag>` element in an XML document, in document order.
+ */
+static std::vector<std::string> xmlElements(const std::string& xml, const std::string& tag)
+{
+    std::vector<std::string> values;
+    std::string open = "<" + tag + ">";
+    std::string close = "</" + tag + ">";
+    size_t position = 0;
+    while ((position = xml.find(open, position)) != std::string::npos) {
+        position += open.size();
+        size_t end = xml.find(close, position);
+        if (end == std::string::npos) {
+            break;
+        }
+        values.push_back(xmlDecode(xml.substr(position, end - position)));
+        position = end + close.size();
+    }
+    return values;
+}
+
+// ==============================
+// HttpClient
+// ==============================
+
+/**
+ * @struct HttpResponse
+ * @brief The parts of an HTTP response used by the backend.
+ */
+struct HttpResponse
+{
+    int status = 0;
+    std::string body;
+    std::string contentRange;
+    // A 200 response to a range request whose body ran past the range. The rest of it was not read.
+    bool truncated = false;
+};
+
+/**
+ * @brief Returns the number of bytes in a range "first-last", or UINT64_MAX for no range.
+ */
+static uint64_t rangeLength(const std::string& range)
+{
+    if (range.empty()) {
+        return UINT64_MAX;
+    }
+    size_t dash = range.find('-');
+    return std::stoull(range.substr(dash + 1)) - std::stoull(range.substr(0, dash)) + 1;
+}
+
+/**
+ * @brief Parses a Content-Range header of the form "bytes first-last/total".
+ *
+ * @return False if the header is missing or malformed. `total` is UINT64_MAX if the server sent "*".
+ */
+static bool parseContentRange(const std::string& value, uint64_t& first, uint64_t& last, uint64_t& total)
+{
+    size_t dash = value.find('-');
+    size_t slash = value.find('/');
+    if (value.compare(0, 6, "bytes ") != 0 || dash == std::string::npos || slash == std::string::npos || slash < dash) {
+        return false;
+    }
+    try {
+        first = std::stoull(value.substr(6, dash - 6));
+        last = std::stoull(value.substr(dash + 1, slash - dash - 1));
+        std::string length = value.substr(slash + 1);
+        total = length == "*" ? UINT64_MAX : std::stoull(length);
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    return first <= last;
+}
+
+/**
+ * @class HttpClient
+ * @brief A minimal HTTP GET client bound to one origin (scheme, host and port).
+ *
+ * The client is safe to use from multiple threads. Connections are kept alive and reused.
+ */
+class HttpClient {
+public:
+    explicit HttpClient(const std::string& url);
+    ~HttpClient();
+
+    /**
+     * @brief Sends a GET request.
+     *
+     * @param target The request target (path and query).
+     * @param range An optional byte range "first-last". Empty for the whole resource.
+     * @return The response. If the server ignores the range and answers 200, no more of the body is read
+     *         than one byte past the range, and `truncated` is set if there was more.
+     * @throws std::runtime_error on a transport error.
+     */
+    HttpResponse get(const std::string& target, const std::string& range);
+
+    // The request target (path and query) of the URL the client was created with.
+    const std::string& getTarget() const { return target; }
+
+    // The scheme, host and port of the URL the client was created with.
+    const std::string& getOrigin() const { return origin; }
+
+private:
+    bool secure = false;
+    std::string host;
+    uint16_t port = 80;
+    std::string target;
+    std::string origin;
+
+#ifdef _WIN32
+    HINTERNET session = NULL;
+    HINTERNET connection = NULL;
+#else
+    int openConnection();
+    HttpResponse exchange(int connection, const std::string& target, const std::string& range, bool& keepAlive);
+
+    std::mutex poolMutex;
+    std::vector<int> idleConnections;
+#endif
+};
+
+/**
+ * @brief Parses the URL and prepares the transport.
+ *
+ * @param url An http:// or https:// URL.
+ * @throws std::runtime_error if the URL is invalid or the scheme is not supported.
+ */
+HttpClient::HttpClient(const std::string& url)
+{
+    size_t schemeEnd = url.find("://");
+    if (schemeEnd == std::string::npos) {
+        throw std::runtime_error("Invalid URL: " + url);
+    }
+    std::string scheme = url.substr(0, schemeEnd);
+    std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+    secure = scheme == "https";
+    port = secure ? 443 : 80;
+
+    size_t authorityStart = schemeEnd + 3;
+    size_t pathStart = url.find_first_of("/?", authorityStart);
+    std::string authority = url.substr(authorityStart, pathStart - authorityStart);
+    target = pathStart == std::string::npos ? "/" : url.substr(pathStart);
+    if (target[0] == '?') {
+        target = "/" + target;
+    }
+    size_t portSeparator = authority.rfind(':');
+    if (portSeparator != std::string::npos && authority.find(']', portSeparator) == std::string::npos) {
+        port = static_cast<uint16_t>(std::stoi(authority.substr(portSeparator + 1)));
+        host = authority.substr(0, portSeparator);
+    }
+    else {
+        host = authority;
+    }
+    if (host.empty()) {
+        throw std::runtime_error("Invalid URL: " + url);
+    }
+    origin = scheme + "://" + authority;
+
+#ifdef _WIN32
+    std::wstring wideHost(host.begin(), host.end());
+    session = WinHttpOpen(L"img_to_vhdx", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+    if (session == NULL) {
+        throw std::runtime_error("Failed to open HTTP session. Error: " + std::to_string(GetLastError()));
+    }
+    connection = WinHttpConnect(session, wideHost.c_str(), port, 0);
+    if (connection == NULL) {
+        WinHttpCloseHandle(session);
+        throw std::runtime_error("Failed to connect to " + host + ". Error: " + std::to_string(GetLastError()));
+    }
+#else
+    if (secure) {
+        throw std::runtime_error("https URLs require the WinHTTP transport. Use an http endpoint on this platform.");
+    }
+#endif
+}
+
+/**
+ * @brief Closes the transport and any idle connections.
+ */
+HttpClient::~HttpClient()
+{
+#ifdef _WIN32
+    WinHttpCloseHandle(connection);
+    WinHttpCloseHandle(session);
+#else
+    for (int idleConnection : idleConnections) {
+        close(idleConnection);
+    }
+#endif
+}
+
+#ifdef _WIN32
+
+// Closes a WinHTTP request handle when it goes out of scope.
+struct InternetHandleCloser {
+    void operator()(void* handle) const {
+        if (handle) {
+            WinHttpCloseHandle(handle);
+        }
+    }
+};
+
+HttpResponse HttpClient::get(const std::string& requestTarget, const std::string& range)
+{
+    std::wstring wideTarget(requestTarget.begin(), requestTarget.end());
+    std::unique_ptr<void, InternetHandleCloser> request(WinHttpOpenRequest(connection, L"GET", wideTarget.c_str(), NULL,
+        WINHTTP_NO_REFERER, WINHTTP_DEFAULT_ACCEPT_TYPES, secure ? WINHTTP_FLAG_SECURE : 0));
+    if (!request) {
+        throw std::runtime_error("Failed to open HTTP request. Error: " + std::to_string(GetLastError()));
+    }
+
+    std::string headers;
+    if (!range.empty()) {
+        headers += "Range: bytes=" + range + "\r\n";
+    }
+    std::wstring wideHeaders(headers.begin(), headers.end());
+    if (!WinHttpSendRequest(request.get(), wideHeaders.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : wideHeaders.c_str(),
+        static_cast<DWORD>(wideHeaders.size()), WINHTTP_NO_REQUEST_DATA, 0, 0, 0) ||
+        !WinHttpReceiveResponse(request.get(), NULL)) {
+        throw std::runtime_error("HTTP request to " + host + " failed. Error: " + std::to_string(GetLastError()));
+    }
+
+    HttpResponse response;
+    DWORD status = 0;
+    DWORD statusSize = sizeof(status);
+    WinHttpQueryHeaders(request.get(), WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &status, &statusSize, WINHTTP_NO_HEADER_INDEX);
+    response.status = static_cast<int>(status);
+    uint64_t bodyLimit = response.status == 200 ? rangeLength(range) : UINT64_MAX;
+
+    wchar_t contentRange[128] = {};
+    DWORD contentRangeSize = sizeof(contentRange);
+    if (WinHttpQueryHeaders(request.get(), WINHTTP_QUERY_CUSTOM, L"Content-Range", contentRange, &contentRangeSize, WINHTTP_NO_HEADER_INDEX)) {
+        for (const wchar_t* c = contentRange; *c; ++c) {
+            response.contentRange += static_cast<char>(*c);
+        }
+    }
+
+    for (;;) {
+        DWORD available = 0;
+        if (!WinHttpQueryDataAvailable(request.get(), &available)) {
+            throw std::runtime_error("Failed to read HTTP response. Error: " + std::to_string(GetLastError()));
+        }
+        if (available == 0) {
+            break;
+        }
+        size_t used = response.body.size();
+        response.body.resize(used + available);
+        DWORD bytesRead = 0;
+        if (!WinHttpReadData(request.get(), &response.body[used], available, &bytesRead)) {
+            throw std::runtime_error("Failed to read HTTP response. Error: " + std::to_string(GetLastError()));
+        }
+        response.body.resize(used + bytesRead);
+        if (response.body.size() > bodyLimit) {
+            // Closing the request abandons the rest of the object
+            response.truncated = true;
+            break;
+        }
+    }
+    return response;
+}
+
+#else
+
+/**
+ * @brief Opens a new TCP connection to the origin.
+ *
+ * @return The connected socket.
+ * @throws std::runtime_error if the host cannot be resolved or reached.
+ */
+int HttpClient::openConnection()
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+        throw std::runtime_error("Failed to resolve host " + host);
+    }
+    int socketHandle = -1;
+    for (addrinfo* address = addresses; address != nullptr; address = address->ai_next) {
+        socketHandle = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (socketHandle < 0) {
+            continue;
+        }
+        if (connect(socketHandle, address->ai_addr, address->ai_addrlen) == 0) {
+            break;
+        }
+        close(socketHandle);
+        socketHandle = -1;
+    }
+    freeaddrinfo(addresses);
+    if (socketHandle < 0) {
+        throw std::runtime_error("Failed to connect to " + host + ":" + std::to_string(port));
+    }
+    int noDelay = 1;
+    setsockopt(socketHandle, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return socketHandle;
+}
+
+/**
+ * @brief Buffered reads from a connected socket.
+ */
+struct SocketReader
+{
+    int socketHandle;
+    std::string pending;
+
+    // Receives more data into `pending`. Returns false at the end of the stream.
+    bool fill() {
+        char buffer[64 * 1024];
+        for (;;) {
+            ssize_t received = recv(socketHandle, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received < 0) {
+                throw std::runtime_error(std::string("Failed to read HTTP response. Error: ") + strerror(errno));
+            }
+            pending.append(buffer, static_cast<size_t>(received));
+            return received > 0;
+        }
+    }
+
+    // Reads a CRLF terminated line, without the CRLF.
+    std::string readLine() {
+        size_t end;
+        while ((end = pending.find("\r\n")) == std::string::npos) {
+            if (!fill()) {
+                throw std::runtime_error("Connection closed while reading HTTP response.");
+            }
+        }
+        std::string line = pending.substr(0, end);
+        pending.erase(0, end + 2);
+        return line;
+    }
+
+    // Appends exactly `length` bytes to `out`.
+    void readExact(size_t length, std::string& out) {
+        while (pending.size() < length) {
+            if (!fill()) {
+                throw std::runtime_error("Connection closed while reading HTTP response.");
+            }
+        }
+        out.append(pending, 0, length);
+        pending.erase(0, length);
+    }
+};
+
+/**
+ * @brief Sends one request on a connection and reads the full response.
+ *
+ * @param connection The connected socket.
+ * @param requestTarget The request target (path and query).
+ * @param range An optional byte range.
+ * @param keepAlive Set to false if the connection cannot be reused.
+ * @return The response.
+ */
+HttpResponse HttpClient::exchange(int connection, const std::string& requestTarget, const std::string& range, bool& keepAlive)
+{
+    std::string request = "GET " + requestTarget + " HTTP/1.1\r\nHost: " + host;
+    if (port != 80) {
+        request += ":" + std::to_string(port);
+    }
+    request += "\r\n";
+    if (!range.empty()) {
+        request += "Range: bytes=" + range + "\r\n";
+    }
+    request += "Connection: keep-alive\r\n\r\n";
+
+    size_t sent = 0;
+    while (sent < request.size()) {
+        ssize_t result = send(connection, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            throw std::runtime_error(std::string("Failed to send HTTP request. Error: ") + strerror(errno));
+        }
+        sent += static_cast<size_t>(result);
+    }
+
+    SocketReader reader{ connection, {} };
+    HttpResponse response;
+    std::string statusLine = reader.readLine();
+    size_t statusStart = statusLine.find(' ');
+    if (statusLine.compare(0, 5, "HTTP/") != 0 || statusStart == std::string::npos) {
+        throw std::runtime_error("Invalid HTTP response from " + host);
+    }
+    response.status = std::stoi(statusLine.substr(statusStart + 1, 3));
+    keepAlive = statusLine.compare(0, 8, "HTTP/1.0") != 0;
+
+    // A server that ignores the Range header sends the whole object. It is not read past the range.
+    uint64_t bodyLimit = response.status == 200 ? rangeLength(range) : UINT64_MAX;
+    bool chunked = false;
+    int64_t contentLength = -1;
+    for (std::string line = reader.readLine(); !line.empty(); line = reader.readLine()) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        std::string value = line.substr(line.find_first_not_of(' ', colon + 1) == std::string::npos ? line.size() : line.find_first_not_of(' ', colon + 1));
+        std::string lowerValue = value;
+        std::transform(lowerValue.begin(), lowerValue.end(), lowerValue.begin(), ::tolower);
+        if (name == "content-length") {
+            contentLength = std::stoll(value);
+        }
+        else if (name == "transfer-encoding" && lowerValue.find("chunked") != std::string::npos) {
+            chunked = true;
+        }
+        else if (name == "connection") {
+            keepAlive = lowerValue.find("close") == std::string::npos;
+        }
+        else if (name == "content-range") {
+            response.contentRange = value;
+        }
+    }
+
+    if (chunked) {
+        for (;;) {
+            size_t chunkSize = std::stoul(reader.readLine(), nullptr, 16);
+            if (chunkSize == 0) {
+                // Skip any trailers
+                while (!reader.readLine().empty()) {
+                }
+                break;
+            }
+            reader.readExact(chunkSize, response.body);
+            reader.readLine();
+            if (response.body.size() > bodyLimit) {
+                response.truncated = true;
+                keepAlive = false;
+                break;
+            }
+        }
+    }
+    else if (contentLength >= 0 && static_cast<uint64_t>(contentLength) > bodyLimit) {
+        // The body is left unread, so the connection cannot be reused
+        response.truncated = true;
+        keepAlive = false;
+    }
+    else if (contentLength >= 0) {
+        response.body.reserve(static_cast<size_t>(contentLength));
+        reader.readExact(static_cast<size_t>(contentLength), response.body);
+    }
+    else {
+        // No length: the body runs to the end of the connection
+        while (reader.pending.size() <= bodyLimit && reader.fill()) {
+        }
+        response.truncated = reader.pending.size() > bodyLimit;
+        response.body = std::move(reader.pending);
+        keepAlive = false;
+    }
+    return response;
+}
+
+HttpResponse HttpClient::get(const std::string& requestTarget, const std::string& range)
+{
+    for (int attempt = 0;; ++attempt) {
+        int connection = -1;
+        bool reused = false;
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            if (!idleConnections.empty()) {
+                connection = idleConnections.back();
+                idleConnections.pop_back();
+                reused = true;
+            }
+        }
+        if (connection < 0) {
+            connection = openConnection();
+        }
+        try {
+            bool keepAlive = false;
+            HttpResponse response = exchange(connection, requestTarget, range, keepAlive);
+            if (keepAlive) {
+                std::lock_guard<std::mutex> lock(poolMutex);
+                idleConnections.push_back(connection);
+            }
+            else {
+                close(connection);
+            }
+            return response;
+        }
+        catch (const std::exception&) {
+            close(connection);
+            // The server may have closed an idle keep-alive connection. Retry once on a new one.
+            if (!reused || attempt > 0) {
+                throw;
+            }
+        }
+    }
+}
+
+#endif
+
+// ==============================
+// HttpRangeSource
+// ==============================
+
+/**
+ * @class PermanentHttpError
+ * @brief A failed request that a retry will not change, such as a missing object or denied access.
+ */
+class PermanentHttpError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * @brief Runs a request, retrying transport errors and bad responses with an exponential backoff.
+ *
+ * @param retryCount The number of times a failed request is retried.
+ * @param request Sends the request and returns its result. Throws `PermanentHttpError` for a failure that is not retried.
+ * @return The result of the first request that succeeds.
+ * @throws std::runtime_error if the request fails after all retries, or fails permanently.
+ */
+template <typename Request>
+static auto retryRequest(uint32_t retryCount, const Request& request) -> decltype(request())
+{
+    for (uint32_t attempt = 0;; ++attempt) {
+        try {
+            return request();
+        }
+        catch (const PermanentHttpError&) {
+            throw;
+        }
+        catch (const std::exception&) {
+            if (attempt >= retryCount) {
+                throw;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100 << attempt));
+        }
+    }
+}
+
+/**
+ * @brief Throws the error for an unexpected HTTP status.
+ *
+ * @param message Describes the request that failed.
+ * @param status The HTTP status.
+ * @throws PermanentHttpError for a client error, which will not succeed on a retry.
+ * @throws std::runtime_error for any other status.
+ */
+[[noreturn]] static void throwHttpStatus(const std::string& message, int status)
+{
+    std::string error = message + " HTTP status: " + std::to_string(status);
+    if (status >= 400 && status < 500) {
+        throw PermanentHttpError(error);
+    }
+    throw std::runtime_error(error);
+}
+
+/**
+ * @brief Throws the error for a server that answered a range request with the whole object.
+ *
+ * @throws PermanentHttpError always. The server will not answer differently on a retry.
+ */
+[[noreturn]] static void throwNoRangeSupport(const std::wstring& name)
+{
+    throw PermanentHttpError("The server of " + wideToString(name) + " does not support range requests.");
+}
+
+/**
+ * @brief Prepares a range-read source for an object URL. No request is sent until the first read.
+ *
+ * @param url The http(s) URL of the backup file.
+ * @param options Tuning options.
+ */
+HttpRangeSource::HttpRangeSource(const std::wstring& url, const HttpSourceOptions& options) : options(options)
+{
+    name = url;
+    client = std::make_shared<HttpClient>(wideToString(url));
+    target = client->getTarget();
+}
+
+/**
+ * @brief Fetches a byte range, retrying transient failures.
+ *
+ * @param offset The offset of the first byte.
+ * @param length The number of bytes.
+ * @return The bytes of the range.
+ * @throws std::runtime_error if the request fails after all retries, the server rejects it,
+ *         returns a different range, or does not support range requests.
+ */
+std::string HttpRangeSource::fetchRange(uint64_t offset, uint64_t length)
+{
+    std::string range = std::to_string(offset) + "-" + std::to_string(offset + length - 1);
+    return retryRequest(options.retryCount, [&]() {
+        HttpResponse response = client->get(target, range);
+        if (response.status == 206) {
+            uint64_t first = 0;
+            uint64_t last = 0;
+            uint64_t total = 0;
+            if (!parseContentRange(response.contentRange, first, last, total) || first != offset ||
+                last - first + 1 != length || response.body.size() != length) {
+                throw std::runtime_error("The server returned the wrong range of " + wideToString(name) + ". Requested bytes " +
+                    range + ", received " + (response.contentRange.empty() ? "no Content-Range" : response.contentRange) + ".");
+            }
+            return std::move(response.body);
+        }
+        if (response.status == 200) {
+            // The whole object. That is only the range asked for if the range is the whole object.
+            if (offset == 0 && !response.truncated && response.body.size() == length) {
+                return std::move(response.body);
+            }
+            throwNoRangeSupport(name);
+        }
+        throwHttpStatus("Failed to read from " + wideToString(name) + ".", response.status);
+    });
+}
+
+/**
+ * @brief Reads `length` bytes at `offset`. Large reads are split and fetched in parallel.
+ */
+void HttpRangeSource::readAt(uint64_t offset, void* buffer, size_t length)
+{
+    std::vector<ReadRange> ranges;
+    auto* out = static_cast<uint8_t*>(buffer);
+    while (length > 0) {
+        ReadRange range;
+        range.offset = offset;
+        range.length = static_cast<uint32_t>(std::min<uint64_t>(length, options.maxRequestLength));
+        range.buffer = out;
+        ranges.push_back(range);
+        offset += range.length;
+        out += range.length;
+        length -= range.length;
+    }
+    readRanges(ranges);
+}
+
+/**
+ * @brief Reads a batch of ranges.
+ *
+ * Neighbouring ranges are merged into single requests, and up to `maxRequestsInFlight`
+ * requests are issued concurrently. The first failure is rethrown once all requests have finished.
+ */
+void HttpRangeSource::readRanges(std::vector<ReadRange>& ranges)
+{
+    std::vector<CoalescedRead> reads = coalesceReadRanges(ranges, options.coalesceGap, options.maxRequestLength);
+
+    std::atomic<size_t> nextRead{ 0 };
+    std::atomic<bool> failed{ false };
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    auto worker = [&]() {
+        for (size_t index = nextRead++; index < reads.size() && !failed; index = nextRead++) {
+            try {
+                const CoalescedRead& read = reads[index];
+                std::string data = fetchRange(read.offset, read.length);
+                for (size_t member : read.members) {
+                    ReadRange& range = ranges[member];
+                    memcpy(range.buffer, data.data() + (range.offset - read.offset), range.length);
+                }
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+        }
+    };
+
+    size_t threadCount = std::min<size_t>(std::max<uint32_t>(options.maxRequestsInFlight, 1), reads.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/**
+ * @brief Returns the size of the object, read from the Content-Range of a one byte request.
+ *
+ * A one byte GET is used rather than HEAD so that pre-signed GET URLs work. The request is retried like a range read.
+ * A server that answers with the whole object is refused without reading it, unless the object is that one byte.
+ */
+uint64_t HttpRangeSource::getSize()
+{
+    // Workers share the source, so the first caller fetches the size while the others wait for it
+    std::lock_guard<std::mutex> lock(sizeMutex);
+    if (size != UINT64_MAX) {
+        return size;
+    }
+    size = retryRequest(options.retryCount, [&]() {
+        HttpResponse response = client->get(target, "0-0");
+        if (response.status == 206) {
+            uint64_t first = 0;
+            uint64_t last = 0;
+            uint64_t total = 0;
+            if (!parseContentRange(response.contentRange, first, last, total) || first != 0 || last != 0 || total == UINT64_MAX) {
+                throw std::runtime_error("The server returned an invalid Content-Range for " + wideToString(name) + ": " +
+                    (response.contentRange.empty() ? "none" : response.contentRange));
+            }
+            return total;
+        }
+        if (response.status == 200) {
+            if (!response.truncated && response.body.size() == 1) {
+                return static_cast<uint64_t>(1);
+            }
+            throwNoRangeSupport(name);
+        }
+        throwHttpStatus("Failed to get the size of " + wideToString(name) + ".", response.status);
+    });
+    return size;
+}
+
+// ==============================
+// HttpBackupStore
+// ==============================
+
+/**
+ * @brief Creates a store for the bucket prefix containing `fileUrl`.
+ *
+ * @param fileUrl The URL of one backup file in the set.
+ * @param options Options passed to every source opened from the store.
+ */
+HttpBackupStore::HttpBackupStore(const std::wstring& fileUrl, const HttpSourceOptions& options) : fileUrl(fileUrl), options(options)
+{
+}
+
+/**
+ * @brief Lists the objects next to the backup file with ListObjectsV2.
+ *
+ * @param extension The extension to match, including the dot.
+ * @return The URLs of the matching objects. Only the original URL if listing is not possible.
+ */
+std::vector<std::wstring> HttpBackupStore::listFiles(const std::wstring& extension)
+{
+    std::string url = wideToString(fileUrl);
+    if (url.find('?') != std::string::npos) {
+        // Pre-signed URLs cannot be used to list the bucket
+        return { fileUrl };
+    }
+
+    std::vector<std::wstring> files;
+    try {
+        HttpClient client(url);
+        const std::string& path = client.getTarget();
+        size_t bucketEnd = path.find('/', 1);
+        if (bucketEnd == std::string::npos) {
+            return { fileUrl };
+        }
+        std::string bucket = path.substr(0, bucketEnd);
+        std::string prefix = percentDecode(path.substr(bucketEnd + 1, path.rfind('/') - bucketEnd));
+        std::string suffix = wideToString(extension);
+
+        std::string continuationToken;
+        do {
+            std::string request = bucket + "?list-type=2&prefix=" + percentEncode(prefix, false);
+            if (!continuationToken.empty()) {
+                request += "&continuation-token=" + percentEncode(continuationToken, false);
+            }
+            HttpResponse response = client.get(request, "");
+            if (response.status != 200) {
+                throw std::runtime_error("ListObjectsV2 returned HTTP status " + std::to_string(response.status));
+            }
+            for (const std::string& key : xmlElements(response.body, "Key")) {
+                std::string fileName = key.substr(prefix.size());
+                // Only files directly under the prefix, with a matching extension
+                if (fileName.find('/') == std::string::npos && fileName.size() > suffix.size() &&
+                    fileName.compare(fileName.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                    std::string objectUrl = client.getOrigin() + bucket + "/" + percentEncode(key, true);
+                    files.emplace_back(objectUrl.begin(), objectUrl.end());
+                }
+            }
+            auto truncated = xmlElements(response.body, "IsTruncated");
+            auto tokens = xmlElements(response.body, "NextContinuationToken");
+            continuationToken = (!truncated.empty() && truncated[0] == "true" && !tokens.empty()) ? tokens[0] : "";
+        } while (!continuationToken.empty());
+    }
+    catch (const std::exception& e) {
+        // The endpoint may not support listing. Fall back to the single file.
+        std::cerr << "Unable to list backup files: " << e.what() << '\n';
+        return { fileUrl };
+    }
+
+    if (files.empty()) {
+        files.push_back(fileUrl);
+    }
+    return files;
+}
+
+/**
+ * @brief Opens an object URL returned by `listFiles`.
+ */
+SharedSource HttpBackupStore::openSource(const std::wstring& name)
+{
+    return std::make_shared<HttpRangeSource>(name, options);
+}
@@ -0,0 +1,95 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief HTTP range-read backend for backup files held on an S3-compatible object store.
+ *
+ * Every read is an HTTP GET with a `Range` header, so a restore can start immediately
+ * without downloading the backup set first. Batched reads are coalesced and several
+ * ranges are kept in flight at once to hide the request latency of the object store.
+ *
+ * On Windows the transport is WinHTTP (http and https). Elsewhere a plain socket
+ * transport is used, which supports http endpoints only.
+ */
+
+#include <mutex>
+#include "backup_source.h"
+
+class HttpClient;
+
+/**
+ * @struct HttpSourceOptions
+ * @brief Tuning options for the HTTP backend.
+ *
+ * Requests are not signed. Objects must be readable anonymously, or reached through a pre-signed URL.
+ *
+ * @var maxRequestsInFlight The maximum number of range requests issued concurrently by `readRanges`.
+ * @var coalesceGap The largest gap, in bytes, read and discarded to merge two neighbouring ranges.
+ * @var maxRequestLength The largest single range request built by coalescing.
+ * @var retryCount The number of times a failed request is retried before the read fails.
+ */
+struct HttpSourceOptions
+{
+    uint32_t maxRequestsInFlight = 8;
+    uint32_t coalesceGap = 256 * 1024;
+    uint64_t maxRequestLength = 16 * 1024 * 1024;
+    uint32_t retryCount = 3;
+};
+
+/**
+ * @class HttpRangeSource
+ * @brief A `BackupSource` for an object reachable over HTTP, read with range requests.
+ */
+class HttpRangeSource : public BackupSource {
+public:
+    explicit HttpRangeSource(const std::wstring& url, const HttpSourceOptions& options = HttpSourceOptions());
+
+    void readAt(uint64_t offset, void* buffer, size_t length) override;
+
+    /**
+     * @brief Reads a batch of ranges with coalescing and parallel in-flight requests.
+     */
+    void readRanges(std::vector<ReadRange>& ranges) override;
+
+    /**
+     * @brief Returns the size of the object. The first call asks the server, later calls return the cached size.
+     */
+    uint64_t getSize() override;
+
+private:
+    std::string fetchRange(uint64_t offset, uint64_t length);
+
+    HttpSourceOptions options;
+    std::shared_ptr<HttpClient> client;
+    std::string target;
+    std::mutex sizeMutex;
+    uint64_t size = UINT64_MAX;
+};
+
+/**
+ * @class HttpBackupStore
+ * @brief A `BackupStore` for a bucket prefix on an S3-compatible object store.
+ *
+ * Files are listed with the S3 ListObjectsV2 API using path-style addressing
+ * (http://host/bucket/prefix/file.mrimgx). If the URL carries a query string
+ * (a pre-signed URL) or the endpoint does not support listing, the store
+ * contains only the given file.
+ */
+class HttpBackupStore : public BackupStore {
+public:
+    explicit HttpBackupStore(const std::wstring& fileUrl, const HttpSourceOptions& options = HttpSourceOptions());
+
+    std::vector<std::wstring> listFiles(const std::wstring& extension) override;
+    SharedSource openSource(const std::wstring& name) override;
+
+private:
+    std::wstring fileUrl;
+    HttpSourceOptions options;
+};
@@ -0,0 +1,1562 @@
+// restore_target.cpp : Write backends for restored disks.
+//
+
+#include "pch.h"
+#include "framework.h"
+#include "file_operations.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+#endif
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+
+This file implements the RestoreTarget backends: raw image files and devices,
+memory-mapped image files, Linux block devices, memory, and streams.
+===============================================================================
+*/
+
+// The size of the buffer used to write zeros when a target has no cheaper way to zero a range
+constexpr size_t ZERO_BUFFER_SIZE = 1024 * 1024;
+
+// ==============================
+// RestoreTarget
+// ==============================
+
+/**
+ * @brief Zeros a range by writing zeros to it.
+ *
+ * @param offset The offset of the first byte to zero.
+ * @param length The number of bytes to zero.
+ * @throws std::runtime_error if a write fails.
+ */
+void RestoreTarget::zeroRange(uint64_t offset, uint64_t length)
+{
+    static const std::vector<uint8_t> zeros(ZERO_BUFFER_SIZE, 0);
+    while (length > 0) {
+        size_t toWrite = static_cast<size_t>(std::min<uint64_t>(length, zeros.size()));
+        writeAt(offset, zeros.data(), toWrite);
+        offset += toWrite;
+        length -= toWrite;
+    }
+}
+
+/**
+ * @brief Accepts a block that fills one block of the compressed block size, if the target has one.
+ */
+bool RestoreTarget::canWriteCompressed(uint64_t offset, uint64_t length) const
+{
+    uint32_t compressedBlockSize = getCompressedBlockSize();
+    return compressedBlockSize != 0 && length == compressedBlockSize && offset % compressedBlockSize == 0;
+}
+
+/**
+ * @brief Rejects compressed blocks. Only targets that accept them in `canWriteCompressed` take them.
+ *
+ * @throws std::logic_error always.
+ */
+void RestoreTarget::writeCompressedAt(uint64_t offset, const void* frame, size_t length)
+{
+    throw std::logic_error("The restore target does not store compressed blocks.");
+}
+
+/**
+ * @brief Rejects reads. Only targets that return true from `isReadable` can be read back.
+ *
+ * @throws std::logic_error always.
+ */
+void RestoreTarget::readAt(uint64_t offset, void* buffer, size_t length)
+{
+    throw std::logic_error("The restore target cannot be read back.");
+}
+
+// ==============================
+// WriteBackTracker
+// ==============================
+
+/**
+ * @brief Sets the policy. Intervals already under way are kept.
+ */
+void WriteBackTracker::setPolicy(const WriteBackPolicy& policy)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->policy = policy;
+    this->policy.interval_bytes = std::max<uint64_t>(this->policy.interval_bytes, 1);
+}
+
+/**
+ * @brief Returns when written data is moved to storage.
+ */
+Durability WriteBackTracker::getDurability() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return policy.durability;
+}
+
+/**
+ * @brief Adds a range to a set of ranges, merging it with the ranges it overlaps or meets.
+ *
+ * @param ranges The end of each range, by its offset.
+ * @param offset The offset of the range.
+ * @param end The end of the range.
+ * @return The number of bytes of the range that were not already in the set.
+ */
+static uint64_t addRange(std::map<uint64_t, uint64_t>& ranges, uint64_t offset, uint64_t end)
+{
+    uint64_t added = end - offset;
+    auto next = ranges.upper_bound(offset);
+    if (next != ranges.begin()) {
+        auto previous = std::prev(next);
+        if (previous->second >= end) {
+            return 0;
+        }
+        if (previous->second >= offset) {
+            added -= previous->second - offset;
+            offset = previous->first;
+            ranges.erase(previous);
+        }
+    }
+    uint64_t writeEnd = end;
+    while (next != ranges.end() && next->first <= end) {
+        added -= std::min(next->second, writeEnd) - std::min(next->first, writeEnd);
+        end = std::max(end, next->second);
+        next = ranges.erase(next);
+    }
+    ranges[offset] = end;
+    return added;
+}
+
+/**
+ * @brief Adds a write to the dirty data and to the current interval, and hands over the interval once it is full.
+ *
+ * With `Durability::ePeriodic`, only the bytes the interval does not already hold are added. Otherwise every
+ * write is added, as the ranges of a whole restore are not kept.
+ *
+ * @param offset The offset of the write.
+ * @param length The length of the write.
+ * @param start Receives the interval just completed.
+ * @param wait Receives the interval before it.
+ * @return True if the write completed an interval.
+ */
+bool WriteBackTracker::record(uint64_t offset, uint64_t length, Span& start, Span& wait)
+{
+    if (length == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (policy.durability != Durability::ePeriodic) {
+        stats.dirty_bytes += length;
+        stats.peak_dirty_bytes = std::max(stats.peak_dirty_bytes, stats.dirty_bytes);
+        return false;
+    }
+
+    uint64_t added = addRange(current.ranges, offset, offset + length);
+    current.bytes += added;
+    stats.dirty_bytes += added;
+    stats.peak_dirty_bytes = std::max(stats.peak_dirty_bytes, stats.dirty_bytes);
+    if (current.bytes < policy.interval_bytes) {
+        return false;
+    }
+
+    start = current;
+    wait = std::move(pending);
+    pending = std::move(current);
+    current = Span();
+    ++stats.write_backs;
+    return true;
+}
+
+/**
+ * @brief Removes an interval that is on storage from the dirty data.
+ */
+void WriteBackTracker::completed(const Span& span)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.dirty_bytes -= std::min(stats.dirty_bytes, span.bytes);
+}
+
+/**
+ * @brief Clears the dirty data and the intervals under way.
+ */
+void WriteBackTracker::flushed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.dirty_bytes = 0;
+    current = Span();
+    pending = Span();
+}
+
+/**
+ * @brief Returns the dirty data and the number of write-backs so far.
+ */
+WriteBackStats WriteBackTracker::getStats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+#ifdef __linux__
+/**
+ * @brief Runs sync_file_range on a range, ignoring files and devices that do not support it.
+ *
+ * @param fd The file or device.
+ * @param offset The offset of the range.
+ * @param length The length of the range.
+ * @param flags The SYNC_FILE_RANGE flags.
+ * @throws std::runtime_error if the write-back fails.
+ */
+static void syncFileRange(int fd, uint64_t offset, uint64_t length, unsigned int flags)
+{
+    if (length == 0) {
+        return;
+    }
+    while (sync_file_range(fd, static_cast<off_t>(offset), static_cast<off_t>(length), flags) != 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EINVAL || errno == ESPIPE || errno == ENOSYS) {
+            return;
+        }
+        throw std::runtime_error(std::string("Failed to write back the target. Error: ") + strerror(errno));
+    }
+}
+#endif
+
+// ==============================
+// FileTarget
+// ==============================
+
+#ifdef _WIN32
+/**
+ * @brief Returns true for Windows device paths such as \\.\PhysicalDrive1.
+ */
+static bool isDevicePath(const std::wstring& path)
+{
+    return path.rfind(L"\\\\.\\", 0) == 0;
+}
+#endif
+
+/**
+ * @brief Opens or creates the file.
+ *
+ * An existing image file is truncated, so that ranges the restore does not write read as zeros,
+ * unless its data is kept. Devices are opened in place.
+ *
+ * @param filePath The path of the file or device.
+ * @param preallocate True to allocate the whole disk size in `prepare`.
+ * @param keepData True to keep the data of an existing image file.
+ * @throws std::runtime_error if the file could not be opened.
+ */
+FileTarget::FileTarget(const std::wstring& filePath, bool preallocate, bool keepData /*= false*/)
+    : preallocate(preallocate), keepData(keepData)
+{
+    if (filePath.empty()) {
+        throw std::invalid_argument("Filename cannot be empty.");
+    }
+    name = filePath;
+#ifdef _WIN32
+    isDevice = isDevicePath(filePath);
+    HANDLE fileHandle = CreateFileW(filePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        isDevice ? OPEN_EXISTING : (keepData ? OPEN_ALWAYS : CREATE_ALWAYS), FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Could not open file: " + wideToString(filePath) + ". Error: " + std::to_string(GetLastError()));
+    }
+    handle = reinterpret_cast<intptr_t>(fileHandle);
+    if (!isDevice && !preallocate) {
+        // A sparse file only allocates the ranges the restore writes
+        DWORD bytesReturned = 0;
+        DeviceIoControl(fileHandle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned, NULL);
+    }
+#else
+    int fd = open(std::filesystem::path(filePath).string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open file: " + wideToString(filePath) + ". Error: " + strerror(errno));
+    }
+    handle = fd;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not open file: " + wideToString(filePath) + ". Error: " + strerror(errno));
+    }
+    isDevice = !S_ISREG(info.st_mode);
+    if (!isDevice && !keepData && ftruncate(fd, 0) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not truncate file: " + wideToString(filePath) + ". Error: " + strerror(errno));
+    }
+#endif
+}
+
+/**
+ * @brief Closes the native handle.
+ */
+FileTarget::~FileTarget()
+{
+#ifdef _WIN32
+    CloseHandle(reinterpret_cast<HANDLE>(handle));
+#else
+    close(static_cast<int>(handle));
+#endif
+}
+
+/**
+ * @brief Sets the size of an image file, allocating it if requested, or checks that a device is large enough.
+ *
+ * @param size The size of the disk to restore.
+ * @throws std::runtime_error if the device is too small or the file cannot be resized.
+ */
+void FileTarget::prepare(uint64_t size)
+{
+    if (isDevice) {
+        uint64_t deviceSize = getSize();
+        if (deviceSize != 0 && deviceSize < size) {
+            throw std::runtime_error("The target device is smaller than the disk being restored.");
+        }
+        return;
+    }
+#ifdef _WIN32
+    HANDLE fileHandle = reinterpret_cast<HANDLE>(handle);
+    if (preallocate) {
+        FILE_ALLOCATION_INFO allocation = {};
+        allocation.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+        if (!SetFileInformationByHandle(fileHandle, FileAllocationInfo, &allocation, sizeof(allocation))) {
+            throw std::runtime_error("Failed to allocate the target file. Error: " + std::to_string(GetLastError()));
+        }
+    }
+    FILE_END_OF_FILE_INFO endOfFile = {};
+    endOfFile.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFileInformationByHandle(fileHandle, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile))) {
+        throw std::runtime_error("Failed to set the size of the target file. Error: " + std::to_string(GetLastError()));
+    }
+#else
+    int fd = static_cast<int>(handle);
+#ifdef __linux__
+    if (preallocate) {
+        int result = posix_fallocate(fd, 0, static_cast<off_t>(size));
+        if (result != 0) {
+            throw std::runtime_error(std::string("Failed to allocate the target file. Error: ") + strerror(result));
+        }
+    }
+#endif
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        throw std::runtime_error(std::string("Failed to set the size of the target file. Error: ") + strerror(errno));
+    }
+#endif
+}
+
+/**
+ * @brief Writes `length` bytes at `offset` without moving a shared file pointer.
+ *
+ * @param offset The offset of the first byte to write.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @throws std::runtime_error if the write fails.
+ */
+void FileTarget::writeAt(uint64_t offset, const void* data, size_t length)
+{
+    uint64_t start = offset;
+    size_t total = length;
+    auto* in = static_cast<const uint8_t*>(data);
+    while (length > 0) {
+#ifdef _WIN32
+        // WriteFile takes a DWORD length, so very large writes are split
+        DWORD toWrite = static_cast<DWORD>(std::min<size_t>(length, 0x40000000));
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD bytesWritten = 0;
+        if (!WriteFile(reinterpret_cast<HANDLE>(handle), in, toWrite, &bytesWritten, &overlapped)) {
+            throw std::runtime_error("Failed to write to file. Error: " + std::to_string(GetLastError()));
+        }
+        size_t transferred = bytesWritten;
+#else
+        ssize_t result = pwrite(static_cast<int>(handle), in, length, static_cast<off_t>(offset));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to write to file. Error: ") + strerror(errno));
+        }
+        size_t transferred = static_cast<size_t>(result);
+#endif
+        if (transferred == 0) {
+            throw std::runtime_error("Failed to write to file. No bytes were written.");
+        }
+        in += transferred;
+        offset += transferred;
+        length -= transferred;
+    }
+    recordWrite(start, total);
+}
+
+/**
+ * @brief Reads `length` bytes at `offset` without moving a shared file pointer.
+ *
+ * Bytes past the end of the file read as zeros, as they do once the file is extended over them.
+ *
+ * @param offset The offset of the first byte to read.
+ * @param buffer The buffer that receives the data.
+ * @param length The number of bytes to read.
+ * @throws std::runtime_error if the read fails.
+ */
+void FileTarget::readAt(uint64_t offset, void* buffer, size_t length)
+{
+    auto* out = static_cast<uint8_t*>(buffer);
+    while (length > 0) {
+#ifdef _WIN32
+        DWORD toRead = static_cast<DWORD>(std::min<size_t>(length, 0x40000000));
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD bytesRead = 0;
+        if (!ReadFile(reinterpret_cast<HANDLE>(handle), out, toRead, &bytesRead, &overlapped) && GetLastError() != ERROR_HANDLE_EOF) {
+            throw std::runtime_error("Failed to read from file. Error: " + std::to_string(GetLastError()));
+        }
+        size_t transferred = bytesRead;
+#else
+        ssize_t result = pread(static_cast<int>(handle), out, length, static_cast<off_t>(offset));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to read from file. Error: ") + strerror(errno));
+        }
+        size_t transferred = static_cast<size_t>(result);
+#endif
+        if (transferred == 0) {
+            // The end of the file
+            memset(out, 0, length);
+            return;
+        }
+        out += transferred;
+        offset += transferred;
+        length -= transferred;
+    }
+}
+
+/**
+ * @brief Zeros a range, releasing its storage where the file system allows.
+ *
+ * @param offset The offset of the first byte to zero.
+ * @param length The number of bytes to zero.
+ * @throws std::runtime_error if the range cannot be zeroed.
+ */
+void FileTarget::zeroRange(uint64_t offset, uint64_t length)
+{
+    if (length == 0) {
+        return;
+    }
+    if (!isDevice) {
+#ifdef _WIN32
+        FILE_ZERO_DATA_INFORMATION zeroData = {};
+        zeroData.FileOffset.QuadPart = static_cast<LONGLONG>(offset);
+        zeroData.BeyondFinalZero.QuadPart = static_cast<LONGLONG>(offset + length);
+        DWORD bytesReturned = 0;
+        if (DeviceIoControl(reinterpret_cast<HANDLE>(handle), FSCTL_SET_ZERO_DATA, &zeroData, sizeof(zeroData), NULL, 0, &bytesReturned, NULL)) {
+            return;
+        }
+#elif defined(__linux__)
+        // A preallocated file keeps its blocks, a sparse one gives them back
+        int mode = preallocate ? FALLOC_FL_ZERO_RANGE : (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE);
+        if (fallocate(static_cast<int>(handle), mode, static_cast<off_t>(offset), static_cast<off_t>(length)) == 0) {
+            return;
+        }
+#endif
+    }
+    RestoreTarget::zeroRange(offset, length);
+}
+
+/**
+ * @brief Releases the storage of a range of a sparse image file.
+ *
+ * Does nothing for devices, preallocated files or file systems without sparse file support.
+ *
+ * @param offset The offset of the first byte to discard.
+ * @param length The number of bytes to discard.
+ */
+void FileTarget::discardRange(uint64_t offset, uint64_t length)
+{
+    if (isDevice || preallocate || length == 0) {
+        return;
+    }
+#ifdef _WIN32
+    FILE_ZERO_DATA_INFORMATION zeroData = {};
+    zeroData.FileOffset.QuadPart = static_cast<LONGLONG>(offset);
+    zeroData.BeyondFinalZero.QuadPart = static_cast<LONGLONG>(offset + length);
+    DWORD bytesReturned = 0;
+    DeviceIoControl(reinterpret_cast<HANDLE>(handle), FSCTL_SET_ZERO_DATA, &zeroData, sizeof(zeroData), NULL, 0, &bytesReturned, NULL);
+#elif defined(__linux__)
+    fallocate(static_cast<int>(handle), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(length));
+#endif
+}
+
+/**
+ * @brief Copies a range of a local backup file into the file without the data passing through the process.
+ *
+ * The range is cloned where the file system shares storage between files (ReFS, XFS, btrfs) and
+ * the range is aligned to its blocks. Otherwise, on Linux, it is copied with copy_file_range,
+ * which stays inside the kernel. A file system that cannot clone or copy is not asked again, but a
+ * range the kernel rejects is only written instead.
+ *
+ * @param source The backup file. Only a `LocalFileSource` can be copied from.
+ * @param sourceOffset The offset of the range in the backup file.
+ * @param offset The offset to copy the range to.
+ * @param length The length of the range.
+ * @return True if the range was copied, false if it must be written instead.
+ * @throws std::runtime_error if the copy fails part way.
+ */
+bool FileTarget::copyFrom(BackupSource& source, uint64_t sourceOffset, uint64_t offset, uint64_t length)
+{
+    LocalFileSource* localSource = dynamic_cast<LocalFileSource*>(&source);
+    if (localSource == nullptr || isDevice || length == 0) {
+        return false;
+    }
+#ifdef _WIN32
+    if (!cloneSupported) {
+        return false;
+    }
+    // Block cloning needs both files on the same ReFS volume and cluster aligned offsets
+    DUPLICATE_EXTENTS_DATA extents = {};
+    extents.FileHandle = reinterpret_cast<HANDLE>(localSource->getNativeHandle());
+    extents.SourceFileOffset.QuadPart = static_cast<LONGLONG>(sourceOffset);
+    extents.TargetFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+    extents.ByteCount.QuadPart = static_cast<LONGLONG>(length);
+    DWORD bytesReturned = 0;
+    if (DeviceIoControl(reinterpret_cast<HANDLE>(handle), FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), NULL, 0, &bytesReturned, NULL)) {
+        return true;
+    }
+    DWORD error = GetLastError();
+    if (error == ERROR_INVALID_FUNCTION || error == ERROR_NOT_SUPPORTED || error == ERROR_NOT_SAME_DEVICE) {
+        cloneSupported = false;
+    }
+    return false;
+#elif defined(__linux__)
+    int fd = static_cast<int>(handle);
+    int sourceFd = static_cast<int>(localSource->getNativeHandle());
+    if (cloneSupported) {
+        file_clone_range range = {};
+        range.src_fd = sourceFd;
+        range.src_offset = sourceOffset;
+        range.src_length = length;
+        range.dest_offset = offset;
+        if (ioctl(fd, FICLONERANGE, &range) == 0) {
+            return true;
+        }
+        // An unaligned range fails with EINVAL, a file system that cannot clone fails every time
+        if (errno == EOPNOTSUPP || errno == EXDEV || errno == ENOTTY) {
+            cloneSupported = false;
+        }
+    }
+    if (!copyRangeSupported) {
+        return false;
+    }
+    loff_t sourcePosition = static_cast<loff_t>(sourceOffset);
+    loff_t position = static_cast<loff_t>(offset);
+    uint64_t remaining = length;
+    while (remaining > 0) {
+        ssize_t copied = copy_file_range(sourceFd, &sourcePosition, fd, &position, static_cast<size_t>(remaining), 0);
+        // EINVAL can be particular to a range, so only that range is written instead. The others mean
+        // the file systems cannot copy at all. Any part already copied is overwritten by the write.
+        if (copied < 0 && errno == EINVAL) {
+            return false;
+        }
+        if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            copyRangeSupported = false;
+            return false;
+        }
+        if (copied < 0) {
+            throw std::runtime_error(std::string("Failed to copy from the backup file. Error: ") + strerror(errno));
+        }
+        if (copied == 0) {
+            throw std::runtime_error("Failed to copy from the backup file. The range is past the end of the file.");
+        }
+        remaining -= static_cast<uint64_t>(copied);
+    }
+    // A copied range is dirty in the cache like a written one. A cloned range shares storage and is not.
+    recordWrite(offset, length);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Flushes written data to the storage, unless the durability is `Durability::eNone`.
+ *
+ * @throws std::runtime_error if the flush fails.
+ */
+void FileTarget::flush()
+{
+    if (writeBack.getDurability() == Durability::eNone) {
+        return;
+    }
+#ifdef _WIN32
+    if (!FlushFileBuffers(reinterpret_cast<HANDLE>(handle))) {
+        throw std::runtime_error("Failed to flush the target. Error: " + std::to_string(GetLastError()));
+    }
+#else
+    if (fsync(static_cast<int>(handle)) != 0 && errno != EINVAL) {
+        throw std::runtime_error(std::string("Failed to flush the target. Error: ") + strerror(errno));
+    }
+#endif
+    writeBack.flushed();
+}
+
+/**
+ * @brief Records data written to the file. With `Durability::ePeriodic`, each full interval has its write-back
+ * started, then the writer waits for the interval before it, which bounds the dirty data in the cache.
+ *
+ * @param offset The offset of the write.
+ * @param length The length of the write.
+ * @throws std::runtime_error if the write-back fails.
+ */
+void FileTarget::recordWrite(uint64_t offset, uint64_t length)
+{
+    WriteBackTracker::Span start;
+    WriteBackTracker::Span wait;
+    if (!writeBack.record(offset, length, start, wait)) {
+        return;
+    }
+    startWriteBack(start);
+    waitForWriteBack(wait);
+    writeBack.completed(wait);
+}
+
+/**
+ * @brief Starts writing the ranges of an interval back with sync_file_range on Linux. Windows has no ranged
+ * write-back for a file handle, so the ranges are written back when they are waited for.
+ *
+ * @param span The ranges written in the interval.
+ */
+void FileTarget::startWriteBack(const WriteBackTracker::Span& span)
+{
+#ifdef __linux__
+    for (const auto& range : span.ranges) {
+        syncFileRange(static_cast<int>(handle), range.first, range.second - range.first, SYNC_FILE_RANGE_WRITE);
+    }
+#endif
+}
+
+/**
+ * @brief Waits until the ranges of an interval are on storage: sync_file_range of each range on Linux, a flush
+ * of the file elsewhere.
+ *
+ * On Windows this is a full FlushFileBuffers, not an incremental write-back. It writes back everything
+ * written to the file so far, including the interval still being written, and waits for the device cache.
+ * The periodic flushes then bound the dirty data but cost more than the ranges they are for.
+ *
+ * @param span The ranges written in the interval.
+ * @throws std::runtime_error if the write-back fails.
+ */
+void FileTarget::waitForWriteBack(const WriteBackTracker::Span& span)
+{
+    if (span.ranges.empty()) {
+        return;
+    }
+#ifdef _WIN32
+    if (!FlushFileBuffers(reinterpret_cast<HANDLE>(handle))) {
+        throw std::runtime_error("Failed to write back the target. Error: " + std::to_string(GetLastError()));
+    }
+#elif defined(__linux__)
+    for (const auto& range : span.ranges) {
+        syncFileRange(static_cast<int>(handle), range.first, range.second - range.first,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#else
+    if (fsync(static_cast<int>(handle)) != 0 && errno != EINVAL) {
+        throw std::runtime_error(std::string("Failed to write back the target. Error: ") + strerror(errno));
+    }
+#endif
+}
+
+/**
+ * @brief Returns the size of the file or device in bytes, or 0 if a device does not report one.
+ *
+ * @throws std::runtime_error if the size of a file could not be read.
+ */
+uint64_t FileTarget::getSize()
+{
+#ifdef _WIN32
+    if (isDevice) {
+        GET_LENGTH_INFORMATION lengthInfo = {};
+        DWORD bytesReturned = 0;
+        if (!DeviceIoControl(reinterpret_cast<HANDLE>(handle), IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &lengthInfo, sizeof(lengthInfo), &bytesReturned, NULL)) {
+            return 0;
+        }
+        return static_cast<uint64_t>(lengthInfo.Length.QuadPart);
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(reinterpret_cast<HANDLE>(handle), &size)) {
+        throw std::runtime_error("Failed to get file size. Error: " + std::to_string(GetLastError()));
+    }
+    return static_cast<uint64_t>(size.QuadPart);
+#else
+    struct stat info;
+    if (fstat(static_cast<int>(handle), &info) != 0) {
+        throw std::runtime_error(std::string("Failed to get file size. Error: ") + strerror(errno));
+    }
+    return static_cast<uint64_t>(info.st_size);
+#endif
+}
+
+// ==============================
+// MappedFileTarget
+// ==============================
+
+/**
+ * @brief Opens or creates the file. The mapping is made by `prepare`.
+ *
+ * @param filePath The path of the image file.
+ * @param keepData True to keep the data of an existing file.
+ * @throws std::runtime_error if the file could not be opened.
+ */
+MappedFileTarget::MappedFileTarget(const std::wstring& filePath, bool keepData /*= false*/)
+    : FileTarget(filePath, false, keepData)
+{
+}
+
+/**
+ * @brief Unmaps the file. Data written to the mapping is written back by the system.
+ */
+MappedFileTarget::~MappedFileTarget()
+{
+    unmap();
+}
+
+/**
+ * @brief Sizes the file for the disk and maps all of it.
+ *
+ * @param size The size of the disk to restore.
+ * @throws std::runtime_error if the file cannot be sized or mapped.
+ */
+void MappedFileTarget::prepare(uint64_t size)
+{
+    unmap();
+    FileTarget::prepare(size);
+    if (size == 0) {
+        return;
+    }
+    if (size > SIZE_MAX) {
+        throw std::runtime_error("The disk is too large to map into memory.");
+    }
+#ifdef _WIN32
+    HANDLE mappingHandle = CreateFileMappingW(reinterpret_cast<HANDLE>(getNativeHandle()), NULL, PAGE_READWRITE,
+        static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), NULL);
+    if (mappingHandle == NULL) {
+        throw std::runtime_error("Failed to map the target file. Error: " + std::to_string(GetLastError()));
+    }
+    void* address = MapViewOfFile(mappingHandle, FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T>(size));
+    if (address == NULL) {
+        DWORD error = GetLastError();
+        CloseHandle(mappingHandle);
+        throw std::runtime_error("Failed to map the target file. Error: " + std::to_string(error));
+    }
+    mapping = reinterpret_cast<intptr_t>(mappingHandle);
+#else
+    void* address = mmap(nullptr, static_cast<size_t>(size), PROT_READ | PROT_WRITE, MAP_SHARED, static_cast<int>(getNativeHandle()), 0);
+    if (address == MAP_FAILED) {
+        throw std::runtime_error(std::string("Failed to map the target file. Error: ") + strerror(errno));
+    }
+#endif
+    view = static_cast<uint8_t*>(address);
+    mappedSize = size;
+}
+
+/**
+ * @brief Copies data into the mapping. Writes past the mapping go to the file.
+ *
+ * @param offset The offset of the first byte to write.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ */
+void MappedFileTarget::writeAt(uint64_t offset, const void* data, size_t length)
+{
+    uint8_t* destination = getWritePointer(offset, length);
+    if (destination == nullptr) {
+        FileTarget::writeAt(offset, data, length);
+        return;
+    }
+    memcpy(destination, data, length);
+    commitWrite(offset, length);
+}
+
+/**
+ * @brief Returns the mapped memory of a range, or null if the range is outside the mapping.
+ *
+ * The range is not counted as written until `commitWrite` reports the data in it, so a periodic write-back
+ * never starts on pages that are still being decoded into.
+ */
+uint8_t* MappedFileTarget::getWritePointer(uint64_t offset, size_t length)
+{
+    if (view == nullptr || offset > mappedSize || length > mappedSize - offset) {
+        return nullptr;
+    }
+    return view + offset;
+}
+
+/**
+ * @brief Records a range of the mapping as written, for periodic write-back.
+ *
+ * @param offset The offset of the range.
+ * @param length The length of the range.
+ * @throws std::runtime_error if a periodic write-back fails.
+ */
+void MappedFileTarget::commitWrite(uint64_t offset, size_t length)
+{
+    if (view == nullptr || offset > mappedSize || length > mappedSize - offset) {
+        return;
+    }
+    recordWrite(offset, length);
+}
+
+/**
+ * @brief Writes the mapped pages back to the file, then flushes the file, unless the durability is `Durability::eNone`.
+ *
+ * @throws std::runtime_error if the flush fails.
+ */
+void MappedFileTarget::flush()
+{
+    if (writeBack.getDurability() == Durability::eNone) {
+        return;
+    }
+    if (view != nullptr) {
+#ifdef _WIN32
+        if (!FlushViewOfFile(view, 0)) {
+            throw std::runtime_error("Failed to flush the target mapping. Error: " + std::to_string(GetLastError()));
+        }
+#else
+        if (msync(view, static_cast<size_t>(mappedSize), MS_SYNC) != 0) {
+            throw std::runtime_error(std::string("Failed to flush the target mapping. Error: ") + strerror(errno));
+        }
+#endif
+    }
+    FileTarget::flush();
+}
+
+/**
+ * @brief Starts writing the ranges of an interval of the mapping back. On Windows, the dirty pages of each range
+ * are written to the file with FlushViewOfFile, so the file flush that waits for the interval finds them.
+ * Elsewhere the pages are the file's own cache pages, which are written back as for any file.
+ *
+ * @param span The ranges written in the interval.
+ */
+void MappedFileTarget::startWriteBack(const WriteBackTracker::Span& span)
+{
+#ifdef _WIN32
+    for (const auto& range : span.ranges) {
+        if (view != nullptr && range.first < mappedSize) {
+            FlushViewOfFile(view + range.first, static_cast<SIZE_T>(std::min(range.second, mappedSize) - range.first));
+        }
+    }
+#else
+    FileTarget::startWriteBack(span);
+#endif
+}
+
+/**
+ * @brief Removes the mapping, if there is one.
+ */
+void MappedFileTarget::unmap()
+{
+    if (view == nullptr) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+    CloseHandle(reinterpret_cast<HANDLE>(mapping));
+    mapping = 0;
+#else
+    munmap(view, static_cast<size_t>(mappedSize));
+#endif
+    view = nullptr;
+    mappedSize = 0;
+}
+
+#ifdef __linux__
+// ==============================
+// BlockDeviceTarget
+// ==============================
+
+/**
+ * @brief Opens a block device for reading and writing.
+ *
+ * The device is opened exclusively, so a device with a mounted file system is refused.
+ *
+ * @param devicePath The path of the device.
+ * @param keepData True to keep the data on the device rather than discard it in `prepare`.
+ * @throws std::runtime_error if the device could not be opened or is not a block device.
+ */
+BlockDeviceTarget::BlockDeviceTarget(const std::wstring& devicePath, bool keepData /*= false*/)
+    : keepData(keepData)
+{
+    name = devicePath;
+    int fd = open(std::filesystem::path(devicePath).string().c_str(), O_RDWR | O_EXCL | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open device: " + wideToString(devicePath) + ". Error: " + strerror(errno));
+    }
+    handle = fd;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISBLK(info.st_mode)) {
+        close(fd);
+        throw std::runtime_error("Not a block device: " + wideToString(devicePath));
+    }
+    int logicalSectorSize = 0;
+    if (ioctl(fd, BLKGETSIZE64, &deviceSize) != 0 || ioctl(fd, BLKSSZGET, &logicalSectorSize) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not read the geometry of device: " + wideToString(devicePath) + ". Error: " + strerror(errno));
+    }
+    if (logicalSectorSize > 0) {
+        sectorSize = static_cast<uint32_t>(logicalSectorSize);
+    }
+}
+
+/**
+ * @brief Closes the device.
+ */
+BlockDeviceTarget::~BlockDeviceTarget()
+{
+    close(static_cast<int>(handle));
+}
+
+/**
+ * @brief Checks that the device can hold the disk and, unless its data is kept, makes the range it will occupy read as zeros.
+ *
+ * The range is discarded first, so thin-provisioned and flash storage release the blocks the restore does not write.
+ * A discard only guarantees zeros on a device that reports it through BLKDISCARDZEROES, so on any other device the
+ * range is also zeroed with BLKZEROOUT. The kernel passes that to the device as a Write Zeroes or WRITE SAME command
+ * where it has one, which is quick on devices with deterministic zeroing (DRZAT or LBPRZ), and writes zeros where it
+ * does not, which takes as long as writing the whole range.
+ *
+ * @param size The size of the disk to restore.
+ * @throws std::runtime_error if the device is too small, or the range cannot be zeroed.
+ */
+void BlockDeviceTarget::prepare(uint64_t size)
+{
+    if (size > deviceSize) {
+        throw std::runtime_error("The target device is smaller than the disk being restored.");
+    }
+    if (keepData) {
+        return;
+    }
+    unsigned int discardZeroes = 0;
+    bool discarded = discard(0, size);
+    if (!discarded || ioctl(static_cast<int>(handle), BLKDISCARDZEROES, &discardZeroes) != 0 || discardZeroes == 0) {
+        zeroRange(0, size);
+    }
+}
+
+/**
+ * @brief Writes `length` bytes at `offset`.
+ *
+ * @param offset The offset of the first byte to write.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @throws std::runtime_error if the write fails.
+ */
+void BlockDeviceTarget::writeAt(uint64_t offset, const void* data, size_t length)
+{
+    if (offset + length > deviceSize) {
+        throw std::runtime_error("Attempted to write past the end of the device.");
+    }
+    uint64_t start = offset;
+    size_t total = length;
+    auto* in = static_cast<const uint8_t*>(data);
+    while (length > 0) {
+        ssize_t result = pwrite(static_cast<int>(handle), in, length, static_cast<off_t>(offset));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to write to device. Error: ") + strerror(errno));
+        }
+        if (result == 0) {
+            throw std::runtime_error("Failed to write to device. No bytes were written.");
+        }
+        in += result;
+        offset += static_cast<uint64_t>(result);
+        length -= static_cast<size_t>(result);
+    }
+    recordWrite(start, total);
+}
+
+/**
+ * @brief Reads `length` bytes at `offset`.
+ *
+ * @param offset The offset of the first byte to read.
+ * @param buffer The buffer that receives the data.
+ * @param length The number of bytes to read.
+ * @throws std::runtime_error if the read fails or the range is outside the device.
+ */
+void BlockDeviceTarget::readAt(uint64_t offset, void* buffer, size_t length)
+{
+    if (offset + length > deviceSize) {
+        throw std::runtime_error("Attempted to read past the end of the device.");
+    }
+    auto* out = static_cast<uint8_t*>(buffer);
+    while (length > 0) {
+        ssize_t result = pread(static_cast<int>(handle), out, length, static_cast<off_t>(offset));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to read from device. Error: ") + strerror(errno));
+        }
+        if (result == 0) {
+            throw std::runtime_error("Failed to read from device. No bytes were read.");
+        }
+        out += result;
+        offset += static_cast<uint64_t>(result);
+        length -= static_cast<size_t>(result);
+    }
+}
+
+/**
+ * @brief Zeros a range with BLKZEROOUT, writing zeros only for the parts that are not sector aligned.
+ *
+ * @param offset The offset of the first byte to zero.
+ * @param length The number of bytes to zero.
+ * @throws std::runtime_error if the range cannot be zeroed.
+ */
+void BlockDeviceTarget::zeroRange(uint64_t offset, uint64_t length)
+{
+    uint64_t start = (offset + sectorSize - 1) / sectorSize * sectorSize;
+    uint64_t end = (offset + length) / sectorSize * sectorSize;
+    if (start >= end) {
+        RestoreTarget::zeroRange(offset, length);
+        return;
+    }
+    uint64_t range[2] = { start, end - start };
+    if (ioctl(static_cast<int>(handle), BLKZEROOUT, range) != 0) {
+        RestoreTarget::zeroRange(offset, length);
+        return;
+    }
+    RestoreTarget::zeroRange(offset, start - offset);
+    RestoreTarget::zeroRange(end, offset + length - end);
+}
+
+/**
+ * @brief Discards the whole sectors in a range with BLKDISCARD.
+ *
+ * @param offset The offset of the first byte to discard.
+ * @param length The number of bytes to discard.
+ */
+void BlockDeviceTarget::discardRange(uint64_t offset, uint64_t length)
+{
+    discard(offset, length);
+}
+
+/**
+ * @brief Discards the whole sectors in a range with BLKDISCARD.
+ *
+ * Devices that do not support discard are remembered, so they are only asked once.
+ *
+ * @param offset The offset of the first byte to discard.
+ * @param length The number of bytes to discard.
+ * @return True if every whole sector in the range was discarded.
+ */
+bool BlockDeviceTarget::discard(uint64_t offset, uint64_t length)
+{
+    if (!discardSupported) {
+        return false;
+    }
+    uint64_t start = (offset + sectorSize - 1) / sectorSize * sectorSize;
+    uint64_t end = std::min(offset + length, deviceSize) / sectorSize * sectorSize;
+    if (start >= end) {
+        return true;
+    }
+    uint64_t range[2] = { start, end - start };
+    if (ioctl(static_cast<int>(handle), BLKDISCARD, range) != 0) {
+        if (errno == EOPNOTSUPP || errno == ENOTTY) {
+            discardSupported = false;
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Flushes written data and the device cache, unless the durability is `Durability::eNone`.
+ *
+ * @throws std::runtime_error if the flush fails.
+ */
+void BlockDeviceTarget::flush()
+{
+    if (writeBack.getDurability() == Durability::eNone) {
+        return;
+    }
+    if (fsync(static_cast<int>(handle)) != 0) {
+        throw std::runtime_error(std::string("Failed to flush the device. Error: ") + strerror(errno));
+    }
+    writeBack.flushed();
+}
+
+/**
+ * @brief Records data written to the device. With `Durability::ePeriodic`, each full interval has its write-back
+ * started, then the writer waits for the interval before it.
+ *
+ * @param offset The offset of the write.
+ * @param length The length of the write.
+ * @throws std::runtime_error if the write-back fails.
+ */
+void BlockDeviceTarget::recordWrite(uint64_t offset, uint64_t length)
+{
+    WriteBackTracker::Span start;
+    WriteBackTracker::Span wait;
+    if (!writeBack.record(offset, length, start, wait)) {
+        return;
+    }
+    int fd = static_cast<int>(handle);
+    for (const auto& range : start.ranges) {
+        syncFileRange(fd, range.first, range.second - range.first, SYNC_FILE_RANGE_WRITE);
+    }
+    for (const auto& range : wait.ranges) {
+        syncFileRange(fd, range.first, range.second - range.first, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    writeBack.completed(wait);
+}
+#endif
+
+// ==============================
+// MemoryTarget
+// ==============================
+
+/**
+ * @brief Creates an empty memory target.
+ *
+ * @param retainData True to keep the written data, false to only count it.
+ */
+MemoryTarget::MemoryTarget(bool retainData)
+    : retainData(retainData)
+{
+    name = L"memory:";
+}
+
+/**
+ * @brief Sets the size of the target. Any retained data is discarded.
+ *
+ * @param size The size of the disk to restore.
+ */
+void MemoryTarget::prepare(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->size = size;
+    chunks.clear();
+}
+
+/**
+ * @brief Copies `length` bytes to `offset`, allocating chunks as they are first written.
+ *
+ * @param offset The offset of the first byte to write.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @throws std::runtime_error if the range is outside the target.
+ */
+void MemoryTarget::writeAt(uint64_t offset, const void* data, size_t length)
+{
+    if (offset + length > size) {
+        throw std::runtime_error("Attempted to write past the end of the memory target.");
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    bytesWritten += length;
+    if (!retainData) {
+        return;
+    }
+    auto* in = static_cast<const uint8_t*>(data);
+    while (length > 0) {
+        uint64_t chunkOffset = offset % CHUNK_SIZE;
+        size_t toCopy = static_cast<size_t>(std::min<uint64_t>(length, CHUNK_SIZE - chunkOffset));
+        auto& chunk = chunks[offset / CHUNK_SIZE];
+        if (!chunk) {
+            chunk.reset(new uint8_t[CHUNK_SIZE]());
+        }
+        memcpy(chunk.get() + chunkOffset, in, toCopy);
+        in += toCopy;
+        offset += toCopy;
+        length -= toCopy;
+    }
+}
+
+/**
+ * @brief Zeros a range, freeing the chunks it covers completely.
+ *
+ * @param offset The offset of the first byte to zero.
+ * @param length The number of bytes to zero.
+ */
+void MemoryTarget::zeroRange(uint64_t offset, uint64_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    length = offset < size ? std::min(length, size - offset) : 0;
+    while (length > 0) {
+        uint64_t chunkOffset = offset % CHUNK_SIZE;
+        uint64_t toZero = std::min<uint64_t>(length, CHUNK_SIZE - chunkOffset);
+        auto it = chunks.find(offset / CHUNK_SIZE);
+        if (it != chunks.end()) {
+            if (toZero == CHUNK_SIZE) {
+                chunks.erase(it);
+            }
+            else {
+                memset(it->second.get() + chunkOffset, 0, static_cast<size_t>(toZero));
+            }
+        }
+        offset += toZero;
+        length -= toZero;
+    }
+}
+
+/**
+ * @brief Discards a range. Memory is released in the same way as `zeroRange`.
+ */
+void MemoryTarget::discardRange(uint64_t offset, uint64_t length)
+{
+    zeroRange(offset, length);
+}
+
+/**
+ * @brief Returns the memory of a range that lies within one chunk, allocating the chunk if needed.
+ *
+ * The range is counted as written. Returns null if the data is not retained, or the range is outside
+ * the target or crosses a chunk boundary.
+ *
+ * @param offset The offset of the range.
+ * @param length The length of the range.
+ */
+uint8_t* MemoryTarget::getWritePointer(uint64_t offset, size_t length)
+{
+    if (!retainData || length == 0 || offset + length > size || offset / CHUNK_SIZE != (offset + length - 1) / CHUNK_SIZE) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    bytesWritten += length;
+    auto& chunk = chunks[offset / CHUNK_SIZE];
+    if (!chunk) {
+        chunk.reset(new uint8_t[CHUNK_SIZE]());
+    }
+    return chunk.get() + offset % CHUNK_SIZE;
+}
+
+/**
+ * @brief Reads back written data.
+ *
+ * @param offset The offset of the first byte to read.
+ * @param buffer The buffer that receives the data.
+ * @param length The number of bytes to read.
+ * @throws std::runtime_error if the data is not retained or the range is outside the target.
+ */
+void MemoryTarget::readAt(uint64_t offset, void* buffer, size_t length)
+{
+    if (!retainData) {
+        throw std::runtime_error("The memory target does not retain data.");
+    }
+    if (offset + length > size) {
+        throw std::runtime_error("Attempted to read past the end of the memory target.");
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto* out = static_cast<uint8_t*>(buffer);
+    while (length > 0) {
+        uint64_t chunkOffset = offset % CHUNK_SIZE;
+        size_t toCopy = static_cast<size_t>(std::min<uint64_t>(length, CHUNK_SIZE - chunkOffset));
+        auto it = chunks.find(offset / CHUNK_SIZE);
+        if (it != chunks.end()) {
+            memcpy(out, it->second.get() + chunkOffset, toCopy);
+        }
+        else {
+            memset(out, 0, toCopy);
+        }
+        out += toCopy;
+        offset += toCopy;
+        length -= toCopy;
+    }
+}
+
+/**
+ * @brief Returns the number of bytes written.
+ */
+uint64_t MemoryTarget::getBytesWritten() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytesWritten;
+}
+
+// ==============================
+// StreamTarget
+// ==============================
+
+/**
+ * @brief Returns true for paths that open a `StreamTarget`: "stdout:" and named pipes.
+ */
+static bool isStreamPath(const std::wstring& path)
+{
+    if (path == L"stdout:") {
+        return true;
+    }
+#ifdef _WIN32
+    return path.rfind(L"\\\\.\\pipe\\", 0) == 0;
+#else
+    struct stat info;
+    return stat(std::filesystem::path(path).string().c_str(), &info) == 0 && S_ISFIFO(info.st_mode);
+#endif
+}
+
+#ifndef _WIN32
+/**
+ * @class PipeSignalBlock
+ * @brief Blocks SIGPIPE on the calling thread while a stream is written.
+ *
+ * A reader that goes away then fails the write with EPIPE rather than ending the process. The SIGPIPE the
+ * write raises is taken off the thread before the mask is restored. How the rest of the process handles
+ * SIGPIPE is left alone.
+ */
+class PipeSignalBlock {
+public:
+    PipeSignalBlock()
+    {
+        sigemptyset(&pipeSignal);
+        sigaddset(&pipeSignal, SIGPIPE);
+        sigset_t pending;
+        sigpending(&pending);
+        wasPending = sigismember(&pending, SIGPIPE) == 1;
+        pthread_sigmask(SIG_BLOCK, &pipeSignal, &previousMask);
+    }
+
+    ~PipeSignalBlock()
+    {
+        // A SIGPIPE that was pending before the write is not ours to take
+        if (!wasPending) {
+            sigset_t pending;
+            sigpending(&pending);
+            if (sigismember(&pending, SIGPIPE) == 1) {
+                int signal;
+                sigwait(&pipeSignal, &signal);
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+    }
+
+    PipeSignalBlock(const PipeSignalBlock&) = delete;
+    PipeSignalBlock& operator=(const PipeSignalBlock&) = delete;
+
+private:
+    sigset_t pipeSignal;
+    sigset_t previousMask;
+    bool wasPending = false;
+};
+#endif
+
+/**
+ * @brief Opens standard output, or a named pipe for writing.
+ *
+ * Standard output is written through its native handle, so it is written in binary whatever mode the
+ * C runtime has it in.
+ *
+ * @param path "stdout:" or the path of a named pipe.
+ * @throws std::runtime_error if the pipe could not be opened.
+ */
+StreamTarget::StreamTarget(const std::wstring& path)
+    : ownsHandle(path != L"stdout:")
+{
+    name = path;
+#ifdef _WIN32
+    HANDLE streamHandle = ownsHandle
+        ? CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)
+        : GetStdHandle(STD_OUTPUT_HANDLE);
+    if (streamHandle == INVALID_HANDLE_VALUE || streamHandle == NULL) {
+        throw std::runtime_error("Could not open stream: " + wideToString(path) + ". Error: " + std::to_string(GetLastError()));
+    }
+    handle = reinterpret_cast<intptr_t>(streamHandle);
+#else
+    int fd = ownsHandle ? open(std::filesystem::path(path).string().c_str(), O_WRONLY | O_CLOEXEC) : STDOUT_FILENO;
+    if (fd < 0) {
+        throw std::runtime_error("Could not open stream: " + wideToString(path) + ". Error: " + strerror(errno));
+    }
+    handle = fd;
+#endif
+}
+
+/**
+ * @brief Closes a named pipe. Standard output is left open.
+ */
+StreamTarget::~StreamTarget()
+{
+    if (!ownsHandle) {
+        return;
+    }
+#ifdef _WIN32
+    CloseHandle(reinterpret_cast<HANDLE>(handle));
+#else
+    close(static_cast<int>(handle));
+#endif
+}
+
+/**
+ * @brief Records the size of the disk. The stream starts at its first byte.
+ *
+ * @param size The size of the disk.
+ */
+void StreamTarget::prepare(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    diskSize = size;
+    position = 0;
+}
+
+/**
+ * @brief Writes data to the stream, after zeros for any gap before it.
+ *
+ * @param offset The disk offset. Must not be before the end of the data already written.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @throws std::runtime_error if the data is out of order or the write fails.
+ */
+void StreamTarget::writeAt(uint64_t offset, const void* data, size_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    skipTo(offset);
+    writeAll(data, length);
+    position += length;
+}
+
+/**
+ * @brief Writes zeros for a range, after zeros for any gap before it.
+ *
+ * @param offset The disk offset. Must not be before the end of the data already written.
+ * @param length The length of the range.
+ * @throws std::runtime_error if the range is out of order or the write fails.
+ */
+void StreamTarget::zeroRange(uint64_t offset, uint64_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    skipTo(offset);
+    writeZeros(length);
+}
+
+/**
+ * @brief Writes zeros to the end of the disk, so the stream is always the size of the disk.
+ *
+ * @throws std::runtime_error if the write fails.
+ */
+void StreamTarget::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (position < diskSize) {
+        skipTo(diskSize);
+    }
+}
+
+/**
+ * @brief Writes zeros up to `offset`.
+ *
+ * @param offset The disk offset of the next write.
+ * @throws std::runtime_error if `offset` is before the end of the data already written.
+ */
+void StreamTarget::skipTo(uint64_t offset)
+{
+    if (offset < position) {
+        throw std::runtime_error("A stream must be written in disk order.");
+    }
+    writeZeros(offset - position);
+}
+
+/**
+ * @brief Writes all of `data` to the stream. A pipe may take a write in several parts.
+ *
+ * On POSIX systems, SIGPIPE is blocked on this thread for the write, so a reader that goes away fails
+ * the write rather than ending the process.
+ *
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @throws std::runtime_error if the write fails or the reader has closed the stream.
+ */
+void StreamTarget::writeAll(const void* data, size_t length)
+{
+    auto* in = static_cast<const uint8_t*>(data);
+#ifndef _WIN32
+    PipeSignalBlock pipeSignalBlock;
+#endif
+    while (length > 0) {
+#ifdef _WIN32
+        DWORD toWrite = static_cast<DWORD>(std::min<size_t>(length, 0x40000000));
+        DWORD bytesWritten = 0;
+        if (!WriteFile(reinterpret_cast<HANDLE>(handle), in, toWrite, &bytesWritten, NULL)) {
+            throw std::runtime_error("Failed to write to stream. Error: " + std::to_string(GetLastError()));
+        }
+        size_t transferred = bytesWritten;
+#else
+        ssize_t result = write(static_cast<int>(handle), in, length);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to write to stream. Error: ") + strerror(errno));
+        }
+        size_t transferred = static_cast<size_t>(result);
+#endif
+        if (transferred == 0) {
+            throw std::runtime_error("Failed to write to stream. No bytes were written.");
+        }
+        in += transferred;
+        length -= transferred;
+    }
+}
+
+/**
+ * @brief Writes `length` zeros to the stream from one shared buffer of zeros.
+ *
+ * @param length The number of zeros to write.
+ */
+void StreamTarget::writeZeros(uint64_t length)
+{
+    static const std::vector<uint8_t> zeros(ZERO_BUFFER_SIZE, 0);
+    position += length;
+    while (length > 0) {
+        size_t toWrite = static_cast<size_t>(std::min<uint64_t>(length, zeros.size()));
+        writeAll(zeros.data(), toWrite);
+        length -= toWrite;
+    }
+}
+
+// ==============================
+// Factory
+// ==============================
+
+/**
+ * @brief Opens a restore target, selecting the backend from the path.
+ *
+ * @param path "memory:", "stdout:", a named pipe, a block device on Linux, or an image file or device path.
+ * @param preallocate True to allocate the whole disk up front for an image file.
+ * @param mapped True to write an image file through a memory mapping. Ignored for memory, streams and block devices.
+ * @param keepData True to keep the data already on an image file or block device.
+ * @return The opened target.
+ */
+SharedTarget openRestoreTarget(const std::wstring& path, bool preallocate, bool mapped /*= false*/, bool keepData /*= false*/)
+{
+    if (path == L"memory:") {
+        return std::make_shared<MemoryTarget>(false);
+    }
+    if (isStreamPath(path)) {
+        return std::make_shared<StreamTarget>(path);
+    }
+#ifdef __linux__
+    struct stat info;
+    if (stat(std::filesystem::path(path).string().c_str(), &info) == 0 && S_ISBLK(info.st_mode)) {
+        return std::make_shared<BlockDeviceTarget>(path, keepData);
+    }
+#endif
+    if (mapped) {
+        return std::make_shared<MappedFileTarget>(path, keepData);
+    }
+    return std::make_shared<FileTarget>(path, preallocate, keepData);
+}
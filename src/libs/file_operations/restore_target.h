@@ -0,0 +1,581 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief Pluggable write backends for restored disks.
+ *
+ * A restore writes track 0, the extended partition sectors and the data blocks of a disk
+ * at absolute disk offsets. `RestoreTarget` captures exactly that, so a disk can be restored
+ * to a mounted virtual disk, a raw image file, a block device or memory without the restore
+ * code knowing the difference.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class BackupSource;
+
+/**
+ * @brief When a target moves written data from the system cache to storage.
+ *
+ * - eNone: written data is left in the cache for the system to write back in its own time. `flush` completes
+ *   the target without waiting for storage, so a crash or power loss soon after can lose the end of the restore.
+ * - eFinalFlush: written data is left in the cache while the restore runs, and `flush` waits until all of it is on storage.
+ * - ePeriodic: as eFinalFlush, but the write-back of each `WriteBackPolicy::interval_bytes` written is started as soon as
+ *   the interval is complete, and the writer then waits for the interval before it. The cache holds no more than a few
+ *   intervals of unwritten data, so neither the restore nor the rest of the system stalls in one huge flush.
+ */
+enum class Durability { eNone, eFinalFlush, ePeriodic };
+
+/**
+ * @struct WriteBackPolicy
+ * @brief How a target moves written data to storage.
+ *
+ * @var durability When written data is moved to storage.
+ * @var interval_bytes With `Durability::ePeriodic`, the bytes written in each interval.
+ */
+struct WriteBackPolicy
+{
+    Durability durability = Durability::eFinalFlush;
+    uint64_t interval_bytes = 64 * 1024 * 1024;
+};
+
+/**
+ * @struct WriteBackStats
+ * @brief How much of the data written to a target may still be dirty in the system cache.
+ *
+ * @var dirty_bytes The bytes written that are not yet known to be on storage.
+ * @var peak_dirty_bytes The most that `dirty_bytes` has been.
+ * @var write_backs The number of periodic write-backs started.
+ */
+struct WriteBackStats
+{
+    uint64_t dirty_bytes = 0;
+    uint64_t peak_dirty_bytes = 0;
+    uint64_t write_backs = 0;
+};
+
+/**
+ * @class WriteBackTracker
+ * @brief Counts the dirty data of a file or device target and marks out the intervals of periodic write-back.
+ *
+ * Each interval keeps the ranges written in it, merged where they meet, so only those ranges are written
+ * back and a range written twice in an interval is counted once. All methods may be called concurrently
+ * by the threads writing to the target.
+ */
+class WriteBackTracker {
+public:
+    /**
+     * @struct Span
+     * @brief The ranges written in an interval, and the number of bytes they cover.
+     *
+     * @var ranges The end of each range, by its offset. Ranges that overlap or meet are merged.
+     * @var bytes The number of bytes the ranges cover.
+     */
+    struct Span
+    {
+        std::map<uint64_t, uint64_t> ranges;
+        uint64_t bytes = 0;
+    };
+
+    void setPolicy(const WriteBackPolicy& policy);
+    Durability getDurability() const;
+
+    /**
+     * @brief Records a write.
+     *
+     * @param offset The offset of the write.
+     * @param length The length of the write.
+     * @param start Receives the interval just completed, whose write-back is to be started.
+     * @param wait Receives the interval before it, whose write-back is to be waited for. Empty for the first interval.
+     * @return True if the write completed an interval. Only with `Durability::ePeriodic`.
+     */
+    bool record(uint64_t offset, uint64_t length, Span& start, Span& wait);
+
+    /**
+     * @brief Records that the write-back of an interval has completed.
+     */
+    void completed(const Span& span);
+
+    /**
+     * @brief Records that everything written is on storage.
+     */
+    void flushed();
+
+    WriteBackStats getStats() const;
+
+private:
+    mutable std::mutex mutex;
+    WriteBackPolicy policy;
+    Span current;
+    Span pending;
+    WriteBackStats stats;
+};
+
+/**
+ * @class RestoreTarget
+ * @brief Write-only, positional access to a restored disk.
+ *
+ * Implementations must allow `writeAt` to be called concurrently from multiple threads
+ * for ranges that do not overlap.
+ */
+class RestoreTarget {
+public:
+    virtual ~RestoreTarget() = default;
+
+    /**
+     * @brief Prepares the target to hold a disk of `size` bytes.
+     *
+     * Called once before the first write. The default implementation does nothing.
+     *
+     * @throws std::runtime_error if the target is too small or cannot be prepared.
+     */
+    virtual void prepare(uint64_t size) {}
+
+    /**
+     * @brief Writes `length` bytes from `data` at `offset`.
+     * @throws std::runtime_error if the write fails or is short.
+     */
+    virtual void writeAt(uint64_t offset, const void* data, size_t length) = 0;
+
+    /**
+     * @brief Makes a range read back as zeros.
+     *
+     * The default implementation writes zeros. Backends override this with a cheaper
+     * operation where the file system or device has one.
+     *
+     * @throws std::runtime_error if the range cannot be zeroed.
+     */
+    virtual void zeroRange(uint64_t offset, uint64_t length);
+
+    /**
+     * @brief Tells the target that a range holds no data, so its storage can be released.
+     *
+     * The contents of the range are undefined afterwards. The default implementation does nothing.
+     */
+    virtual void discardRange(uint64_t offset, uint64_t length) {}
+
+    /**
+     * @brief Returns the size of the blocks the target can store as zstd frames, or 0 if it cannot.
+     *
+     * A target that stores compressed blocks, such as a qcow2 image, takes a block that is
+     * already a zstd frame as it is, without it being decompressed and compressed again.
+     * The default implementation returns 0.
+     */
+    virtual uint32_t getCompressedBlockSize() const { return 0; }
+
+    /**
+     * @brief Returns true if a block of `length` bytes at `offset` can be written as its zstd frame with `writeCompressedAt`.
+     *
+     * The default implementation accepts a block that fills one block of `getCompressedBlockSize()`.
+     */
+    virtual bool canWriteCompressed(uint64_t offset, uint64_t length) const;
+
+    /**
+     * @brief Writes a whole block given as a single zstd frame.
+     *
+     * @param offset The offset of the block, accepted by `canWriteCompressed`.
+     * @param frame The zstd frame, which decompresses to the whole block.
+     * @param length The length of the frame.
+     * @throws std::logic_error if the target does not store compressed blocks.
+     * @throws std::runtime_error if the write fails.
+     */
+    virtual void writeCompressedAt(uint64_t offset, const void* frame, size_t length);
+
+    /**
+     * @brief Copies a range of a backup file to `offset` without the data passing through the process.
+     *
+     * A target on the same storage as the backup file can have the file system clone the range or
+     * copy it inside the kernel. The default implementation copies nothing.
+     *
+     * @param source The backup file.
+     * @param sourceOffset The offset of the range in the backup file.
+     * @param offset The offset to copy the range to.
+     * @param length The length of the range.
+     * @return True if the range was copied, false if the target cannot copy from the source. Nothing is written then.
+     * @throws std::runtime_error if the copy fails part way.
+     */
+    virtual bool copyFrom(BackupSource& source, uint64_t sourceOffset, uint64_t offset, uint64_t length) { return false; }
+
+    /**
+     * @brief Returns memory through which a range can be written in place, or null if the target has none.
+     *
+     * A block can then be decrypted and decompressed straight into the target, with no copy between
+     * the decoder and the target. The memory stays valid until the range is zeroed or discarded, or the
+     * target is prepared or flushed. The default implementation returns null.
+     *
+     * @param offset The offset of the range.
+     * @param length The length of the range.
+     */
+    virtual uint8_t* getWritePointer(uint64_t offset, size_t length) { return nullptr; }
+
+    /**
+     * @brief Records that a range has been written through the memory from `getWritePointer`. The default implementation does nothing.
+     *
+     * @param offset The offset of the range.
+     * @param length The length of the range.
+     * @throws std::runtime_error if a periodic write-back fails.
+     */
+    virtual void commitWrite(uint64_t offset, size_t length) {}
+
+    /**
+     * @brief Returns true if the data on the target can be read back with `readAt`. The default implementation returns false.
+     */
+    virtual bool isReadable() const { return false; }
+
+    /**
+     * @brief Returns true if the target was opened with the data already on it kept, so a restore can build on an earlier one.
+     *
+     * A target that is created or truncated when it is opened holds nothing of an earlier restore. The default implementation returns false.
+     */
+    virtual bool keepsData() const { return false; }
+
+    /**
+     * @brief Reads back data from the target.
+     *
+     * @throws std::logic_error if the target cannot be read.
+     * @throws std::runtime_error if the read fails.
+     */
+    virtual void readAt(uint64_t offset, void* buffer, size_t length);
+
+    /**
+     * @brief Returns true if the target must be written from start to end, such as a compressed stream.
+     *
+     * Each write must then start at or after the end of the write before it, so the restore writes
+     * the disk in disk order rather than in backup file order. The default implementation returns false.
+     */
+    virtual bool isSequential() const { return false; }
+
+    /**
+     * @brief Makes all writes durable. The default implementation does nothing.
+     * @throws std::runtime_error if the flush fails.
+     */
+    virtual void flush() {}
+
+    /**
+     * @brief Sets when written data is moved from the system cache to storage. Call before `prepare`.
+     *
+     * The default implementation ignores the policy, for targets that do not write through the cache.
+     */
+    virtual void setWriteBack(const WriteBackPolicy& policy) {}
+
+    /**
+     * @brief Returns how much written data may still be dirty in the system cache. The default implementation returns zeros.
+     */
+    virtual WriteBackStats getWriteBackStats() const { return WriteBackStats(); }
+
+    /**
+     * @brief Returns the size of the target in bytes.
+     */
+    virtual uint64_t getSize() = 0;
+
+    /**
+     * @brief Returns the name used to open the target (a path, or "memory:").
+     */
+    const std::wstring& getName() const { return name; }
+
+protected:
+    std::wstring name;
+};
+
+// A shared pointer to a RestoreTarget.
+typedef std::shared_ptr<RestoreTarget> SharedTarget;
+
+/**
+ * @class FileTarget
+ * @brief A `RestoreTarget` for a raw disk image file, or a disk device on Windows.
+ *
+ * Uses positional writes on a native handle, so concurrent writes do not share a file pointer.
+ * Windows device paths (\\.\PhysicalDriveN) are written in place and never resized.
+ */
+class FileTarget : public RestoreTarget {
+public:
+    /**
+     * @brief Opens or creates the file.
+     *
+     * @param filePath The path of the file or device.
+     * @param preallocate True to allocate the whole disk size in `prepare`, rather than leave the file sparse.
+     * @param keepData True to keep the data of an existing image file, rather than truncate it, so unchanged blocks can be skipped.
+     * @throws std::runtime_error if the file could not be opened.
+     */
+    FileTarget(const std::wstring& filePath, bool preallocate, bool keepData = false);
+    ~FileTarget() override;
+
+    FileTarget(const FileTarget&) = delete;
+    FileTarget& operator=(const FileTarget&) = delete;
+
+    void prepare(uint64_t size) override;
+    void writeAt(uint64_t offset, const void* data, size_t length) override;
+    void zeroRange(uint64_t offset, uint64_t length) override;
+    void discardRange(uint64_t offset, uint64_t length) override;
+    bool copyFrom(BackupSource& source, uint64_t sourceOffset, uint64_t offset, uint64_t length) override;
+    void flush() override;
+    uint64_t getSize() override;
+    bool isReadable() const override { return true; }
+    bool keepsData() const override { return keepData; }
+    void setWriteBack(const WriteBackPolicy& policy) override { writeBack.setPolicy(policy); }
+    WriteBackStats getWriteBackStats() const override { return writeBack.getStats(); }
+
+    /**
+     * @brief Reads back data from the file. Bytes past the end of the file read as zeros.
+     * @throws std::runtime_error if the read fails.
+     */
+    void readAt(uint64_t offset, void* buffer, size_t length) override;
+
+    /**
+     * @brief Returns the native handle (a HANDLE on Windows, a file descriptor elsewhere).
+     */
+    intptr_t getNativeHandle() const { return handle; }
+
+protected:
+    /**
+     * @brief Records data written to the file, and runs a periodic write-back when an interval is complete.
+     * @throws std::runtime_error if the write-back fails.
+     */
+    void recordWrite(uint64_t offset, uint64_t length);
+
+    /**
+     * @brief Starts writing the ranges of an interval back to storage without waiting for them.
+     */
+    virtual void startWriteBack(const WriteBackTracker::Span& span);
+
+    /**
+     * @brief Waits until the ranges of an interval are on storage.
+     * @throws std::runtime_error if the write-back fails.
+     */
+    virtual void waitForWriteBack(const WriteBackTracker::Span& span);
+
+    WriteBackTracker writeBack;
+
+private:
+    intptr_t handle;
+    bool preallocate;
+    bool keepData;
+    bool isDevice;
+    std::atomic<bool> cloneSupported{ true };
+    std::atomic<bool> copyRangeSupported{ true };
+};
+
+/**
+ * @class MappedFileTarget
+ * @brief A `FileTarget` for a raw image file that is written through a memory mapping of the whole file.
+ *
+ * `getWritePointer` returns the mapping, so the restore decodes blocks straight into the file's pages in
+ * the file system cache and never copies them. The whole disk is mapped at once, so a large disk needs a
+ * 64-bit process. For periodic write-back, a range is counted as written when `commitWrite` reports the data
+ * decoded into it, not when its write pointer is handed out.
+ */
+class MappedFileTarget : public FileTarget {
+public:
+    /**
+     * @brief Opens or creates the file. It is mapped by `prepare`, once the disk size is known.
+     *
+     * @param filePath The path of the image file.
+     * @param keepData True to keep the data of an existing file, rather than truncate it.
+     * @throws std::runtime_error if the file could not be opened.
+     */
+    explicit MappedFileTarget(const std::wstring& filePath, bool keepData = false);
+    ~MappedFileTarget() override;
+
+    void prepare(uint64_t size) override;
+    void writeAt(uint64_t offset, const void* data, size_t length) override;
+    uint8_t* getWritePointer(uint64_t offset, size_t length) override;
+    void commitWrite(uint64_t offset, size_t length) override;
+    void flush() override;
+
+protected:
+    void startWriteBack(const WriteBackTracker::Span& span) override;
+
+private:
+    void unmap();
+
+    uint8_t* view = nullptr;
+    uint64_t mappedSize = 0;
+    // The file mapping object on Windows
+    intptr_t mapping = 0;
+};
+
+#ifdef __linux__
+/**
+ * @class BlockDeviceTarget
+ * @brief A `RestoreTarget` for a Linux block device, such as /dev/sdb or /dev/nvme1n1.
+ *
+ * `prepare` discards the restored range so that thin-provisioned and flash devices release
+ * the blocks the restore does not write, unless the data on the device is kept. The range is
+ * also zeroed, unless the device guarantees that discarded blocks read as zeros. `zeroRange`
+ * and `discardRange` use the BLKZEROOUT and BLKDISCARD ioctls, so the device does the work
+ * without any data crossing the bus where it supports them.
+ */
+class BlockDeviceTarget : public RestoreTarget {
+public:
+    /**
+     * @brief Opens the device for reading and writing.
+     *
+     * @param devicePath The path of the device.
+     * @param keepData True to keep the data on the device, rather than discard it in `prepare`, so unchanged blocks can be skipped.
+     * @throws std::runtime_error if the device could not be opened or is not a block device.
+     */
+    explicit BlockDeviceTarget(const std::wstring& devicePath, bool keepData = false);
+    ~BlockDeviceTarget() override;
+
+    BlockDeviceTarget(const BlockDeviceTarget&) = delete;
+    BlockDeviceTarget& operator=(const BlockDeviceTarget&) = delete;
+
+    void prepare(uint64_t size) override;
+    void writeAt(uint64_t offset, const void* data, size_t length) override;
+    void zeroRange(uint64_t offset, uint64_t length) override;
+    void discardRange(uint64_t offset, uint64_t length) override;
+    void flush() override;
+    uint64_t getSize() override { return deviceSize; }
+    bool isReadable() const override { return true; }
+    bool keepsData() const override { return keepData; }
+    void readAt(uint64_t offset, void* buffer, size_t length) override;
+    void setWriteBack(const WriteBackPolicy& policy) override { writeBack.setPolicy(policy); }
+    WriteBackStats getWriteBackStats() const override { return writeBack.getStats(); }
+
+    /**
+     * @brief Returns the file descriptor of the device.
+     */
+    intptr_t getNativeHandle() const { return handle; }
+
+private:
+    bool discard(uint64_t offset, uint64_t length);
+    void recordWrite(uint64_t offset, uint64_t length);
+
+    intptr_t handle;
+    bool keepData;
+    uint64_t deviceSize = 0;
+    uint32_t sectorSize = 512;
+    std::atomic<bool> discardSupported{ true };
+    WriteBackTracker writeBack;
+};
+#endif
+
+/**
+ * @class MemoryTarget
+ * @brief A `RestoreTarget` held in memory.
+ *
+ * With `retainData`, written data is kept in 1 MB chunks, allocated as they are first written,
+ * and can be read back. Without it, writes are only counted, so a restore measures the read and
+ * decode throughput without any storage in the way.
+ */
+class MemoryTarget : public RestoreTarget {
+public:
+    explicit MemoryTarget(bool retainData = true);
+
+    void prepare(uint64_t size) override;
+    void writeAt(uint64_t offset, const void* data, size_t length) override;
+    void zeroRange(uint64_t offset, uint64_t length) override;
+    void discardRange(uint64_t offset, uint64_t length) override;
+    uint8_t* getWritePointer(uint64_t offset, size_t length) override;
+    uint64_t getSize() override { return size; }
+    bool isReadable() const override { return retainData; }
+
+    /**
+     * @brief Reads back written data. Ranges that were never written read as zeros.
+     * @throws std::runtime_error if the data is not retained or the range is outside the target.
+     */
+    void readAt(uint64_t offset, void* buffer, size_t length) override;
+
+    /**
+     * @brief Returns the number of bytes written.
+     */
+    uint64_t getBytesWritten() const;
+
+private:
+    static constexpr uint64_t CHUNK_SIZE = 1024 * 1024;
+
+    bool retainData;
+    uint64_t size = 0;
+    uint64_t bytesWritten = 0;
+    mutable std::mutex mutex;
+    std::map<uint64_t, std::unique_ptr<uint8_t[]>> chunks;
+};
+
+/**
+ * @class StreamTarget
+ * @brief A sequential `RestoreTarget` that writes the raw disk as one byte stream, to standard output or a pipe.
+ *
+ * The disk is written from its first byte to its last, so it can be piped into another program, such as
+ * ssh, dd, a compressor or a hashing tool, without any scratch space. Writes must be made in disk order.
+ * The gaps between them, and the rest of the disk when the target is flushed, are written from one
+ * buffer of zeros, so empty ranges cost no more than the pipe takes to carry them.
+ */
+class StreamTarget : public RestoreTarget {
+public:
+    /**
+     * @brief Opens standard output, or a named pipe for writing.
+     *
+     * @param path "stdout:" for standard output, or the path of a named pipe (a FIFO, or \\.\pipe\name on Windows).
+     * @throws std::runtime_error if the pipe could not be opened.
+     */
+    explicit StreamTarget(const std::wstring& path);
+    ~StreamTarget() override;
+
+    StreamTarget(const StreamTarget&) = delete;
+    StreamTarget& operator=(const StreamTarget&) = delete;
+
+    void prepare(uint64_t size) override;
+
+    /**
+     * @brief Writes data to the stream, after zeros for any gap before it.
+     * @throws std::runtime_error if the data is before the end of the stream written so far, or the write fails.
+     */
+    void writeAt(uint64_t offset, const void* data, size_t length) override;
+
+    /**
+     * @brief Writes zeros to the stream for a range, after zeros for any gap before it.
+     * @throws std::runtime_error if the range is before the end of the stream written so far, or the write fails.
+     */
+    void zeroRange(uint64_t offset, uint64_t length) override;
+
+    bool isSequential() const override { return true; }
+
+    /**
+     * @brief Writes zeros to the end of the disk.
+     * @throws std::runtime_error if the write fails.
+     */
+    void flush() override;
+    uint64_t getSize() override { return diskSize; }
+
+private:
+    void skipTo(uint64_t offset);
+    void writeAll(const void* data, size_t length);
+    void writeZeros(uint64_t length);
+
+    intptr_t handle;
+    bool ownsHandle;
+    uint64_t diskSize = 0;
+    // The disk offset of the next byte of the stream
+    uint64_t position = 0;
+    std::mutex mutex;
+};
+
+/**
+ * @brief Opens a restore target, selecting the backend from the path.
+ *
+ * - "memory:" opens a `MemoryTarget` that counts writes without keeping them, for benchmarks.
+ * - "stdout:", or a named pipe, opens a `StreamTarget` that writes the disk as one stream in disk order.
+ * - A block device opens a `BlockDeviceTarget` on Linux.
+ * - Anything else opens a `FileTarget`, creating the file if it does not exist, or a `MappedFileTarget` if `mapped` is set.
+ *
+ * @param path The path of the target.
+ * @param preallocate True to allocate the whole disk up front for a raw image file.
+ * @param mapped True to write a raw image file through a memory mapping, so blocks are decoded straight into it.
+ * @param keepData True to keep the data already on a file or device, so a restore can skip the blocks that are unchanged.
+ * @return The opened target.
+ * @throws std::runtime_error if the target cannot be opened.
+ */
+SharedTarget openRestoreTarget(const std::wstring& path, bool preallocate, bool mapped = false, bool keepData = false);
@@ -70,22 +70,21 @@ size_t getFullIndexBeforeDelta(const BackupSetFileLayouts& backupSetFileLayouts)
 // ==============================
 
 /**
- * @brief Retrieves the file handle for a given file number in a backup set.
+ * @brief Retrieves the source for a given file number in a backup set.
  *
- * This function iterates over all the file handles in the backup set. If the file number of the current file handle matches the requested index, the handle is returned.
- * If no matching file handle is found, an exception is thrown.
+ * If no source is found for the file number, an exception is thrown.
  *
  * @param index The file number to search for.
- * @return The file handle for the file with the given number.
+ * @return The source for the file with the given number.
  * @throws std::runtime_error if no file with the given number is found in the backup set.
  */
-std::fstream* BackupSet::getFileHandle(const int index) 
+BackupSource* BackupSet::getSource(const int index) 
 {
     try {
-        return indexHandleMap.at(index).get();
+        return indexSourceMap.at(index).get();
     }
     catch (const std::out_of_range&) {
-        throw std::runtime_error("getFileHandle - File not found");
+        throw std::runtime_error("getSource - File not found");
     }
 }
 
@@ -160,28 +159,24 @@ void buildIndex(BackupSet& backupSet, const BackupSetFileLayouts& backupSetFileL
 /**
  * @brief Adds a backup file to the backup set.
  *
- * This function creates a BackupFileAndHandle object for the backup file and adds it to the backup set.
- * It also adds the file number and file handle to the indexHandleMap in the backupSet, which is used to quickly find the file handle for a given file number.
- * The function also handles file merges due to consolidation. This enables merged files to reference the file handle of the consolidated file.
+ * This function adds the file layout to the backup set layouts.
+ * It also adds the file number and source to the indexSourceMap in the backupSet, which is used to quickly find the source for a given file number.
+ * The function also handles file merges due to consolidation. This enables merged files to reference the source of the consolidated file.
  *
  * @param backupSet The BackupSet object to add the backup file to.
- * @param filePath The path to the backup file.
+ * @param source The source the backup file is read from.
  * @param backupFile The file layout of the backup file.
  * @param backupSetFileLayouts The file layouts for the backup set.
  */
-void addBackupFileToSet(BackupSet& backupSet, const std::filesystem::path& filePath, const file_structs::fileLayout& backupFile, BackupSetFileLayouts& backupSetFileLayouts) {
-    // Create a BackupFileAndHandle object for the backup file
-    auto backupFileLayout = backupFile;
-
-    // Add the file number and file handle to the indexHandleMap in the backupSet
-    // The indexHandleMap is used to quickly find the file handle for a given file number
-    auto sharedFileHandle = openFileWithGuard(filePath.wstring(), true);
-    backupSet.indexHandleMap[backupFile._header.file_number] = sharedFileHandle;
+void addBackupFileToSet(BackupSet& backupSet, const SharedSource& source, const file_structs::fileLayout& backupFile, BackupSetFileLayouts& backupSetFileLayouts) {
+    // Add the file number and source to the indexSourceMap in the backupSet
+    // The indexSourceMap is used to quickly find the source for a given file number
+    backupSet.indexSourceMap[backupFile._header.file_number] = source;
 
     // Handle file merges due to consolidation
-    // This enables merged files to reference the file handle of the consolidated file
+    // This enables merged files to reference the source of the consolidated file
     for (auto mergedFileNumber : backupFile._header.merged_files) {
-        backupSet.indexHandleMap[mergedFileNumber] = sharedFileHandle;
+        backupSet.indexSourceMap[mergedFileNumber] = source;
     }
 
     // Move the shared_ptr to backupFileLayout into the fileLayouts vector in the backupSet
@@ -199,7 +194,7 @@ void addBackupFileToSet(BackupSet& backupSet, const std::filesystem::path& fileP
  * It then builds an index for the backup set to facilitate quick access to the backup files.
  *
  * @param backupSet The BackupSet object to populate.
- * @param filePath The path to the backup file.
+ * @param filePath The path to the backup file. A local path, or an http(s) URL of an object.
  * @param password The password for the backup file.
  * @param imageId The image ID for the backup file.
  */
@@ -217,40 +212,38 @@ void createBackupSet(BackupSet& backupSet, const std::wstring& filePath, const s
     readBackupFile(filePath, backupFile, password, loadIndex);
 
     // Find the rest of the files in this backup set
-    std::filesystem::path path(filePath);
-    std::string extension = path.extension().string();
+    std::filesystem::path path(getSourceFileName(filePath));
+    std::wstring extension = path.extension().wstring();
     if (!extension.empty()) {
-        std::filesystem::path directory = path.parent_path();
-        // Iterate over all files in the directory
-        for (const auto& fileName : std::filesystem::directory_iterator(directory)) {
-            // If the file is a regular file and has the same extension as the backup file
-            if (fileName.is_regular_file() && fileName.path().extension() == extension) {
-                // Create a new BackupFileAndHandle and fileLayout using std::make_unique for efficient memory allocation
-                //auto backupFileLayout = std::make_unique<BackupFileAndHandle>();
-                auto setbackupFile = std::make_unique<file_structs::fileLayout>();
-                try {
-                    // Setting loadIndex to false saves memory and time.
-                    // The index is not needed here
-                    bool loadIndex = false;
-                    // Read the backup file
-                    readBackupFile(fileName.path().wstring(), *setbackupFile, password, loadIndex);
-                    // If the image ID, increment number, and file name match the backup file
-                    if (setbackupFile->_header.imageid == imageId &&
-                        setbackupFile->_header.increment_number <= backupFile._header.increment_number) {
-                        loadIndex = true;
+        // The store is the folder, or bucket prefix, that holds the backup file
+        SharedStore store = openBackupStore(filePath);
+        // Iterate over all files in the store with the same extension as the backup file
+        for (const auto& fileName : store->listFiles(extension)) {
+            auto setbackupFile = std::make_unique<file_structs::fileLayout>();
+            try {
+                // Open the file once. The same source is used for both reads and for the restore.
+                SharedSource source = store->openSource(fileName);
+                // Setting loadIndex to false saves memory and time.
+                // The index is not needed here
+                bool loadIndex = false;
+                // Read the backup file
+                readBackupFile(source, *setbackupFile, password, loadIndex);
+                // If the image ID, increment number, and file name match the backup file
+                if (setbackupFile->_header.imageid == imageId &&
+                    setbackupFile->_header.increment_number <= backupFile._header.increment_number) {
+                    loadIndex = true;
 
-                        // Read the backup file again with loadIndex set to true
-                        readBackupFile(fileName.path().wstring(), *setbackupFile, password, loadIndex);
-                        // Add the backup file handle to the backup set
-                        addBackupFileToSet(backupSet, fileName.path().wstring(), *setbackupFile, backupSetFileLayouts);
-                    }
-                }
-                catch (const std::exception& e) {
-                    // Invalid password or corrupt file errors do not fail the entire backup set
-                    // There may be files in the folder that are not part of the backup set
-                    std::cerr << "Caught exception: " << e.what() << '\n';
+                    // Read the backup file again with loadIndex set to true
+                    readBackupFile(source, *setbackupFile, password, loadIndex);
+                    // Add the backup file source to the backup set
+                    addBackupFileToSet(backupSet, source, *setbackupFile, backupSetFileLayouts);
                 }
             }
+            catch (const std::exception& e) {
+                // Invalid password or corrupt file errors do not fail the entire backup set
+                // There may be files in the folder that are not part of the backup set
+                std::cerr << "Caught exception: " << e.what() << '\n';
+            }
         }
         // Sort the backup set by file number in descending order
         std::sort(backupSetFileLayouts.begin(), backupSetFileLayouts.end(),
@@ -259,9 +252,14 @@ void createBackupSet(BackupSet& backupSet, const std::wstring& filePath, const s
         }
         );
 
+        if (backupSetFileLayouts.empty()) {
+            throw std::runtime_error("createBackupSet - no backup files found");
+        }
         backupSet.backupFileLayoutForRestoration = backupSetFileLayouts[0];
         // Build the full index for the backup set. This maps delta incrementals into the block index.
         buildIndex(backupSet, backupSetFileLayouts);
+        // Keep the layouts of every file in the set. Each keeps its own index for verification.
+        backupSet.fileLayouts = backupSetFileLayouts;
 
     }
     else {
@@ -269,5 +267,3 @@ void createBackupSet(BackupSet& backupSet, const std::wstring& filePath, const s
         throw std::runtime_error("populateBackupSet - invalid file extension");
     }
 }
-
-
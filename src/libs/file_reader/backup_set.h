@@ -7,26 +7,31 @@ typedef std::vector <BackupFileLayout> BackupSetFileLayouts;
 
 /**
  * @struct BackupSet
- * @brief Represents a set of backup files and their associated handles.
+ * @brief Represents a set of backup files and their associated sources.
  *
- * This structure contains a vector of unique pointers to `BackupFileAndHandle` objects, which represent backup files and their associated handles.
- * It also contains a map that maps an integer index to a `std::fstream*`. This map can be used to quickly look up a `std::fstream*` based on its associated index.
+ * This structure contains the layout of the backup file being restored, and a map that maps a file number
+ * to the `BackupSource` the file is read from. The map can be used to quickly look up a source based on its file number.
  *
- * @var fileLayouts A vector of unique pointers to `BackupFileAndHandle` objects.
- * @var indexHandleMap A map that maps an integer index to a `std::fstream*`.
+ * @var backupFileLayoutForRestoration The layout of the backup file being restored, with the full block index.
+ * @var indexSourceMap A map that maps a file number to a `BackupSource`.
+ * @var fileLayouts The layouts of every file in the backup set, each with its own block index, newest first.
  */
 struct BackupSet
 {
     // A unique pointer to the backup file layout that we're restoring
     BackupFileLayout backupFileLayoutForRestoration;
 
-    // A map that maps an integer index to a std::fstream*.
-    // This map can be used to quickly look up a std::fstream* based on its associated index.
-    std::map<int, SharedFile> indexHandleMap;
+    // A map that maps a file number to a BackupSource.
+    // This map can be used to quickly look up the source of a data block based on its file number.
+    std::map<int, SharedSource> indexSourceMap;
 
+    // The layouts of every file in the backup set, sorted by file number in descending order.
+    // The first entry is backupFileLayoutForRestoration.
+    BackupSetFileLayouts fileLayouts;
 
-    // Returns the file handle for the backup file at the given index.
-    std::fstream* getFileHandle(const int index);
+
+    // Returns the source for the backup file with the given file number.
+    BackupSource* getSource(const int index);
 
     // Returns the file layout for backupFileLayoutForRestoration
     file_structs::fileLayout& getBackupFileWithFullIndex();
@@ -34,7 +39,7 @@ struct BackupSet
 
 
 //  Createsa a BackupSet struct.
-// It takes a file path, a password, and an image ID as parameters.
+// It takes a file path (or an http(s) URL), a password, and an image ID as parameters.
 // It calls the populateBackupSet function to read the backup set from the file at the given path,
 // using the provided password and image ID. It then calls the buildIndex function to build an index for the backup set.
 void createBackupSet(BackupSet& backupSet, const std::wstring& filePath, const std::string& password, const std::string& imageId);
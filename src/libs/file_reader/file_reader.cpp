@@ -35,13 +35,13 @@ description, please see https://github.com/facebook/zstd/blob/dev/LICENSE.
  *
  * The header offset is read into `llHeaderOffset` and the magic data is read into `Magic`.
  *
- * @param hFile The handle to the Macrium Reflect X backup file.
+ * @param reader A reader positioned at the footer of the Macrium Reflect X backup file.
  * @param llHeaderOffset A reference to a uint64_t that will receive the header offset.
  * @param Magic A reference to a vector of uint8_t that will receive the magic data.
  */
-void readHeaderOffsetAndMagicData(std::fstream* fileHandle, uint64_t& llHeaderOffset, std::vector<uint8_t>& Magic) {
-	readFile(fileHandle, &llHeaderOffset, sizeof(llHeaderOffset));
-	readFile(fileHandle, Magic.data(), MAGIC_BYTES_VX_SIZE);
+void readHeaderOffsetAndMagicData(SourceReader& reader, uint64_t& llHeaderOffset, std::vector<uint8_t>& Magic) {
+	reader.read(&llHeaderOffset, sizeof(llHeaderOffset));
+	reader.read(Magic.data(), MAGIC_BYTES_VX_SIZE);
 }
 
 
@@ -152,38 +152,49 @@ void validatePassword(file_structs::fileLayout& backupLayout, const std::string&
 /*
  * Reads a Macrium Reflect X backup file and parses its JSON data.
  *
- * This function opens the file, reads the header offset and magic data, checks the magic data,
- * sets the file pointer to the header offset, reads the JSON data from the file, and parses the JSON data.
+ * This function opens the file with the backend selected by `openBackupSource` and reads it.
  *
- * @param filename The name of the file to read.
+ * @param filename The name of the file to read. A local path or an http(s) URL.
  * @throws std::runtime_error if an error occurs during reading or parsing.
  */
-void readBackupFile(const std::wstring& filename, file_structs::fileLayout& backupLayout,const std::string password, bool loadIndex /* = true */) {
-	// Open the file and get a handle to it
-	auto fileGuard = openFileWithGuard(filename, true);
-	std::fstream* fileHandle = fileGuard.get();
+void readBackupFile(const std::wstring& filename, file_structs::fileLayout& backupLayout, const std::string password, bool loadIndex /* = true */) {
+	readBackupFile(openBackupSource(filename), backupLayout, password, loadIndex);
+}
+
+/*
+ * Reads a Macrium Reflect X backup file from an open source and parses its JSON data.
+ *
+ * This function reads the header offset and magic data, checks the magic data,
+ * sets the read position to the header offset, reads the JSON data from the file, and parses the JSON data.
+ *
+ * @param source The backup file to read.
+ * @throws std::runtime_error if an error occurs during reading or parsing.
+ */
+void readBackupFile(const SharedSource& source, file_structs::fileLayout& backupLayout, const std::string password, bool loadIndex /* = true */) {
+	// Metadata is parsed with small sequential reads through a buffered window
+	SourceReader reader(*source);
 
 	// Calculate the offset to the end of the file
 	std::streamoff fileOffset = calculateOffset();
 
-	// Set the file pointer to the end of the file
-	setFilePointer(fileHandle, fileOffset, std::ios::end);
+	// Set the read position to the end of the file
+	reader.seek(fileOffset, std::ios::end);
 
 	uint64_t headerOffset;
 	std::vector<uint8_t> magicData(MAGIC_BYTES_VX_SIZE);
 	// Read the header offset and magic data from the file
-	readHeaderOffsetAndMagicData(fileHandle, headerOffset, magicData);
+	readHeaderOffsetAndMagicData(reader, headerOffset, magicData);
 
 	// Check the magic data
 	checkMagicData(magicData);
 
 	// Set the file pointer to the header offset
 	fileOffset = headerOffset;
-	setFilePointer(fileHandle, fileOffset, std::ios::beg);
+	reader.seek(fileOffset, std::ios::beg);
 
 	// Read the JSON data from the file
 	std::string jsonStr;
-	readFileMetadataData(backupLayout, fileHandle, jsonStr);
+	readFileMetadataData(backupLayout, reader, jsonStr);
 	// Parse the JSON data
 	nlohmann::json j = parseJsonData(jsonStr);
 	// Convert the parsed JSON data to a fileLayout object
@@ -192,7 +203,7 @@ void readBackupFile(const std::wstring& filename, file_structs::fileLayout& back
 	backupLayout.jsonStr = jsonStr;
 
 	// Set the filename in the backupLayout object
-	backupLayout.file_name = filename;
+	backupLayout.file_name = source->getName();
 
 	// validate password
 	if (loadIndex && backupLayout._encryption.enable) {
@@ -202,7 +213,7 @@ void readBackupFile(const std::wstring& filename, file_structs::fileLayout& back
 	}
 
 	fileOffset = backupLayout._header.index_file_position;
-	setFilePointer(fileHandle, fileOffset, std::ios::beg);
+	reader.seek(fileOffset, std::ios::beg);
 
 	// Check if the file is not split. 
 	// split files have no data blocks, so we don't need to read them
@@ -210,23 +221,23 @@ void readBackupFile(const std::wstring& filename, file_structs::fileLayout& back
 		// Iterate over each disk in the parsed file layout
 		for (auto& disk : backupLayout.disks) {
 			// Read the disk metadata
-			readDiskMetadata(backupLayout, fileHandle, disk);
+			readDiskMetadata(backupLayout, reader, disk);
 			// Iterate over each partition in the disk
 			for (auto& partition : disk.partitions) {
 				// Skip the partition metadata as it isn't used for this restore
-				readPartitionMetadataData(backupLayout, fileHandle);
+				readPartitionMetadataData(backupLayout, reader);
 				int32_t blockCount;
 				// Read the block count
-				readFile(fileHandle, &blockCount, sizeof(blockCount));
+				reader.read(&blockCount, sizeof(blockCount));
 				// If block count is greater than zero
 				if (blockCount > 0) {
 					// Resize the reserved sectors blocks vector to the block count
 					partition.reserved_sectors_blocks.resize(blockCount);
 					// Read the data blocks into the reserved sectors blocks vector
-					readFile(fileHandle, partition.reserved_sectors_blocks.data(), sizeof(DataBlockIndexElement) * blockCount);
+					reader.read(partition.reserved_sectors_blocks.data(), sizeof(DataBlockIndexElement) * blockCount);
 				}
 				// Read the block count again
-				readFile(fileHandle, &blockCount, sizeof(blockCount));
+				reader.read(&blockCount, sizeof(blockCount));
 				// If block count is greater than zero
 				if (blockCount > 0) {
 					bool isdelta = backupLayout._header.delta_index;
@@ -235,20 +246,20 @@ void readBackupFile(const std::wstring& filename, file_structs::fileLayout& back
 							// Resize the delta data blocks vector to the block count
 							partition.delta_data_blocks.resize(blockCount);
 							// Read the delta data blocks into the data blocks vector
-							readFile(fileHandle, partition.delta_data_blocks.data(), sizeof(DeltaDataBlock) * blockCount);
+							reader.read(partition.delta_data_blocks.data(), sizeof(DeltaDataBlock) * blockCount);
 						}
 						else {
 							// Resize the data blocks vector to the block count
 							partition.data_blocks.resize(blockCount);
 							// Read the data blocks into the data blocks vector
-							readFile(fileHandle, partition.data_blocks.data(), sizeof(DataBlockIndexElement) * blockCount);
+							reader.read(partition.data_blocks.data(), sizeof(DataBlockIndexElement) * blockCount);
 
 						}
 					}  
 					else {
 						// Skip the data blocks
 						fileOffset = isdelta ? sizeof(DeltaDataBlock) * blockCount : sizeof(DataBlockIndexElement) * blockCount;
-						setFilePointer(fileHandle, fileOffset, std::ios::cur);
+						reader.seek(fileOffset, std::ios::cur);
 					}
 				}
 			}
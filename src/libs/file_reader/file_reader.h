@@ -45,6 +45,14 @@ The library uses the following external libraries:
  */
 void readBackupFile(const std::wstring& filename, file_structs::fileLayout& backupLayout, const std::string password, bool loadIndex = true);
 
+/**
+ * Reads a Macrium Reflect X backup file from an open source and parses its JSON data.
+ *
+ * @param source The backup file to read, from any backend.
+ * @throws std::runtime_error if an error occurs during reading or parsing.
+ */
+void readBackupFile(const SharedSource& source, file_structs::fileLayout& backupLayout, const std::string password, bool loadIndex = true);
+
 
 /**
  * @brief Selects a disk to restore from the backup layout based on the provided disk number.
@@ -34,14 +34,13 @@
   *
   * @param Header A reference to a `MetadataBlockHeader` object that contains
   * the block's metadata.
-  * @param hFile A handle to the Macrium Reflect X backup file from which to
-  * read the block.
+  * @param reader A reader positioned at the start of the block data.
   * @return A `std::unique_ptr` to an array of unsigned chars that contains the
   * block data. If the block length is 0, or if an error occurs during reading
   * or decompression, it returns `nullptr`.
   */
 
-std::unique_ptr<unsigned char[]> readBlock(const file_structs::fileLayout& backupLayout, MetadataBlockHeader& Header, std::fstream* fileHandle)
+std::unique_ptr<unsigned char[]> readBlock(const file_structs::fileLayout& backupLayout, MetadataBlockHeader& Header, SourceReader& reader)
 {
 	// If the block length is 0, return nullptr
 	if (Header.block_Length == 0) {
@@ -52,7 +51,7 @@ std::unique_ptr<unsigned char[]> readBlock(const file_structs::fileLayout& backu
 	std::unique_ptr<unsigned char[]> readBuffer = std::make_unique<unsigned char[]>(Header.block_Length);
 
 	// Read the block from the file
-	readFile(fileHandle, readBuffer.get(), Header.block_Length);
+	reader.read(readBuffer.get(), Header.block_Length);
 
 	// Compute the MD5 hash of the decompressed data
 	auto computedHash = computeMD5Hash(readBuffer.get(), Header.block_Length);
@@ -108,12 +107,12 @@ std::unique_ptr<unsigned char[]> readBlock(const file_structs::fileLayout& backu
  * TRACK_0 and EXT_PAR_TABLE blocks. It then reads these blocks and
  * assigns their contents to the `Disk` object.
  *
- * @param fileHandle A handle to the Macrium Reflect X backup file from
+ * @param reader A reader positioned in the Macrium Reflect X backup file from
  * which to read the metadata.
  * @param Disk A reference to a DiskLayout object where the disk metadata
  * will be stored.
  */
-void readDiskMetadata(const file_structs::fileLayout& backupLayout, std::fstream* fileHandle, file_structs::Disk::DiskLayout& Disk) {
+void readDiskMetadata(const file_structs::fileLayout& backupLayout, SourceReader& reader, file_structs::Disk::DiskLayout& Disk) {
 	std::string strJSON;
 	MetadataBlockHeader Header;
 	bool track0Found = false; // Flag to track if TRACK_0 is found
@@ -121,12 +120,12 @@ void readDiskMetadata(const file_structs::fileLayout& backupLayout, std::fstream
 	// Loop until the last block is found
 	do {
 		// Read the header of the next block
-		readFile(fileHandle, &Header, sizeof(Header));
+		reader.read(&Header, sizeof(Header));
 
 		// If the block name is TRACK_0
 		if (memcmp(Header.block_name, TRACK_0, BLOCK_NAME_LENGTH) == 0) {
 			if (Header.block_Length > 0) {
-				auto blockData = readBlock(backupLayout, Header, fileHandle);
+				auto blockData = readBlock(backupLayout, Header, reader);
 
 				// If reading the block failed, throw an exception
 				if (blockData == nullptr) {
@@ -142,7 +141,7 @@ void readDiskMetadata(const file_structs::fileLayout& backupLayout, std::fstream
 			// If the block name is EXT_PAR_TABL
 			if (Header.block_Length > 0) {
 				// Read the block
-				auto blockData = readBlock(backupLayout, Header, fileHandle);
+				auto blockData = readBlock(backupLayout, Header, reader);
 
 				// If reading the block failed, throw an exception
 				if (blockData == nullptr) {
@@ -174,7 +173,7 @@ void readDiskMetadata(const file_structs::fileLayout& backupLayout, std::fstream
 		}
 		else {
 			// Move the file pointer to the next block
-			setFilePointer(fileHandle, Header.block_Length, std::ios::cur);
+			reader.seek(Header.block_Length, std::ios::cur);
 		}
 	} while (Header.flags.last_block  == 0);
 
@@ -194,10 +193,10 @@ void readDiskMetadata(const file_structs::fileLayout& backupLayout, std::fstream
  * This function reads the metadata block by block until it finds the JSON_HEADER block.
  * It then reads this block and assigns its contents to the `strJSON` string.
  *
- * @param fileHandle A handle to the Macrium Reflect X backup file from which to read the metadata.
+ * @param reader A reader positioned in the Macrium Reflect X backup file from which to read the metadata.
  * @param strJSON A reference to a string where the JSON metadata will be stored.
  */
-void readFileMetadataData(const file_structs::fileLayout& backupLayout, std::fstream* fileHandle, std::string& strJSON) {
+void readFileMetadataData(const file_structs::fileLayout& backupLayout, SourceReader& reader, std::string& strJSON) {
 	MetadataBlockHeader Header;
 	bool jsonHeaderFound = false; // Flag to track if JSON_HEADER is found
 
@@ -205,12 +204,12 @@ void readFileMetadataData(const file_structs::fileLayout& backupLayout, std::fst
 	// Loop until the last block is found
 	do {
 		// Read the header of the next block
-		readFile(fileHandle, &Header, sizeof(Header));
+		reader.read(&Header, sizeof(Header));
 
 		// If the block name is JSON_HEADER
 		if (memcmp(Header.block_name, JSON_HEADER, BLOCK_NAME_LENGTH) == 0) {
 			// Read the block
-			auto blockData = readBlock(backupLayout, Header, fileHandle);
+			auto blockData = readBlock(backupLayout, Header, reader);
 
 			// If reading the block failed, throw an exception
 			if (blockData == nullptr) {
@@ -222,7 +221,7 @@ void readFileMetadataData(const file_structs::fileLayout& backupLayout, std::fst
 		}
 		else {
 			// Move the file pointer to the next block
-			setFilePointer(fileHandle, Header.block_Length, std::ios::cur);
+			reader.seek(Header.block_Length, std::ios::cur);
 		}
 	} while (Header.flags.last_block  == 0);
 
@@ -241,38 +240,38 @@ void readFileMetadataData(const file_structs::fileLayout& backupLayout, std::fst
  * It then reads these blocks to validate the data. For IDX_HEADER, it repositions the file pointer to the end of the block.
  *
  * @param backupLayout A reference to the file layout structure containing encryption and other metadata.
- * @param fileHandle A handle to the Macrium Reflect X backup file from which to read the metadata.
+ * @param reader A reader positioned in the Macrium Reflect X backup file from which to read the metadata.
  */
-void readPartitionMetadataData(const file_structs::fileLayout& backupLayout, std::fstream* fileHandle) {
+void readPartitionMetadataData(const file_structs::fileLayout& backupLayout, SourceReader& reader) {
 	MetadataBlockHeader Header;
 	bool idxHeaderFound = false; // Flag to track if IDX_HEADER is found
 
 	// Loop until the last block is found
 	do {
 		// Read the header of the next block
-		readFile(fileHandle, &Header, sizeof(Header));
+		reader.read(&Header, sizeof(Header));
 
 		// If the block name is BITMAP_HEADER
 		if (memcmp(Header.block_name, BITMAP_HEADER, BLOCK_NAME_LENGTH) == 0) {
 			// Read the block to validate the data
 			// Do nothing with the block data if it exists
-			auto blockData = readBlock(backupLayout, Header, fileHandle);
+			auto blockData = readBlock(backupLayout, Header, reader);
 		}
 		// IDX_HEADER is a special case where we just need to validate the block data
 		// as we're reading the block indexes directly in file_reader.cpp - readBackupFile
 		else if (memcmp(Header.block_name, IDX_HEADER, BLOCK_NAME_LENGTH) == 0) {
 			// Read the block to validate the hash
 			// Do nothing with the block data.  
-			auto blockData = readBlock(backupLayout, Header, fileHandle);
+			auto blockData = readBlock(backupLayout, Header, reader);
 			// Now reposition the file pointer to the end of the IDX_HEADER block
 			// The blockData is processed in file_reader.cpp - readBackupFile
 			// Note: IDX_HEADER is always the last block.
-			setFilePointer(fileHandle, -static_cast<std::streamoff>(Header.block_Length), std::ios::cur);
+			reader.seek(-static_cast<std::streamoff>(Header.block_Length), std::ios::cur);
 			idxHeaderFound = true;
 		}
 		else {
 			// Move the file pointer to the next block
-			setFilePointer(fileHandle, Header.block_Length, std::ios::cur);
+			reader.seek(Header.block_Length, std::ios::cur);
 		}
 	} while (Header.flags.last_block == 0);
 
@@ -1,21 +1,22 @@
 ﻿#pragma once
 #include "file_structs.h"
+#include "..\file_operations\backup_source.h"
 
 /**
  * Reads file metadata from a Macrium Reflect X backup file.
  *
- * @param fileHandle A handle to the Macrium Reflect X backup file from which to read the metadata.
+ * @param reader A reader positioned in the Macrium Reflect X backup file from which to read the metadata.
  * @param strJSON A reference to a string where the JSON metadata will be stored.
  */
-void readFileMetadataData(const file_structs::fileLayout& backupLayout, std::fstream* fileHandle, std::string& strJSON);
+void readFileMetadataData(const file_structs::fileLayout& backupLayout, SourceReader& reader, std::string& strJSON);
 
 /**
  * Reads disk metadata from a Macrium Reflect X backup file.
  *
- * @param fileHandle A handle to the Macrium Reflect X backup file from which to read the metadata.
+ * @param reader A reader positioned in the Macrium Reflect X backup file from which to read the metadata.
  * @param Disk A reference to a DiskLayout object where the disk metadata will be stored.
  */
-void readDiskMetadata(const file_structs::fileLayout& parsedFileLayout, std::fstream* fileHandle, file_structs::Disk::DiskLayout& Disk);
+void readDiskMetadata(const file_structs::fileLayout& parsedFileLayout, SourceReader& reader, file_structs::Disk::DiskLayout& Disk);
 
 
 /**
@@ -25,6 +26,6 @@ void readDiskMetadata(const file_structs::fileLayout& parsedFileLayout, std::fst
  * It then reads these blocks to validate the data. For IDX_HEADER, it repositions the file pointer to the end of the block.
  *
  * @param backupLayout A reference to the file layout structure containing encryption and other metadata.
- * @param fileHandle A handle to the Macrium Reflect X backup file from which to read the metadata.
+ * @param reader A reader positioned in the Macrium Reflect X backup file from which to read the metadata.
  */
-void readPartitionMetadataData(const file_structs::fileLayout& backupLayout, std::fstream* fileHandle);
\ No newline at end of file
+void readPartitionMetadataData(const file_structs::fileLayout& backupLayout, SourceReader& reader);
\ No newline at end of file
@@ -0,0 +1,148 @@
+// auto_tuner.cpp : Tunes the active workers and read-ahead depth of a block pipeline to the measured throughput.
+//
+
+#include "pch.h"
+#include "auto_tuner.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+// How often the autotuner measures the throughput and adjusts the pipeline while it searches with large steps
+static constexpr std::chrono::milliseconds TUNE_INTERVAL{ 500 };
+
+// How often the autotuner measures once it moves one worker at a time, long enough to average out the noise
+static constexpr std::chrono::milliseconds SETTLED_TUNE_INTERVAL{ 2000 };
+
+// The change in throughput between two intervals that the autotuner takes as noise
+static constexpr double TUNE_TOLERANCE = 0.05;
+
+/**
+ * @brief Creates a tuner that starts at half of each cap, moving a quarter of the workers at a time.
+ *
+ * @param maxWorkers The most workers that may be active.
+ * @param maxReadAhead The deepest read-ahead in batches. 0 for no read-ahead.
+ */
+AutoTuner::AutoTuner(unsigned maxWorkers, size_t maxReadAhead)
+	: maxWorkers(std::max(1u, maxWorkers)), active(std::max(1u, maxWorkers / 2)), step(std::max(1u, maxWorkers / 4)),
+	maxReadAhead(maxReadAhead), readAhead(maxReadAhead > 0 ? std::max<size_t>(1, maxReadAhead / 2) : 0),
+	lastSample(std::chrono::steady_clock::now())
+{
+}
+
+/**
+ * @brief Waits until a worker is one of the active workers.
+ *
+ * @param worker The index of the worker.
+ */
+void AutoTuner::waitTurn(unsigned worker)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	turn.wait(lock, [&]() { return released || worker < active; });
+}
+
+/**
+ * @brief Lets every waiting worker run.
+ */
+void AutoTuner::release()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	released = true;
+	turn.notify_all();
+}
+
+/**
+ * @brief Adds the time a worker spent on a batch. May be called from several workers at once.
+ *
+ * @param reading The time spent reading the batch from the backup files.
+ * @param busy The time spent on the whole batch.
+ */
+void AutoTuner::addTime(std::chrono::steady_clock::duration reading, std::chrono::steady_clock::duration busy)
+{
+	readingTime += reading.count();
+	busyTime += busy.count();
+}
+
+/**
+ * @brief Gets the number of workers that take batches.
+ *
+ * @return The active worker count.
+ */
+unsigned AutoTuner::getActiveWorkers() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return active;
+}
+
+/**
+ * @brief Gets the number of batches after the newest batch taken to prefetch.
+ *
+ * @return The read-ahead depth in batches.
+ */
+size_t AutoTuner::getReadAhead() const
+{
+	return readAhead;
+}
+
+/**
+ * @brief Measures the throughput and adjusts the pipeline, if an interval has passed since the last time.
+ *
+ * The interval is short while the worker count moves in large steps, and longer once it moves one at a time.
+ *
+ * @param bytesDone The restored bytes processed so far.
+ */
+void AutoTuner::sample(uint64_t bytesDone)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (now - lastSample < (step > 1 ? TUNE_INTERVAL : SETTLED_TUNE_INTERVAL)) {
+		return;
+	}
+	double rate = (bytesDone - lastBytes) / std::chrono::duration<double>(now - lastSample).count();
+	lastSample = now;
+	lastBytes = bytesDone;
+	adjust(rate, std::chrono::steady_clock::duration(readingTime.exchange(0)), std::chrono::steady_clock::duration(busyTime.exchange(0)));
+}
+
+/**
+ * @brief Adjusts the pipeline to the throughput of an interval.
+ *
+ * @param bytesPerSecond The throughput of the interval.
+ * @param reading The worker time spent reading in the interval.
+ * @param busy The worker time spent on batches in the interval.
+ */
+void AutoTuner::adjust(double bytesPerSecond, std::chrono::steady_clock::duration reading, std::chrono::steady_clock::duration busy)
+{
+	// Keep going while the throughput rises. Turn back when it falls, or when more workers left it flat.
+	if (lastRate > 0) {
+		if (bytesPerSecond < lastRate * (1 - TUNE_TOLERANCE) || (direction > 0 && bytesPerSecond <= lastRate * (1 + TUNE_TOLERANCE))) {
+			direction = -direction;
+			step = std::max(1u, step / 2);
+		}
+	}
+	lastRate = bytesPerSecond;
+	int next = std::clamp(static_cast<int>(active) + direction * static_cast<int>(step), 1, static_cast<int>(maxWorkers));
+	if (next == static_cast<int>(active)) {
+		// At a cap, try the other way next time
+		direction = -direction;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		active = static_cast<unsigned>(next);
+		turn.notify_all();
+	}
+
+	// Fetch further ahead while the workers wait on reads
+	if (maxReadAhead > 0 && busy.count() > 0) {
+		double readShare = static_cast<double>(reading.count()) / busy.count();
+		if (readShare > 0.5) {
+			readAhead = std::min(maxReadAhead, readAhead * 2);
+		}
+		else if (readShare < 0.1) {
+			readAhead = std::max<size_t>(1, readAhead / 2);
+		}
+	}
+}
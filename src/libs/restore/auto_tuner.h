@@ -0,0 +1,112 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief The autotuner that sets the number of active workers and the read-ahead depth of a block pipeline.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * @class AutoTuner
+ * @brief Adjusts the number of active workers and the read-ahead depth of a pipeline while it runs.
+ *
+ * Every worker thread is started, but only the first `active` of them take batches and the rest wait. Each interval,
+ * the tuner compares the throughput with the interval before and keeps moving the worker count in the direction that
+ * raised it. When the throughput falls, or more workers leave it flat, it turns back and halves its step. Large steps
+ * find the best count in the first seconds, then single steps over longer intervals follow changes in the data, such
+ * as a run of uncompressed blocks after compressed ones. Fewer workers that keep the throughput are preferred. The
+ * share of worker time spent reading sets the read-ahead depth: it doubles while reads hold up the workers and halves
+ * once they are a small part, so only as much is fetched ahead as decoding needs.
+ */
+class AutoTuner {
+public:
+	/**
+	 * @brief Creates a tuner that starts at half of each cap.
+	 *
+	 * @param maxWorkers The most workers that may be active, which is the number of worker threads.
+	 * @param maxReadAhead The deepest read-ahead in batches. 0 for no read-ahead.
+	 */
+	AutoTuner(unsigned maxWorkers, size_t maxReadAhead);
+
+	AutoTuner(const AutoTuner&) = delete;
+	AutoTuner& operator=(const AutoTuner&) = delete;
+
+	/**
+	 * @brief Waits until a worker is one of the active workers.
+	 *
+	 * @param worker The index of the worker.
+	 */
+	void waitTurn(unsigned worker);
+
+	/**
+	 * @brief Lets every waiting worker run, once the batches are all taken or the pipeline is stopping.
+	 */
+	void release();
+
+	/**
+	 * @brief Adds the time a worker spent on a batch.
+	 *
+	 * @param reading The time spent reading the batch from the backup files.
+	 * @param busy The time spent on the whole batch.
+	 */
+	void addTime(std::chrono::steady_clock::duration reading, std::chrono::steady_clock::duration busy);
+
+	/**
+	 * @brief Gets the number of workers that take batches.
+	 *
+	 * @return The active worker count, from 1 to the cap.
+	 */
+	unsigned getActiveWorkers() const;
+
+	/**
+	 * @brief Gets the number of batches after the newest batch taken to prefetch.
+	 *
+	 * @return The read-ahead depth in batches, from 1 to the cap, or 0 with no read-ahead.
+	 */
+	size_t getReadAhead() const;
+
+	/**
+	 * @brief Measures the throughput and the time added since the last interval and adjusts the pipeline, if an
+	 *        interval has passed since the last time.
+	 *
+	 * @param bytesDone The restored bytes processed so far.
+	 */
+	void sample(uint64_t bytesDone);
+
+	/**
+	 * @brief Adjusts the pipeline to the throughput of an interval, which `sample` measures.
+	 *
+	 * @param bytesPerSecond The throughput of the interval.
+	 * @param reading The worker time spent reading in the interval.
+	 * @param busy The worker time spent on batches in the interval. 0 leaves the read-ahead depth as it is.
+	 */
+	void adjust(double bytesPerSecond, std::chrono::steady_clock::duration reading, std::chrono::steady_clock::duration busy);
+
+private:
+	unsigned maxWorkers;
+	unsigned active;
+	unsigned step;
+	int direction = 1;
+	size_t maxReadAhead;
+	std::atomic<size_t> readAhead;
+	std::atomic<uint64_t> readingTime{ 0 };
+	std::atomic<uint64_t> busyTime{ 0 };
+	std::chrono::steady_clock::time_point lastSample;
+	uint64_t lastBytes = 0;
+	double lastRate = 0;
+	mutable std::mutex mutex;
+	std::condition_variable turn;
+	bool released = false;
+};
@@ -0,0 +1,930 @@
+// block_pipeline.cpp : Parallel read, decode and hash check of data blocks.
+//
+
+#include "pch.h"
+#include ".\zstd\zstd.h"
+#include "..\file_reader\file_reader.h"
+#include "..\file_operations\file_operations.h"
+#include "..\encryption\encryption.h"
+#include "block_pipeline.h"
+#include "auto_tuner.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+
+Zstandard is dual-licensed under BSD and GPLv2. For a complete
+description, please see https://github.com/facebook/zstd/blob/dev/LICENSE.
+===============================================================================
+*/
+
+// The most decoded bytes held for deferred hash checks before workers wait for the verifier threads
+static constexpr uint64_t DEFERRED_VERIFY_BYTES = 256 * 1024 * 1024;
+
+// The largest gap between two stored blocks that a read-ahead or drop-behind hint covers to join them
+static constexpr uint64_t HINT_GAP_BYTES = 1024 * 1024;
+
+// ==============================
+// BlockDecoder
+// ==============================
+
+/**
+ * @brief Creates a decoder with its own zstd decompression context.
+ */
+BlockDecoder::BlockDecoder() : context(ZSTD_createDCtx())
+{
+	if (context == nullptr) {
+		throw std::runtime_error("Failed to create decompression context.");
+	}
+}
+
+/**
+ * @brief Frees the decompression context.
+ */
+BlockDecoder::~BlockDecoder()
+{
+	ZSTD_freeDCtx(context);
+}
+
+/**
+ * @brief Decrypts and decompresses a block.
+ *
+ * The hash is not checked here. The pipeline checks the hashes of several blocks at once with
+ * `computeMD5HashBatch`, which is much faster than hashing one block at a time.
+ *
+ * @param block The block to decode.
+ * @param data The block as stored in the backup file. Encrypted blocks are decrypted in place.
+ * @param output A buffer that receives the decompressed data, reused between calls.
+ * @param keepCompressed True to return the zstd frame rather than decompress it, if it decompresses to a whole block.
+ * @param destination Target memory to decompress the block into, if it decompresses to a whole block.
+ * @return The decoded block.
+ * @throws std::runtime_error if the block cannot be decompressed, or its frame claims more than `write_limit`
+ *         and `block_size` bytes.
+ */
+DecodedBlock BlockDecoder::decode(const BlockRef& block, uint8_t* data, std::vector<uint8_t>& output, bool keepCompressed /*= false*/, uint8_t* destination /*= nullptr*/)
+{
+	const file_structs::fileLayout& layout = *block.layout;
+	uint32_t blockLength = block.element->block_length;
+
+	if (layout._encryption.aes_type != ImageEnums::AES::eNone) {
+		int aes_variant = layout._encryption.getAESValue();
+		uint8_t iv[16];
+		std::array<uint8_t, KEY_LENGTH> derivedKey = layout._encryption.derived_key;
+		formatInitializationVectorForAES(layout._header.imageid_binary, block.disk_number, block.partition_number, block.iv_index, layout._encryption.key_iterations, derivedKey, iv);
+		decryptDataWithAESCBC(aes_variant, derivedKey.data(), iv, data, blockLength);
+	}
+
+	DecodedBlock decoded;
+	if (layout._compression.compression_level != ImageEnums::CompressionType::eNone) {
+		// Get the size of the compressed frame, which may be shorter than the stored block
+		size_t compressedSize = ZSTD_findFrameCompressedSize(data, blockLength);
+		unsigned long long decompressedSize = ZSTD_getFrameContentSize(data, blockLength);
+		if (ZSTD_isError(compressedSize) || decompressedSize == ZSTD_CONTENTSIZE_ERROR || decompressedSize == ZSTD_CONTENTSIZE_UNKNOWN) {
+			throw std::runtime_error("Invalid compressed block.");
+		}
+
+		// The content size comes from the frame header, so it is checked before any buffer is sized from it
+		if (decompressedSize > std::max(block.write_limit, block.block_size)) {
+			throw std::runtime_error("Compressed block is larger than the partition block size.");
+		}
+
+		// A frame that holds exactly the bytes to write, and is smaller than them, can be stored as it is by a
+		// target that keeps blocks compressed
+		if (keepCompressed && decompressedSize == block.write_limit && compressedSize <= block.write_limit) {
+			decoded.data = data;
+			decoded.length = compressedSize;
+			decoded.compressed = true;
+			return decoded;
+		}
+
+		// A frame that fills the target memory exactly is decompressed straight into it, saving a copy
+		if (destination != nullptr && decompressedSize == block.write_limit) {
+			size_t zout = ZSTD_decompressDCtx(context, destination, block.write_limit, data, compressedSize);
+			if (ZSTD_isError(zout) || zout != block.write_limit) {
+				throw std::runtime_error("Failed to decompress block.");
+			}
+			decoded.data = destination;
+			decoded.length = zout;
+			decoded.in_place = true;
+			return decoded;
+		}
+		output.resize(static_cast<size_t>(decompressedSize));
+
+		// Decompress the block
+		size_t zout = ZSTD_decompressDCtx(context, output.data(), output.size(), data, compressedSize);
+		if (ZSTD_isError(zout)) {
+			throw std::runtime_error("Failed to decompress block.");
+		}
+		decoded.data = output.data();
+		decoded.length = zout;
+	}
+	else {
+		decoded.data = data;
+		decoded.length = blockLength;
+		decoded.in_place = destination != nullptr && data == destination;
+	}
+	return decoded;
+}
+
+/**
+ * @brief Decompresses the zstd frame of a block kept compressed by `decode`.
+ *
+ * @param decoded A block decoded with `compressed` set. `decode` has already checked its frame header.
+ * @param output A buffer that receives the decompressed data, reused between calls.
+ * @throws std::runtime_error if the frame cannot be decompressed.
+ */
+void BlockDecoder::decompress(const DecodedBlock& decoded, std::vector<uint8_t>& output)
+{
+	output.resize(static_cast<size_t>(ZSTD_getFrameContentSize(decoded.data, decoded.length)));
+	size_t zout = ZSTD_decompressDCtx(context, output.data(), output.size(), decoded.data, decoded.length);
+	if (ZSTD_isError(zout) || zout != output.size()) {
+		throw std::runtime_error("Failed to decompress block.");
+	}
+}
+
+// ==============================
+// ReorderBuffer
+// ==============================
+
+/**
+ * @class ReorderBuffer
+ * @brief Passes blocks decoded out of order to a sink in their original order.
+ *
+ * A block that arrives in turn is passed on at once, followed by any held blocks that are now in turn.
+ * A block that arrives early is copied and held. When the held blocks reach the capacity, early blocks
+ * wait until they are in turn or there is room. The worker with the next block is never waiting, because
+ * each worker hands over its blocks in order and the batches are handed out in order.
+ */
+class ReorderBuffer {
+public:
+	ReorderBuffer(uint64_t capacity, const BlockSink& sink, const BlockErrorHandler& onError)
+		: capacity(capacity), sink(sink), onError(onError) {}
+
+	/**
+	 * @brief Hands over a block, or the error for a block.
+	 *
+	 * @param sequence The index of the block in the block list.
+	 * @param block The block.
+	 * @param decoded The decoded block. Ignored if there is an error.
+	 * @param error The reason the block is bad, or empty.
+	 * @throws std::runtime_error with the error if there is no error handler, when the block is in turn.
+	 */
+	void push(size_t sequence, const BlockRef& block, const DecodedBlock& decoded, const std::string& error)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (sequence != next) {
+			size_t length = error.empty() ? decoded.length : 0;
+			inTurn.wait(lock, [&]() { return cancelled || sequence == next || heldBytes + length <= capacity; });
+			if (cancelled) {
+				return;
+			}
+			if (sequence != next) {
+				Held& held = this->held[sequence];
+				held.block = &block;
+				held.data.assign(decoded.data, decoded.data + length);
+				held.compressed = decoded.compressed;
+				held.error = error;
+				heldBytes += length;
+				return;
+			}
+		}
+
+		deliver(block, decoded, error);
+		++next;
+		for (auto it = held.begin(); it != held.end() && it->first == next; it = held.erase(it)) {
+			DecodedBlock heldBlock;
+			heldBlock.data = it->second.data.data();
+			heldBlock.length = it->second.data.size();
+			heldBlock.compressed = it->second.compressed;
+			deliver(*it->second.block, heldBlock, it->second.error);
+			heldBytes -= it->second.data.size();
+			++next;
+		}
+		inTurn.notify_all();
+	}
+
+	/**
+	 * @brief Releases any waiting workers after the pipeline has stopped.
+	 */
+	void cancel()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cancelled = true;
+		inTurn.notify_all();
+	}
+
+private:
+	struct Held
+	{
+		const BlockRef* block = nullptr;
+		std::vector<uint8_t> data;
+		bool compressed = false;
+		std::string error;
+	};
+
+	void deliver(const BlockRef& block, const DecodedBlock& decoded, const std::string& error)
+	{
+		if (error.empty()) {
+			sink(block, decoded);
+		}
+		else if (onError) {
+			onError(block, error);
+		}
+		else {
+			throw std::runtime_error(error);
+		}
+	}
+
+	uint64_t capacity;
+	const BlockSink& sink;
+	const BlockErrorHandler& onError;
+	std::mutex mutex;
+	std::condition_variable inTurn;
+	std::map<size_t, Held> held;
+	uint64_t heldBytes = 0;
+	size_t next = 0;
+	bool cancelled = false;
+};
+
+// ==============================
+// DeferredVerifier
+// ==============================
+
+/**
+ * @class DeferredVerifier
+ * @brief Checks the MD5 hashes of blocks on its own threads after they have been passed to the sink.
+ *
+ * Workers hand over each block's data and carry on decoding. A block decoded in place is checked in the
+ * target memory, which stays valid until the target is flushed. Any other block is handed over in a buffer,
+ * and the buffers of checked blocks are handed back to the workers to decode into. The verifier threads hash
+ * the blocks a group at a time and note the ones that do not match. When the data held reaches the capacity,
+ * workers wait for the verifier threads to catch up.
+ */
+class DeferredVerifier {
+public:
+	DeferredVerifier(const std::vector<BlockRef>& blocks, unsigned threadCount, uint64_t capacity)
+		: blocks(blocks), capacity(capacity)
+	{
+		for (unsigned i = 0; i < threadCount; ++i) {
+			threads.emplace_back(&DeferredVerifier::run, this);
+		}
+	}
+
+	~DeferredVerifier()
+	{
+		finish();
+	}
+
+	DeferredVerifier(const DeferredVerifier&) = delete;
+	DeferredVerifier& operator=(const DeferredVerifier&) = delete;
+
+	/**
+	 * @brief Hands over a block that has been passed to the sink.
+	 *
+	 * @param index The index of the block in the block list.
+	 * @param decoded The decoded block. Data in target memory is checked where it is.
+	 * @param output The buffer the block was decompressed into, if it was. It is swapped for an unused buffer.
+	 */
+	void push(size_t index, const DecodedBlock& decoded, std::vector<uint8_t>& output)
+	{
+		Job job;
+		job.index = index;
+		job.length = decoded.length;
+		if (decoded.in_place) {
+			job.data = decoded.data;
+		}
+		else {
+			job.buffer = takeBuffer();
+			if (decoded.data == output.data()) {
+				job.buffer.swap(output);
+			}
+			else {
+				job.buffer.assign(decoded.data, decoded.data + decoded.length);
+			}
+			job.data = job.buffer.data();
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		hasRoom.wait(lock, [&]() { return queue.empty() || heldBytes + job.length <= capacity; });
+		heldBytes += job.length;
+		queue.push_back(std::move(job));
+		hasWork.notify_one();
+	}
+
+	/**
+	 * @brief Waits until every block handed over has been checked and stops the verifier threads.
+	 *
+	 * @return The indexes of the blocks that failed their check, in block list order.
+	 */
+	std::vector<size_t> finish()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finishing = true;
+			hasWork.notify_all();
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		threads.clear();
+		std::sort(mismatches.begin(), mismatches.end());
+		return mismatches;
+	}
+
+private:
+	struct Job
+	{
+		size_t index = 0;
+		const uint8_t* data = nullptr;
+		size_t length = 0;
+		std::vector<uint8_t> buffer;
+	};
+
+	std::vector<uint8_t> takeBuffer()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (spare.empty()) {
+			return std::vector<uint8_t>();
+		}
+		std::vector<uint8_t> buffer = std::move(spare.back());
+		spare.pop_back();
+		return buffer;
+	}
+
+	void run()
+	{
+		size_t groupSize = getMD5BatchWidth();
+		std::vector<Job> group;
+		std::vector<MD5Job> hashJobs;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				hasWork.wait(lock, [&]() { return finishing || !queue.empty(); });
+				if (queue.empty()) {
+					return;
+				}
+				while (!queue.empty() && group.size() < groupSize) {
+					group.push_back(std::move(queue.front()));
+					queue.pop_front();
+				}
+			}
+
+			hashJobs.resize(group.size());
+			for (size_t j = 0; j < group.size(); ++j) {
+				hashJobs[j].data = group[j].data;
+				hashJobs[j].length = group[j].length;
+			}
+			computeMD5HashBatch(hashJobs.data(), hashJobs.size());
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t j = 0; j < group.size(); ++j) {
+				const BlockRef& block = blocks[group[j].index];
+				if (memcmp(hashJobs[j].hash.data(), block.element->md5_hash, sizeof(block.element->md5_hash)) != 0) {
+					mismatches.push_back(group[j].index);
+				}
+				heldBytes -= group[j].length;
+				if (!group[j].buffer.empty() && spare.size() < SPARE_BUFFERS) {
+					spare.push_back(std::move(group[j].buffer));
+				}
+			}
+			group.clear();
+			hasRoom.notify_all();
+		}
+	}
+
+	static constexpr size_t SPARE_BUFFERS = 64;
+
+	const std::vector<BlockRef>& blocks;
+	uint64_t capacity;
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable hasWork;
+	std::condition_variable hasRoom;
+	std::deque<Job> queue;
+	std::vector<std::vector<uint8_t>> spare;
+	std::vector<size_t> mismatches;
+	uint64_t heldBytes = 0;
+	bool finishing = false;
+};
+
+// ==============================
+// Pipeline
+// ==============================
+
+/**
+ * @brief Passes the stored ranges of a batch of blocks to their sources, one range for each run of nearby blocks in the same source.
+ *
+ * @param blocks The block list.
+ * @param first The first block of the batch.
+ * @param last The block after the batch.
+ * @param hint Called with the source and the offset and length of each range.
+ */
+static void hintBatch(const std::vector<BlockRef>& blocks, size_t first, size_t last, const std::function<void(BackupSource&, uint64_t, uint64_t)>& hint)
+{
+	for (size_t i = first; i < last;) {
+		BackupSource* source = blocks[i].source;
+		uint64_t start = blocks[i].element->file_position;
+		uint64_t end = start + blocks[i].element->block_length;
+		size_t next = i + 1;
+		while (next < last && blocks[next].source == source) {
+			uint64_t position = blocks[next].element->file_position;
+			if (position < start || position > end + HINT_GAP_BYTES) {
+				break;
+			}
+			end = std::max(end, position + blocks[next].element->block_length);
+			++next;
+		}
+		if (source != nullptr) {
+			hint(*source, start, end - start);
+		}
+		i = next;
+	}
+}
+
+/**
+ * @brief Reads, decodes and hash checks blocks on all cores.
+ *
+ * @param blocks The blocks to process.
+ * @param options The thread count and batch size.
+ * @param sink Receives each good block.
+ * @param onError Receives each bad block. If null, the first error stops the pipeline and is rethrown.
+ * @param outputProgress An optional callback that receives the number of restored bytes processed, which is the
+ *                       `write_limit` of each block rather than its compressed length in the backup file.
+ */
+void runBlockPipeline(const std::vector<BlockRef>& blocks, const PipelineOptions& options, const BlockSink& sink, const BlockErrorHandler& onError, ProgressCallback outputProgress /*= nullptr*/)
+{
+	// Split the blocks into batches of about batch_bytes stored bytes
+	std::vector<size_t> batchStarts;
+	uint64_t totalBytes = 0;
+	uint64_t batchBytes = 0;
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		if (batchStarts.empty() || batchBytes >= options.batch_bytes) {
+			batchStarts.push_back(i);
+			batchBytes = 0;
+		}
+		batchBytes += blocks[i].element->block_length;
+		totalBytes += blocks[i].write_limit;
+	}
+	size_t batchCount = batchStarts.size();
+	batchStarts.push_back(blocks.size());
+	if (batchCount == 0) {
+		return;
+	}
+
+	unsigned threadCount = options.thread_count ? options.thread_count : std::max(1u, std::thread::hardware_concurrency());
+	threadCount = static_cast<unsigned>(std::min<size_t>(threadCount, batchCount));
+
+	// With autotune, thread_count and read_ahead_bytes are caps, and the tuner picks the workers and depth used
+	size_t readAheadBatches = 0;
+	if (options.read_ahead_bytes > 0 && !options.read_current) {
+		readAheadBatches = static_cast<size_t>((options.read_ahead_bytes + options.batch_bytes - 1) / std::max<uint32_t>(options.batch_bytes, 1));
+	}
+	std::unique_ptr<AutoTuner> tuner;
+	if (options.autotune) {
+		tuner = std::make_unique<AutoTuner>(threadCount, readAheadBatches);
+	}
+
+	// Batches are taken in order, so the ones after the newest batch taken are read next. Each batch is hinted
+	// once, when it comes within the read-ahead depth of the newest batch taken. The first batches are hinted up front.
+	auto prefetch = [](BackupSource& source, uint64_t offset, uint64_t length) { source.prefetch(offset, length); };
+	auto release = [](BackupSource& source, uint64_t offset, uint64_t length) { source.release(offset, length); };
+	std::atomic<size_t> hintedBatches{ 0 };
+	auto hintAhead = [&](size_t batch) {
+		size_t depth = tuner ? tuner->getReadAhead() : readAheadBatches;
+		size_t end = std::min(batchCount, batch + depth + 1);
+		size_t start = hintedBatches;
+		while (start < end && !hintedBatches.compare_exchange_weak(start, end)) {
+		}
+		for (size_t ahead = start; ahead < end; ++ahead) {
+			hintBatch(blocks, batchStarts[ahead], batchStarts[ahead + 1], prefetch);
+		}
+	};
+	if (readAheadBatches > 0) {
+		hintAhead(0);
+	}
+
+	std::atomic<size_t> nextBatch{ 0 };
+	std::atomic<uint64_t> bytesDone{ 0 };
+	std::atomic<bool> stop{ false };
+	std::mutex mutex;
+	std::condition_variable workerFinished;
+	unsigned running = threadCount;
+	std::exception_ptr firstError;
+	std::unique_ptr<ReorderBuffer> reorder;
+	if (options.reorder_bytes > 0) {
+		reorder = std::make_unique<ReorderBuffer>(options.reorder_bytes, sink, onError);
+	}
+
+	// Blocks passed on in order are checked inline, so the sink never sees a bad block out of turn.
+	// Deferred checks use one verifier thread for every four workers.
+	HashCheck hashCheck = options.hash_check;
+	if (hashCheck == HashCheck::eDeferred && reorder) {
+		hashCheck = HashCheck::eInline;
+	}
+	uint32_t sampleEvery = std::max<uint32_t>(1, options.hash_sample);
+	std::unique_ptr<DeferredVerifier> verifier;
+	if (hashCheck == HashCheck::eDeferred) {
+		verifier = std::make_unique<DeferredVerifier>(blocks, std::max(1u, threadCount / 4), DEFERRED_VERIFY_BYTES);
+	}
+
+	auto worker = [&](unsigned workerIndex) {
+		try {
+			BlockDecoder decoder;
+			std::vector<uint8_t> readBuffer;
+			std::vector<size_t> offsets;
+			std::vector<std::string> readErrors;
+			std::vector<bool> handled;
+			std::vector<uint8_t*> destinations;
+			std::vector<ReadRange> ranges;
+
+			// Blocks are hashed in groups, one block per lane of the MD5 kernel
+			size_t groupSize = getMD5BatchWidth();
+			std::vector<std::vector<uint8_t>> outputs(groupSize);
+			std::vector<DecodedBlock> decoded(groupSize);
+			std::vector<std::string> errors(groupSize);
+			std::vector<MD5Job> hashJobs;
+			std::vector<size_t> hashIndexes;
+
+			// Workers the tuner has set aside wait before taking a batch, so they never hold one back
+			auto takeBatch = [&]() {
+				if (tuner) {
+					tuner->waitTurn(workerIndex);
+				}
+				return nextBatch++;
+			};
+
+			for (size_t batch = takeBatch(); batch < batchCount && !stop; batch = takeBatch()) {
+				auto batchStart = std::chrono::steady_clock::now();
+				size_t first = batchStarts[batch];
+				size_t last = batchStarts[batch + 1];
+				readErrors.assign(last - first, std::string());
+				if (readAheadBatches > 0) {
+					hintAhead(batch);
+				}
+
+				// Blocks whose data on the target is unchanged are left as they are. The target data is
+				// hashed a group at a time, the same way as decoded blocks.
+				handled.assign(last - first, false);
+				if (options.read_current && !reorder) {
+					for (size_t groupStart = first; groupStart < last; groupStart += groupSize) {
+						size_t groupEnd = std::min(groupStart + groupSize, last);
+						hashJobs.clear();
+						hashIndexes.clear();
+						for (size_t i = groupStart; i < groupEnd; ++i) {
+							size_t k = i - groupStart;
+							if (blocks[i].source == nullptr) {
+								continue;
+							}
+							outputs[k].resize(blocks[i].write_limit);
+							if (options.read_limit) {
+								options.read_limit->acquire(blocks[i].write_limit);
+							}
+							try {
+								options.read_current(blocks[i], outputs[k].data());
+							}
+							catch (const std::exception&) {
+								// The block is restored
+								continue;
+							}
+							MD5Job job;
+							job.data = outputs[k].data();
+							job.length = blocks[i].write_limit;
+							hashJobs.push_back(job);
+							hashIndexes.push_back(k);
+						}
+						computeMD5HashBatch(hashJobs.data(), hashJobs.size());
+						for (size_t j = 0; j < hashJobs.size(); ++j) {
+							size_t i = groupStart + hashIndexes[j];
+							handled[i - first] = memcmp(hashJobs[j].hash.data(), blocks[i].element->md5_hash, sizeof(blocks[i].element->md5_hash)) == 0;
+						}
+					}
+				}
+
+				// Blocks the sink's target can copy for itself are not read
+				if (options.copy_block && !reorder) {
+					for (size_t i = first; i < last; ++i) {
+						if (handled[i - first]) {
+							continue;
+						}
+						try {
+							handled[i - first] = blocks[i].source != nullptr && options.copy_block(blocks[i]);
+							// The copy has already happened, so its bytes hold back the blocks after it
+							if (handled[i - first] && options.read_limit) {
+								options.read_limit->acquire(blocks[i].element->block_length);
+							}
+							if (handled[i - first] && options.write_limit) {
+								options.write_limit->acquire(blocks[i].write_limit);
+							}
+						}
+						catch (const std::exception& e) {
+							readErrors[i - first] = e.what();
+						}
+					}
+				}
+
+				// Uncompressed blocks that fill their place in the target are read straight into it.
+				// Lay the rest of the batch out in one buffer.
+				destinations.assign(last - first, nullptr);
+				offsets.resize(last - first);
+				size_t used = 0;
+				for (size_t i = first; i < last; ++i) {
+					offsets[i - first] = used;
+					if (handled[i - first] || !readErrors[i - first].empty()) {
+						continue;
+					}
+					if (options.write_pointer && !reorder && blocks[i].layout->_compression.compression_level == ImageEnums::CompressionType::eNone
+						&& blocks[i].element->block_length == blocks[i].write_limit) {
+						destinations[i - first] = options.write_pointer(blocks[i]);
+					}
+					if (destinations[i - first] == nullptr) {
+						used += blocks[i].element->block_length;
+					}
+				}
+				readBuffer.resize(used);
+				auto blockData = [&](size_t i) {
+					return destinations[i - first] ? destinations[i - first] : readBuffer.data() + offsets[i - first];
+				};
+
+				// Read each run of blocks from the same source with a single call
+				auto readStart = std::chrono::steady_clock::now();
+				for (size_t runStart = first; runStart < last;) {
+					BackupSource* source = blocks[runStart].source;
+					size_t runEnd = runStart;
+					while (runEnd < last && blocks[runEnd].source == source) {
+						++runEnd;
+					}
+					if (source == nullptr) {
+						for (size_t i = runStart; i < runEnd; ++i) {
+							readErrors[i - first] = "File " + std::to_string(blocks[i].element->file_number) + " not found in the backup set.";
+						}
+					}
+					else {
+						ranges.clear();
+						uint64_t runBytes = 0;
+						for (size_t i = runStart; i < runEnd; ++i) {
+							if (handled[i - first] || !readErrors[i - first].empty()) {
+								continue;
+							}
+							ranges.push_back({ static_cast<uint64_t>(blocks[i].element->file_position), blocks[i].element->block_length, blockData(i) });
+							runBytes += blocks[i].element->block_length;
+						}
+						if (options.read_limit) {
+							options.read_limit->acquire(runBytes);
+						}
+						try {
+							source->readRanges(ranges);
+						}
+						catch (const std::exception&) {
+							// Retry one block at a time to find the blocks that cannot be read
+							for (size_t i = runStart; i < runEnd; ++i) {
+								if (handled[i - first] || !readErrors[i - first].empty()) {
+									continue;
+								}
+								try {
+									source->readAt(blocks[i].element->file_position, blockData(i), blocks[i].element->block_length);
+								}
+								catch (const std::exception& e) {
+									readErrors[i - first] = e.what();
+								}
+							}
+						}
+					}
+					runStart = runEnd;
+				}
+
+				auto readTime = std::chrono::steady_clock::now() - readStart;
+
+				// Decode, check and pass on each group of blocks
+				for (size_t groupStart = first; groupStart < last && !stop; groupStart += groupSize) {
+					size_t groupEnd = std::min(groupStart + groupSize, last);
+					hashJobs.clear();
+					hashIndexes.clear();
+					for (size_t i = groupStart; i < groupEnd; ++i) {
+						size_t k = i - groupStart;
+						errors[k] = readErrors[i - first];
+						if (!errors[k].empty() || handled[i - first]) {
+							continue;
+						}
+						try {
+							bool keepCompressed = options.keep_compressed && options.keep_compressed(blocks[i]);
+							uint8_t* destination = destinations[i - first];
+							if (destination == nullptr && !keepCompressed && options.write_pointer && !reorder
+								&& blocks[i].layout->_compression.compression_level != ImageEnums::CompressionType::eNone) {
+								destination = options.write_pointer(blocks[i]);
+							}
+							decoded[k] = decoder.decode(blocks[i], blockData(i), outputs[k], keepCompressed, destination);
+							if ((hashCheck == HashCheck::eDeferred && !decoded[k].compressed) || (hashCheck == HashCheck::eSampled && i % sampleEvery != 0)) {
+								continue;
+							}
+							MD5Job job;
+							if (decoded[k].compressed) {
+								// The hash is of the raw data. The frame is passed on as it is, and its raw data is
+								// decompressed into the unused output buffer to be checked.
+								decoder.decompress(decoded[k], outputs[k]);
+								job.data = outputs[k].data();
+								job.length = outputs[k].size();
+							}
+							else {
+								job.data = decoded[k].data;
+								job.length = decoded[k].length;
+							}
+							hashJobs.push_back(job);
+							hashIndexes.push_back(k);
+						}
+						catch (const std::exception& e) {
+							errors[k] = e.what();
+						}
+					}
+
+					// The MD5 hash in the block index is of the raw data, after decryption and decompression
+					computeMD5HashBatch(hashJobs.data(), hashJobs.size());
+					for (size_t j = 0; j < hashJobs.size(); ++j) {
+						const BlockRef& block = blocks[groupStart + hashIndexes[j]];
+						if (memcmp(hashJobs[j].hash.data(), block.element->md5_hash, sizeof(block.element->md5_hash)) != 0) {
+							errors[hashIndexes[j]] = "Block hash mismatch.";
+						}
+					}
+
+					for (size_t i = groupStart; i < groupEnd; ++i) {
+						const BlockRef& block = blocks[i];
+						const std::string& error = errors[i - groupStart];
+						if (options.write_limit && error.empty() && !handled[i - first]) {
+							options.write_limit->acquire(decoded[i - groupStart].length);
+						}
+						if (reorder) {
+							reorder->push(i, block, decoded[i - groupStart], error);
+						}
+						else if (!error.empty()) {
+							if (!onError) {
+								throw std::runtime_error(error);
+							}
+							onError(block, error);
+						}
+						else if (!handled[i - first]) {
+							sink(block, decoded[i - groupStart]);
+							if (verifier && !decoded[i - groupStart].compressed) {
+								verifier->push(i, decoded[i - groupStart], outputs[i - groupStart]);
+							}
+						}
+						bytesDone += block.write_limit;
+					}
+				}
+
+				// The stored blocks are not read again once decoded
+				if (options.drop_behind) {
+					hintBatch(blocks, first, last, release);
+				}
+				if (tuner) {
+					tuner->addTime(readTime, std::chrono::steady_clock::now() - batchStart);
+				}
+			}
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!firstError) {
+				firstError = std::current_exception();
+			}
+			stop = true;
+		}
+		if (tuner) {
+			// The batches are all taken, or the pipeline is stopping, so the waiting workers can finish too
+			tuner->release();
+		}
+		if (stop && reorder) {
+			reorder->cancel();
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		--running;
+		workerFinished.notify_all();
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < threadCount; ++i) {
+		threads.emplace_back(worker, i);
+	}
+
+	// Report progress while the workers run. The callback consumes the bytes it reports.
+	auto lastUpdateTime = std::chrono::steady_clock::now();
+	uint64_t bytesReported = 0;
+	auto reportProgress = [&]() {
+		uint64_t bytesSoFar = bytesDone - bytesReported;
+		uint64_t bytesPending = bytesSoFar;
+		outputProgress(totalBytes, bytesSoFar, lastUpdateTime);
+		if (bytesSoFar == 0) {
+			bytesReported += bytesPending;
+		}
+	};
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running > 0) {
+			workerFinished.wait_for(lock, std::chrono::milliseconds(250));
+			if (tuner) {
+				tuner->sample(bytesDone);
+			}
+			if (outputProgress) {
+				lock.unlock();
+				reportProgress();
+				lock.lock();
+			}
+		}
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	if (firstError) {
+		std::rethrow_exception(firstError);
+	}
+
+	// Report the blocks that failed a deferred check, now that every block has been passed on
+	if (verifier) {
+		for (size_t index : verifier->finish()) {
+			if (!onError) {
+				throw std::runtime_error("Block hash mismatch.");
+			}
+			onError(blocks[index], "Block hash mismatch.");
+		}
+	}
+	if (outputProgress) {
+		// Subtract 10 seconds from lastUpdateTime to force an update
+		lastUpdateTime -= std::chrono::seconds(10);
+		reportProgress();
+	}
+}
+
+// ==============================
+// Block lists
+// ==============================
+
+/**
+ * @brief Appends the blocks of a partition to a block list.
+ *
+ * @param layout The layout that holds the partition.
+ * @param disk The disk that holds the partition.
+ * @param partition The partition to list.
+ * @param backupSet The backup set used to find the source of each block.
+ * @param ownIndexOnly True to list only the blocks in the file's own index, false to list the merged index.
+ * @param blocks The list to append to.
+ */
+void appendPartitionBlocks(const file_structs::fileLayout& layout, const file_structs::Disk::DiskLayout& disk, const file_structs::Partition::PartitionLayout& partition,
+	BackupSet& backupSet, bool ownIndexOnly, std::vector<BlockRef>& blocks)
+{
+	uint64_t blockSize = partition._header.block_size;
+
+	auto addBlock = [&](const DataBlockIndexElement& element, uint32_t index, uint64_t diskOffset, uint32_t writeLimit, bool reservedSectors) {
+		// Empty entries are clusters that were not backed up
+		if (element.block_length == 0) {
+			return;
+		}
+		BlockRef block;
+		block.element = &element;
+		auto source = backupSet.indexSourceMap.find(element.file_number);
+		block.source = source == backupSet.indexSourceMap.end() ? nullptr : source->second.get();
+		block.layout = &layout;
+		block.disk_number = disk._header.disk_number;
+		block.partition_number = partition._header.partition_number;
+		block.iv_index = index;
+		block.disk_offset = diskOffset;
+		block.bytes_per_sector = disk._geometry.bytes_per_sector > 0 ? disk._geometry.bytes_per_sector : 512;
+		block.reserved_sectors = reservedSectors;
+		block.write_limit = writeLimit;
+		block.block_size = static_cast<uint32_t>(blockSize);
+		blocks.push_back(block);
+	};
+
+	// FAT32 reserved sectors are restored from the boot sector onwards
+	uint64_t bootSectorStart = partition._geometry.start + partition._geometry.boot_sector_offset;
+	uint64_t reservedLength = partition._file_system.reserved_sectors_byte_length;
+	for (uint32_t index = 0; index < partition.reserved_sectors_blocks.size() && blockSize * index < reservedLength; ++index) {
+		uint32_t writeLimit = static_cast<uint32_t>(std::min(blockSize, reservedLength - blockSize * index));
+		addBlock(partition.reserved_sectors_blocks[index], index, bootSectorStart + blockSize * index, writeLimit, true);
+	}
+
+	// calculate the disk offset for the first data block in the partition
+	uint64_t lcn0Start = partition._geometry.start + (partition._file_system.lcn0_offset - partition._file_system.start);
+	if (ownIndexOnly && layout._header.delta_index) {
+		for (const auto& deltaBlock : partition.delta_data_blocks) {
+			addBlock(deltaBlock.delta_data_block, deltaBlock.block_index, lcn0Start + blockSize * deltaBlock.block_index, static_cast<uint32_t>(blockSize), false);
+		}
+	}
+	else {
+		for (uint32_t index = 0; index < partition.data_blocks.size(); ++index) {
+			addBlock(partition.data_blocks[index], index, lcn0Start + blockSize * index, static_cast<uint32_t>(blockSize), false);
+		}
+	}
+}
+
+/**
+ * @brief Sorts blocks into read order: by file number, then by file position.
+ */
+void sortBlocksByFilePosition(std::vector<BlockRef>& blocks)
+{
+	std::stable_sort(blocks.begin(), blocks.end(), [](const BlockRef& a, const BlockRef& b) {
+		if (a.element->file_number != b.element->file_number) {
+			return a.element->file_number < b.element->file_number;
+		}
+		return a.element->file_position < b.element->file_position;
+	});
+}
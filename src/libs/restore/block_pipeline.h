@@ -0,0 +1,251 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief Parallel read, decrypt, decompress and hash check of data blocks.
+ *
+ * Each data block in a backup file is independent: it is encrypted with its own IV,
+ * compressed as its own zstd frame and carries the MD5 hash of its raw data in the index.
+ * The block pipeline uses this to spread the work over all cores. Worker threads take
+ * batches of blocks, read each batch from the backup files with a single `readRanges` call,
+ * then decode and check every block in the batch before passing it to a sink.
+ */
+
+#include <functional>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "..\file_reader\file_reader.h"
+#include "throttle.h"
+
+/**
+ * @brief Type alias for a callback function used to report progress during disk restoration.
+ *
+ * This callback function is invoked periodically during the disk restoration process to report the progress.
+ * It takes three parameters: the total number of bytes to be processed, the number of bytes processed so far,
+ * and the time point of the last update. The function does not return a value.
+ */
+using ProgressCallback = std::function<void(const uint64_t totalBytes, uint64_t& bytesSoFar, std::chrono::steady_clock::time_point& lastUpdateTime)>;
+
+/**
+ * @struct BlockRef
+ * @brief A data block referenced by a block index, with everything needed to decode and place it.
+ *
+ * @var element The index entry for the block. Points into the block index of a file layout.
+ * @var source The backup file that holds the block.
+ * @var layout The layout whose encryption and compression settings apply to the block.
+ * @var disk_number The disk number used in IV generation.
+ * @var partition_number The partition number used in IV generation.
+ * @var iv_index The block index used in IV generation.
+ * @var disk_offset The offset of the block on the restored disk.
+ * @var bytes_per_sector The sector size of the restored disk.
+ * @var reserved_sectors True if the block holds FAT32 reserved sectors rather than file system clusters.
+ * @var write_limit The most bytes of the decoded block to write. The last reserved sector block can extend
+ *                  past the end of the reserved sectors.
+ * @var block_size The block size of the partition, the most bytes a block can decompress to.
+ * @var target_index The index of the target the block is written to, for sinks that write several targets.
+ */
+struct BlockRef
+{
+	const DataBlockIndexElement* element = nullptr;
+	BackupSource* source = nullptr;
+	const file_structs::fileLayout* layout = nullptr;
+	int32_t disk_number = 0;
+	int32_t partition_number = 0;
+	uint32_t iv_index = 0;
+	uint64_t disk_offset = 0;
+	uint32_t bytes_per_sector = 512;
+	bool reserved_sectors = false;
+	uint32_t write_limit = 0;
+	uint32_t block_size = 0;
+	uint32_t target_index = 0;
+};
+
+/**
+ * @struct DecodedBlock
+ * @brief The raw data of a block after decryption and decompression.
+ *
+ * The data is only valid until the sink returns.
+ *
+ * @var data The data of the block.
+ * @var length The length of the data.
+ * @var compressed True if the data is the block's zstd frame, decrypted but not decompressed. The frame
+ *                 decompresses to `write_limit` bytes. Its hash is checked by decompressing it to scratch memory.
+ * @var in_place True if the data was decoded straight into the target memory given by `PipelineOptions::write_pointer`,
+ *               so it is already in place.
+ */
+struct DecodedBlock
+{
+	const uint8_t* data = nullptr;
+	size_t length = 0;
+	bool compressed = false;
+	bool in_place = false;
+};
+
+struct ZSTD_DCtx_s;
+
+/**
+ * @class BlockDecoder
+ * @brief Decrypts and decompresses data blocks.
+ *
+ * A decoder holds a zstd decompression context, so each thread should use its own decoder.
+ */
+class BlockDecoder {
+public:
+	BlockDecoder();
+	~BlockDecoder();
+
+	BlockDecoder(const BlockDecoder&) = delete;
+	BlockDecoder& operator=(const BlockDecoder&) = delete;
+
+	/**
+	 * @brief Decrypts and decompresses a block.
+	 *
+	 * The MD5 hash is not checked. `runBlockPipeline` checks the hashes of several decoded blocks at once.
+	 *
+	 * @param block The block to decode.
+	 * @param data The block as stored in the backup file. Encrypted blocks are decrypted in place.
+	 * @param output A buffer that receives the decompressed data, reused between calls.
+	 * @param keepCompressed True to return the zstd frame of a compressed block rather than decompress it,
+	 *                       if the frame decompresses to exactly `write_limit` bytes and is no longer than them.
+	 * @param destination Target memory of `write_limit` bytes to decompress the block into, used if the block
+	 *                    decompresses to exactly that many bytes. An uncompressed block may have been read into it. Null to use `output`.
+	 * @return The decoded block. Points into `data`, `output` or `destination`.
+	 * @throws std::runtime_error if the block cannot be decompressed, or its frame claims more than `write_limit`
+	 *         and `block_size` bytes.
+	 */
+	DecodedBlock decode(const BlockRef& block, uint8_t* data, std::vector<uint8_t>& output, bool keepCompressed = false, uint8_t* destination = nullptr);
+
+	/**
+	 * @brief Decompresses the zstd frame of a block that `decode` kept compressed, so its hash can be checked.
+	 *
+	 * @param decoded A block decoded with `compressed` set.
+	 * @param output A buffer that receives the decompressed data, reused between calls.
+	 * @throws std::runtime_error if the frame cannot be decompressed.
+	 */
+	void decompress(const DecodedBlock& decoded, std::vector<uint8_t>& output);
+
+private:
+	ZSTD_DCtx_s* context;
+};
+
+/**
+ * @brief When `runBlockPipeline` checks the MD5 hashes of decoded blocks.
+ *
+ * - eInline: every block is checked before it is passed to the sink, so a bad block never reaches the sink.
+ * - eDeferred: every block is passed to the sink first and checked afterwards by separate verifier threads, which
+ *   keeps hashing off the path to the target. A bad block has already been passed on when it is found. It is
+ *   reported once every block has been passed on.
+ * - eSampled: one block in `hash_sample` is checked before it is passed to the sink. The rest are not checked.
+ */
+enum class HashCheck { eInline, eDeferred, eSampled };
+
+/**
+ * @struct PipelineOptions
+ * @brief Options for `runBlockPipeline`.
+ *
+ * @var thread_count The number of worker threads. 0 uses one thread per logical processor.
+ * @var batch_bytes The number of stored bytes each worker reads at a time.
+ * @var reorder_bytes 0 to pass blocks to the sink as soon as they are decoded, in any order. Otherwise blocks
+ *                    are passed to the sink one at a time in the order given, and up to this many decoded bytes
+ *                    are held back while earlier blocks are still being decoded. Workers wait when it is full.
+ * @var keep_compressed Returns true for blocks the sink takes as zstd frames, so they are decrypted but not
+ *                      decompressed. A frame that is hash checked is still decompressed to scratch memory, and
+ *                      always inline, as the deferred verifier only takes decoded data. Null to decompress every block.
+ * @var read_current Reads the `write_limit` bytes at a block's place in the target into the buffer. A block whose data on the
+ *                   target already has the MD5 hash in the block index is not read, decoded or passed to the sink. A block
+ *                   that cannot be read back is restored. Null to restore every block. Not used with reorder_bytes.
+ * @var copy_block Copies a block from its backup file to its place without it being read, and returns true if it did.
+ *                 A copied block is not decoded, hash checked or passed to the sink. Null to read every block.
+ *                 Not used with reorder_bytes.
+ * @var write_pointer Returns the target memory a block is written to, from `RestoreTarget::getWritePointer`, so the block is read,
+ *                    decrypted and decompressed straight into it. Null, or a null result, decodes the block into a buffer.
+ *                    Not used with reorder_bytes. A block that fails its hash check may leave bad data in the target.
+ * @var hash_check When the MD5 hashes of decoded blocks are checked. Blocks passed on with reorder_bytes are checked inline
+ *                 rather than deferred.
+ * @var hash_sample With `HashCheck::eSampled`, the block at every index that is a multiple of this is checked.
+ * @var read_ahead_bytes How far past the newest batch taken by a worker the stored ranges of the blocks are passed to
+ *                       `BackupSource::prefetch`, so the reads of the next batches find their data already fetched. 0 for
+ *                       no hints. Not used with read_current, which leaves most blocks unread.
+ * @var drop_behind True to pass the stored ranges of each batch to `BackupSource::release` once its blocks are decoded,
+ *                  so the backup files do not push the rest of the system's data out of the cache.
+ * @var read_limit Charged with the stored bytes read from the backup files, the bytes copied by copy_block and the bytes
+ *                 read by read_current, before they are read. Null for no limit.
+ * @var write_limit Charged with the bytes of each block before it is passed to the sink, and the bytes copied by copy_block.
+ *                  Null for no limit, as for a sink that writes nothing.
+ * @var autotune True to tune the pipeline while it runs: thread_count and read_ahead_bytes become caps, and the number of
+ *               workers taking batches and the read-ahead depth are adjusted every half second to what gives the most
+ *               throughput. The workers start at half the cap and the read-ahead at half its cap.
+ */
+struct PipelineOptions
+{
+	unsigned thread_count = 0;
+	uint32_t batch_bytes = 16 * 1024 * 1024;
+	uint64_t reorder_bytes = 0;
+	std::function<bool(const BlockRef& block)> keep_compressed;
+	std::function<void(const BlockRef& block, uint8_t* buffer)> read_current;
+	std::function<bool(const BlockRef& block)> copy_block;
+	std::function<uint8_t*(const BlockRef& block)> write_pointer;
+	HashCheck hash_check = HashCheck::eInline;
+	uint32_t hash_sample = 64;
+	uint64_t read_ahead_bytes = 0;
+	bool drop_behind = false;
+	RateLimiter* read_limit = nullptr;
+	RateLimiter* write_limit = nullptr;
+	bool autotune = false;
+};
+
+// Called with each decoded block. May be called concurrently from several worker threads, unless reorder_bytes is set.
+using BlockSink = std::function<void(const BlockRef& block, const DecodedBlock& decoded)>;
+
+// Called with each block that could not be read or decoded. May be called concurrently from several worker threads, unless reorder_bytes is set.
+using BlockErrorHandler = std::function<void(const BlockRef& block, const std::string& error)>;
+
+/**
+ * @brief Reads, decodes and hash checks blocks on all cores.
+ *
+ * Blocks are processed in batches, in the order given. For the fastest reads, sort the blocks
+ * by source and file position first, and set reorder_bytes if the sink needs them in another order. A failed batch read is retried one block at a time so
+ * that errors are reported against the blocks they affect. The MD5 hashes of the decoded
+ * blocks are checked `getMD5BatchWidth()` blocks at a time. With `HashCheck::eDeferred`, blocks that fail
+ * their check are reported to onError, or the first is thrown, after every block has been passed to the sink.
+ *
+ * @param blocks The blocks to process.
+ * @param options The thread count and batch size.
+ * @param sink Receives each good block.
+ * @param onError Receives each bad block. If null, the first error stops the pipeline and is rethrown.
+ * @param outputProgress An optional callback that receives the number of restored bytes processed, the `write_limit` of each block.
+ */
+void runBlockPipeline(const std::vector<BlockRef>& blocks, const PipelineOptions& options, const BlockSink& sink, const BlockErrorHandler& onError, ProgressCallback outputProgress = nullptr);
+
+/**
+ * @brief Appends the blocks of a partition to a block list.
+ *
+ * Empty index entries are skipped. Reserved sector blocks are placed one partition block
+ * after another from the boot sector; data blocks are placed at their cluster offset from LCN 0.
+ *
+ * @param layout The layout that holds the partition.
+ * @param disk The disk that holds the partition.
+ * @param partition The partition to list.
+ * @param backupSet The backup set used to find the source of each block.
+ * @param ownIndexOnly True to list only the blocks in the file's own index (its delta index for a delta file),
+ *                     false to list the merged index built for the backup set.
+ * @param blocks The list to append to.
+ */
+void appendPartitionBlocks(const file_structs::fileLayout& layout, const file_structs::Disk::DiskLayout& disk, const file_structs::Partition::PartitionLayout& partition,
+	BackupSet& backupSet, bool ownIndexOnly, std::vector<BlockRef>& blocks);
+
+/**
+ * @brief Sorts blocks into read order: by file number, then by file position.
+ *
+ * Blocks from the same backup file end up next to each other in the order they are stored,
+ * so each file is read from start to end once.
+ */
+void sortBlocksByFilePosition(std::vector<BlockRef>& blocks);
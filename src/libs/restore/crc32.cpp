@@ -1,48 +1,137 @@
 #include "pch.h"
+#include "..\encryption\cpu_features.h"
 #include "crc32.h"
+#include "crc32_kernels.h"
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CRC32_X86
+#endif
 
-static uint32_t crc32LookupTable[256]; // Lookup table array
-static bool isCRCTableInitialized = false;
+// The reflected form of the polynomial 0x04c11db7, which is the official polynomial used by CRC-32 in PKZip, WinZip and Ethernet.
+constexpr uint32_t CRC32_POLYNOMIAL = 0xedb88320;
+
+// The reflected form of the Castagnoli polynomial 0x1edc6f41, used by CRC-32C in VHDX, iSCSI and ext4.
+constexpr uint32_t CRC32C_POLYNOMIAL = 0x82f63b78;
+
+// Buffers shorter than this are faster through the tables than through the PCLMULQDQ kernel
+constexpr size_t CRC32_PCLMUL_MINIMUM_LENGTH = 256;
 
 /**
- * Reverses the bits in a given value.
+ * The lookup tables for slice-by-16.
  *
- * This function takes a value and the number of bits to reflect, and returns the value with its bits reversed.
- * It's used in the CRC32 calculation process, specifically in the table initialization.
+ * table[0] is the classic byte-at-a-time table. table[k] gives the CRC of a byte followed by k zero bytes,
+ * so 16 bytes can be folded into the CRC with 16 independent lookups.
+ */
+struct CRC32Tables
+{
+    uint32_t table[16][256];
+};
+
+/**
+ * Generates the lookup tables for a reflected polynomial at compile time.
  *
- * @param ref The value whose bits are to be reflected.
- * @param bitCount The number of bits to reflect.
- * @return The value with its bits reversed.
+ * @param polynomial The reflected polynomial.
+ * @return The lookup tables.
+ */
+static constexpr CRC32Tables makeCRC32Tables(uint32_t polynomial)
+{
+    CRC32Tables tables = {};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+        tables.table[0][i] = crc;
+    }
+    for (int k = 1; k < 16; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t previous = tables.table[k - 1][i];
+            tables.table[k][i] = (previous >> 8) ^ tables.table[0][previous & 0xFF];
+        }
+    }
+    return tables;
+}
+
+// The tables are built by the compiler, so there is no initialization to race on
+static constexpr CRC32Tables crc32Tables = makeCRC32Tables(CRC32_POLYNOMIAL);
+static constexpr CRC32Tables crc32cTables = makeCRC32Tables(CRC32C_POLYNOMIAL);
+
+/**
+ * Reads a little-endian 32-bit value.
  */
-uint32_t ReverseBits(uint32_t ref, char bitCount)
+static inline uint32_t readLE32(const uint8_t* p)
 {
-    uint32_t reflectedValue(0);
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
 
-    for (int i = 1; i < (bitCount + 1); i++) {
-        if (ref & 1)
-            reflectedValue |= 1 << (bitCount - i);
-        ref >>= 1;
+/**
+ * Updates a CRC register using slice-by-16 table lookups.
+ *
+ * @param tables The lookup tables for the polynomial.
+ * @param crc The CRC register, before the final inversion.
+ * @param data The data.
+ * @param length The length of the data.
+ * @return The updated CRC32 register.
+ */
+static uint32_t sliceCRC32(const CRC32Tables& tables, uint32_t crc, const uint8_t* data, size_t length)
+{
+    const auto& t = tables.table;
+    while (length >= 16) {
+        uint32_t w0 = readLE32(data) ^ crc;
+        uint32_t w1 = readLE32(data + 4);
+        uint32_t w2 = readLE32(data + 8);
+        uint32_t w3 = readLE32(data + 12);
+        crc = t[15][w0 & 0xFF] ^ t[14][(w0 >> 8) & 0xFF] ^ t[13][(w0 >> 16) & 0xFF] ^ t[12][w0 >> 24]
+            ^ t[11][w1 & 0xFF] ^ t[10][(w1 >> 8) & 0xFF] ^ t[9][(w1 >> 16) & 0xFF] ^ t[8][w1 >> 24]
+            ^ t[7][w2 & 0xFF] ^ t[6][(w2 >> 8) & 0xFF] ^ t[5][(w2 >> 16) & 0xFF] ^ t[4][w2 >> 24]
+            ^ t[3][w3 & 0xFF] ^ t[2][(w3 >> 8) & 0xFF] ^ t[1][(w3 >> 16) & 0xFF] ^ t[0][w3 >> 24];
+        data += 16;
+        length -= 16;
     }
-    return reflectedValue;
+    while (length--)
+        crc = (crc >> 8) ^ t[0][(crc & 0xFF) ^ *data++];
+    return crc;
 }
 
 /**
- * Initializes the CRC32 lookup table.
+ * Updates a CRC32 register with the fastest implementation for this CPU.
  *
- * This function generates a lookup table for the CRC32 calculation. It should be called once before any CRC32 calculations are done.
- * The lookup table uses the polynomial 0x04c11db7, which is the official polynomial used by CRC-32 in PKZip, WinZip and Ethernet.
+ * @param crc The CRC32 register, before the final inversion.
+ * @param data The data.
+ * @param length The length of the data.
+ * @return The updated CRC32 register.
  */
-void Initialize_CRC32_Table()
+static uint32_t updateCRC32Register(uint32_t crc, const uint8_t* data, size_t length)
 {
-    uint32_t polynomial = 0x04c11db7;
+#ifdef CRC32_X86
+    if (length >= CRC32_PCLMUL_MINIMUM_LENGTH) {
+        const CpuFeatures& features = getCpuFeatures();
+        if (features.pclmul && features.sse42) {
+            size_t foldLength = length & ~static_cast<size_t>(15);
+            crc = foldCRC32PCLMUL(crc, data, foldLength);
+            data += foldLength;
+            length -= foldLength;
+        }
+    }
+#endif
+    return sliceCRC32(crc32Tables, crc, data, length);
+}
 
-    for (int i = 0; i <= 0xFF; i++) {
-        crc32LookupTable[i] = ReverseBits(i, 8) << 24;
-        for (int j = 0; j < 8; j++)
-            crc32LookupTable[i] = (crc32LookupTable[i] << 1) ^ (crc32LookupTable[i] & (1 << 31) ? polynomial : 0);
-        crc32LookupTable[i] = ReverseBits(crc32LookupTable[i], 32);
+/**
+ * Updates a CRC32C register with the fastest implementation for this CPU.
+ *
+ * @param crc The CRC32C register, before the final inversion.
+ * @param data The data.
+ * @param length The length of the data.
+ * @return The updated CRC32C register.
+ */
+static uint32_t updateCRC32CRegister(uint32_t crc, const uint8_t* data, size_t length)
+{
+#ifdef CRC32_X86
+    if (getCpuFeatures().sse42) {
+        return updateCRC32CSSE42(crc, data, length);
     }
+#endif
+    return sliceCRC32(crc32cTables, crc, data, length);
 }
 
 /**
@@ -62,13 +151,55 @@ uint32_t Calculate_CRC32(const uint8_t* buffer, uint32_t dataLength, uint32_t bu
     if (dataLength > bufferLength) {
         return 0;
     }
+    return updateCRC32Register(initialCRC, buffer, dataLength) ^ 0xffffffff;
+}
 
-    if (!isCRCTableInitialized) {
-        Initialize_CRC32_Table();
-        isCRCTableInitialized = true;
-    }
+/**
+ * Calculates the CRC32 checksum of a buffer.
+ *
+ * @param data The data to calculate the CRC for.
+ * @param length The length of the data.
+ * @return The CRC32 checksum.
+ */
+uint32_t computeCRC32(const uint8_t* data, size_t length)
+{
+    return updateCRC32(0, data, length);
+}
 
-    while (dataLength--)
-        initialCRC = (initialCRC >> 8) ^ crc32LookupTable[(initialCRC & 0xFF) ^ *buffer++];
-    return initialCRC ^ 0xffffffff;
-}
\ No newline at end of file
+/**
+ * Continues a CRC32 calculation with more data.
+ *
+ * @param crc The CRC32 checksum of the data so far, or 0 to start a new calculation.
+ * @param data The next data.
+ * @param length The length of the next data.
+ * @return The CRC32 checksum of all the data.
+ */
+uint32_t updateCRC32(uint32_t crc, const uint8_t* data, size_t length)
+{
+    return updateCRC32Register(crc ^ 0xffffffff, data, length) ^ 0xffffffff;
+}
+
+/**
+ * Calculates the CRC32C checksum of a buffer.
+ *
+ * @param data The data to calculate the CRC for.
+ * @param length The length of the data.
+ * @return The CRC32C checksum.
+ */
+uint32_t computeCRC32C(const uint8_t* data, size_t length)
+{
+    return updateCRC32C(0, data, length);
+}
+
+/**
+ * Continues a CRC32C calculation with more data.
+ *
+ * @param crc The CRC32C checksum of the data so far, or 0 to start a new calculation.
+ * @param data The next data.
+ * @param length The length of the next data.
+ * @return The CRC32C checksum of all the data.
+ */
+uint32_t updateCRC32C(uint32_t crc, const uint8_t* data, size_t length)
+{
+    return updateCRC32CRegister(crc ^ 0xffffffff, data, length) ^ 0xffffffff;
+}
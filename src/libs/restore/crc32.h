@@ -5,6 +5,7 @@
  *
  * This function calculates the CRC32 checksum for a given buffer of data. It uses the polynomial 0x04C11DB7.
  * The function can also continue a previous CRC calculation by providing the previous CRC value as the last parameter.
+ * It is thread-safe.
  *
  * @param buf The buffer containing the data to calculate the CRC for.
  * @param len The length of the data in the buffer to calculate the CRC for.
@@ -12,4 +13,51 @@
  * @param ulCRC The initial CRC value. This can be the result of a previous CRC calculation to continue from. Defaults to 0xffffffff.
  * @return The calculated CRC32 checksum.
  */
-uint32_t Calculate_CRC32(const uint8_t* buf, uint32_t len, uint32_t Bufferlen, uint32_t ulCRC = 0xffffffff);
\ No newline at end of file
+uint32_t Calculate_CRC32(const uint8_t* buf, uint32_t len, uint32_t Bufferlen, uint32_t ulCRC = 0xffffffff);
+
+/**
+ * Calculates the CRC32 checksum of a buffer, as used by GPT, zip and Ethernet.
+ *
+ * The fastest implementation for the CPU is chosen at runtime: carry-less multiplication (PCLMULQDQ)
+ * for long buffers where available, otherwise slice-by-16 table lookups. The function is thread-safe.
+ *
+ * @param data The data to calculate the CRC for.
+ * @param length The length of the data.
+ * @return The CRC32 checksum.
+ */
+uint32_t computeCRC32(const uint8_t* data, size_t length);
+
+/**
+ * Continues a CRC32 calculation with more data.
+ *
+ * updateCRC32(computeCRC32(a, n), b, m) is the CRC32 of a followed by b. updateCRC32(0, data, length)
+ * is the same as computeCRC32(data, length).
+ *
+ * @param crc The CRC32 checksum of the data so far.
+ * @param data The next data.
+ * @param length The length of the next data.
+ * @return The CRC32 checksum of all the data.
+ */
+uint32_t updateCRC32(uint32_t crc, const uint8_t* data, size_t length);
+
+/**
+ * Calculates the CRC32C checksum of a buffer, as used by VHDX, iSCSI and ext4.
+ *
+ * CRC32C uses the Castagnoli polynomial 0x1EDC6F41. The SSE4.2 CRC32 instruction is used where
+ * available, otherwise slice-by-16 table lookups. The function is thread-safe.
+ *
+ * @param data The data to calculate the CRC for.
+ * @param length The length of the data.
+ * @return The CRC32C checksum.
+ */
+uint32_t computeCRC32C(const uint8_t* data, size_t length);
+
+/**
+ * Continues a CRC32C calculation with more data.
+ *
+ * @param crc The CRC32C checksum of the data so far, or 0 to start a new calculation.
+ * @param data The next data.
+ * @param length The length of the next data.
+ * @return The CRC32C checksum of all the data.
+ */
+uint32_t updateCRC32C(uint32_t crc, const uint8_t* data, size_t length);
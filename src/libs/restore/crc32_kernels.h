@@ -0,0 +1,28 @@
+#pragma once
+
+/**
+ * Folds a buffer into a CRC32 register using carry-less multiplication (PCLMULQDQ).
+ *
+ * The register is the running CRC before the final inversion, as in the table-driven implementation.
+ * The kernel is compiled for PCLMULQDQ and SSE4.1 regardless of the compiler settings, so it must
+ * only be called after getCpuFeatures has confirmed support.
+ *
+ * @param crc The CRC32 register.
+ * @param data The data. Must be at least 64 bytes.
+ * @param length The length of the data. Must be a multiple of 16.
+ * @return The updated CRC32 register.
+ */
+uint32_t foldCRC32PCLMUL(uint32_t crc, const uint8_t* data, size_t length);
+
+/**
+ * Updates a CRC32C register using the SSE4.2 CRC32 instruction.
+ *
+ * The register is the running CRC before the final inversion. The kernel is compiled for SSE4.2
+ * regardless of the compiler settings, so it must only be called after getCpuFeatures has confirmed support.
+ *
+ * @param crc The CRC32C register.
+ * @param data The data.
+ * @param length The length of the data.
+ * @return The updated CRC32C register.
+ */
+uint32_t updateCRC32CSSE42(uint32_t crc, const uint8_t* data, size_t length);
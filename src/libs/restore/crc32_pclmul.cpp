@@ -0,0 +1,109 @@
+#include "pch.h"
+#include "crc32_kernels.h"
+
+/*
+ * CRC32 folding with carry-less multiplication, after Gopal et al., "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction", Intel, 2009. The constants are the bit-reflected folding
+ * constants and Barrett reduction constants for the polynomial 0x04c11db7 given in that paper.
+ *
+ * The kernel is compiled for PCLMULQDQ and SSE4.1 regardless of the compiler settings. It is only
+ * called when the CPU supports them.
+ */
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC target("pclmul,sse4.1")
+#elif defined(__clang__)
+#pragma clang attribute push(__attribute__((target("pclmul,sse4.1"))), apply_to = function)
+#endif
+
+alignas(16) static const uint64_t foldBy4Constants[2] = { 0x0154442bd4, 0x01c6e41596 };
+alignas(16) static const uint64_t foldBy1Constants[2] = { 0x01751997d0, 0x00ccaa009e };
+alignas(16) static const uint64_t foldTo32Constants[2] = { 0x0163cd6124, 0x0000000000 };
+alignas(16) static const uint64_t barrettConstants[2] = { 0x01db710641, 0x01f7011641 };
+
+/**
+ * Folds one 128-bit value into the next 16 bytes of data.
+ */
+static inline __m128i fold128(__m128i value, __m128i constants, __m128i next)
+{
+    __m128i low = _mm_clmulepi64_si128(value, constants, 0x00);
+    __m128i high = _mm_clmulepi64_si128(value, constants, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(high, low), next);
+}
+
+/**
+ * Folds a buffer into a CRC32 register using carry-less multiplication.
+ *
+ * Four 128-bit lanes are folded 64 bytes at a time, then folded into one lane, which is folded 16 bytes
+ * at a time. The remaining 128 bits are reduced to 32 bits with a Barrett reduction.
+ *
+ * @param crc The CRC32 register.
+ * @param data The data. Must be at least 64 bytes.
+ * @param length The length of the data. Must be a multiple of 16.
+ * @return The updated CRC32 register.
+ */
+uint32_t foldCRC32PCLMUL(uint32_t crc, const uint8_t* data, size_t length)
+{
+    const __m128i* p = reinterpret_cast<const __m128i*>(data);
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128(p), _mm_cvtsi32_si128(static_cast<int>(crc)));
+    __m128i x2 = _mm_loadu_si128(p + 1);
+    __m128i x3 = _mm_loadu_si128(p + 2);
+    __m128i x4 = _mm_loadu_si128(p + 3);
+    p += 4;
+    length -= 64;
+
+    // Fold 64 bytes at a time
+    __m128i constants = _mm_load_si128(reinterpret_cast<const __m128i*>(foldBy4Constants));
+    while (length >= 64) {
+        x1 = fold128(x1, constants, _mm_loadu_si128(p));
+        x2 = fold128(x2, constants, _mm_loadu_si128(p + 1));
+        x3 = fold128(x3, constants, _mm_loadu_si128(p + 2));
+        x4 = fold128(x4, constants, _mm_loadu_si128(p + 3));
+        p += 4;
+        length -= 64;
+    }
+
+    // Fold the four lanes into one
+    constants = _mm_load_si128(reinterpret_cast<const __m128i*>(foldBy1Constants));
+    x1 = fold128(x1, constants, x2);
+    x1 = fold128(x1, constants, x3);
+    x1 = fold128(x1, constants, x4);
+
+    // Fold 16 bytes at a time
+    while (length >= 16) {
+        x1 = fold128(x1, constants, _mm_loadu_si128(p));
+        p += 1;
+        length -= 16;
+    }
+
+    // Fold 128 bits to 64 bits
+    __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, constants, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    constants = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(foldTo32Constants));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), constants, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    constants = _mm_load_si128(reinterpret_cast<const __m128i*>(barrettConstants));
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), constants, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), constants, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#elif defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif
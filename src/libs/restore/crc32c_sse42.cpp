@@ -0,0 +1,63 @@
+#include "pch.h"
+#include "crc32_kernels.h"
+
+/*
+ * CRC32C with the SSE4.2 CRC32 instruction, which implements the Castagnoli polynomial 0x1edc6f41
+ * in hardware. Eight bytes are folded per instruction on x64 and four on x86.
+ *
+ * The kernel is compiled for SSE4.2 regardless of the compiler settings. It is only called when the
+ * CPU supports it.
+ */
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+#include <cstring>
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#elif defined(__clang__)
+#pragma clang attribute push(__attribute__((target("sse4.2"))), apply_to = function)
+#endif
+
+/**
+ * Updates a CRC32C register with the SSE4.2 CRC32 instruction.
+ *
+ * @param crc The CRC32C register.
+ * @param data The data.
+ * @param length The length of the data.
+ * @return The updated CRC32C register.
+ */
+uint32_t updateCRC32CSSE42(uint32_t crc, const uint8_t* data, size_t length)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    while (length >= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        length -= 4;
+    }
+    while (length--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#elif defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif
@@ -7,6 +7,17 @@
 #include <objbase.h>
 #include <winioctl.h>
 #include <chrono>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <sstream>
 #include "nlohmann\json.hpp"
-#include <random>
\ No newline at end of file
+#include <random>
+#include <set>
\ No newline at end of file
@@ -2,41 +2,53 @@
 //
 
 #include "pch.h"
-#include ".\zstd\zstd.h"
 #include "..\file_reader\file_reader.h"
 #include "..\file_operations\file_operations.h"
 #include "..\encryption\encryption.h"
 #include "crc32.h"
+#include "restore_plan.h"
 #include "restore.h"
 
+// The most decoded bytes held back while earlier blocks are decoded, for a sequential target
+static constexpr uint64_t SEQUENTIAL_REORDER_BYTES = 256 * 1024 * 1024;
+
+// The most decoded bytes queued for each target of a restore to several targets
+static constexpr uint64_t FAN_OUT_QUEUE_BYTES = 64 * 1024 * 1024;
+
 /**
- * Struct: EncryptionIVParams
- * These parameters are used to generate a unique Initialization Vector (IV) for each block of data to be encrypted.
- * Fields:
- * - imageid: A pointer to the image ID used in IV generation.
- * - disk: The disk number used in IV generation.
- * - partition: The partition number used in IV generation.
- * - index: The block index used in IV generation.
+ * @brief Recalculates the checksums of the GPT header in track 0 after its disk GUID changed.
+ *
+ * @param disk The disk, whose track 0 holds the header.
+ * @param gptHeader The GPT header in the disk's track 0.
  */
-struct EncryptionIVParams
+static void updateGPTChecksums(file_structs::Disk::DiskLayout& disk, gpt_header* gptHeader)
 {
-	const uint8_t* imageid;  // Pointer to the image ID
-	uint16_t disk_number;     // Disk number
-	uint16_t partition_number; // Partition number
-	uint32_t index;    // Block index
-	void Set(const file_structs::Header& header, const file_structs::Disk::DiskLayout& disk, const file_structs::Partition::PartitionLayout& partition, uint32_t _index) {
-		imageid = &header.imageid_binary[0];
-		disk_number = disk._header.disk_number;
-		partition_number = partition._header.partition_number;
-		index = _index;
+	uint16_t bytesPerSector = disk._geometry.bytes_per_sector;
+
+	// The partition entry array normally follows the header in track 0. The partition GUIDs are kept, as boot
+	// configurations and PARTUUID references name them, but the checksum is recalculated in case it was stale.
+	uint64_t entryArrayOffset = gptHeader->partition_entry_lba * bytesPerSector;
+	uint64_t entryArraySize = static_cast<uint64_t>(gptHeader->num_partition_entries) * gptHeader->sizeof_partition_entry;
+	if (gptHeader->sizeof_partition_entry >= sizeof(gpt_entry) && entryArrayOffset + entryArraySize <= disk.track0.size()) {
+		// The header holds the CRC32 checksum of the partition entry array, so it must be updated before the header checksum
+		gptHeader->partition_entry_array_crc32 = computeCRC32(disk.track0.data() + entryArrayOffset, static_cast<size_t>(entryArraySize));
 	}
-};
+
+	// Before calculating the new CRC32 checksum, the existing checksum in the header must be set to 0.
+	gptHeader->header_crc32 = 0;
+
+	// Calculate the CRC32 checksum for the GPT header and store it in the header.
+	// The checksum is calculated over the entire header, with the checksum field itself set to 0.
+	// GPT disks are not loaded if the checksum is incorrect.
+	gptHeader->header_crc32 = Calculate_CRC32((unsigned char*)gptHeader, gptHeader->header_size, sizeof(gpt_header));
+}
 
 /**
  * @brief Sets a new disk ID for the provided disk.
  *
  * This function checks if the disk format is GPT or MBR and sets a new unique identifier accordingly.
- * For GPT, it creates a new GUID and assigns it to the disk_guid field of the GPT header.
+ * For GPT, it creates a new GUID and assigns it to the disk_guid field of the GPT header, then recalculates the
+ * CRC32 checksums of the partition entry array and the header. The unique partition GUIDs are left unchanged.
  * For MBR, it generates a new disk ID by getting the current tick count and writes it into the boot code of the MBR.
  *
  * @param disk The disk for which to set a new ID.
@@ -57,13 +69,7 @@ void setNewDiskID(file_structs::Disk::DiskLayout& disk)
 			// Assign the new GUID to the disk
 			memcpy(&gptHeader->disk_guid, &newDiskGuid, sizeof(newDiskGuid));
 
-			// Before calculating the new CRC32 checksum, the existing checksum in the header must be set to 0.
-			gptHeader->header_crc32 = 0;
-
-			// Calculate the CRC32 checksum for the GPT header and store it in the header.
-			// The checksum is calculated over the entire header, with the checksum field itself set to 0.
-			// GPT disks are not loaded if the checksum is incorrect.
-			gptHeader->header_crc32 = Calculate_CRC32((unsigned char*)gptHeader, gptHeader->header_size, sizeof(gpt_header));
+			updateGPTChecksums(disk, gptHeader);
 		}
 	}
 	else {
@@ -81,231 +87,1089 @@ void setNewDiskID(file_structs::Disk::DiskLayout& disk)
 }
 
 /**
- * @brief Reads a block of data from a file, decrypts it if necessary, and decompresses it if it is compressed.
+ * @brief Gives a disk the disk ID of the restore a target already holds.
  *
- * @param fileHandle The handle to the file from which to read the block.
- * @param block The block to read.
- * @param isCompressed A flag indicating whether the block is compressed.
- * @return A unique_ptr to the read (and possibly decrypted and decompressed) data.
+ * A target brought up to date with `sync_from` is the same disk as before, so it keeps its ID, whether that was
+ * kept from the backup or set new by the earlier restore. The target's ID is copied into the disk's track 0.
+ *
+ * @param target The target, which holds an earlier restore of the disk.
+ * @param disk The disk to restore, whose track 0 is updated.
  */
-std::unique_ptr<unsigned char[]> readBlock(file_structs::fileLayout& backupLayout, const EncryptionIVParams & ivParams, std::fstream* fileHandle, DataBlockIndexElement& block)
+static void keepTargetDiskID(RestoreTarget& target, file_structs::Disk::DiskLayout& disk)
 {
-	if (block.block_length == 0) {
-		return nullptr;
+	std::vector<uint8_t> current(disk.track0.size());
+	target.readAt(0, current.data(), current.size());
+
+	if (disk._header.disk_format != ImageEnums::DiskFormat::eGPT) {
+		// The MBR disk ID is in the boot code
+		if (current.size() >= 444) {
+			memcpy(disk.track0.data() + 440, current.data() + 440, sizeof(uint32_t));
+		}
+		return;
+	}
+
+	uint16_t bytesPerSector = disk._geometry.bytes_per_sector;
+	if (current.size() < static_cast<size_t>(bytesPerSector) + sizeof(gpt_header)) {
+		return;
+	}
+	gpt_header* gptHeader = reinterpret_cast<gpt_header*>(disk.track0.data() + bytesPerSector);
+	const gpt_header* targetHeader = reinterpret_cast<const gpt_header*>(current.data() + bytesPerSector);
+	// A target without a GPT header where the backup has one keeps the backup's ID
+	if (targetHeader->signature != gptHeader->signature) {
+		return;
 	}
-	// Allocate a buffer to read the block
-	std::unique_ptr<unsigned char[]> readBuffer = std::make_unique<unsigned char[]>(block.block_length);
+	memcpy(&gptHeader->disk_guid, &targetHeader->disk_guid, sizeof(gptHeader->disk_guid));
+	updateGPTChecksums(disk, gptHeader);
+}
 
-	std::streamoff fileOffset = block.file_position;
-	setFilePointer(fileHandle, fileOffset, std::ios::beg);
-	readFile(fileHandle, readBuffer.get(), block.block_length);
-	if (backupLayout._encryption.aes_type != ImageEnums::AES::eNone) {
-		int aes_variant = backupLayout._encryption.getAESValue();
-		uint8_t iv[16];
-		formatInitializationVectorForAES(backupLayout._header.imageid_binary, ivParams.disk_number, ivParams.partition_number, ivParams.index, backupLayout._encryption.key_iterations, backupLayout._encryption.derived_key, iv);
-		decryptDataWithAESCBC(aes_variant, backupLayout._encryption.derived_key.data(), iv, readBuffer.get(), block.block_length);
+/**
+ * @brief Prepares a target for a disk and writes the disk structures to it.
+ *
+ * Sets the disk ID, sets the write-back policy of the target, sizes the target for the disk and writes the track0 data to it.
+ * If the disk format is MBR, also writes the extended partition and logical drive boot records.
+ *
+ * @param target The target the disk is restored to.
+ * @param disk The disk to restore.
+ * @param options The restore options. With `sync_from`, the disk keeps the ID the target already has.
+ */
+static void prepareDisk(RestoreTarget& target, file_structs::Disk::DiskLayout& disk, const RestoreOptions& options)
+{
+	// A target brought up to date keeps its ID. Otherwise a new disk ID prevents a disk collision. However, the disk ID
+	// should remain unchanged if the disk is bootable
+	if (!options.sync_from.empty()) {
+		keepTargetDiskID(target, disk);
+	}
+	else if (!options.keep_disk_id) {
+		setNewDiskID(disk);
+	}
+	// A journal records blocks once the target has been flushed, so its flushes must reach storage
+	WriteBackPolicy writeBack = options.write_back;
+	if (!options.journal_path.empty() && writeBack.durability == Durability::eNone) {
+		writeBack.durability = Durability::eFinalFlush;
 	}
-	if (backupLayout._compression.compression_level != ImageEnums::CompressionType::eNone) {
-		// Get the size of the compressed block
-		auto compressedsize = ZSTD_findFrameCompressedSize(readBuffer.get(), block.block_length);
-		// Get the size of the decompressed block
-		auto decompressedsize = ZSTD_getFrameContentSize(readBuffer.get(), block.block_length);
-		// Allocate a buffer for the decompressed data
-		std::unique_ptr<unsigned char[]> decompressedBuffer = std::make_unique<unsigned char[]>(decompressedsize);
+	target.setWriteBack(writeBack);
 
-		// Decompress the block
-		auto zout = ZSTD_decompress(decompressedBuffer.get(), (size_t)decompressedsize, readBuffer.get(), compressedsize);
+	// Size the target for the disk and write the track0 data to it
+	target.prepare(disk._geometry.disk_size);
+	target.writeAt(0, disk.track0.data(), disk.track0.size());
 
-		// If decompression failed, throw an exception
-		if (ZSTD_isError(zout)) {
-			throw std::runtime_error("Failed to decompress block.");
+	// If the disk format is MBR, restore the extended partition and logical drive boot records.
+	// A sequential target takes them between the blocks instead, in disk order.
+	if (disk._header.disk_format == ImageEnums::DiskFormat::eMBR && !target.isSequential()) {
+		for (auto& extendedPartition : disk.extendedPartitions) {
+			target.writeAt(extendedPartition.offset, &extendedPartition.partitionSector, sizeof(extendedPartition.partitionSector));
 		}
+	}
+}
 
-		// Update the block length to the decompressed size
-		block.block_length = static_cast<uint32_t>(decompressedsize);
+/**
+ * @brief Returns true if a block can be written to a target as its stored zstd frame.
+ *
+ * @param target The target the block is written to.
+ * @param block The block.
+ */
+static bool canKeepCompressed(const RestoreTarget& target, const BlockRef& block)
+{
+	return target.canWriteCompressed(block.disk_offset, block.write_limit);
+}
 
-		// Compute the MD5 hash of the decompressed data
-		auto computedHash = computeMD5Hash(decompressedBuffer.get(), decompressedsize);
+/**
+ * @brief Returns true if a block is stored in its backup file exactly as it is written to the disk.
+ *
+ * @param block The block.
+ */
+static bool isStoredAsWritten(const BlockRef& block)
+{
+	const file_structs::fileLayout& layout = *block.layout;
+	return layout._compression.compression_level == ImageEnums::CompressionType::eNone && layout._encryption.aes_type == ImageEnums::AES::eNone
+		&& block.write_limit <= block.element->block_length;
+}
 
-		// If the computed hash does not match the expected hash, throw an exception
-		if (memcmp(computedHash.data(), block.md5_hash, sizeof(block.md5_hash)) != 0) {
-			throw std::runtime_error("Block hash mismatch.");
-		}
+/**
+ * @brief Writes the extended partition and logical drive boot records that come before an offset to a sequential target.
+ *
+ * @param target The target the disk is restored to.
+ * @param disk The disk to restore, with its extended partitions sorted by offset.
+ * @param next The index of the next boot record to write. Updated as the records are written.
+ * @param offset The offset the boot records must come before.
+ */
+static void writeBootRecordsBefore(RestoreTarget& target, const file_structs::Disk::DiskLayout& disk, size_t& next, uint64_t offset)
+{
+	if (disk._header.disk_format != ImageEnums::DiskFormat::eMBR) {
+		return;
+	}
+	for (; next < disk.extendedPartitions.size() && disk.extendedPartitions[next].offset < offset; ++next) {
+		const ExtendedPartition& extendedPartition = disk.extendedPartitions[next];
+		target.writeAt(extendedPartition.offset, &extendedPartition.partitionSector, sizeof(extendedPartition.partitionSector));
+	}
+}
 
-		// Replace the read buffer with the decompressed data
-		readBuffer = std::move(decompressedBuffer);
+/**
+ * @brief Writes a decoded block to its offset on a target.
+ *
+ * @param target The target the block is written to.
+ * @param block The block.
+ * @param decoded The decoded block, or its zstd frame if the block was kept compressed. A block decoded in place is already
+ *                in the target, and is only reported to it as written.
+ */
+static void writeBlock(RestoreTarget& target, const BlockRef& block, const DecodedBlock& decoded)
+{
+	if (decoded.in_place) {
+		target.commitWrite(block.disk_offset, std::min<size_t>(decoded.length, block.write_limit));
+		return;
+	}
+	if (decoded.compressed) {
+		target.writeCompressedAt(block.disk_offset, decoded.data, decoded.length);
+	}
+	else {
+		target.writeAt(block.disk_offset, decoded.data, std::min<size_t>(decoded.length, block.write_limit));
 	}
-	// Return the read (and possibly decompressed) data
-	return readBuffer;
 }
 
+/**
+ * @brief Returns the header of the backup a target already holds, after checking it is an earlier backup of the same disk.
+ *
+ * @param syncFrom The path of the backup file the target holds.
+ * @param password The password for the backup file.
+ * @param backupLayout The layout of the backup being restored.
+ * @param disk The disk being restored.
+ * @param diskNumber The disk number to restore. -1 for the first disk.
+ * @return The header of the backup file.
+ * @throws std::runtime_error if the file is not an earlier backup of the same backup set, or the size of the disk or the
+ *         placement of its partitions changed.
+ */
+static file_structs::Header getSyncHeader(const std::wstring& syncFrom, const std::string& password, const file_structs::fileLayout& backupLayout,
+	const file_structs::Disk::DiskLayout& disk, int diskNumber)
+{
+	file_structs::fileLayout syncLayout;
+	readBackupFile(syncFrom, syncLayout, password, false);
+	if (syncLayout._header.imageid != backupLayout._header.imageid || syncLayout._header.increment_number > backupLayout._header.increment_number) {
+		throw std::runtime_error("The backup the target holds is not an earlier backup of the same backup set.");
+	}
+
+	file_structs::Disk::DiskLayout syncDisk;
+	getDiskToRestoreFromDiskNumber(syncLayout, diskNumber, syncDisk);
+	if (syncDisk._geometry.disk_size != disk._geometry.disk_size) {
+		throw std::runtime_error("The size of the disk changed after the backup the target holds.");
+	}
+	// An unchanged block is only where the target holds it if its partition did not move
+	if (!haveSameBlockPlacement(syncDisk, disk)) {
+		throw std::runtime_error("The partitions of the disk changed after the backup the target holds.");
+	}
+	return syncLayout._header;
+}
 
 /**
- * @brief Calculates the total size of the backup.
+ * @brief Restores a disk from a backup file.
  *
- * This function calculates the total size of the backup by summing up the lengths of all data blocks and reserved sector blocks in all partitions of all disks in the backup layout.
+ * This function performs the following steps:
+ * 1. Reads the backup file layout.
+ * 2. Creates a backup set, which includes building an index and creating a map of file sources.
+ * 3. Selects the disk for restoration based on the provided disk number.
+ * 4. Optionally sets a new disk ID to prevent a disk collision. With `sync_from`, the target keeps its disk ID.
+ * 5. Prepares the target for the size of the disk and writes the track0 data to it.
+ * 6. If the disk format is MBR, restores the extended partition and logical drive boot records.
+ * 7. Plans the block reads for the disk in backup file order, or in disk order for a sequential target.
+ * 8. Reads, decodes and hash checks the blocks on all cores, and writes each block to its offset on the target.
+ *    A target that stores zstd frames, such as a qcow2 image, takes whole compressed blocks without them being decompressed.
+ *    A sequential target, such as a seekable zstd file or a stream to standard output, is passed the blocks one at a time in disk order.
+ *    With `kernel_copy`, a target that can copy from the backup file copies the blocks that are stored as they are written.
+ *    A target with memory behind it, such as a mapped image file, has the blocks decoded straight into that memory.
+ *    With `skip_unchanged`, blocks whose data on the target already matches their hash are left as they are.
+ *    With `sync_from`, only the blocks held by files written after that backup are restored.
+ *    With a journal, the blocks written are checkpointed, and when resuming, the blocks in the journal are skipped.
+ *    With `continue_on_error`, a block that cannot be read or decoded is zeroed on the target and listed.
+ * 9. Outputs the progress of the restoration process.
+ * 10. Flushes the target.
  *
- * @param fileLayout The layout of the backup.
- * @return The total size of the backup in bytes.
+ * @param filePath The path to the backup file.
+ * @param password The password for the backup file.
+ * @param target The target the disk is restored to.
+ * @param options The disk to restore, whether to keep the disk ID, the number of worker threads, whether to copy blocks in the kernel,
+ *                whether to skip unchanged blocks, the backup the target already holds, the journal and whether to carry on past bad blocks.
+ * @param outputProgress A callback function to output the progress of the restoration process. Default is nullptr.
+ * @return The blocks that could not be read or decoded, in disk order.
+ * @throws std::invalid_argument if `skip_unchanged` or `sync_from` is set and the target cannot be read back, is sequential or was not opened
+ *                               with its data kept, a journal is set and the target is sequential, or `resume` is set and the target was not
+ *                               opened with its data kept.
+ * @throws std::runtime_error if `sync_from` is not an earlier backup of the same disk or the backup set does not show where it is in its chain, the journal is for another restore or target, a block cannot be written,
+ *                            or a block cannot be read or decoded and `continue_on_error` is not set.
  */
-uint64_t calculateTotalBytes(file_structs::fileLayout& fileLayout)
+std::vector<BadBlock> restoreDisk(const std::wstring& filePath, const std::string& password, RestoreTarget& target, const RestoreOptions& options, ProgressCallback outputProgress/*= nullptr*/)
 {
-	uint64_t totalBytes = 0;
-	for (auto& disk : fileLayout.disks) {
-		for (auto& partition : disk.partitions) {
-			totalBytes += partition._file_system.reserved_sectors_byte_length;
-			for (auto& block : partition.data_blocks) {
-				if (block.block_length)
-					totalBytes += partition._header.block_size;
+	// Both build on an earlier restore, so the target must still hold it
+	if ((options.skip_unchanged || !options.sync_from.empty()) && (!target.isReadable() || target.isSequential() || !target.keepsData())) {
+		throw std::invalid_argument("Only a target opened with its data kept, that can be read back, can be brought up to date in place.");
+	}
+	if (!options.journal_path.empty() && target.isSequential()) {
+		throw std::invalid_argument("A restore to a sequential target cannot be resumed.");
+	}
+	// The blocks in the journal are only still there if the target was not truncated or discarded when it was opened
+	if (options.resume && !target.keepsData()) {
+		throw std::invalid_argument("A restore can only be resumed on a target opened with its data kept.");
+	}
+
+	BackupSet backupSet;
+	{
+		file_structs::fileLayout backupLayout;
+		readBackupFile(filePath, backupLayout, password);
+
+		// Read the backup set, build the index and create a map of file sources 
+		createBackupSet(backupSet, filePath, password, backupLayout._header.imageid);
+	}
+	// Get the backup layout for the first file in the backup set.
+	// This is the layout of the backup file to restore with the index built from the backup set.
+	file_structs::fileLayout& backupLayout = backupSet.getBackupFileWithFullIndex();
+
+	// Select the disk for restoration based on the provided disk number
+	// diskNumber is -1 if not supplied
+	int diskNumber = options.disk_number;
+	file_structs::Disk::DiskLayout diskToRestore;
+	getDiskToRestoreFromDiskNumber(backupLayout, diskNumber, diskToRestore);
+
+	// The earlier backup is checked before anything is written to the target
+	file_structs::Header syncHeader;
+	if (!options.sync_from.empty()) {
+		syncHeader = getSyncHeader(options.sync_from, password, backupLayout, diskToRestore, options.disk_number);
+	}
+
+	prepareDisk(target, diskToRestore, options);
+
+	// Read the blocks in backup file order rather than disk order. A seekable target takes the
+	// blocks as soon as they are decoded.
+	RestorePlan plan = planDiskRestore(backupLayout, diskToRestore, backupSet);
+	if (!options.sync_from.empty()) {
+		// The target already holds the earlier backup, so only the blocks that changed after it are restored
+		keepBlocksChangedSince(plan, backupSet, syncHeader);
+	}
+
+	// The journal is tied to this backup, disk and disk size. A resumed restore skips the blocks it lists.
+	std::unique_ptr<RestoreJournal> journal;
+	if (!options.journal_path.empty()) {
+		std::string identity = backupLayout._header.imageid + "/" + std::to_string(backupLayout._header.file_number) + "/"
+			+ std::to_string(diskToRestore._header.disk_number) + "/" + std::to_string(diskToRestore._geometry.disk_size);
+		journal = std::make_unique<RestoreJournal>(options.journal_path, target, identity, options.journal_interval);
+		if (options.resume && journal->load()) {
+			plan.blocks.erase(std::remove_if(plan.blocks.begin(), plan.blocks.end(), [&](const BlockRef& block) {
+				return journal->isComplete(block);
+			}), plan.blocks.end());
+		}
+	}
+
+	PipelineOptions pipelineOptions;
+	pipelineOptions.thread_count = options.thread_count;
+	pipelineOptions.hash_check = journal ? HashCheck::eInline : options.hash_check;
+	pipelineOptions.hash_sample = options.hash_sample;
+	pipelineOptions.read_ahead_bytes = options.read_ahead_bytes;
+	pipelineOptions.drop_behind = options.drop_behind;
+	pipelineOptions.read_limit = options.limiters ? &options.limiters->reads : &RateLimiter::globalReads();
+	pipelineOptions.write_limit = options.limiters ? &options.limiters->writes : &RateLimiter::globalWrites();
+	pipelineOptions.autotune = options.autotune;
+	// A target that stores zstd frames takes whole blocks as they are, without them being decompressed
+	pipelineOptions.keep_compressed = [&](const BlockRef& block) { return canKeepCompressed(target, block); };
+	// A target with memory behind it, such as a mapped image file, has the blocks decoded straight into it
+	pipelineOptions.write_pointer = [&](const BlockRef& block) { return target.getWritePointer(block.disk_offset, block.write_limit); };
+	if (options.kernel_copy) {
+		// A block stored as it is written can be cloned or copied by the file system without being read into memory
+		pipelineOptions.copy_block = [&](const BlockRef& block) {
+			return isStoredAsWritten(block) && target.copyFrom(*block.source, block.element->file_position, block.disk_offset, block.write_limit);
+		};
+	}
+	if (options.skip_unchanged) {
+		// A block already on the target, from an earlier restore of the same disk, is checked against its hash rather than written again
+		pipelineOptions.read_current = [&](const BlockRef& block, uint8_t* buffer) {
+			target.readAt(block.disk_offset, buffer, block.write_limit);
+		};
+	}
+
+	// Blocks never overlap, so the workers write to the target concurrently
+	BlockSink sink = [&](const BlockRef& block, const DecodedBlock& decoded) {
+		writeBlock(target, block, decoded);
+	};
+	if (journal) {
+		sink = [&](const BlockRef& block, const DecodedBlock& decoded) {
+			journal->write(block, [&]() { writeBlock(target, block, decoded); });
+		};
+	}
+
+	// A sequential target is written from start to end, so the blocks are read in disk order and passed
+	// on one at a time, with the boot records of the logical drives in their place between them
+	size_t nextBootRecord = 0;
+	if (target.isSequential()) {
+		std::sort(plan.blocks.begin(), plan.blocks.end(), [](const BlockRef& a, const BlockRef& b) {
+			return a.disk_offset < b.disk_offset;
+		});
+		std::sort(diskToRestore.extendedPartitions.begin(), diskToRestore.extendedPartitions.end(), [](const ExtendedPartition& a, const ExtendedPartition& b) {
+			return a.offset < b.offset;
+		});
+		pipelineOptions.reorder_bytes = SEQUENTIAL_REORDER_BYTES;
+		sink = [&](const BlockRef& block, const DecodedBlock& decoded) {
+			writeBootRecordsBefore(target, diskToRestore, nextBootRecord, block.disk_offset);
+			writeBlock(target, block, decoded);
+		};
+	}
+
+	// Any bad block stops the restore, unless what can be restored is salvaged. The place of a bad block is
+	// zeroed, so it holds no stale or partly decoded data, and the block is listed.
+	std::vector<BadBlock> badBlocks;
+	std::mutex badBlockMutex;
+	BlockErrorHandler onError;
+	if (options.continue_on_error) {
+		onError = [&](const BlockRef& block, const std::string& error) {
+			if (target.isSequential()) {
+				writeBootRecordsBefore(target, diskToRestore, nextBootRecord, block.disk_offset);
+			}
+			target.zeroRange(block.disk_offset, block.write_limit);
+			BadBlock badBlock = describeBadBlock(block, error);
+			std::lock_guard<std::mutex> lock(badBlockMutex);
+			badBlocks.push_back(std::move(badBlock));
+		};
+	}
+
+	try {
+		runBlockPipeline(plan.blocks, pipelineOptions, sink, onError, outputProgress);
+	}
+	catch (...) {
+		if (journal) {
+			// Keep the blocks written so far for a resumed restore. The target may be what failed.
+			try {
+				journal->checkpoint();
+			}
+			catch (const std::exception&) {
 			}
 		}
+		throw;
+	}
+	if (target.isSequential()) {
+		writeBootRecordsBefore(target, diskToRestore, nextBootRecord, UINT64_MAX);
+	}
+	target.flush();
+	if (journal) {
+		journal->remove();
 	}
-	return totalBytes;
+
+	std::sort(badBlocks.begin(), badBlocks.end(), [](const BadBlock& a, const BadBlock& b) {
+		return a.disk_lba < b.disk_lba;
+	});
+	return badBlocks;
 }
 
+/**
+ * @brief Restores a disk as a chain of targets that mirrors the incremental chain of a backup set.
+ *
+ * This function performs the following steps:
+ * 1. Creates the backup set for the newest backup file.
+ * 2. Lists the files of the chain, oldest first. Split files hold no index, so their blocks are listed by the file that indexes them.
+ * 3. Opens a target for each file and writes the disk structures of the file to it.
+ * 4. Lists the blocks of each file: every block for the oldest file, and for the others only the blocks stored in the file.
+ * 5. Reads, decodes and hash checks all the blocks in one pass, in backup file order, and writes each block to its own target.
+ * 6. Flushes the targets, oldest first, so each is complete before the target that links to it.
+ *
+ * @param filePath The path to the newest backup file of the chain to restore.
+ * @param password The password for the backup files.
+ * @param options The disk to restore, whether to keep the disk ID and the number of worker threads.
+ * @param openTarget Opens the target for each file of the chain.
+ * @param outputProgress A callback function to output the progress of the restoration process. Default is nullptr.
+ * @throws std::invalid_argument if a target is sequential, or `continue_on_error` is set.
+ * @throws std::runtime_error if the oldest file is not a full backup, the disk size or its partitions changed along the chain, or a block cannot be read, decoded or written.
+ */
+void restoreChain(const std::wstring& filePath, const std::string& password, const RestoreOptions& options, const ChainTargetFactory& openTarget, ProgressCallback outputProgress/*= nullptr*/)
+{
+	// Bad blocks are only zeroed and listed by restoreDisk
+	if (options.continue_on_error) {
+		throw std::invalid_argument("restoreChain - a chain cannot be salvaged");
+	}
 
+	BackupSet backupSet;
+	{
+		file_structs::fileLayout backupLayout;
+		readBackupFile(filePath, backupLayout, password);
+		createBackupSet(backupSet, filePath, password, backupLayout._header.imageid);
+	}
+
+	// The layouts are newest first. Split files are parts of the file that indexes them, so they are not links of the chain.
+	std::vector<const file_structs::fileLayout*> chain;
+	for (auto layout = backupSet.fileLayouts.rbegin(); layout != backupSet.fileLayouts.rend(); ++layout) {
+		if (!(*layout)->_header.split_file) {
+			chain.push_back(layout->get());
+		}
+	}
+	if (chain.empty() || chain.front()->_header.delta_index) {
+		throw std::runtime_error("restoreChain - the oldest backup file is not a full backup");
+	}
+
+	// The blocks point into the disk layouts, so the vector must not reallocate
+	std::vector<file_structs::Disk::DiskLayout> disks;
+	disks.reserve(chain.size());
+	std::vector<SharedTarget> targets;
+	std::vector<BlockRef> blocks;
+	for (size_t link = 0; link < chain.size(); ++link) {
+		const file_structs::fileLayout& layout = *chain[link];
+		bool base = link == 0;
+
+		int diskNumber = options.disk_number;
+		disks.emplace_back();
+		file_structs::Disk::DiskLayout& disk = disks.back();
+		getDiskToRestoreFromDiskNumber(layout, diskNumber, disk);
+		if (!base && disk._geometry.disk_size != disks.front()._geometry.disk_size) {
+			throw std::runtime_error("restoreChain - the disk size changed along the backup chain");
+		}
+		// Each link only holds the blocks that changed, so the unchanged blocks must be where the link before put them
+		if (!base && !haveSameBlockPlacement(disks[disks.size() - 2], disk)) {
+			throw std::runtime_error("restoreChain - the partitions of the disk changed along the backup chain");
+		}
+
+		targets.push_back(openTarget(layout, backupSet.getSource(layout._header.file_number)->getName(), base));
+		if (targets.back()->isSequential()) {
+			throw std::invalid_argument("restoreChain - the blocks of a chain cannot be written to a sequential target");
+		}
+		prepareDisk(*targets.back(), disk, options);
+
+		std::vector<BlockRef> linkBlocks;
+		for (const auto& partition : disk.partitions) {
+			appendPartitionBlocks(layout, disk, partition, backupSet, true, linkBlocks);
+		}
+		// A file with a full index also lists the unchanged blocks written by older files, which the links before it already hold
+		if (!base) {
+			keepBlocksChangedSince(linkBlocks, backupSet, chain[link - 1]->_header);
+		}
+		for (auto& block : linkBlocks) {
+			block.target_index = static_cast<uint32_t>(link);
+		}
+		blocks.insert(blocks.end(), linkBlocks.begin(), linkBlocks.end());
+	}
 
+	sortBlocksByFilePosition(blocks);
+
+	PipelineOptions pipelineOptions;
+	pipelineOptions.thread_count = options.thread_count;
+	pipelineOptions.hash_check = options.hash_check;
+	pipelineOptions.hash_sample = options.hash_sample;
+	pipelineOptions.read_ahead_bytes = options.read_ahead_bytes;
+	pipelineOptions.drop_behind = options.drop_behind;
+	pipelineOptions.read_limit = options.limiters ? &options.limiters->reads : &RateLimiter::globalReads();
+	pipelineOptions.write_limit = options.limiters ? &options.limiters->writes : &RateLimiter::globalWrites();
+	pipelineOptions.autotune = options.autotune;
+	pipelineOptions.keep_compressed = [&](const BlockRef& block) { return canKeepCompressed(*targets[block.target_index], block); };
+	pipelineOptions.write_pointer = [&](const BlockRef& block) { return targets[block.target_index]->getWritePointer(block.disk_offset, block.write_limit); };
+
+	// Blocks never overlap within a target, so the workers write to the targets concurrently
+	BlockSink sink = [&](const BlockRef& block, const DecodedBlock& decoded) {
+		writeBlock(*targets[block.target_index], block, decoded);
+	};
+
+	// Any bad block stops the restore
+	runBlockPipeline(blocks, pipelineOptions, sink, nullptr, outputProgress);
+	for (auto& target : targets) {
+		target->flush();
+	}
+}
 
 /**
- * @brief Restores a disk from a backup file.
+ * @brief Restores every disk of a backup file at the same time, each to its own target.
  *
  * This function performs the following steps:
- * 1. Opens the target disk file.
- * 2. Reads the backup file layout.
- * 3. Creates a backup set, which includes building an index and creating a map of file handles.
- * 4. Calculates the total size of the backup.
- * 5. Sets the file pointer to the beginning of the backup file.
- * 6. Selects the disk for restoration based on the provided disk number.
- * 7. Optionally sets a new disk ID to prevent a disk collision.
- * 8. Writes the track0 data to the target disk.
- * 9. If the disk format is MBR, restores the extended partition and logical drive boot records.
- * 10. Loops through each partition in the disk to restore.
- * 11. For each partition, writes FAT32 reserved sectors to the target disk.
- * 12. Loops through each data block in the partition.
- * 13. For each data block, reads the block data from the backup file.
- * 14. Writes the block data to the target disk.
- * 15. Outputs the progress of the restoration process.
+ * 1. Creates the backup set for the backup file.
+ * 2. Opens a target for each disk and writes the disk structures to it.
+ * 3. Plans the block reads of each disk in backup file order.
+ * 4. Merges the plans so the batches take turns between the disks.
+ * 5. Reads, decodes and hash checks all the blocks in one pass, and writes each block to the target of its disk.
+ * 6. Flushes the targets.
  *
  * @param filePath The path to the backup file.
  * @param password The password for the backup file.
- * @param targetDiskHandle The handle to the target disk where the backup is being restored.
- * @param diskNumber The user provided disk number to restore. -1 if not supplied.
- * @param keepDiskId A flag indicating whether to keep the disk ID the same or set a new one.
+ * @param options Whether to keep the disk IDs, the number of worker threads, whether to copy blocks in the kernel and whether to skip unchanged blocks.
+ * @param openTarget Opens the target for each disk.
  * @param outputProgress A callback function to output the progress of the restoration process. Default is nullptr.
+ * @throws std::invalid_argument if a target is sequential, `skip_unchanged` is set and a target cannot be read back or was not opened with its data kept,
+ *                               or `sync_from`, a journal or `continue_on_error` is set.
+ * @throws std::runtime_error if a block cannot be read, decoded or written.
  */
-void restoreDisk(const std::wstring& filePath, const std::string& password,const std::wstring targetDisk, int diskNumber, bool keepDiskId, ProgressCallback outputProgress/*= nullptr*/)
+void restoreAllDisks(const std::wstring& filePath, const std::string& password, const RestoreOptions& options, const DiskTargetFactory& openTarget, ProgressCallback outputProgress/*= nullptr*/)
 {
-	auto targetDiskFileStream = openFileWithGuard(targetDisk, false);
-	auto targetDiskHandle = targetDiskFileStream.get();
+	if (!options.sync_from.empty() || !options.journal_path.empty()) {
+		throw std::invalid_argument("restoreAllDisks - a restore of all disks cannot be brought up to date or resumed");
+	}
+	// Bad blocks are only zeroed and listed by restoreDisk
+	if (options.continue_on_error) {
+		throw std::invalid_argument("restoreAllDisks - a restore of all disks cannot be salvaged");
+	}
+
 	BackupSet backupSet;
 	{
 		file_structs::fileLayout backupLayout;
 		readBackupFile(filePath, backupLayout, password);
-
-		// Read the backup set, build the index and create a map of file handles 
 		createBackupSet(backupSet, filePath, password, backupLayout._header.imageid);
 	}
-	// Get the backup layout for the first file in the backup set.
-	// This is the layout of the backup file to restore with the index built from the backup set.
 	file_structs::fileLayout& backupLayout = backupSet.getBackupFileWithFullIndex();
 
-	// Get the backup file handle from the backup set
-	std::fstream* backupFileHandle = backupSet.getFileHandle(backupLayout._header.file_number);
+	// The blocks point into the disk layouts, so the vector must not reallocate
+	std::vector<file_structs::Disk::DiskLayout> disks = backupLayout.disks;
+	std::vector<SharedTarget> targets;
+	std::vector<std::vector<BlockRef>> diskBlocks(disks.size());
+	for (size_t index = 0; index < disks.size(); ++index) {
+		file_structs::Disk::DiskLayout& disk = disks[index];
+		targets.push_back(openTarget(disk));
+		if (targets.back()->isSequential()) {
+			throw std::invalid_argument("restoreAllDisks - the disks cannot be written to a sequential target");
+		}
+		if (options.skip_unchanged && (!targets.back()->isReadable() || !targets.back()->keepsData())) {
+			throw std::invalid_argument("restoreAllDisks - unchanged blocks can only be skipped on a target opened with its data kept, that can be read back");
+		}
+		prepareDisk(*targets.back(), disk, options);
 
-	// Calculate the total size of the backup
-	auto totalBackupSize = calculateTotalBytes(backupLayout);
+		RestorePlan plan = planDiskRestore(backupLayout, disk, backupSet);
+		for (auto& block : plan.blocks) {
+			block.target_index = static_cast<uint32_t>(index);
+		}
+		diskBlocks[index] = std::move(plan.blocks);
+	}
 
-	uint64_t bytesProcessed = 0;
-	std::streamoff  fileOffset = 0;
+	PipelineOptions pipelineOptions;
+	pipelineOptions.thread_count = options.thread_count;
+	pipelineOptions.hash_check = options.hash_check;
+	pipelineOptions.hash_sample = options.hash_sample;
+	pipelineOptions.read_ahead_bytes = options.read_ahead_bytes;
+	pipelineOptions.drop_behind = options.drop_behind;
+	pipelineOptions.read_limit = options.limiters ? &options.limiters->reads : &RateLimiter::globalReads();
+	pipelineOptions.write_limit = options.limiters ? &options.limiters->writes : &RateLimiter::globalWrites();
+	pipelineOptions.autotune = options.autotune;
+	pipelineOptions.keep_compressed = [&](const BlockRef& block) { return canKeepCompressed(*targets[block.target_index], block); };
+	pipelineOptions.write_pointer = [&](const BlockRef& block) { return targets[block.target_index]->getWritePointer(block.disk_offset, block.write_limit); };
+	if (options.kernel_copy) {
+		pipelineOptions.copy_block = [&](const BlockRef& block) {
+			return isStoredAsWritten(block) && targets[block.target_index]->copyFrom(*block.source, block.element->file_position, block.disk_offset, block.write_limit);
+		};
+	}
+	if (options.skip_unchanged) {
+		pipelineOptions.read_current = [&](const BlockRef& block, uint8_t* buffer) {
+			targets[block.target_index]->readAt(block.disk_offset, buffer, block.write_limit);
+		};
+	}
 
-	// Set the file pointer to the beginning of the backup file
-	setFilePointer(backupFileHandle, fileOffset, std::ios::beg);
+	// Each batch is the size of a turn, so consecutive batches go to different disks
+	std::vector<BlockRef> blocks = interleaveDisks(diskBlocks, pipelineOptions.batch_bytes);
+	diskBlocks.clear();
 
-	// Select the disk for restoration based on the provided disk number
-	// diskNumber is -1 if not supplied
-	file_structs::Disk::DiskLayout diskToRestore;
-	getDiskToRestoreFromDiskNumber(backupLayout, diskNumber, diskToRestore);
+	// Blocks never overlap within a target, so the workers write to the targets concurrently
+	BlockSink sink = [&](const BlockRef& block, const DecodedBlock& decoded) {
+		writeBlock(*targets[block.target_index], block, decoded);
+	};
 
-	// A new disk ID prevents a disk collision. However, the disk ID should remain unchanged if the disk is bootable
-	if (!keepDiskId) {
-		setNewDiskID(diskToRestore);
-	}
-	// Write the track0 data to the target disk
-	writeFile(targetDiskHandle, diskToRestore.track0.data(), (uint32_t)diskToRestore.track0.size());
-
-	// If the disk format is MBR, restore the extended partition and logical drive boot records
-	if (diskToRestore._header.disk_format == ImageEnums::DiskFormat::eMBR) {
-		for (auto& extendedPartition : diskToRestore.extendedPartitions) {
-			fileOffset = extendedPartition.offset;
-			setFilePointer(targetDiskHandle, fileOffset, std::ios::beg);
-			writeFile(targetDiskHandle, &extendedPartition.partitionSector, sizeof(extendedPartition.partitionSector));
-		}
-	}
-
-	// Record the time when the restoration process starts
-	auto lastUpdateTime = std::chrono::steady_clock::now();
-
-	// Loop through each partition in the disk to restore
-	for (auto& partition : diskToRestore.partitions) {
-		fileOffset = partition._geometry.start + partition._geometry.boot_sector_offset;
-		setFilePointer(targetDiskHandle, fileOffset, std::ios::beg);
-
-		// write  FAT32 reserved sectors to the target disk
-		if (partition._file_system.reserved_sectors_byte_length > 0) {
-			// Loop through each reserved sector block in the partition
-			auto totalBytesToWrite = partition._file_system.reserved_sectors_byte_length;
-			uint32_t bytesWritten = 0;
-			int index = 0;
-			for (auto& reservedSectorBlock : partition.reserved_sectors_blocks) {
-				// If encryption is enabled, set the Initialization Vector (IV) parameters
-				EncryptionIVParams ivParams;
-				if (backupLayout._encryption.aes_type != ImageEnums::AES::eNone) {
-					ivParams.Set(backupLayout._header, diskToRestore, partition, index++);
-				}
-				// Read the block data from the backup file
-				auto blockData = readBlock(backupLayout, ivParams, backupSet.getFileHandle(reservedSectorBlock.file_number), reservedSectorBlock);
-				if (blockData != nullptr) {
-					// Calculate the amount of data to write
-					uint32_t bytesToWrite = min(reservedSectorBlock.block_length, totalBytesToWrite - bytesWritten);
-					// Write the block data to the target disk
-					writeFile(targetDiskHandle, blockData.get(), bytesToWrite);
-					bytesWritten += bytesToWrite;
+	// Any bad block stops the restore
+	runBlockPipeline(blocks, pipelineOptions, sink, nullptr, outputProgress);
+	for (auto& target : targets) {
+		target->flush();
+	}
+}
+
+/**
+ * @struct QueuedBlock
+ * @brief A decoded block copied out of the pipeline, shared by the queues of every target it is written to.
+ */
+struct QueuedBlock
+{
+	BlockRef block;
+	std::vector<uint8_t> data;
+	bool compressed = false;
+};
+
+/**
+ * @class TargetWriter
+ * @brief The blocks waiting to be written to one target of a restore to several targets, and the thread that writes them.
+ *
+ * The queue is bounded by the bytes it holds. A slow target holds back the decode only once its queue is
+ * full, and the other targets are written at their own speed meanwhile. A target that fails drops its
+ * queue and takes no more blocks.
+ */
+class TargetWriter {
+public:
+	/**
+	 * @param target The target.
+	 * @param onProgress Called on the writer thread after each block is written and when the target is flushed, with false,
+	 *                   and when the target fails, with true to report it at once.
+	 */
+	TargetWriter(RestoreTarget& target, std::function<void(bool failed)> onProgress) : target(target), onProgress(std::move(onProgress)) {}
+
+	TargetWriter(const TargetWriter&) = delete;
+	TargetWriter& operator=(const TargetWriter&) = delete;
+
+	~TargetWriter()
+	{
+		finish(false);
+	}
+
+	/**
+	 * @brief Starts the writer thread.
+	 */
+	void start()
+	{
+		thread = std::thread([this]() { run(); });
+	}
+
+	/**
+	 * @brief Queues a block, waiting while the queue is full. A block for a failed target is dropped.
+	 */
+	void push(const std::shared_ptr<const QueuedBlock>& queued)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		// A block larger than the queue is taken once the queue is empty
+		spaceAvailable.wait(lock, [&]() { return failed || queuedBytes == 0 || queuedBytes + queued->data.size() <= FAN_OUT_QUEUE_BYTES; });
+		if (failed) {
+			return;
+		}
+		queue.push_back(queued);
+		queuedBytes += queued->data.size();
+		blockAvailable.notify_one();
+	}
+
+	/**
+	 * @brief Ends the queue and waits for the writer thread.
+	 *
+	 * @param complete True to write the queued blocks and flush the target. False to drop them, when the restore has failed.
+	 */
+	void finish(bool complete)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+			if (!complete) {
+				queue.clear();
+			}
+			flushAtEnd = complete;
+			blockAvailable.notify_all();
+		}
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	/**
+	 * @brief Marks the target as failed and drops its queue.
+	 */
+	void fail(const std::string& reason)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (failed) {
+				return;
+			}
+			failed = true;
+			error = reason;
+			queue.clear();
+			queuedBytes = 0;
+			spaceAvailable.notify_all();
+			blockAvailable.notify_all();
+		}
+		onProgress(true);
+	}
+
+	/**
+	 * @brief Returns the bytes written so far, and why the target failed.
+	 */
+	FanOutResult getResult() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		FanOutResult result;
+		result.bytes_written = bytesWritten;
+		result.error = error;
+		return result;
+	}
+
+	bool hasFailed() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return failed;
+	}
+
+private:
+	void run()
+	{
+		for (;;) {
+			std::shared_ptr<const QueuedBlock> queued;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				blockAvailable.wait(lock, [&]() { return failed || closed || !queue.empty(); });
+				if (failed || queue.empty()) {
+					break;
 				}
+				queued = std::move(queue.front());
+				queue.pop_front();
 			}
-			// Update the amount of data processed
-			bytesProcessed += partition._file_system.reserved_sectors_byte_length;
-			if (outputProgress) outputProgress(totalBackupSize, bytesProcessed, lastUpdateTime);
-		}
-		int blockIndex = 0;
-		// calculate the file offset for the first data block in the partition
-		auto lcn0Start = partition._geometry.start + (partition._file_system.lcn0_offset - partition._file_system.start);
-		// Loop through each data block in the partition
-		int index = 0;
-		for (auto& dataBlock : partition.data_blocks) {
-			// If encryption is enabled, set the Initialization Vector (IV) parameters
-			EncryptionIVParams ivParams;
-			if (backupLayout._encryption.aes_type != ImageEnums::AES::eNone) {
-				ivParams.Set(backupLayout._header, diskToRestore, partition, index++);
+			try {
+				DecodedBlock decoded;
+				decoded.data = queued->data.data();
+				decoded.length = queued->data.size();
+				decoded.compressed = queued->compressed;
+				writeBlock(target, queued->block, decoded);
+			}
+			catch (const std::exception& e) {
+				fail(e.what());
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				bytesWritten += queued->block.write_limit;
+				queuedBytes = queuedBytes > queued->data.size() ? queuedBytes - queued->data.size() : 0;
+				spaceAvailable.notify_all();
+			}
+			onProgress(false);
+		}
+
+		// Each target is flushed on its own thread, so the flushes overlap
+		bool flush;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			flush = flushAtEnd && !failed;
+		}
+		if (flush) {
+			try {
+				target.flush();
 			}
-			// Read the block data from the backup file
-			auto blockData = readBlock(backupLayout, ivParams, backupSet.getFileHandle(dataBlock.file_number), dataBlock);
-			if (blockData != nullptr && dataBlock.block_length != 0) {
-				// Update the amount of data processed
-				bytesProcessed += partition._header.block_size;
-				// Calculate the file offset for the data block
-				fileOffset = lcn0Start + (static_cast<uint64_t>(partition._header.block_size) * blockIndex);
-				setFilePointer(targetDiskHandle, fileOffset, std::ios::beg);
-				// Write the block data to the target disk
-				writeFile(targetDiskHandle, blockData.get(), dataBlock.block_length);
-				// Output the progress of the restoration process
-				if (outputProgress) outputProgress(totalBackupSize, bytesProcessed, lastUpdateTime);
+			catch (const std::exception& e) {
+				fail(e.what());
+				return;
 			}
-			++blockIndex;
+			onProgress(false);
 		}
 	}
 
-	// Subtract 10 seconds from lastUpdateTime to force an update
-	lastUpdateTime -= std::chrono::seconds(10);
-	if (outputProgress) outputProgress(totalBackupSize, bytesProcessed, lastUpdateTime);
+	RestoreTarget& target;
+	std::function<void(bool failed)> onProgress;
+	std::thread thread;
+
+	mutable std::mutex mutex;
+	std::condition_variable spaceAvailable;
+	std::condition_variable blockAvailable;
+	std::deque<std::shared_ptr<const QueuedBlock>> queue;
+	uint64_t queuedBytes = 0;
+	uint64_t bytesWritten = 0;
+	bool closed = false;
+	bool flushAtEnd = false;
+	bool failed = false;
+	std::string error;
+};
+
+/**
+ * @brief Restores a disk to several targets at once, decoding each block once.
+ *
+ * This function performs the following steps:
+ * 1. Creates the backup set and selects the disk.
+ * 2. Writes the disk structures to each target, with its own disk ID unless the ID is kept.
+ * 3. Plans the block reads for the disk in backup file order.
+ * 4. Reads, decodes and hash checks each block once, and queues it for every target that has not failed.
+ *    Each target has its own bounded queue and writer thread, so the targets are written at their own speed
+ *    and a slow target only holds back the decode once its queue is full. A target that fails a write is
+ *    dropped, and the restore carries on to the others.
+ * 5. Flushes each target on its writer thread once its queue is written.
+ *
+ * @param filePath The path to the backup file.
+ * @param password The password for the backup file.
+ * @param targets The targets the disk is restored to.
+ * @param options The disk to restore, whether to keep the disk ID and the number of worker threads.
+ * @param outputProgress A callback function to output the progress of the decode. Default is nullptr.
+ * @param targetProgress A callback function to output the bytes written to each target and why a target failed. Default is nullptr.
+ * @return The result for each target.
+ * @throws std::invalid_argument if there are no targets, a target is sequential, or `skip_unchanged`, `sync_from`, a journal or
+ *                               `continue_on_error` is set.
+ * @throws std::runtime_error if a block cannot be read or decoded, or every target fails.
+ */
+std::vector<FanOutResult> restoreDiskToTargets(const std::wstring& filePath, const std::string& password, const std::vector<SharedTarget>& targets,
+	const RestoreOptions& options, ProgressCallback outputProgress/*= nullptr*/, FanOutProgressCallback targetProgress/*= nullptr*/)
+{
+	if (targets.empty()) {
+		throw std::invalid_argument("restoreDiskToTargets - no targets");
+	}
+	if (options.skip_unchanged || !options.sync_from.empty() || !options.journal_path.empty()) {
+		throw std::invalid_argument("restoreDiskToTargets - a restore to several targets cannot skip blocks, be brought up to date or be resumed");
+	}
+	// Bad blocks are only zeroed and listed by restoreDisk
+	if (options.continue_on_error) {
+		throw std::invalid_argument("restoreDiskToTargets - a restore to several targets cannot be salvaged");
+	}
+	for (const auto& target : targets) {
+		if (target->isSequential()) {
+			throw std::invalid_argument("restoreDiskToTargets - the disk cannot be written to several sequential targets");
+		}
+	}
+
+	BackupSet backupSet;
+	{
+		file_structs::fileLayout backupLayout;
+		readBackupFile(filePath, backupLayout, password);
+		createBackupSet(backupSet, filePath, password, backupLayout._header.imageid);
+	}
+	file_structs::fileLayout& backupLayout = backupSet.getBackupFileWithFullIndex();
+
+	int diskNumber = options.disk_number;
+	file_structs::Disk::DiskLayout diskToRestore;
+	getDiskToRestoreFromDiskNumber(backupLayout, diskNumber, diskToRestore);
+
+	RestorePlan plan = planDiskRestore(backupLayout, diskToRestore, backupSet);
+
+	// Reports the progress of every target at most once a second, at once when a target fails, and at the end
+	std::mutex progressMutex;
+	std::chrono::steady_clock::time_point lastProgress;
+	std::vector<std::unique_ptr<TargetWriter>> writers;
+	auto reportProgress = [&](bool now) {
+		if (!targetProgress) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(progressMutex);
+		auto time = std::chrono::steady_clock::now();
+		if (!now && time - lastProgress < std::chrono::seconds(1)) {
+			return;
+		}
+		lastProgress = time;
+		std::vector<FanOutResult> results;
+		for (const auto& writer : writers) {
+			results.push_back(writer->getResult());
+		}
+		targetProgress(results, plan.restored_bytes);
+	};
+	for (size_t index = 0; index < targets.size(); ++index) {
+		writers.push_back(std::make_unique<TargetWriter>(*targets[index], [&](bool failed) { reportProgress(failed); }));
+	}
+	auto throwIfAllFailed = [&]() {
+		if (std::all_of(writers.begin(), writers.end(), [](const std::unique_ptr<TargetWriter>& writer) { return writer->hasFailed(); })) {
+			throw std::runtime_error("restoreDiskToTargets - every target failed. " + writers.front()->getResult().error);
+		}
+	};
+
+	// Each target is prepared with its own disk ID, as if it were restored on its own
+	for (size_t index = 0; index < targets.size(); ++index) {
+		try {
+			prepareDisk(*targets[index], diskToRestore, options);
+		}
+		catch (const std::exception& e) {
+			writers[index]->fail(e.what());
+		}
+	}
+	throwIfAllFailed();
+
+	PipelineOptions pipelineOptions;
+	pipelineOptions.thread_count = options.thread_count;
+	pipelineOptions.hash_check = options.hash_check;
+	pipelineOptions.hash_sample = options.hash_sample;
+	pipelineOptions.read_ahead_bytes = options.read_ahead_bytes;
+	pipelineOptions.drop_behind = options.drop_behind;
+	pipelineOptions.read_limit = options.limiters ? &options.limiters->reads : &RateLimiter::globalReads();
+	pipelineOptions.write_limit = options.limiters ? &options.limiters->writes : &RateLimiter::globalWrites();
+	pipelineOptions.autotune = options.autotune;
+	// A block is only kept as a zstd frame if every target stores zstd frames
+	pipelineOptions.keep_compressed = [&](const BlockRef& block) {
+		return std::all_of(targets.begin(), targets.end(), [&](const SharedTarget& target) { return canKeepCompressed(*target, block); });
+	};
+
+	// The decoded block is copied once out of the pipeline's buffers and queued for every target that has not failed.
+	// Each target's writer thread writes its queue, so a slow target only holds back the others once its queue is full.
+	BlockSink sink = [&](const BlockRef& block, const DecodedBlock& decoded) {
+		auto queued = std::make_shared<QueuedBlock>();
+		queued->block = block;
+		queued->data.assign(decoded.data, decoded.data + (decoded.compressed ? decoded.length : std::min<size_t>(decoded.length, block.write_limit)));
+		queued->compressed = decoded.compressed;
+		for (auto& writer : writers) {
+			writer->push(queued);
+		}
+		throwIfAllFailed();
+	};
+
+	for (auto& writer : writers) {
+		writer->start();
+	}
+	// A bad block fails every target, so it stops the restore
+	try {
+		runBlockPipeline(plan.blocks, pipelineOptions, sink, nullptr, outputProgress);
+	}
+	catch (...) {
+		for (auto& writer : writers) {
+			writer->finish(false);
+		}
+		throw;
+	}
+	for (auto& writer : writers) {
+		writer->finish(true);
+	}
+	reportProgress(true);
+	throwIfAllFailed();
+
+	std::vector<FanOutResult> results;
+	for (const auto& writer : writers) {
+		results.push_back(writer->getResult());
+	}
+	return results;
+}
+
+/**
+ * @brief Clears the disk ID and the checksums that `setNewDiskID` replaces from a copy of track 0.
+ *
+ * @param disk The disk, whose track 0 in the backup locates the IDs.
+ * @param track0 A copy of track 0, from the backup or the target.
+ */
+static void clearDiskIdentity(const file_structs::Disk::DiskLayout& disk, std::vector<uint8_t>& track0)
+{
+	uint16_t bytesPerSector = disk._geometry.bytes_per_sector;
+	if (disk._header.disk_format != ImageEnums::DiskFormat::eGPT) {
+		// The MBR disk ID is in the boot code
+		if (track0.size() >= 444) {
+			memset(track0.data() + 440, 0, sizeof(uint32_t));
+		}
+		return;
+	}
+
+	if (disk.track0.size() < static_cast<size_t>(bytesPerSector) + sizeof(gpt_header) || track0.size() != disk.track0.size()) {
+		return;
+	}
+	// The header is located from the backup, so both copies are cleared in the same places. The entry array checksum is
+	// recalculated on restore, so it may differ from the backup's if that was stale.
+	gpt_header* copy = reinterpret_cast<gpt_header*>(track0.data() + bytesPerSector);
+	memset(&copy->disk_guid, 0, sizeof(copy->disk_guid));
+	copy->header_crc32 = 0;
+	copy->partition_entry_array_crc32 = 0;
+}
+
+/**
+ * @brief Adds a failed range to a report, merging it into the last range if it follows on for the same reason.
+ *
+ * @param report The report.
+ * @param diskOffset The offset of the range on the disk.
+ * @param length The length of the range.
+ * @param error Why the range failed.
+ */
+static void addMismatch(TargetVerifyReport& report, uint64_t diskOffset, uint64_t length, const std::string& error)
+{
+	if (!report.mismatches.empty()) {
+		TargetMismatch& last = report.mismatches.back();
+		if (last.disk_offset + last.length == diskOffset && last.error == error) {
+			last.length += length;
+			return;
+		}
+	}
+	report.mismatches.push_back({ diskOffset, length, error });
 }
 
+/**
+ * @brief Verifies a restored disk against the backup it was restored from.
+ *
+ * This function performs the following steps:
+ * 1. Creates the backup set and selects the disk, as `restoreDisk` does.
+ * 2. Compares track 0 and, for an MBR disk, the boot records of the logical drives with the target.
+ * 3. Plans the blocks of the disk and sorts them into disk order, so each worker reads a run of the target from start to end.
+ * 4. Runs the block pipeline with the target as the current data. Blocks whose hash matches are not read from the backup.
+ *    The others are decoded and compared with the target byte for byte.
+ * 5. Merges neighbouring failed blocks into ranges.
+ *
+ * @param filePath The path to the backup file.
+ * @param password The password for the backup file.
+ * @param target The restored disk.
+ * @param options The disk to check, whether the disk ID was kept and the number of worker threads.
+ * @param outputProgress A callback function to output the progress of the verification. Default is nullptr.
+ * @return The verification report.
+ * @throws std::invalid_argument if the target cannot be read back.
+ * @throws std::runtime_error if the backup set cannot be read or the target is smaller than the disk.
+ */
+TargetVerifyReport verifyTarget(const std::wstring& filePath, const std::string& password, RestoreTarget& target, const RestoreOptions& options, ProgressCallback outputProgress/*= nullptr*/)
+{
+	if (!target.isReadable()) {
+		throw std::invalid_argument("The target cannot be read back.");
+	}
+
+	BackupSet backupSet;
+	{
+		file_structs::fileLayout backupLayout;
+		readBackupFile(filePath, backupLayout, password);
+		createBackupSet(backupSet, filePath, password, backupLayout._header.imageid);
+	}
+	file_structs::fileLayout& backupLayout = backupSet.getBackupFileWithFullIndex();
+
+	int diskNumber = options.disk_number;
+	file_structs::Disk::DiskLayout diskToVerify;
+	getDiskToRestoreFromDiskNumber(backupLayout, diskNumber, diskToVerify);
+	if (target.getSize() < diskToVerify._geometry.disk_size) {
+		throw std::runtime_error("The target is smaller than the disk in the backup.");
+	}
+
+	TargetVerifyReport report;
+
+	// A new disk ID is random, so the IDs are only compared if the disk ID was kept
+	std::vector<uint8_t> expected = diskToVerify.track0;
+	std::vector<uint8_t> actual(expected.size());
+	target.readAt(0, actual.data(), actual.size());
+	if (!options.keep_disk_id) {
+		clearDiskIdentity(diskToVerify, expected);
+		clearDiskIdentity(diskToVerify, actual);
+	}
+	if (expected != actual) {
+		addMismatch(report, 0, expected.size(), "Track 0 does not match the backup.");
+	}
+	report.bytes_checked += expected.size();
+
+	if (diskToVerify._header.disk_format == ImageEnums::DiskFormat::eMBR) {
+		std::sort(diskToVerify.extendedPartitions.begin(), diskToVerify.extendedPartitions.end(), [](const ExtendedPartition& a, const ExtendedPartition& b) {
+			return a.offset < b.offset;
+		});
+		for (const auto& extendedPartition : diskToVerify.extendedPartitions) {
+			BootRecord bootRecord;
+			target.readAt(extendedPartition.offset, &bootRecord, sizeof(bootRecord));
+			if (memcmp(&bootRecord, &extendedPartition.partitionSector, sizeof(bootRecord)) != 0) {
+				addMismatch(report, extendedPartition.offset, sizeof(bootRecord), "The boot record of a logical drive does not match the backup.");
+			}
+			report.bytes_checked += sizeof(bootRecord);
+		}
+	}
+
+	// The target is read in disk order. The backup is only read for the blocks that do not match.
+	RestorePlan plan = planDiskRestore(backupLayout, diskToVerify, backupSet);
+	std::sort(plan.blocks.begin(), plan.blocks.end(), [](const BlockRef& a, const BlockRef& b) {
+		return a.disk_offset < b.disk_offset;
+	});
+	report.blocks_checked = plan.blocks.size();
+	report.bytes_checked += plan.restored_bytes;
+
+	PipelineOptions pipelineOptions;
+	pipelineOptions.thread_count = options.thread_count;
+	pipelineOptions.read_limit = options.limiters ? &options.limiters->reads : &RateLimiter::globalReads();
+	pipelineOptions.read_current = [&](const BlockRef& block, uint8_t* buffer) {
+		target.readAt(block.disk_offset, buffer, block.write_limit);
+	};
+
+	std::vector<TargetMismatch> failed;
+	std::mutex failedMutex;
+	auto fail = [&](const BlockRef& block, const std::string& error) {
+		std::lock_guard<std::mutex> lock(failedMutex);
+		failed.push_back({ block.disk_offset, block.write_limit, error });
+	};
+
+	// The sink receives the blocks whose hash did not match the target, decoded from the backup
+	BlockSink sink = [&](const BlockRef& block, const DecodedBlock& decoded) {
+		size_t length = std::min<size_t>(decoded.length, block.write_limit);
+		std::vector<uint8_t> current(length);
+		try {
+			target.readAt(block.disk_offset, current.data(), length);
+		}
+		catch (const std::exception& e) {
+			fail(block, e.what());
+			return;
+		}
+		if (length != block.write_limit || memcmp(current.data(), decoded.data, length) != 0) {
+			fail(block, "The data on the target does not match the backup.");
+		}
+	};
+	BlockErrorHandler onError = [&](const BlockRef& block, const std::string& error) {
+		fail(block, "The block could not be read from the backup: " + error);
+	};
+
+	runBlockPipeline(plan.blocks, pipelineOptions, sink, onError, outputProgress);
+
+	// Workers finish out of order. Report the ranges in disk order.
+	std::sort(failed.begin(), failed.end(), [](const TargetMismatch& a, const TargetMismatch& b) {
+		return a.disk_offset < b.disk_offset;
+	});
+	for (const auto& mismatch : failed) {
+		addMismatch(report, mismatch.disk_offset, mismatch.length, mismatch.error);
+	}
+	std::sort(report.mismatches.begin(), report.mismatches.end(), [](const TargetMismatch& a, const TargetMismatch& b) {
+		return a.disk_offset < b.disk_offset;
+	});
+	return report;
+}
@@ -25,25 +25,239 @@ The program uses the following libraries:
  * No other include files are necessary.
  */
 
- /**
- * @brief Type alias for a callback function used to report progress during disk restoration.
+#include "block_pipeline.h"
+#include "restore_journal.h"
+#include "restore_plan.h"
+#include "seekable_writer.h"
+#include "verify.h"
+
+/**
+ * @struct RestoreOptions
+ * @brief Options for `restoreDisk`.
  *
- * This callback function is invoked periodically during the disk restoration process to report the progress.
- * It takes three parameters: the total number of bytes to be processed, the number of bytes processed so far,
- * and the time point of the last update. The function does not return a value.
+ * @var disk_number The disk number to restore. -1 restores the first disk.
+ * @var keep_disk_id True to keep the disk ID, false to set a new one to prevent a disk collision. Not used with `sync_from`.
+ * @var thread_count The number of worker threads. 0 uses one thread per logical processor.
+ * @var kernel_copy True to have the target copy or clone the blocks of an uncompressed, unencrypted backup file
+ *                  straight from the file where it can, with `RestoreTarget::copyFrom`. The hashes of copied blocks are not checked.
+ *                  Used by `restoreDisk`.
+ * @var skip_unchanged True to read back each block's place on the target and leave it as it is if its MD5 hash matches the block index,
+ *                     so restoring over an earlier restore of the same disk only writes the blocks that changed. The target must be
+ *                     readable and opened with its data kept. Ranges the backup does not hold keep their old data. Used by `restoreDisk`.
+ * @var sync_from The path of an earlier backup file of the same backup set that the target already holds a restore of. Only the blocks
+ *                that changed after it are read and written, and the rest of the target is not touched. The target must be readable
+ *                and opened with its data kept. The target keeps its disk ID, and the partitions must be placed as they were in the
+ *                earlier backup. Empty to restore every block. Used by `restoreDisk`.
+ * @var journal_path The path of a journal that records the blocks written, so a failed restore can be resumed. Empty for no journal.
+ *                   The journal is deleted when the restore completes. Used by `restoreDisk`.
+ * @var journal_interval The least time between checkpoints of the journal. Each checkpoint flushes the target.
+ * @var resume True to skip the blocks recorded in the journal by an earlier run of the same restore to the same target. The target
+ *             must be opened with its data kept.
+ * @var continue_on_error True to salvage what can be restored: a block that cannot be read or decoded has its place on the target
+ *                        zeroed and the restore carries on. The bad blocks are returned. Used by `restoreDisk`, and
+ *                        refused by the restores to several targets.
+ * @var hash_check When the MD5 hashes of the decoded blocks are checked. `HashCheck::eDeferred` writes each block before its
+ *                 check, and a block that fails it fails the restore, or is zeroed with `continue_on_error`, once every block
+ *                 has been written. A restore with a journal always checks inline, so a bad block is never recorded as written.
+ * @var hash_sample With `HashCheck::eSampled`, one block in this many is checked.
+ * @var write_back When the targets move written data from the system cache to storage. With `Durability::ePeriodic`, the
+ *                 dirty data in the cache stays bounded and each journal checkpoint only waits for the last interval.
+ *                 A restore with a journal never uses `Durability::eNone`, so a checkpoint always reaches storage.
+ * @var read_ahead_bytes How far ahead of the reads the stored blocks of the plan are prefetched from the backup files. 0 to leave
+ *                       read-ahead to the system.
+ * @var drop_behind True to drop the stored blocks from the system cache once they are decoded, as a restore reads each block once.
+ * @var limiters The rate limiters the reads and writes of the job are charged to. Null to charge the global limiters alone.
+ * @var autotune True to measure the throughput while the restore runs and adjust the number of workers and the read-ahead
+ *               to it, with thread_count and read_ahead_bytes as caps. False to use them as they are.
  */
-using ProgressCallback = std::function<void(const uint64_t totalBytes, uint64_t& bytesSoFar, std::chrono::steady_clock::time_point& lastUpdateTime)>;
+struct RestoreOptions
+{
+	int disk_number = -1;
+	bool keep_disk_id = false;
+	unsigned thread_count = 0;
+	bool kernel_copy = false;
+	bool skip_unchanged = false;
+	std::wstring sync_from;
+	std::wstring journal_path;
+	std::chrono::seconds journal_interval{ 30 };
+	bool resume = false;
+	bool continue_on_error = false;
+	HashCheck hash_check = HashCheck::eInline;
+	uint32_t hash_sample = 64;
+	WriteBackPolicy write_back;
+	uint64_t read_ahead_bytes = 64 * 1024 * 1024;
+	bool drop_behind = true;
+	JobLimiters* limiters = nullptr;
+	bool autotune = true;
+};
 
 /**
  * @brief Restores a disk from a backup file.
  *
- * This function restores a disk from a backup file. It takes the path to the backup file, a password, a target disk, and an optional progress callback function as parameters.
+ * This function restores a disk from a backup file. It takes the path to the backup file, a password, a restore target, the restore options and an optional progress callback function as parameters.
+ * Blocks are read in backup file order and decoded on all cores, then written to their place on the target, which may be a virtual disk, a raw image file, a block device or memory.
+ * A sequential target, such as a seekable zstd file or a stream to standard output, is written in disk order instead.
+ * With `continue_on_error`, bad blocks are zeroed on the target rather than stopping the restore.
  *
  * @param filePath The path to the backup file.
  * @param password The password for the backup file.
- * @param targetDisk The path to the target disk where the backup is being restored.
- * @param diskNumber The user provided disk number to restore. -1 if not supplied.
+ * @param target The target the disk is restored to. It is sized with `RestoreTarget::prepare` and flushed when the restore completes.
+ * @param options The restore options.
+ * @param outputProgress An optional callback function to output the progress of the restoration process. Default is nullptr.
+ * @throws std::invalid_argument if `skip_unchanged` or `sync_from` is set and the target cannot be read back, is sequential or was not opened
+ *                               with its data kept, a journal is set and the target is sequential, or `resume` is set and the target was not
+ *                               opened with its data kept.
+ * @return The blocks that could not be read or decoded, in disk order. Always empty unless `continue_on_error` is set.
+ * @throws std::runtime_error if `sync_from` is not an earlier backup of the same disk or the backup set does not show where it is in its chain, the journal is for another restore or target, a block cannot be written,
+ *                            or a block cannot be read or decoded and `continue_on_error` is not set.
+ */
+std::vector<BadBlock> restoreDisk(const std::wstring& filePath, const std::string& password, RestoreTarget& target, const RestoreOptions& options, ProgressCallback outputProgress = nullptr);
+
+/**
+ * @brief Opens the target for one backup file of an incremental chain.
+ *
+ * @param layout The layout of the backup file.
+ * @param backupFileName The name of the backup file.
+ * @param base True for the oldest file of the chain, which holds the whole disk. The other files only hold the blocks that changed.
+ * @return The target for the backup file.
+ */
+using ChainTargetFactory = std::function<SharedTarget(const file_structs::fileLayout& layout, const std::wstring& backupFileName, bool base)>;
+
+/**
+ * @brief Restores a disk as a chain of targets that mirrors the incremental chain of a backup set.
+ *
+ * The oldest file of the backup set, which must be a full backup, is restored in full to the first target. Each newer
+ * file is restored to its own target with only the blocks it holds, the blocks that changed since the file before it,
+ * so no block is decoded more than once. The targets are opened in chain order, oldest first, which lets a factory
+ * link each one to the target before it, as differencing virtual disks are.
+ *
+ * @param filePath The path to the newest backup file of the chain to restore.
+ * @param password The password for the backup files.
+ * @param options The restore options.
+ * @param openTarget Opens the target for each file of the chain.
  * @param outputProgress An optional callback function to output the progress of the restoration process. Default is nullptr.
+ * @throws std::invalid_argument if a target is sequential, or `continue_on_error` is set.
+ * @throws std::runtime_error if the oldest file is not a full backup, the disk size or its partitions changed along the chain, or a block cannot be read, decoded or written.
  */
+void restoreChain(const std::wstring& filePath, const std::string& password, const RestoreOptions& options, const ChainTargetFactory& openTarget, ProgressCallback outputProgress = nullptr);
 
-void restoreDisk(const std::wstring& filePath, const std::string& password, const std::wstring targetDisk, int diskNumber, bool keepDiskId, ProgressCallback outputProgress = nullptr);
+/**
+ * @brief Opens the target for one disk of a backup.
+ *
+ * @param disk The disk to restore.
+ * @return The target for the disk.
+ */
+using DiskTargetFactory = std::function<SharedTarget(const file_structs::Disk::DiskLayout& disk)>;
+
+/**
+ * @brief Restores every disk of a backup file at the same time, each to its own target.
+ *
+ * The blocks of all the disks are decoded by one set of worker threads, and each backup file is read once. The
+ * workers take turns between the disks a batch at a time, so every target is written at once and the restore
+ * of a multi-disk system ends with its largest disk, rather than after each disk in turn.
+ *
+ * @param filePath The path to the backup file.
+ * @param password The password for the backup file.
+ * @param options Whether to keep the disk IDs, the number of worker threads, whether to copy blocks in the kernel and whether to skip
+ *                unchanged blocks. The disk number is not used.
+ * @param openTarget Opens the target for each disk, in the order of the disks in the backup file.
+ * @param outputProgress An optional callback function to output the progress of the restoration process. Default is nullptr.
+ * @throws std::invalid_argument if a target is sequential, `skip_unchanged` is set and a target cannot be read back or was not opened with its data kept,
+ *                               or `sync_from`, a journal or `continue_on_error` is set.
+ * @throws std::runtime_error if a block cannot be read, decoded or written.
+ */
+void restoreAllDisks(const std::wstring& filePath, const std::string& password, const RestoreOptions& options, const DiskTargetFactory& openTarget, ProgressCallback outputProgress = nullptr);
+
+/**
+ * @struct FanOutResult
+ * @brief The result of `restoreDiskToTargets` for one target.
+ *
+ * @var bytes_written The number of block bytes written to the target.
+ * @var error Why the target failed. Empty if the disk was restored to it. A failed target is not written to again.
+ */
+struct FanOutResult
+{
+	uint64_t bytes_written = 0;
+	std::string error;
+};
+
+/**
+ * @brief A callback to output the progress of each target of `restoreDiskToTargets`.
+ *
+ * Called at most once a second, at once when a target fails, and when the restore ends. The results are in
+ * the order of the targets. `totalBytes` is the number of block bytes each target will be written.
+ */
+using FanOutProgressCallback = std::function<void(const std::vector<FanOutResult>& results, uint64_t totalBytes)>;
+
+/**
+ * @brief Restores a disk to several targets at once, decoding each block once.
+ *
+ * Each block is read, decrypted, decompressed and hash checked once, then queued for every target. Each
+ * target has its own bounded queue and writer thread, so the targets are written at their own speed and a
+ * slow target only holds back the decode once its queue is full. A target that fails is dropped and the
+ * restore carries on to the others. Each target is given its own disk ID unless `keep_disk_id` is set.
+ *
+ * @param filePath The path to the backup file.
+ * @param password The password for the backup file.
+ * @param targets The targets the disk is restored to. None may be sequential.
+ * @param options The disk to restore, whether to keep the disk ID and the number of worker threads.
+ * @param outputProgress An optional callback function to output the progress of the decode. Default is nullptr.
+ * @param targetProgress An optional callback function to output the progress of each target. Default is nullptr.
+ * @return The result for each target, in the order of `targets`.
+ * @throws std::invalid_argument if there are no targets, a target is sequential, or `skip_unchanged`, `sync_from`, a journal or
+ *                               `continue_on_error` is set.
+ * @throws std::runtime_error if a block cannot be read or decoded, or every target fails.
+ */
+std::vector<FanOutResult> restoreDiskToTargets(const std::wstring& filePath, const std::string& password, const std::vector<SharedTarget>& targets,
+	const RestoreOptions& options, ProgressCallback outputProgress = nullptr, FanOutProgressCallback targetProgress = nullptr);
+
+/**
+ * @struct TargetMismatch
+ * @brief A range of a restored disk that does not hold the data in the backup.
+ *
+ * @var disk_offset The offset of the range on the disk.
+ * @var length The length of the range.
+ * @var error Why the range failed.
+ */
+struct TargetMismatch
+{
+	uint64_t disk_offset = 0;
+	uint64_t length = 0;
+	std::string error;
+};
+
+/**
+ * @struct TargetVerifyReport
+ * @brief The result of `verifyTarget`.
+ *
+ * @var blocks_checked The number of blocks checked, not counting track 0 and the boot records.
+ * @var bytes_checked The number of bytes of the target checked.
+ * @var mismatches The ranges that do not match, in disk order. Neighbouring blocks that fail for the same reason are reported as one range.
+ */
+struct TargetVerifyReport
+{
+	uint64_t blocks_checked = 0;
+	uint64_t bytes_checked = 0;
+	std::vector<TargetMismatch> mismatches;
+};
+
+/**
+ * @brief Verifies a restored disk against the backup it was restored from, without restoring it again.
+ *
+ * Track 0 and the boot records of logical drives are compared with the backup. Each block, including the
+ * reserved sector blocks, is read back from the target in disk order, and the MD5 hashes of its data are
+ * computed several blocks at a time on all cores and compared with the index built for the backup set.
+ * Only blocks that do not match, and the last reserved sector block of a partition, which does not fill a
+ * whole block on the disk, are read from the backup and compared byte for byte.
+ *
+ * @param filePath The path to the backup file.
+ * @param password The password for the backup file.
+ * @param target The restored disk. It must be readable, and must have been opened with its data kept.
+ * @param options The disk to check, whether the disk ID was kept and the number of worker threads.
+ *                If the disk ID was not kept, the disk and partition IDs in track 0 are not compared.
+ * @param outputProgress An optional callback function to output the progress of the verification. Default is nullptr.
+ * @return The verification report.
+ * @throws std::invalid_argument if the target cannot be read back.
+ * @throws std::runtime_error if the backup set cannot be read or the target is smaller than the disk.
+ */
+TargetVerifyReport verifyTarget(const std::wstring& filePath, const std::string& password, RestoreTarget& target, const RestoreOptions& options, ProgressCallback outputProgress = nullptr);
@@ -0,0 +1,213 @@
+// restore_journal.cpp : A checkpoint journal of the blocks a restore has written.
+//
+
+#include "pch.h"
+#include <filesystem>
+#include <fstream>
+#include "..\file_operations\file_operations.h"
+#include "restore_journal.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+// The version of the journal file format. Version 2 records the target.
+static constexpr int JOURNAL_VERSION = 2;
+
+/**
+ * @brief Returns the name of a target as an absolute, normalised path, so the same file named two ways matches.
+ *
+ * @param target The target.
+ */
+static std::string getTargetName(const RestoreTarget& target)
+{
+	std::error_code error;
+	std::filesystem::path path = std::filesystem::absolute(std::filesystem::path(target.getName()), error);
+	if (error) {
+		return wideToString(target.getName());
+	}
+	return wideToString(path.lexically_normal().wstring());
+}
+
+/**
+ * @brief Creates a journal for a restore.
+ *
+ * @param path The path of the journal file.
+ * @param target The target the blocks are written to.
+ * @param identity Identifies the restore.
+ * @param interval The least time between checkpoints.
+ */
+RestoreJournal::RestoreJournal(const std::wstring& path, RestoreTarget& target, const std::string& identity, std::chrono::seconds interval)
+	: path(path), target(target), identity(identity), targetName(getTargetName(target)), interval(interval),
+	nextCheckpoint(std::chrono::steady_clock::now() + interval)
+{
+}
+
+/**
+ * @brief Loads the blocks completed by an earlier run of the same restore.
+ *
+ * @return False if there is no journal file.
+ * @throws std::runtime_error if the journal file cannot be read, or is for another restore or another target.
+ */
+bool RestoreJournal::load()
+{
+	std::filesystem::path journalPath(path);
+	if (!std::filesystem::exists(journalPath)) {
+		return false;
+	}
+	std::ifstream file(journalPath, std::ios::binary);
+	if (!file) {
+		throw std::runtime_error("Could not open the restore journal: " + journalPath.string());
+	}
+
+	nlohmann::json journal;
+	try {
+		journal = nlohmann::json::parse(file);
+	}
+	catch (const nlohmann::json::exception& e) {
+		throw std::runtime_error(std::string("The restore journal is corrupt: ") + e.what());
+	}
+	if (journal.value("version", 0) != JOURNAL_VERSION || journal.value("identity", std::string()) != identity) {
+		throw std::runtime_error("The restore journal is for another restore.");
+	}
+	// The blocks it lists are only on the target they were written to
+	if (journal.value("target", std::string()) != targetName) {
+		throw std::runtime_error("The restore journal is for another target: " + journal.value("target", std::string()));
+	}
+
+	std::lock_guard<std::mutex> lock(blockMutex);
+	completed.clear();
+	for (const auto& partition : journal.at("partitions")) {
+		auto& blocks = completed[{ partition.at("partition_number").get<int32_t>(), partition.at("reserved_sectors").get<bool>() }];
+		for (const auto& range : partition.at("ranges")) {
+			uint32_t first = range.at(0).get<uint32_t>();
+			uint32_t end = range.at(1).get<uint32_t>();
+			if (first >= end) {
+				continue;
+			}
+			if (end > blocks.size()) {
+				blocks.resize(end, false);
+			}
+			std::fill(blocks.begin() + first, blocks.begin() + end, true);
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Returns true if the block was written and flushed by an earlier run.
+ */
+bool RestoreJournal::isComplete(const BlockRef& block) const
+{
+	std::lock_guard<std::mutex> lock(blockMutex);
+	auto blocks = completed.find({ block.partition_number, block.reserved_sectors });
+	return blocks != completed.end() && block.iv_index < blocks->second.size() && blocks->second[block.iv_index];
+}
+
+/**
+ * @brief Writes a block and records it, then checkpoints if the interval has passed.
+ *
+ * The block is recorded only after `writeBlock` returns, and a checkpoint waits for the writes in
+ * progress, so every block in a checkpoint was written before the target was flushed.
+ *
+ * @param block The block.
+ * @param writeBlock Writes the block to the target.
+ */
+void RestoreJournal::write(const BlockRef& block, const std::function<void()>& writeBlock)
+{
+	{
+		std::shared_lock<std::shared_mutex> writing(writeMutex);
+		writeBlock();
+
+		std::lock_guard<std::mutex> lock(blockMutex);
+		auto& blocks = completed[{ block.partition_number, block.reserved_sectors }];
+		if (block.iv_index >= blocks.size()) {
+			blocks.resize(block.iv_index + 1, false);
+		}
+		blocks[block.iv_index] = true;
+	}
+
+	if (std::chrono::steady_clock::now() >= nextCheckpoint.load()) {
+		std::unique_lock<std::shared_mutex> flushing(writeMutex);
+		// Another worker may have made the checkpoint while this one waited
+		if (std::chrono::steady_clock::now() >= nextCheckpoint.load()) {
+			target.flush();
+			std::lock_guard<std::mutex> lock(blockMutex);
+			save();
+			nextCheckpoint = std::chrono::steady_clock::now() + interval;
+		}
+	}
+}
+
+/**
+ * @brief Flushes the target and writes the journal file.
+ */
+void RestoreJournal::checkpoint()
+{
+	std::unique_lock<std::shared_mutex> flushing(writeMutex);
+	target.flush();
+	std::lock_guard<std::mutex> lock(blockMutex);
+	save();
+	nextCheckpoint = std::chrono::steady_clock::now() + interval;
+}
+
+/**
+ * @brief Deletes the journal file.
+ */
+void RestoreJournal::remove()
+{
+	std::error_code error;
+	std::filesystem::remove(std::filesystem::path(path), error);
+}
+
+/**
+ * @brief Writes the completed blocks to the journal file as ranges of block indexes.
+ *
+ * The journal is written to a temporary file, which is flushed and then renamed over the journal
+ * file, so the journal file always holds a complete checkpoint.
+ *
+ * @throws std::runtime_error if the journal file cannot be written.
+ */
+void RestoreJournal::save()
+{
+	nlohmann::json partitions = nlohmann::json::array();
+	for (const auto& [key, blocks] : completed) {
+		nlohmann::json ranges = nlohmann::json::array();
+		for (size_t index = 0; index < blocks.size();) {
+			if (!blocks[index]) {
+				++index;
+				continue;
+			}
+			size_t end = index;
+			while (end < blocks.size() && blocks[end]) {
+				++end;
+			}
+			ranges.push_back({ index, end });
+			index = end;
+		}
+		partitions.push_back({ { "partition_number", key.first }, { "reserved_sectors", key.second }, { "ranges", std::move(ranges) } });
+	}
+
+	nlohmann::json journal;
+	journal["version"] = JOURNAL_VERSION;
+	journal["identity"] = identity;
+	journal["target"] = targetName;
+	journal["partitions"] = std::move(partitions);
+	std::string text = journal.dump();
+
+	std::wstring temporaryPath = path + L".tmp";
+	{
+		FileTarget file(temporaryPath, false);
+		file.writeAt(0, text.data(), text.size());
+		file.flush();
+	}
+	std::error_code error;
+	std::filesystem::rename(std::filesystem::path(temporaryPath), std::filesystem::path(path), error);
+	if (error) {
+		throw std::runtime_error("Could not write the restore journal. Error: " + error.message());
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief A checkpoint journal of the blocks a restore has written, so a failed restore can be resumed.
+ *
+ * The journal lists the completed blocks of each partition as ranges of block indexes. It is only
+ * written after the target has been flushed, so every block it lists is durable on the target. A
+ * resumed restore skips the listed blocks and only restores the rest.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "block_pipeline.h"
+#include "..\file_operations\restore_target.h"
+
+/**
+ * @class RestoreJournal
+ * @brief Records the blocks written to a restore target and checkpoints them to a file.
+ *
+ * Blocks are written through `write`, which may be called from several worker threads at once.
+ * At most once per interval, a checkpoint waits for the writes in progress, flushes the target and
+ * replaces the journal file. The journal file is replaced atomically, so a failure during a
+ * checkpoint leaves the previous checkpoint.
+ */
+class RestoreJournal {
+public:
+	/**
+	 * @brief Creates a journal for a restore. Nothing is written until the first checkpoint.
+	 *
+	 * @param path The path of the journal file.
+	 * @param target The target the blocks are written to.
+	 * @param identity Identifies the restore: the backup, the disk and its size. A journal of another restore is not resumed.
+	 *                 The journal also records the target by its absolute path, and a journal of another target is not resumed.
+	 * @param interval The least time between checkpoints.
+	 */
+	RestoreJournal(const std::wstring& path, RestoreTarget& target, const std::string& identity, std::chrono::seconds interval);
+
+	RestoreJournal(const RestoreJournal&) = delete;
+	RestoreJournal& operator=(const RestoreJournal&) = delete;
+
+	/**
+	 * @brief Loads the blocks completed by an earlier run of the same restore from the journal file.
+	 *
+	 * @return False if there is no journal file.
+	 * @throws std::runtime_error if the journal file cannot be read, or is for another restore or another target.
+	 */
+	bool load();
+
+	/**
+	 * @brief Returns true if the block was written and flushed by an earlier run.
+	 */
+	bool isComplete(const BlockRef& block) const;
+
+	/**
+	 * @brief Writes a block with `writeBlock` and records it, then checkpoints if the interval has passed.
+	 *
+	 * @param block The block.
+	 * @param writeBlock Writes the block to the target.
+	 * @throws std::runtime_error if the block cannot be written or the checkpoint fails.
+	 */
+	void write(const BlockRef& block, const std::function<void()>& writeBlock);
+
+	/**
+	 * @brief Flushes the target and writes the journal file.
+	 * @throws std::runtime_error if the target cannot be flushed or the journal file cannot be written.
+	 */
+	void checkpoint();
+
+	/**
+	 * @brief Deletes the journal file once the restore is complete and the target is flushed.
+	 */
+	void remove();
+
+private:
+	// The blocks of a partition: its partition number, and whether they are reserved sector blocks
+	using PartitionKey = std::pair<int32_t, bool>;
+
+	/**
+	 * @brief Writes the completed blocks to the journal file. Must be called with the blocks locked.
+	 */
+	void save();
+
+	std::wstring path;
+	RestoreTarget& target;
+	std::string identity;
+	std::string targetName;
+	std::chrono::seconds interval;
+	std::atomic<std::chrono::steady_clock::time_point> nextCheckpoint;
+
+	// Held shared while a block is written, and exclusively while the target is flushed
+	std::shared_mutex writeMutex;
+	mutable std::mutex blockMutex;
+	// The completed blocks of each partition, by block index
+	std::map<PartitionKey, std::vector<bool>> completed;
+};
@@ -0,0 +1,181 @@
+// restore_plan.cpp : Plans the block reads for a disk restore.
+//
+
+#include "pch.h"
+#include "..\file_reader\file_reader.h"
+#include "..\file_operations\file_operations.h"
+#include "restore_plan.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @brief Plans the block reads for a disk restore.
+ *
+ * @param layout The layout with the index built for the backup set.
+ * @param disk The disk to restore.
+ * @param backupSet The backup set used to find the source of each block.
+ * @return The plan, with the blocks in backup file order.
+ */
+RestorePlan planDiskRestore(const file_structs::fileLayout& layout, const file_structs::Disk::DiskLayout& disk, BackupSet& backupSet)
+{
+	RestorePlan plan;
+	for (const auto& partition : disk.partitions) {
+		appendPartitionBlocks(layout, disk, partition, backupSet, false, plan.blocks);
+	}
+
+	for (const auto& block : plan.blocks) {
+		plan.stored_bytes += block.element->block_length;
+		plan.restored_bytes += block.write_limit;
+	}
+
+	sortBlocksByFilePosition(plan.blocks);
+	return plan;
+}
+
+/**
+ * @brief Returns the number of the last file written for an earlier backup of a set, after checking that the
+ *        set places every file written after it at a higher number.
+ *
+ * @param backupSet The backup set.
+ * @param earlier The header of the earlier backup file.
+ * @return The highest file number of the earlier backup and its split parts.
+ * @throws std::runtime_error if the earlier backup is not in the set, or a file written after it has a lower number.
+ */
+static int32_t getLastFileOf(const BackupSet& backupSet, const file_structs::Header& earlier)
+{
+	int32_t lastFile = earlier.file_number;
+	bool found = false;
+	for (const auto& setFile : backupSet.fileLayouts) {
+		const file_structs::Header& header = setFile->_header;
+		if (header.file_number == earlier.file_number) {
+			if (header.increment_number != earlier.increment_number) {
+				throw std::runtime_error("The backup set holds another file with the number of the earlier backup.");
+			}
+			found = true;
+		}
+		if (header.increment_number == earlier.increment_number) {
+			lastFile = std::max<int32_t>(lastFile, header.file_number);
+		}
+		if (std::find(header.merged_files.begin(), header.merged_files.end(), earlier.file_number) != header.merged_files.end()) {
+			found = true;
+		}
+	}
+	if (!found) {
+		throw std::runtime_error("The backup set does not include the earlier backup, so the blocks changed since it cannot be found.");
+	}
+	for (const auto& setFile : backupSet.fileLayouts) {
+		if (setFile->_header.increment_number > earlier.increment_number && setFile->_header.file_number <= lastFile) {
+			throw std::runtime_error("A file written after the earlier backup is numbered before it, so the blocks changed since it cannot be found.");
+		}
+	}
+	return lastFile;
+}
+
+/**
+ * @brief Removes the blocks that have not changed since an earlier backup of the set from a list.
+ *
+ * Each block is judged by the file that wrote it, not by the file that holds it now. Consolidation
+ * moves the blocks of merged files into another file, which can be older or newer than they are.
+ * Files are numbered in the order they are written, so a block written after the earlier backup
+ * names a file numbered after the earlier backup and its split parts.
+ *
+ * @param blocks The blocks to filter.
+ * @param backupSet The backup set the blocks were listed from.
+ * @param earlier The header of the earlier backup file.
+ * @throws std::runtime_error if the backup set does not show where the earlier backup is in its chain.
+ */
+void keepBlocksChangedSince(std::vector<BlockRef>& blocks, const BackupSet& backupSet, const file_structs::Header& earlier)
+{
+	int32_t lastFile = getLastFileOf(backupSet, earlier);
+	blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [&](const BlockRef& block) {
+		return block.element->file_number <= lastFile;
+	}), blocks.end());
+}
+
+/**
+ * @brief Removes the blocks that have not changed since an earlier backup of the set from a plan.
+ *
+ * @param plan The plan to filter. Its byte counts are updated.
+ * @param backupSet The backup set the plan was made from.
+ * @param earlier The header of the earlier backup file.
+ * @throws std::runtime_error if the backup set does not show where the earlier backup is in its chain.
+ */
+void keepBlocksChangedSince(RestorePlan& plan, const BackupSet& backupSet, const file_structs::Header& earlier)
+{
+	keepBlocksChangedSince(plan.blocks, backupSet, earlier);
+
+	plan.stored_bytes = 0;
+	plan.restored_bytes = 0;
+	for (const auto& block : plan.blocks) {
+		plan.stored_bytes += block.element->block_length;
+		plan.restored_bytes += block.write_limit;
+	}
+}
+
+/**
+ * @brief Returns true if two backups of a disk place its blocks at the same disk offsets.
+ *
+ * @param earlier The disk in the earlier backup.
+ * @param later The disk in the later backup.
+ * @return True if the disks have the same partitions, with the same start, boot sector, file system start, first
+ *         cluster, reserved sectors and block size.
+ */
+bool haveSameBlockPlacement(const file_structs::Disk::DiskLayout& earlier, const file_structs::Disk::DiskLayout& later)
+{
+	if (earlier.partitions.size() != later.partitions.size()) {
+		return false;
+	}
+	for (const auto& partition : earlier.partitions) {
+		auto match = std::find_if(later.partitions.begin(), later.partitions.end(), [&](const file_structs::Partition::PartitionLayout& laterPartition) {
+			return laterPartition._header.partition_number == partition._header.partition_number;
+		});
+		if (match == later.partitions.end() ||
+			match->_geometry.start != partition._geometry.start ||
+			match->_geometry.boot_sector_offset != partition._geometry.boot_sector_offset ||
+			match->_file_system.start != partition._file_system.start ||
+			match->_file_system.lcn0_offset != partition._file_system.lcn0_offset ||
+			match->_file_system.reserved_sectors_byte_length != partition._file_system.reserved_sectors_byte_length ||
+			match->_header.block_size != partition._header.block_size) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Merges the blocks of several disks into one list that takes turns between the disks.
+ *
+ * Each turn takes about `turnBytes` stored bytes of a disk, in its read order. The pipeline workers take
+ * batches of that size in list order, so they restore all the disks at once rather than one after another.
+ *
+ * @param diskBlocks The blocks of each disk, in read order.
+ * @param turnBytes The stored bytes of each turn.
+ * @return The merged list.
+ */
+std::vector<BlockRef> interleaveDisks(const std::vector<std::vector<BlockRef>>& diskBlocks, uint64_t turnBytes)
+{
+	size_t total = 0;
+	for (const auto& blocks : diskBlocks) {
+		total += blocks.size();
+	}
+
+	std::vector<BlockRef> blocks;
+	blocks.reserve(total);
+	std::vector<size_t> next(diskBlocks.size(), 0);
+	while (blocks.size() < total) {
+		for (size_t disk = 0; disk < diskBlocks.size(); ++disk) {
+			uint64_t turn = 0;
+			for (size_t& i = next[disk]; i < diskBlocks[disk].size() && turn < turnBytes; ++i) {
+				turn += diskBlocks[disk][i].element->block_length;
+				blocks.push_back(diskBlocks[disk][i]);
+			}
+		}
+	}
+	return blocks;
+}
@@ -0,0 +1,95 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief Plans the block reads for a disk restore.
+ *
+ * The index built for a backup set lists the blocks in disk order, but the blocks of a long
+ * incremental chain are spread over many backup files, and a consolidated file may hold its
+ * blocks out of sequence. Reading in disk order then jumps between files and positions.
+ * The plan lists the blocks in backup file order instead, so each file is read from start to
+ * end once, and the writes to the target are made out of order.
+ */
+
+#include "block_pipeline.h"
+
+/**
+ * @struct RestorePlan
+ * @brief The blocks to restore for one disk, in read order.
+ *
+ * @var blocks The blocks, sorted by file number and file position.
+ * @var stored_bytes The number of bytes to read from the backup files.
+ * @var restored_bytes The number of bytes to write to the target.
+ */
+struct RestorePlan
+{
+	std::vector<BlockRef> blocks;
+	uint64_t stored_bytes = 0;
+	uint64_t restored_bytes = 0;
+};
+
+/**
+ * @brief Plans the block reads for a disk restore.
+ *
+ * @param layout The layout with the index built for the backup set.
+ * @param disk The disk to restore. The plan points into its block index, so it must outlive the plan.
+ * @param backupSet The backup set used to find the source of each block.
+ * @return The plan.
+ */
+RestorePlan planDiskRestore(const file_structs::fileLayout& layout, const file_structs::Disk::DiskLayout& disk, BackupSet& backupSet);
+
+/**
+ * @brief Removes the blocks that have not changed since an earlier backup of the set from a list.
+ *
+ * The index built for a backup set has the delta index of each incremental merged into it, and each entry
+ * names the file that wrote the block. A block written by a file after the earlier backup changed after it.
+ * The blocks written by the earlier backup, or by the files before it, are the same on a disk restored from it.
+ *
+ * @param blocks The blocks to filter.
+ * @param backupSet The backup set the blocks were listed from.
+ * @param earlier The header of the earlier backup file.
+ * @throws std::runtime_error if the backup set does not show where the earlier backup is in its chain.
+ */
+void keepBlocksChangedSince(std::vector<BlockRef>& blocks, const BackupSet& backupSet, const file_structs::Header& earlier);
+
+/**
+ * @brief Removes the blocks that have not changed since an earlier backup of the set from a plan.
+ *
+ * @param plan The plan to filter. Its byte counts are updated.
+ * @param backupSet The backup set the plan was made from.
+ * @param earlier The header of the earlier backup file.
+ * @throws std::runtime_error if the backup set does not show where the earlier backup is in its chain.
+ */
+void keepBlocksChangedSince(RestorePlan& plan, const BackupSet& backupSet, const file_structs::Header& earlier);
+
+/**
+ * @brief Returns true if two backups of a disk place its blocks at the same disk offsets.
+ *
+ * The blocks of a partition are placed from the start of the partition, the first cluster of its file system
+ * and its block size. A partition that was moved, resized or formatted again between the backups has its
+ * unchanged blocks somewhere else on the disk.
+ *
+ * @param earlier The disk in the earlier backup.
+ * @param later The disk in the later backup.
+ * @return True if both backups have the same partitions, each placed the same way.
+ */
+bool haveSameBlockPlacement(const file_structs::Disk::DiskLayout& earlier, const file_structs::Disk::DiskLayout& later);
+
+/**
+ * @brief Merges the blocks of several disks into one list that takes turns between the disks.
+ *
+ * Each turn takes about `turnBytes` stored bytes of a disk, in its read order, so pipeline workers that
+ * take batches of that size in list order restore all the disks at once rather than one after another.
+ *
+ * @param diskBlocks The blocks of each disk, in read order.
+ * @param turnBytes The stored bytes of each turn.
+ * @return The merged list.
+ */
+std::vector<BlockRef> interleaveDisks(const std::vector<std::vector<BlockRef>>& diskBlocks, uint64_t turnBytes);
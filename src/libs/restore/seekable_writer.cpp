@@ -0,0 +1,270 @@
+// seekable_writer.cpp : Writes a restored disk as a zstd seekable format file.
+//
+
+#include "pch.h"
+#include ".\zstd\zstd.h"
+#include "seekable_writer.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+
+This file writes the zstd seekable format, as described in
+https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md.
+Zstandard is dual-licensed under BSD and GPLv2. For a complete
+description, please see https://github.com/facebook/zstd/blob/dev/LICENSE.
+===============================================================================
+*/
+
+namespace
+{
+	// The seek table is a skippable frame with this magic number
+	constexpr uint32_t SKIPPABLE_FRAME_MAGIC = 0x184D2A5E;
+	constexpr uint32_t SEEKABLE_MAGIC = 0x8F92EAB1;
+	// The seek table footer: the number of frames, the descriptor and the seekable magic number
+	constexpr size_t SEEK_TABLE_FOOTER_SIZE = 9;
+	// The most frames a seekable decompressor accepts
+	constexpr size_t MAX_FRAMES = 0x8000000;
+
+	/**
+	 * @brief Appends a value in little-endian byte order, the byte order of every seek table field.
+	 */
+	void putLittleEndian(std::vector<uint8_t>& out, uint32_t value)
+	{
+		for (int i = 0; i < 4; i++) {
+			out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+		}
+	}
+}
+
+/**
+ * @brief Creates the file and a compression context for the frames the writer compresses.
+ *
+ * @param filePath The path of the file. An existing file is overwritten.
+ * @param compressionLevel The zstd compression level.
+ * @throws std::runtime_error if the file or the compression context could not be created.
+ */
+SeekableZstdWriter::SeekableZstdWriter(const std::wstring& filePath, int compressionLevel /*= 1*/)
+	: file(filePath, false), context(ZSTD_createCCtx()), compressionLevel(compressionLevel)
+{
+	if (context == nullptr) {
+		throw std::runtime_error("Failed to create compression context.");
+	}
+	name = filePath;
+}
+
+/**
+ * @brief Frees the compression context.
+ */
+SeekableZstdWriter::~SeekableZstdWriter()
+{
+	ZSTD_freeCCtx(context);
+}
+
+/**
+ * @brief Records the size of the disk and compresses the zero frame used for gaps.
+ *
+ * @param size The size of the disk.
+ */
+void SeekableZstdWriter::prepare(uint64_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	diskSize = size;
+	diskPosition = 0;
+	fileEnd = 0;
+	pending.clear();
+	seekTable.clear();
+
+	std::vector<uint8_t> zeros(ZERO_FRAME_SIZE, 0);
+	zeroFrame.resize(ZSTD_compressBound(zeros.size()));
+	size_t frameSize = ZSTD_compressCCtx(context, zeroFrame.data(), zeroFrame.size(), zeros.data(), zeros.size(), compressionLevel);
+	if (ZSTD_isError(frameSize)) {
+		throw std::runtime_error("Failed to compress zero frame.");
+	}
+	zeroFrame.resize(frameSize);
+}
+
+/**
+ * @brief Adds data to the frame being built, after zero frames for any gap before it.
+ *
+ * @param offset The disk offset. Must not be before the end of the data already written.
+ * @param data The data.
+ * @param length The length of the data.
+ * @throws std::runtime_error if the data is out of order or cannot be written.
+ */
+void SeekableZstdWriter::writeAt(uint64_t offset, const void* data, size_t length)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	skipTo(offset);
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	while (length > 0) {
+		size_t toCopy = std::min<size_t>(length, FRAME_SIZE - pending.size());
+		pending.insert(pending.end(), bytes, bytes + toCopy);
+		diskPosition += toCopy;
+		bytes += toCopy;
+		length -= toCopy;
+		if (pending.size() == FRAME_SIZE) {
+			compressPending();
+		}
+	}
+}
+
+/**
+ * @brief Writes zero frames for a range.
+ *
+ * @param offset The disk offset. Must not be before the end of the data already written.
+ * @param length The length of the range.
+ * @throws std::runtime_error if the range is out of order or cannot be written.
+ */
+void SeekableZstdWriter::zeroRange(uint64_t offset, uint64_t length)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	skipTo(offset);
+	appendZeros(length);
+}
+
+/**
+ * @brief Accepts any block. A frame is written as it is, whatever its size.
+ */
+bool SeekableZstdWriter::canWriteCompressed(uint64_t offset, uint64_t length) const
+{
+	return length != 0 && length <= UINT32_MAX;
+}
+
+/**
+ * @brief Writes a stored zstd frame as a frame of the file, after zero frames for any gap before it.
+ *
+ * @param offset The disk offset. Must not be before the end of the data already written.
+ * @param frame The zstd frame, which records its decompressed size.
+ * @param length The length of the frame.
+ * @throws std::runtime_error if the frame is out of order, does not record its size or cannot be written.
+ */
+void SeekableZstdWriter::writeCompressedAt(uint64_t offset, const void* frame, size_t length)
+{
+	unsigned long long decompressedSize = ZSTD_getFrameContentSize(frame, length);
+	if (decompressedSize == ZSTD_CONTENTSIZE_ERROR || decompressedSize == ZSTD_CONTENTSIZE_UNKNOWN || decompressedSize > UINT32_MAX) {
+		throw std::runtime_error("The block is not a zstd frame of a known size.");
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	skipTo(offset);
+	compressPending();
+	appendFrame(frame, length, static_cast<uint32_t>(decompressedSize));
+	diskPosition += decompressedSize;
+}
+
+/**
+ * @brief Writes zero frames to the end of the disk, then the seek table.
+ *
+ * The seek table is written after the last frame without being counted in the file, so more
+ * frames can be written after a flush and the next flush writes the table again.
+ *
+ * @throws std::runtime_error if the file has too many frames or cannot be written.
+ */
+void SeekableZstdWriter::flush()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (diskPosition < diskSize) {
+		skipTo(diskSize);
+	}
+	compressPending();
+	if (seekTable.size() > MAX_FRAMES) {
+		throw std::runtime_error("The disk needs more frames than a seekable zstd file can hold.");
+	}
+
+	std::vector<uint8_t> table;
+	table.reserve(8 + seekTable.size() * sizeof(SeekEntry) + SEEK_TABLE_FOOTER_SIZE);
+	putLittleEndian(table, SKIPPABLE_FRAME_MAGIC);
+	putLittleEndian(table, static_cast<uint32_t>(seekTable.size() * sizeof(SeekEntry) + SEEK_TABLE_FOOTER_SIZE));
+	for (const auto& entry : seekTable) {
+		putLittleEndian(table, entry.compressed_size);
+		putLittleEndian(table, entry.decompressed_size);
+	}
+	putLittleEndian(table, static_cast<uint32_t>(seekTable.size()));
+	// No checksums in the seek table
+	table.push_back(0);
+	putLittleEndian(table, SEEKABLE_MAGIC);
+
+	file.writeAt(fileEnd, table.data(), table.size());
+	// Drop anything left over from a file that was there before
+	file.prepare(fileEnd + table.size());
+	file.flush();
+}
+
+/**
+ * @brief Writes zero frames up to `offset`.
+ *
+ * @param offset The disk offset of the next write.
+ * @throws std::runtime_error if `offset` is before the end of the data already written.
+ */
+void SeekableZstdWriter::skipTo(uint64_t offset)
+{
+	if (offset < diskPosition) {
+		throw std::runtime_error("A seekable zstd file must be written in disk order.");
+	}
+	if (offset > diskPosition) {
+		appendZeros(offset - diskPosition);
+	}
+}
+
+/**
+ * @brief Compresses the data held from `writeAt` into a frame, if there is any.
+ */
+void SeekableZstdWriter::compressPending()
+{
+	if (!pending.empty()) {
+		appendCompressed(pending.data(), pending.size());
+		pending.clear();
+	}
+}
+
+/**
+ * @brief Writes frames of `length` zeros. Whole zero frames reuse the frame compressed by `prepare`.
+ *
+ * @param length The number of zero bytes.
+ */
+void SeekableZstdWriter::appendZeros(uint64_t length)
+{
+	compressPending();
+	diskPosition += length;
+	for (; length >= ZERO_FRAME_SIZE; length -= ZERO_FRAME_SIZE) {
+		appendFrame(zeroFrame.data(), zeroFrame.size(), ZERO_FRAME_SIZE);
+	}
+	if (length > 0) {
+		std::vector<uint8_t> zeros(static_cast<size_t>(length), 0);
+		appendCompressed(zeros.data(), zeros.size());
+	}
+}
+
+/**
+ * @brief Compresses data into a frame and writes it.
+ *
+ * @param data The data.
+ * @param length The length of the data, at most `ZERO_FRAME_SIZE`.
+ * @throws std::runtime_error if the data cannot be compressed or written.
+ */
+void SeekableZstdWriter::appendCompressed(const uint8_t* data, size_t length)
+{
+	compressed.resize(ZSTD_compressBound(length));
+	size_t frameSize = ZSTD_compressCCtx(context, compressed.data(), compressed.size(), data, length, compressionLevel);
+	if (ZSTD_isError(frameSize)) {
+		throw std::runtime_error("Failed to compress frame.");
+	}
+	appendFrame(compressed.data(), frameSize, static_cast<uint32_t>(length));
+}
+
+/**
+ * @brief Writes a frame at the end of the file and adds it to the seek table.
+ *
+ * @param frame The frame.
+ * @param length The length of the frame.
+ * @param decompressedSize The number of bytes the frame decompresses to.
+ */
+void SeekableZstdWriter::appendFrame(const void* frame, size_t length, uint32_t decompressedSize)
+{
+	file.writeAt(fileEnd, frame, length);
+	fileEnd += length;
+	seekTable.push_back({ static_cast<uint32_t>(length), decompressedSize });
+}
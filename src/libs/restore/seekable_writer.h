@@ -0,0 +1,125 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief Writes a restored disk as a zstd seekable format file.
+ *
+ * The seekable format is a series of independent zstd frames followed by a seek table, a
+ * skippable frame that lists the compressed and decompressed size of every frame. Any zstd
+ * decompressor reads the file as the raw disk, and a seekable decompressor reads any range of
+ * the disk by decompressing only the frames that hold it.
+ *
+ * Each data block of a compressed backup file is already a zstd frame, so a block is written as
+ * its stored frame and is never compressed again. Gaps between the blocks are written as frames
+ * of zeros, which compress to a few bytes.
+ */
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "..\file_operations\restore_target.h"
+
+struct ZSTD_CCtx_s;
+
+/**
+ * @class SeekableZstdWriter
+ * @brief A sequential `RestoreTarget` that writes a zstd seekable format file.
+ *
+ * The disk must be written from start to end. Blocks passed to `writeCompressedAt` are written
+ * as they are; data passed to `writeAt`, such as track 0, is compressed into frames of up to
+ * `FRAME_SIZE` bytes. The seek table is written by `flush`, which must be called once the
+ * restore is complete.
+ */
+class SeekableZstdWriter : public RestoreTarget {
+public:
+	// The most bytes of data from writeAt compressed into one frame
+	static constexpr uint32_t FRAME_SIZE = 1024 * 1024;
+
+	// The most zero bytes in one frame. Zero frames compress to a few bytes, so larger frames keep the seek table small.
+	static constexpr uint32_t ZERO_FRAME_SIZE = 16 * 1024 * 1024;
+
+	/**
+	 * @brief Creates the file.
+	 *
+	 * @param filePath The path of the file. An existing file is overwritten.
+	 * @param compressionLevel The zstd compression level of the frames compressed by the writer.
+	 * @throws std::runtime_error if the file could not be created.
+	 */
+	SeekableZstdWriter(const std::wstring& filePath, int compressionLevel = 1);
+	~SeekableZstdWriter() override;
+
+	SeekableZstdWriter(const SeekableZstdWriter&) = delete;
+	SeekableZstdWriter& operator=(const SeekableZstdWriter&) = delete;
+
+	void prepare(uint64_t size) override;
+	void writeAt(uint64_t offset, const void* data, size_t length) override;
+	void zeroRange(uint64_t offset, uint64_t length) override;
+	bool canWriteCompressed(uint64_t offset, uint64_t length) const override;
+	void writeCompressedAt(uint64_t offset, const void* frame, size_t length) override;
+	bool isSequential() const override { return true; }
+	void flush() override;
+	uint64_t getSize() override { return diskSize; }
+	void setWriteBack(const WriteBackPolicy& policy) override { file.setWriteBack(policy); }
+	WriteBackStats getWriteBackStats() const override { return file.getWriteBackStats(); }
+
+private:
+	/**
+	 * @brief Writes zero frames up to `offset`. Must be called with the mutex held.
+	 * @throws std::runtime_error if `offset` is before the end of the data already written.
+	 */
+	void skipTo(uint64_t offset);
+
+	/**
+	 * @brief Compresses the data held from `writeAt` into a frame. Must be called with the mutex held.
+	 */
+	void compressPending();
+
+	/**
+	 * @brief Writes frames of `length` zeros. Must be called with the mutex held.
+	 */
+	void appendZeros(uint64_t length);
+
+	/**
+	 * @brief Compresses data into a frame and writes it. Must be called with the mutex held.
+	 */
+	void appendCompressed(const uint8_t* data, size_t length);
+
+	/**
+	 * @brief Writes a frame and adds it to the seek table. Must be called with the mutex held.
+	 */
+	void appendFrame(const void* frame, size_t length, uint32_t decompressedSize);
+
+	/**
+	 * @struct SeekEntry
+	 * @brief An entry of the seek table.
+	 */
+	struct SeekEntry
+	{
+		uint32_t compressed_size;
+		uint32_t decompressed_size;
+	};
+
+	FileTarget file;
+	ZSTD_CCtx_s* context;
+	int compressionLevel;
+	uint64_t diskSize = 0;
+	// The disk offset of the end of the data written, including the pending data
+	uint64_t diskPosition = 0;
+	// The file offset of the end of the last frame
+	uint64_t fileEnd = 0;
+	// Data from writeAt that has not yet been compressed, which ends at diskPosition
+	std::vector<uint8_t> pending;
+	std::vector<uint8_t> compressed;
+	// A frame of ZERO_FRAME_SIZE zeros
+	std::vector<uint8_t> zeroFrame;
+	std::vector<SeekEntry> seekTable;
+	std::mutex mutex;
+};
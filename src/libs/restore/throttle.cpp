@@ -0,0 +1,419 @@
+// throttle.cpp : Rate limits and process priority for restore and verify jobs.
+//
+
+#include "pch.h"
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include "throttle.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#ifdef __linux__
+#include <cerrno>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+// The part of a second's worth of tokens a bucket holds, which bounds the burst after an idle spell
+static constexpr double BURST_SECONDS = 0.25;
+
+// How often the control file's modification time is checked
+static constexpr std::chrono::milliseconds CONTROL_POLL_INTERVAL{ 1000 };
+
+// How often the watcher wakes to check for a stop or a reload request
+static constexpr std::chrono::milliseconds CONTROL_WAKE_INTERVAL{ 100 };
+
+// ==============================
+// RateLimiter
+// ==============================
+
+/**
+ * @brief Creates a limiter with a full bucket.
+ *
+ * @param bytesPerSecond The limit. 0 for no limit.
+ * @param parent A limiter that is also charged with every byte. Null for none.
+ */
+RateLimiter::RateLimiter(uint64_t bytesPerSecond, RateLimiter* parent)
+	: parent(parent), rate(bytesPerSecond), tokens(bytesPerSecond * BURST_SECONDS), lastRefill(std::chrono::steady_clock::now())
+{
+}
+
+/**
+ * @brief Changes the limit. The tokens gathered at the old rate are kept, up to the new bucket size.
+ *
+ * @param bytesPerSecond The new limit. 0 for no limit.
+ */
+void RateLimiter::setRate(uint64_t bytesPerSecond)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto now = std::chrono::steady_clock::now();
+	if (rate == 0) {
+		// An unlimited bucket gathers nothing, so start the new limit full
+		tokens = bytesPerSecond * BURST_SECONDS;
+	}
+	else {
+		tokens += std::chrono::duration<double>(now - lastRefill).count() * rate;
+		tokens = std::min(tokens, bytesPerSecond * BURST_SECONDS);
+	}
+	lastRefill = now;
+	rate = bytesPerSecond;
+}
+
+/**
+ * @brief Gets the limit.
+ *
+ * @return The limit in bytes per second. 0 for no limit.
+ */
+uint64_t RateLimiter::getRate() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return rate;
+}
+
+/**
+ * @brief Takes bytes from the bucket and the parent's, waiting until the rates allow them.
+ *
+ * The bytes are taken even if the bucket runs into debt, and the caller sleeps until it is repaid. A caller
+ * that arrives during the wait takes its bytes after the debt, so callers are served in turn.
+ *
+ * @param bytes The number of bytes about to be read or written.
+ */
+void RateLimiter::acquire(uint64_t bytes)
+{
+	if (parent) {
+		parent->acquire(bytes);
+	}
+
+	std::chrono::duration<double> wait{ 0 };
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (rate == 0) {
+			return;
+		}
+		auto now = std::chrono::steady_clock::now();
+		tokens += std::chrono::duration<double>(now - lastRefill).count() * rate;
+		tokens = std::min(tokens, rate * BURST_SECONDS);
+		lastRefill = now;
+		tokens -= static_cast<double>(bytes);
+		if (tokens < 0) {
+			wait = std::chrono::duration<double>(-tokens / rate);
+		}
+	}
+	if (wait.count() > 0) {
+		std::this_thread::sleep_for(wait);
+	}
+}
+
+/**
+ * @brief Gets the limiter every job's reads are charged to.
+ *
+ * @return The global read limiter.
+ */
+RateLimiter& RateLimiter::globalReads()
+{
+	static RateLimiter limiter;
+	return limiter;
+}
+
+/**
+ * @brief Gets the limiter every job's writes are charged to.
+ *
+ * @return The global write limiter.
+ */
+RateLimiter& RateLimiter::globalWrites()
+{
+	static RateLimiter limiter;
+	return limiter;
+}
+
+// ==============================
+// Priority
+// ==============================
+
+#ifdef __linux__
+/**
+ * @brief Sets the nice value and I/O priority of every thread of the process.
+ *
+ * The threads are listed again until a pass finds none it has not changed, which catches a thread
+ * started by one that had not been changed yet. A thread that ends before it is changed is skipped.
+ *
+ * @param niceValue The nice value.
+ * @param ioPriority The I/O class and level, as ioprio_set takes them.
+ * @return False if the system refused the change for a thread.
+ */
+static bool applyToEveryThread(int niceValue, int ioPriority)
+{
+	constexpr int IOPRIO_WHO_PROCESS = 1;
+
+	bool applied = true;
+	std::set<pid_t> changed;
+	bool found = true;
+	while (found) {
+		found = false;
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator("/proc/self/task", error)) {
+			pid_t thread = static_cast<pid_t>(std::stol(entry.path().filename().string()));
+			if (!changed.insert(thread).second) {
+				continue;
+			}
+			found = true;
+			if (setpriority(PRIO_PROCESS, thread, niceValue) != 0 && errno != ESRCH) {
+				applied = false;
+			}
+			if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, thread, ioPriority) != 0 && errno != ESRCH) {
+				applied = false;
+			}
+		}
+		if (error) {
+			// Without /proc only the calling thread can be changed
+			return setpriority(PRIO_PROCESS, 0, niceValue) == 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioPriority) == 0;
+		}
+	}
+	return applied;
+}
+#endif
+
+/**
+ * @brief Sets the CPU and I/O priority of the process, on Linux of each of its threads.
+ *
+ * @param priority The priority.
+ * @return False if the system refused part of the change.
+ */
+bool applyPriority(ImageEnums::CPUPrority priority)
+{
+#ifdef _WIN32
+	DWORD priorityClass = NORMAL_PRIORITY_CLASS;
+	switch (priority) {
+	case ImageEnums::CPUPrority::eIdle:
+		priorityClass = IDLE_PRIORITY_CLASS;
+		break;
+	case ImageEnums::CPUPrority::eBelowNormal:
+		priorityClass = BELOW_NORMAL_PRIORITY_CLASS;
+		break;
+	case ImageEnums::CPUPrority::eAboveNormal:
+		priorityClass = ABOVE_NORMAL_PRIORITY_CLASS;
+		break;
+	default:
+		break;
+	}
+
+	// Background mode lowers the I/O and memory priority as well. It is left for any other priority.
+	bool applied = true;
+	if (priority == ImageEnums::CPUPrority::eIdle) {
+		if (!SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN) && GetLastError() != ERROR_PROCESS_MODE_ALREADY_BACKGROUND) {
+			applied = false;
+		}
+	}
+	else if (!SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_END) && GetLastError() != ERROR_PROCESS_MODE_NOT_BACKGROUND) {
+		applied = false;
+	}
+	if (!SetPriorityClass(GetCurrentProcess(), priorityClass)) {
+		applied = false;
+	}
+	return applied;
+#else
+	int niceValue = 0;
+	switch (priority) {
+	case ImageEnums::CPUPrority::eIdle:
+		niceValue = 19;
+		break;
+	case ImageEnums::CPUPrority::eBelowNormal:
+		niceValue = 10;
+		break;
+	case ImageEnums::CPUPrority::eAboveNormal:
+		niceValue = -5;
+		break;
+	default:
+		break;
+	}
+
+#ifdef __linux__
+	// The I/O classes and levels of ioprio_set, which has no wrapper in the C library
+	constexpr int IOPRIO_CLASS_SHIFT = 13;
+	constexpr int IOPRIO_CLASS_NONE = 0;
+	constexpr int IOPRIO_CLASS_BE = 2;
+	constexpr int IOPRIO_CLASS_IDLE = 3;
+
+	int ioPriority = IOPRIO_CLASS_NONE << IOPRIO_CLASS_SHIFT;
+	switch (priority) {
+	case ImageEnums::CPUPrority::eIdle:
+		ioPriority = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+		break;
+	case ImageEnums::CPUPrority::eBelowNormal:
+		ioPriority = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7;
+		break;
+	case ImageEnums::CPUPrority::eAboveNormal:
+		ioPriority = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 0;
+		break;
+	default:
+		break;
+	}
+	return applyToEveryThread(niceValue, ioPriority);
+#else
+	return setpriority(PRIO_PROCESS, 0, niceValue) == 0;
+#endif
+#endif
+}
+
+// ==============================
+// ThrottleControl
+// ==============================
+
+// Counts the reload requests, so every watcher reads its control file again after one
+static std::atomic<uint32_t> reloadRequests{ 0 };
+
+// A request may come from a signal handler, which can only use lock-free atomics
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Reload requests need a lock-free counter.");
+
+/**
+ * @brief Asks every watcher to read its control file again at once.
+ */
+void ThrottleControl::requestReload()
+{
+	++reloadRequests;
+}
+
+/**
+ * @brief Parses a control file setting as a number of MB/s.
+ *
+ * @param key The setting, for the error message.
+ * @param value The value of the setting.
+ * @return The rate in bytes per second.
+ * @throws std::runtime_error if the value is not a whole number.
+ */
+static uint64_t parseRate(const std::string& key, const std::string& value)
+{
+	if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+		throw std::runtime_error("Bad rate in control file for " + key + ": " + value);
+	}
+	return std::stoull(value) * 1024 * 1024;
+}
+
+/**
+ * @brief Parses a control file setting as a priority.
+ *
+ * @param value The value of the setting.
+ * @return The priority.
+ * @throws std::runtime_error if the value is not a priority.
+ */
+static ImageEnums::CPUPrority parsePriority(const std::string& value)
+{
+	static const std::map<std::string, ImageEnums::CPUPrority> priorities = {
+		{ "idle", ImageEnums::CPUPrority::eIdle },
+		{ "below_normal", ImageEnums::CPUPrority::eBelowNormal },
+		{ "normal", ImageEnums::CPUPrority::eNormal },
+		{ "above_normal", ImageEnums::CPUPrority::eAboveNormal } };
+	auto found = priorities.find(value);
+	if (found == priorities.end()) {
+		throw std::runtime_error("Bad priority in control file: " + value);
+	}
+	return found->second;
+}
+
+/**
+ * @brief Starts watching a control file, reading it first if it exists.
+ *
+ * @param path The path of the control file.
+ * @param limiters The limiters of the job.
+ */
+ThrottleControl::ThrottleControl(const std::wstring& path, JobLimiters& limiters)
+	: path(path), limiters(limiters)
+{
+	watcher = std::thread(&ThrottleControl::watch, this);
+}
+
+/**
+ * @brief Stops watching the control file. The limits and priority last applied stay in force.
+ */
+ThrottleControl::~ThrottleControl()
+{
+	stop = true;
+	watcher.join();
+}
+
+/**
+ * @brief Reads the control file now and applies it.
+ *
+ * @return False if the file does not exist or cannot be read.
+ * @throws std::runtime_error if a setting has a bad value.
+ */
+bool ThrottleControl::reload()
+{
+	std::filesystem::path controlPath(path);
+	std::ifstream file(controlPath);
+	if (!file) {
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		line.erase(std::remove_if(line.begin(), line.end(), [](char c) { return c == ' ' || c == '\t' || c == '\r'; }), line.end());
+		size_t equals = line.find('=');
+		if (line.empty() || line[0] == '#' || equals == std::string::npos) {
+			continue;
+		}
+		std::string key = line.substr(0, equals);
+		std::string value = line.substr(equals + 1);
+		if (key == "read") {
+			limiters.reads.setRate(parseRate(key, value));
+		}
+		else if (key == "write") {
+			limiters.writes.setRate(parseRate(key, value));
+		}
+		else if (key == "global_read") {
+			RateLimiter::globalReads().setRate(parseRate(key, value));
+		}
+		else if (key == "global_write") {
+			RateLimiter::globalWrites().setRate(parseRate(key, value));
+		}
+		else if (key == "priority") {
+			applyPriority(parsePriority(value));
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Reads the control file whenever it changes or a reload is requested, until stopped.
+ *
+ * A file with a bad setting is skipped from that setting on, and read again when it next changes.
+ */
+void ThrottleControl::watch()
+{
+	std::filesystem::file_time_type lastWrite{};
+	auto nextPoll = std::chrono::steady_clock::now();
+	uint32_t reloadsSeen = reloadRequests;
+	while (!stop) {
+		bool changed = reloadRequests != reloadsSeen;
+		reloadsSeen = reloadRequests;
+		if (std::chrono::steady_clock::now() >= nextPoll) {
+			std::error_code error;
+			auto writeTime = std::filesystem::last_write_time(std::filesystem::path(path), error);
+			if (!error && writeTime != lastWrite) {
+				lastWrite = writeTime;
+				changed = true;
+			}
+			nextPoll = std::chrono::steady_clock::now() + CONTROL_POLL_INTERVAL;
+		}
+		if (changed) {
+			try {
+				reload();
+			}
+			catch (const std::exception&) {
+				// The settings before the bad one are applied, the rest are left as they were
+			}
+		}
+		std::this_thread::sleep_for(CONTROL_WAKE_INTERVAL);
+	}
+}
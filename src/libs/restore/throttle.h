@@ -0,0 +1,168 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief Rate limits and process priority for restore and verify jobs.
+ *
+ * A job charges the bytes it reads and writes to token bucket rate limiters. Each job can have its own
+ * limiters, which also charge the process-wide limiters, so several jobs in one process share the global
+ * limits. The limits can be changed while a job runs, from a control file watched by `ThrottleControl`.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "..\file_reader\file_reader.h"
+
+/**
+ * @class RateLimiter
+ * @brief A token bucket that limits the bytes passed through it each second.
+ *
+ * Tokens accrue at the rate, up to a quarter of a second's worth. `acquire` takes its bytes at once and
+ * sleeps until the bucket is out of debt, so a request larger than the bucket waits for its own bytes
+ * rather than failing. May be used from several threads at once.
+ */
+class RateLimiter {
+public:
+	/**
+	 * @brief Creates a limiter.
+	 *
+	 * @param bytesPerSecond The limit. 0 for no limit.
+	 * @param parent A limiter that is also charged with every byte, such as a global limiter. Null for none.
+	 */
+	explicit RateLimiter(uint64_t bytesPerSecond = 0, RateLimiter* parent = nullptr);
+
+	RateLimiter(const RateLimiter&) = delete;
+	RateLimiter& operator=(const RateLimiter&) = delete;
+
+	/**
+	 * @brief Changes the limit. Threads already waiting finish the wait they started with.
+	 *
+	 * @param bytesPerSecond The new limit. 0 for no limit.
+	 */
+	void setRate(uint64_t bytesPerSecond);
+
+	/**
+	 * @brief Gets the limit.
+	 *
+	 * @return The limit in bytes per second. 0 for no limit.
+	 */
+	uint64_t getRate() const;
+
+	/**
+	 * @brief Takes bytes from the bucket and the parent's, waiting until the rates allow them.
+	 *
+	 * @param bytes The number of bytes about to be read or written.
+	 */
+	void acquire(uint64_t bytes);
+
+	/**
+	 * @brief Gets the limiter every job's reads are charged to.
+	 *
+	 * @return The global read limiter. It has no limit until one is set.
+	 */
+	static RateLimiter& globalReads();
+
+	/**
+	 * @brief Gets the limiter every job's writes are charged to.
+	 *
+	 * @return The global write limiter. It has no limit until one is set.
+	 */
+	static RateLimiter& globalWrites();
+
+private:
+	RateLimiter* parent;
+	mutable std::mutex mutex;
+	uint64_t rate;
+	double tokens = 0;
+	std::chrono::steady_clock::time_point lastRefill;
+};
+
+/**
+ * @brief Sets the CPU and I/O priority of the process, and of the threads it starts from then on.
+ *
+ * On Windows, the priority class is set, and eIdle also enters background mode, which lowers the
+ * I/O and memory priority of the process. On Linux, eIdle sets the nice value to 19 and the idle I/O class,
+ * eBelowNormal sets a nice value of 10 and the lowest best-effort I/O level, and eAboveNormal sets a nice
+ * value of -5 and the highest best-effort I/O level, which needs privileges. Linux keeps these per thread,
+ * so every thread of the process is changed, and the threads they start inherit the new priority.
+ *
+ * @param priority The priority.
+ * @return False if the system refused part of the change. The rest of it is still applied.
+ */
+bool applyPriority(ImageEnums::CPUPrority priority);
+
+/**
+ * @struct JobLimiters
+ * @brief The read and write limiters of one job, each charging the global limiter of its kind.
+ *
+ * @var reads Limits the bytes read from the backup files and, when they are compared, from the target.
+ * @var writes Limits the bytes written to the target.
+ */
+struct JobLimiters
+{
+	RateLimiter reads{ 0, &RateLimiter::globalReads() };
+	RateLimiter writes{ 0, &RateLimiter::globalWrites() };
+};
+
+/**
+ * @class ThrottleControl
+ * @brief Watches a control file and applies the limits and priority in it while a job runs.
+ *
+ * The control file holds one `key=value` setting per line. Rates are in MB/s, with 0 for no limit:
+ * - read, write: the limits of the job.
+ * - global_read, global_write: the limits of every job in the process.
+ * - priority: idle, below_normal, normal or above_normal.
+ *
+ * Lines starting with # and unknown keys are ignored. A setting missing from the file is left as it is.
+ * The file is read when it is first found, then whenever its modification time changes, or at once
+ * after `requestReload`. The library installs no signal handlers. A program that wants SIGHUP to
+ * reload the file installs a handler that calls `requestReload`.
+ */
+class ThrottleControl {
+public:
+	/**
+	 * @brief Starts watching a control file.
+	 *
+	 * @param path The path of the control file. It need not exist yet.
+	 * @param limiters The limiters of the job.
+	 */
+	ThrottleControl(const std::wstring& path, JobLimiters& limiters);
+	~ThrottleControl();
+
+	ThrottleControl(const ThrottleControl&) = delete;
+	ThrottleControl& operator=(const ThrottleControl&) = delete;
+
+	/**
+	 * @brief Reads the control file now and applies it.
+	 *
+	 * @return False if the file does not exist or cannot be read.
+	 * @throws std::runtime_error if a setting has a bad value. The settings before it are applied.
+	 */
+	bool reload();
+
+	/**
+	 * @brief Asks every watcher to read its control file again at once.
+	 *
+	 * It only counts the request in a lock-free atomic, so it may be called from a signal handler.
+	 */
+	static void requestReload();
+
+private:
+	std::wstring path;
+	JobLimiters& limiters;
+	std::atomic<bool> stop{ false };
+	std::thread watcher;
+
+	void watch();
+};
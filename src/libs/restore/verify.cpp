@@ -0,0 +1,173 @@
+// verify.cpp : Verifies the data blocks of a backup set.
+//
+
+#include "pch.h"
+#include "..\file_reader\file_reader.h"
+#include "..\file_operations\file_operations.h"
+#include "verify.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @brief Lists the blocks to verify.
+ *
+ * @param backupSet The backup set.
+ * @param scope The blocks to list.
+ * @return The blocks in read order, with duplicate references removed.
+ */
+std::vector<BlockRef> collectVerifyBlocks(BackupSet& backupSet, VerifyScope scope)
+{
+	std::vector<BlockRef> blocks;
+	if (scope == VerifyScope::eBackupSet) {
+		const file_structs::fileLayout& layout = backupSet.getBackupFileWithFullIndex();
+		for (const auto& disk : layout.disks) {
+			for (const auto& partition : disk.partitions) {
+				appendPartitionBlocks(layout, disk, partition, backupSet, false, blocks);
+			}
+		}
+	}
+	else {
+		for (const auto& fileLayout : backupSet.fileLayouts) {
+			for (const auto& disk : fileLayout->disks) {
+				for (const auto& partition : disk.partitions) {
+					appendPartitionBlocks(*fileLayout, disk, partition, backupSet, true, blocks);
+				}
+			}
+		}
+	}
+
+	sortBlocksByFilePosition(blocks);
+
+	// A block can be referenced by more than one index. Check it once.
+	auto duplicate = std::unique(blocks.begin(), blocks.end(), [](const BlockRef& a, const BlockRef& b) {
+		return a.source == b.source && a.element->file_number == b.element->file_number && a.element->file_position == b.element->file_position;
+	});
+	blocks.erase(duplicate, blocks.end());
+	return blocks;
+}
+
+/**
+ * @brief Describes a block that could not be read or decoded.
+ *
+ * The offset in the file system is found from the block size of the block's partition.
+ *
+ * @param block The block.
+ * @param error Why the block failed.
+ * @return The bad block.
+ */
+BadBlock describeBadBlock(const BlockRef& block, const std::string& error)
+{
+	BadBlock badBlock;
+	badBlock.file_name = block.source ? block.source->getName() : std::wstring();
+	badBlock.file_number = block.element->file_number;
+	badBlock.file_position = block.element->file_position;
+	badBlock.block_length = block.element->block_length;
+	badBlock.disk_number = block.disk_number;
+	badBlock.partition_number = block.partition_number;
+	badBlock.disk_lba = block.disk_offset / block.bytes_per_sector;
+	badBlock.sector_count = (block.write_limit + block.bytes_per_sector - 1) / block.bytes_per_sector;
+	badBlock.reserved_sectors = block.reserved_sectors;
+	badBlock.error = error;
+	for (const auto& disk : block.layout->disks) {
+		if (disk._header.disk_number != block.disk_number) {
+			continue;
+		}
+		for (const auto& partition : disk.partitions) {
+			if (partition._header.partition_number == block.partition_number) {
+				badBlock.file_system_offset = static_cast<uint64_t>(block.iv_index) * partition._header.block_size;
+			}
+		}
+	}
+	return badBlock;
+}
+
+/**
+ * @brief Formats bad blocks as a JSON map.
+ *
+ * @param badBlocks The bad blocks.
+ * @return The JSON text.
+ */
+std::string formatBadBlockMap(const std::vector<BadBlock>& badBlocks)
+{
+	nlohmann::json blocks = nlohmann::json::array();
+	for (const auto& badBlock : badBlocks) {
+		blocks.push_back({
+			{ "disk_number", badBlock.disk_number },
+			{ "partition_number", badBlock.partition_number },
+			{ "disk_lba", badBlock.disk_lba },
+			{ "sector_count", badBlock.sector_count },
+			{ "reserved_sectors", badBlock.reserved_sectors },
+			{ "file_system_offset", badBlock.file_system_offset },
+			{ "file_name", wideToString(badBlock.file_name) },
+			{ "file_number", badBlock.file_number },
+			{ "file_position", badBlock.file_position },
+			{ "block_length", badBlock.block_length },
+			{ "error", badBlock.error },
+		});
+	}
+	nlohmann::json map;
+	map["bad_blocks"] = std::move(blocks);
+	return map.dump(2);
+}
+
+/**
+ * @brief Verifies the data blocks of a backup set.
+ *
+ * @param filePath The path to the backup file.
+ * @param password The password for the backup file.
+ * @param scope The blocks to check.
+ * @param threadCount The number of worker threads. 0 uses one thread per logical processor.
+ * @param outputProgress An optional callback function to output the progress of the verification.
+ * @param limiters The rate limiters the reads of the verification are charged to.
+ * @return The verification report.
+ */
+VerifyReport verifyBackup(const std::wstring& filePath, const std::string& password, VerifyScope scope, unsigned threadCount, ProgressCallback outputProgress /*= nullptr*/, JobLimiters* limiters /*= nullptr*/)
+{
+	BackupSet backupSet;
+	{
+		file_structs::fileLayout backupLayout;
+		readBackupFile(filePath, backupLayout, password);
+
+		// Read the backup set, build the index and create a map of file sources
+		createBackupSet(backupSet, filePath, password, backupLayout._header.imageid);
+	}
+
+	std::vector<BlockRef> blocks = collectVerifyBlocks(backupSet, scope);
+
+	VerifyReport report;
+	std::mutex reportMutex;
+	for (const auto& block : blocks) {
+		report.bytes_checked += block.element->block_length;
+	}
+	report.blocks_checked = blocks.size();
+
+	PipelineOptions options;
+	options.thread_count = threadCount;
+	options.read_limit = limiters ? &limiters->reads : &RateLimiter::globalReads();
+
+	// Good blocks are discarded
+	BlockSink sink = [](const BlockRef&, const DecodedBlock&) {};
+
+	BlockErrorHandler onError = [&](const BlockRef& block, const std::string& error) {
+		BadBlock badBlock = describeBadBlock(block, error);
+		std::lock_guard<std::mutex> lock(reportMutex);
+		report.bad_blocks.push_back(std::move(badBlock));
+	};
+
+	runBlockPipeline(blocks, options, sink, onError, outputProgress);
+
+	// Workers finish out of order. Report the bad blocks in backup file order.
+	std::sort(report.bad_blocks.begin(), report.bad_blocks.end(), [](const BadBlock& a, const BadBlock& b) {
+		if (a.file_number != b.file_number) {
+			return a.file_number < b.file_number;
+		}
+		return a.file_position < b.file_position;
+	});
+	return report;
+}
@@ -0,0 +1,108 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief Verifies the data blocks of a backup set without restoring it.
+ *
+ * Every block is read, decrypted and decompressed, and the MD5 hash of its raw data is
+ * compared with the hash in the block index. Nothing is written.
+ */
+
+#include "block_pipeline.h"
+
+/**
+ * @brief The blocks checked by `verifyBackup`.
+ *
+ * - eBackupSet: the blocks a restore of the backup file would read, using the index built for the backup set.
+ * - eAllFiles: the blocks referenced by the index of every file in the backup set, including blocks
+ *   that have been superseded by later incrementals.
+ */
+enum class VerifyScope { eBackupSet, eAllFiles };
+
+/**
+ * @struct BadBlock
+ * @brief A block that failed verification.
+ *
+ * @var file_name The backup file that holds the block.
+ * @var file_number The file number of the block.
+ * @var file_position The offset of the block in the backup file.
+ * @var block_length The stored length of the block.
+ * @var disk_number The disk the block belongs to.
+ * @var partition_number The partition the block belongs to.
+ * @var disk_lba The first sector of the block on the restored disk.
+ * @var sector_count The number of sectors the block fills on the restored disk.
+ * @var reserved_sectors True if the block holds FAT32 reserved sectors rather than file system clusters.
+ * @var file_system_offset The offset of the block in its file system: from LCN 0 for a data block, or from the boot sector
+ *                         for reserved sectors. Divide by the cluster size for the first cluster of a data block.
+ * @var error Why the block failed.
+ */
+struct BadBlock
+{
+	std::wstring file_name;
+	uint16_t file_number = 0;
+	int64_t file_position = 0;
+	uint32_t block_length = 0;
+	int32_t disk_number = 0;
+	int32_t partition_number = 0;
+	uint64_t disk_lba = 0;
+	uint64_t sector_count = 0;
+	bool reserved_sectors = false;
+	uint64_t file_system_offset = 0;
+	std::string error;
+};
+
+/**
+ * @brief Describes a block that could not be read or decoded.
+ *
+ * @param block The block.
+ * @param error Why the block failed.
+ * @return The bad block.
+ */
+BadBlock describeBadBlock(const BlockRef& block, const std::string& error);
+
+/**
+ * @brief Formats bad blocks as a JSON map, for tools that check or repair the restored disk.
+ *
+ * @param badBlocks The bad blocks.
+ * @return A JSON object with a "bad_blocks" array, one object for each block with the fields of `BadBlock`.
+ */
+std::string formatBadBlockMap(const std::vector<BadBlock>& badBlocks);
+
+/**
+ * @struct VerifyReport
+ * @brief The result of `verifyBackup`.
+ *
+ * @var blocks_checked The number of blocks checked.
+ * @var bytes_checked The number of stored bytes read.
+ * @var bad_blocks The blocks that failed, in backup file order.
+ */
+struct VerifyReport
+{
+	uint64_t blocks_checked = 0;
+	uint64_t bytes_checked = 0;
+	std::vector<BadBlock> bad_blocks;
+};
+
+/**
+ * @brief Verifies the data blocks of a backup set.
+ *
+ * Blocks are read in backup file order and checked on all cores. Each block is checked once,
+ * even if it is referenced by the index of more than one file.
+ *
+ * @param filePath The path to the backup file. The rest of the backup set is found next to it.
+ * @param password The password for the backup file.
+ * @param scope The blocks to check.
+ * @param threadCount The number of worker threads. 0 uses one thread per logical processor.
+ * @param outputProgress An optional callback function to output the progress of the verification.
+ * @param limiters The rate limiters the reads of the verification are charged to. Null to charge the global read limiter alone.
+ * @return The verification report.
+ * @throws std::runtime_error if the backup set cannot be read.
+ */
+VerifyReport verifyBackup(const std::wstring& filePath, const std::string& password, VerifyScope scope, unsigned threadCount, ProgressCallback outputProgress = nullptr, JobLimiters* limiters = nullptr);
@@ -1,10 +1,15 @@
 #pragma once
 
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
+#ifdef _WIN32
 #include <windows.h>
 #include <winioctl.h>
 #include <VirtDisk.h>
+#include <objbase.h>
+#endif
+#include <algorithm>
+#include <cstring>
+#include <iterator>
 #include <memory>
 #include <string>
 #include <stdexcept> 
-#include <objbase.h>
@@ -0,0 +1,568 @@
+#include "pch.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+
+This file implements a qcow2 writer that follows the qcow2 version 3
+specification, as implemented by QEMU. Whole backup blocks that are zstd frames
+are stored as zstd compressed clusters without being decompressed.
+===============================================================================
+*/
+#include "qcow2_writer.h"
+#include "..\file_operations\file_operations.h"
+#include <filesystem>
+
+namespace
+{
+    constexpr uint64_t SECTOR_SIZE = 512;
+
+    constexpr uint32_t QCOW2_MAGIC = 0x514649FB; // "QFI\xfb"
+    constexpr uint32_t QCOW2_VERSION = 3;
+    constexpr uint32_t HEADER_LENGTH = 112;
+    // 16-bit reference counts
+    constexpr uint32_t REFCOUNT_ORDER = 4;
+
+    // Header extensions
+    constexpr uint32_t EXTENSION_END = 0;
+    constexpr uint32_t EXTENSION_BACKING_FORMAT = 0xE2792ACA;
+
+    // Incompatible feature bits
+    constexpr uint64_t INCOMPATIBLE_COMPRESSION_TYPE = 1ull << 3;
+    constexpr uint8_t COMPRESSION_TYPE_ZSTD = 1;
+
+    // L1 and L2 entry flags
+    constexpr uint64_t OFLAG_COPIED = 1ull << 63;
+    constexpr uint64_t OFLAG_COMPRESSED = 1ull << 62;
+    constexpr uint64_t OFLAG_ZERO = 1;
+    constexpr uint64_t OFFSET_MASK = 0x00FFFFFFFFFFFE00ull;
+
+    /**
+     * @brief Stores a value in big-endian byte order, the byte order of every qcow2 field.
+     */
+    void putBigEndian(uint8_t* out, uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; i++) {
+            out[i] = static_cast<uint8_t>(value >> (8 * (bytes - 1 - i)));
+        }
+    }
+
+    /**
+     * @brief Rounds a value up to a multiple of `alignment`.
+     */
+    uint64_t roundUp(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+}
+
+/**
+ * @brief Creates the image file and checks the cluster size.
+ *
+ * @param filePath The path of the image file. An existing file is overwritten.
+ * @param clusterSize The cluster size.
+ * @throws std::invalid_argument if the cluster size is not valid.
+ */
+QCOW2Writer::QCOW2Writer(const std::wstring& filePath, uint32_t clusterSize)
+    : file(filePath, false), clusterSize(clusterSize), clusterBits(0)
+{
+    if (clusterSize < 4096 || clusterSize > 2 * 1024 * 1024 || (clusterSize & (clusterSize - 1)) != 0) {
+        throw std::invalid_argument("The qcow2 cluster size must be a power of two from 4 KB to 2 MB.");
+    }
+    name = filePath;
+    while ((1u << clusterBits) < clusterSize) {
+        clusterBits++;
+    }
+}
+
+/**
+ * @brief Makes `backing` the backing file of this image.
+ *
+ * The backing file is recorded by its path relative to this file, with forward slashes, which
+ * QEMU accepts on every platform. Its format is recorded too, so QEMU does not probe it.
+ *
+ * @param backing The backing image.
+ */
+void QCOW2Writer::setBackingFile(const std::shared_ptr<QCOW2Writer>& backing)
+{
+    std::filesystem::path imageFolder = std::filesystem::absolute(std::filesystem::path(name)).parent_path();
+    std::filesystem::path backingPath = std::filesystem::absolute(std::filesystem::path(backing->getName()));
+    backingFileName = wideToString(backingPath.lexically_relative(imageFolder).generic_wstring());
+    this->backing = backing;
+}
+
+/**
+ * @brief Writes the header and the empty L1 table for a disk of `size` bytes.
+ *
+ * The size is rounded up to a whole number of sectors.
+ *
+ * @param size The size of the virtual disk.
+ * @throws std::runtime_error if the header could not be written.
+ */
+void QCOW2Writer::prepare(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    diskSize = roundUp(size, SECTOR_SIZE);
+
+    uint64_t l2Entries = clusterSize / sizeof(uint64_t);
+    uint64_t guestClusters = (diskSize + clusterSize - 1) / clusterSize;
+    l1.assign(std::max<uint64_t>((guestClusters + l2Entries - 1) / l2Entries, 1), 0);
+    l2Tables.clear();
+    partialClusters.clear();
+
+    // The header is in the first cluster, and the L1 table follows it
+    l1Offset = clusterSize;
+    l1Clusters = roundUp(l1.size() * sizeof(uint64_t), clusterSize) / clusterSize;
+    fileEnd = 0;
+    refcounts.clear();
+    allocateClusters(1 + l1Clusters);
+    std::fill(refcounts.begin(), refcounts.end(), 1);
+
+    // The backing file name follows the header and two extensions in the first cluster
+    if (HEADER_LENGTH + 24 + backingFileName.size() > clusterSize || backingFileName.size() > 1023) {
+        throw std::runtime_error("The qcow2 backing file path is too long.");
+    }
+    writeHeader();
+    writeTables();
+    file.prepare(fileEnd);
+}
+
+/**
+ * @brief Returns the L2 entry of a guest cluster, allocating its L2 table at the end of the file if needed.
+ *
+ * Must be called with the mutex held.
+ *
+ * @param clusterIndex The index of the guest cluster.
+ * @param allocate True to allocate the L2 table if it does not exist.
+ * @return The entry, or null if the L2 table does not exist and `allocate` is false.
+ */
+uint64_t* QCOW2Writer::getL2Entry(uint64_t clusterIndex, bool allocate)
+{
+    uint64_t l2Entries = clusterSize / sizeof(uint64_t);
+    uint64_t l1Index = clusterIndex / l2Entries;
+    if (l1[l1Index] == 0) {
+        if (!allocate) {
+            return nullptr;
+        }
+        l1[l1Index] = allocateClusters(1);
+        refcounts[l1[l1Index] / clusterSize] = 1;
+        l2Tables[l1Index].assign(l2Entries, 0);
+    }
+    return &l2Tables[l1Index][clusterIndex % l2Entries];
+}
+
+/**
+ * @brief Allocates clusters at the end of the file. Their reference counts start at 0.
+ *
+ * Must be called with the mutex held.
+ *
+ * @param count The number of clusters.
+ * @return The file offset of the first cluster.
+ */
+uint64_t QCOW2Writer::allocateClusters(uint64_t count)
+{
+    uint64_t offset = fileEnd;
+    fileEnd += count * clusterSize;
+    refcounts.resize(fileEnd / clusterSize, 0);
+    return offset;
+}
+
+/**
+ * @brief Allocates room for a compressed cluster.
+ *
+ * Compressed clusters are packed one after another. One may continue into the next host
+ * cluster while the compressed clusters are the last clusters allocated.
+ *
+ * Must be called with the mutex held.
+ *
+ * @param length The length of the compressed data.
+ * @return The file offset of the compressed data.
+ */
+uint64_t QCOW2Writer::allocateCompressed(size_t length)
+{
+    if (compressedOffset + length > compressedEnd) {
+        if (compressedEnd != 0 && compressedEnd == fileEnd) {
+            allocateClusters((compressedOffset + length - compressedEnd + clusterSize - 1) / clusterSize);
+        }
+        else {
+            compressedOffset = allocateClusters((length + clusterSize - 1) / clusterSize);
+        }
+        compressedEnd = fileEnd;
+    }
+    uint64_t offset = compressedOffset;
+    compressedOffset += length;
+    return offset;
+}
+
+/**
+ * @brief Releases the host clusters an L2 entry refers to. A cluster whose count drops to 0 is leaked, not reused.
+ *
+ * Must be called with the mutex held.
+ *
+ * @param entry The L2 entry.
+ */
+void QCOW2Writer::releaseEntry(uint64_t entry)
+{
+    if (entry & OFLAG_COMPRESSED) {
+        uint32_t sectorShift = 62 - (clusterBits - 8);
+        uint64_t offset = entry & ((1ull << sectorShift) - 1);
+        uint64_t additionalSectors = (entry & ~OFLAG_COMPRESSED) >> sectorShift;
+        uint64_t end = (offset / SECTOR_SIZE + additionalSectors + 1) * SECTOR_SIZE;
+        for (uint64_t cluster = offset / clusterSize; cluster <= (end - 1) / clusterSize; cluster++) {
+            refcounts[cluster]--;
+        }
+    }
+    else if ((entry & OFFSET_MASK) != 0) {
+        refcounts[(entry & OFFSET_MASK) / clusterSize]--;
+    }
+}
+
+/**
+ * @brief Writes data to the virtual disk, allocating the clusters it falls in.
+ *
+ * The parts of a new cluster that are never written read as zeros, or, with a backing file,
+ * are copied from the backing file by `flush`. A write that only covers part of a sector
+ * makes the rest of that sector read as zeros.
+ *
+ * @param offset The offset on the virtual disk.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @throws std::runtime_error if the range is outside the disk, only partly covers a compressed cluster, or the write fails.
+ */
+void QCOW2Writer::writeAt(uint64_t offset, const void* data, size_t length)
+{
+    if (offset + length > diskSize) {
+        throw std::runtime_error("Attempted to write past the end of the virtual disk.");
+    }
+    auto* in = static_cast<const uint8_t*>(data);
+    while (length > 0) {
+        uint64_t clusterIndex = offset / clusterSize;
+        uint64_t clusterOffset = offset % clusterSize;
+        size_t toWrite = static_cast<size_t>(std::min<uint64_t>(length, clusterSize - clusterOffset));
+        bool wholeCluster = clusterOffset == 0 && (toWrite == clusterSize || offset + toWrite == diskSize);
+        uint64_t hostOffset;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t& entry = *getL2Entry(clusterIndex, true);
+            if (entry & OFLAG_COMPRESSED) {
+                if (!wholeCluster) {
+                    throw std::runtime_error("A compressed qcow2 cluster cannot be partly overwritten.");
+                }
+                releaseEntry(entry);
+                entry = 0;
+            }
+            hostOffset = entry & OFFSET_MASK;
+            if (hostOffset == 0) {
+                bool readsAsZeros = (entry & OFLAG_ZERO) != 0 || !backing;
+                hostOffset = allocateClusters(1);
+                refcounts[hostOffset / clusterSize] = 1;
+                entry = hostOffset | OFLAG_COPIED;
+                if (!wholeCluster) {
+                    // The cluster may be where the refcount structures were last written
+                    if (hostOffset < staleEnd) {
+                        file.zeroRange(hostOffset, clusterSize);
+                    }
+                    if (!readsAsZeros) {
+                        partialClusters[clusterIndex].assign(clusterSize / SECTOR_SIZE, false);
+                    }
+                }
+            }
+            auto partial = partialClusters.find(clusterIndex);
+            if (partial != partialClusters.end()) {
+                uint64_t lastSector = (clusterOffset + toWrite + SECTOR_SIZE - 1) / SECTOR_SIZE;
+                std::fill(partial->second.begin() + clusterOffset / SECTOR_SIZE, partial->second.begin() + lastSector, true);
+            }
+        }
+        file.writeAt(hostOffset + clusterOffset, in, toWrite);
+        in += toWrite;
+        offset += toWrite;
+        length -= toWrite;
+    }
+}
+
+/**
+ * @brief Stores a whole cluster given as a zstd frame as a compressed cluster.
+ *
+ * @param offset The offset of the cluster on the virtual disk.
+ * @param frame The zstd frame, which decompresses to one cluster.
+ * @param length The length of the frame, at most one cluster.
+ * @throws std::invalid_argument if the offset is not the start of a cluster or the frame is longer than a cluster.
+ * @throws std::runtime_error if the write fails.
+ */
+void QCOW2Writer::writeCompressedAt(uint64_t offset, const void* frame, size_t length)
+{
+    if (offset % clusterSize != 0 || offset >= diskSize || length == 0 || length > clusterSize) {
+        throw std::invalid_argument("A compressed qcow2 cluster must be at most one cluster long, at the start of a cluster.");
+    }
+    uint64_t hostOffset;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t clusterIndex = offset / clusterSize;
+        uint64_t& entry = *getL2Entry(clusterIndex, true);
+        releaseEntry(entry);
+        partialClusters.erase(clusterIndex);
+
+        hostOffset = allocateCompressed(length);
+        for (uint64_t cluster = hostOffset / clusterSize; cluster <= (hostOffset + length - 1) / clusterSize; cluster++) {
+            refcounts[cluster]++;
+        }
+        // The entry holds the offset of the data and the number of sectors it runs into after the first
+        uint32_t sectorShift = 62 - (clusterBits - 8);
+        uint64_t additionalSectors = (hostOffset + length - 1) / SECTOR_SIZE - hostOffset / SECTOR_SIZE;
+        entry = OFLAG_COMPRESSED | (additionalSectors << sectorShift) | hostOffset;
+        hasCompressedClusters = true;
+    }
+    file.writeAt(hostOffset, frame, length);
+}
+
+/**
+ * @brief Zeros a range of the virtual disk.
+ *
+ * Whole clusters that are allocated are zeroed in the file. Other whole clusters are marked
+ * as reading zeros when there is a backing file, and are left unallocated when there is not.
+ * Parts of clusters are written with zeros.
+ *
+ * @param offset The offset on the virtual disk.
+ * @param length The number of bytes to zero.
+ * @throws std::runtime_error if the range cannot be zeroed.
+ */
+void QCOW2Writer::zeroRange(uint64_t offset, uint64_t length)
+{
+    length = offset < diskSize ? std::min(length, diskSize - offset) : 0;
+    while (length > 0) {
+        uint64_t clusterIndex = offset / clusterSize;
+        uint64_t clusterOffset = offset % clusterSize;
+        uint64_t toZero = std::min<uint64_t>(length, clusterSize - clusterOffset);
+        if (clusterOffset != 0 || (toZero != clusterSize && offset + toZero != diskSize)) {
+            RestoreTarget::zeroRange(offset, toZero);
+        }
+        else {
+            uint64_t hostOffset = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                uint64_t* entry = getL2Entry(clusterIndex, backing != nullptr);
+                if (entry != nullptr) {
+                    if ((*entry & OFLAG_COMPRESSED) == 0 && (*entry & OFFSET_MASK) != 0) {
+                        hostOffset = *entry & OFFSET_MASK;
+                        partialClusters.erase(clusterIndex);
+                    }
+                    else {
+                        releaseEntry(*entry);
+                        *entry = backing ? OFLAG_ZERO : 0;
+                    }
+                }
+            }
+            if (hostOffset != 0) {
+                file.zeroRange(hostOffset, clusterSize);
+            }
+        }
+        offset += toZero;
+        length -= toZero;
+    }
+}
+
+/**
+ * @brief Reads back data written to the image.
+ *
+ * Clusters this image does not hold are read from the backing file, or read as zeros.
+ *
+ * @param offset The offset on the virtual disk.
+ * @param buffer The buffer that receives the data.
+ * @param length The number of bytes to read.
+ * @throws std::runtime_error if the range holds a compressed cluster or the read fails.
+ */
+void QCOW2Writer::readAt(uint64_t offset, void* buffer, size_t length)
+{
+    auto* out = static_cast<uint8_t*>(buffer);
+    while (length > 0) {
+        uint64_t clusterIndex = offset / clusterSize;
+        uint64_t clusterOffset = offset % clusterSize;
+        size_t toRead = static_cast<size_t>(std::min<uint64_t>(length, clusterSize - clusterOffset));
+        uint64_t entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t* l2Entry = getL2Entry(clusterIndex, false);
+            entry = l2Entry ? *l2Entry : 0;
+        }
+        if (entry & OFLAG_COMPRESSED) {
+            throw std::runtime_error("A compressed qcow2 cluster cannot be read back.");
+        }
+        else if ((entry & OFFSET_MASK) != 0) {
+            file.readAt((entry & OFFSET_MASK) + clusterOffset, out, toRead);
+        }
+        else if ((entry & OFLAG_ZERO) == 0 && backing) {
+            backing->readAt(offset, out, toRead);
+        }
+        else {
+            memset(out, 0, toRead);
+        }
+        out += toRead;
+        offset += toRead;
+        length -= toRead;
+    }
+}
+
+/**
+ * @brief Completes partly written clusters, writes the tables, refcounts and header, and flushes the file.
+ *
+ * @throws std::runtime_error if the file could not be written or flushed.
+ */
+void QCOW2Writer::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    fillFromBackingFile();
+    writeTables();
+    writeRefcounts();
+    writeHeader();
+    file.prepare(staleEnd);
+    file.flush();
+}
+
+/**
+ * @brief Copies the sectors of partly written clusters that were not written from the backing file.
+ *
+ * A qcow2 cluster is read from the image or the backing file as a whole, so the sectors of an
+ * allocated cluster that the restore did not write must be copied into it.
+ *
+ * Must be called with the mutex held.
+ */
+void QCOW2Writer::fillFromBackingFile()
+{
+    std::vector<uint8_t> buffer;
+    for (const auto& [clusterIndex, written] : partialClusters) {
+        uint64_t hostOffset = l2Tables[clusterIndex / (clusterSize / sizeof(uint64_t))][clusterIndex % (clusterSize / sizeof(uint64_t))] & OFFSET_MASK;
+        uint64_t clusterStart = clusterIndex * clusterSize;
+        uint64_t sectorCount = std::min<uint64_t>(written.size(), (diskSize - clusterStart) / SECTOR_SIZE);
+        for (uint64_t sector = 0; sector < sectorCount;) {
+            if (written[sector]) {
+                sector++;
+                continue;
+            }
+            uint64_t runEnd = sector;
+            while (runEnd < sectorCount && !written[runEnd]) {
+                runEnd++;
+            }
+            buffer.resize(static_cast<size_t>((runEnd - sector) * SECTOR_SIZE));
+            backing->readAt(clusterStart + sector * SECTOR_SIZE, buffer.data(), buffer.size());
+            file.writeAt(hostOffset + sector * SECTOR_SIZE, buffer.data(), buffer.size());
+            sector = runEnd;
+        }
+    }
+    partialClusters.clear();
+}
+
+/**
+ * @brief Writes the L2 tables and the L1 table.
+ *
+ * Must be called with the mutex held.
+ */
+void QCOW2Writer::writeTables()
+{
+    std::vector<uint8_t> buffer(clusterSize);
+    for (const auto& [l1Index, table] : l2Tables) {
+        for (size_t i = 0; i < table.size(); i++) {
+            putBigEndian(buffer.data() + i * sizeof(uint64_t), table[i], sizeof(uint64_t));
+        }
+        file.writeAt(l1[l1Index], buffer.data(), buffer.size());
+    }
+
+    // Every table and cluster is referenced once, so the L1 entries have the COPIED flag
+    buffer.assign(static_cast<size_t>(l1Clusters * clusterSize), 0);
+    for (size_t i = 0; i < l1.size(); i++) {
+        putBigEndian(buffer.data() + i * sizeof(uint64_t), l1[i] ? l1[i] | OFLAG_COPIED : 0, sizeof(uint64_t));
+    }
+    file.writeAt(l1Offset, buffer.data(), buffer.size());
+}
+
+/**
+ * @brief Writes the refcount table and blocks after the last allocated cluster.
+ *
+ * The refcount structures count themselves, so their size is found by iterating until it no
+ * longer changes. They are not allocated, so clusters allocated after a flush reuse their space,
+ * and the next flush writes them again after the new last cluster.
+ *
+ * Must be called with the mutex held.
+ */
+void QCOW2Writer::writeRefcounts()
+{
+    uint64_t entriesPerBlock = clusterSize / sizeof(uint16_t);
+    uint64_t dataClusters = fileEnd / clusterSize;
+    uint64_t blockCount = 0;
+    uint64_t tableClusters = 0;
+    for (;;) {
+        uint64_t totalClusters = dataClusters + tableClusters + blockCount;
+        uint64_t newBlockCount = (totalClusters + entriesPerBlock - 1) / entriesPerBlock;
+        uint64_t newTableClusters = roundUp(newBlockCount * sizeof(uint64_t), clusterSize) / clusterSize;
+        if (newBlockCount == blockCount && newTableClusters == tableClusters) {
+            break;
+        }
+        blockCount = newBlockCount;
+        tableClusters = newTableClusters;
+    }
+
+    refcountTableOffset = fileEnd;
+    refcountTableClusters = tableClusters;
+    uint64_t firstBlockOffset = refcountTableOffset + tableClusters * clusterSize;
+    staleEnd = firstBlockOffset + blockCount * clusterSize;
+
+    std::vector<uint16_t> counts(refcounts);
+    counts.resize(blockCount * entriesPerBlock, 0);
+    std::fill(counts.begin() + dataClusters, counts.begin() + dataClusters + tableClusters + blockCount, 1);
+
+    std::vector<uint8_t> buffer(static_cast<size_t>(tableClusters * clusterSize), 0);
+    for (uint64_t block = 0; block < blockCount; block++) {
+        putBigEndian(buffer.data() + block * sizeof(uint64_t), firstBlockOffset + block * clusterSize, sizeof(uint64_t));
+    }
+    file.writeAt(refcountTableOffset, buffer.data(), buffer.size());
+
+    buffer.assign(static_cast<size_t>(blockCount * clusterSize), 0);
+    for (size_t i = 0; i < counts.size(); i++) {
+        putBigEndian(buffer.data() + i * sizeof(uint16_t), counts[i], sizeof(uint16_t));
+    }
+    file.writeAt(firstBlockOffset, buffer.data(), buffer.size());
+}
+
+/**
+ * @brief Writes the header, its extensions and the backing file name to the first cluster.
+ *
+ * Must be called with the mutex held.
+ */
+void QCOW2Writer::writeHeader()
+{
+    std::vector<uint8_t> header(clusterSize, 0);
+    uint8_t* out = header.data();
+    putBigEndian(out + 0, QCOW2_MAGIC, 4);
+    putBigEndian(out + 4, QCOW2_VERSION, 4);
+    putBigEndian(out + 20, clusterBits, 4);
+    putBigEndian(out + 24, diskSize, 8);
+    putBigEndian(out + 36, l1.size(), 4);
+    putBigEndian(out + 40, l1Offset, 8);
+    putBigEndian(out + 48, refcountTableOffset, 8);
+    putBigEndian(out + 56, refcountTableClusters, 4);
+    // zstd compressed clusters need a reader that knows the compression type field
+    putBigEndian(out + 72, hasCompressedClusters ? INCOMPATIBLE_COMPRESSION_TYPE : 0, 8);
+    putBigEndian(out + 96, REFCOUNT_ORDER, 4);
+    putBigEndian(out + 100, HEADER_LENGTH, 4);
+    out[104] = hasCompressedClusters ? COMPRESSION_TYPE_ZSTD : 0;
+
+    // Header extensions follow the header, each padded to 8 bytes
+    size_t position = HEADER_LENGTH;
+    if (backing) {
+        const char format[] = "qcow2";
+        putBigEndian(out + position, EXTENSION_BACKING_FORMAT, 4);
+        putBigEndian(out + position + 4, sizeof(format) - 1, 4);
+        memcpy(out + position + 8, format, sizeof(format) - 1);
+        position += 8 + roundUp(sizeof(format) - 1, 8);
+    }
+    putBigEndian(out + position, EXTENSION_END, 4);
+    position += 8;
+
+    if (backing) {
+        putBigEndian(out + 8, position, 8);
+        putBigEndian(out + 16, backingFileName.size(), 4);
+        memcpy(out + position, backingFileName.data(), backingFileName.size());
+    }
+    file.writeAt(0, header.data(), header.size());
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief A qcow2 writer, for images that QEMU and KVM hosts open directly.
+ *
+ * The file is laid out as described in the qcow2 version 3 specification: the header in the
+ * first cluster, the L1 table after it, then L2 tables and data clusters allocated at the end
+ * of the file as they are first written. The refcount table and blocks are written after the
+ * last allocated cluster by `flush`.
+ *
+ * A backup block that is already a zstd frame of a whole cluster is stored as a zstd compressed
+ * cluster as it is, so the image is written at close to copy speed and at the compressed size.
+ * An image can have a backing file, so a chain of images can mirror an incremental chain.
+ */
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "..\file_operations\restore_target.h"
+
+/**
+ * @class QCOW2Writer
+ * @brief A `RestoreTarget` that writes a qcow2 image.
+ *
+ * Writes to different clusters, and to different ranges of the same cluster, may be made
+ * concurrently. The tables are written by `flush`, which must be called once the restore
+ * is complete.
+ */
+class QCOW2Writer : public RestoreTarget {
+public:
+    // The cluster size used by qemu-img for new images
+    static constexpr uint32_t DEFAULT_CLUSTER_SIZE = 64 * 1024;
+
+    /**
+     * @brief Creates the image file. The layout is written by `prepare`, once the disk size is known.
+     *
+     * @param filePath The path of the image file. An existing file is overwritten.
+     * @param clusterSize The cluster size, a power of two from 4 KB to 2 MB.
+     * @throws std::invalid_argument if the cluster size is not valid.
+     * @throws std::runtime_error if the file could not be created.
+     */
+    QCOW2Writer(const std::wstring& filePath, uint32_t clusterSize = DEFAULT_CLUSTER_SIZE);
+
+    /**
+     * @brief Makes `backing` the backing file of this image.
+     *
+     * Must be called before `prepare`. Clusters this image does not hold are read from the backing
+     * file, which is recorded by its path relative to this file. The backing file must be flushed
+     * before this image, because the parts of clusters this image only partly writes are copied
+     * from it then.
+     *
+     * @param backing The backing image.
+     */
+    void setBackingFile(const std::shared_ptr<QCOW2Writer>& backing);
+
+    /**
+     * @brief Reads back data written to the image, falling through to the backing file.
+     * @throws std::runtime_error if the range holds a compressed cluster, which cannot be read back.
+     */
+    void readAt(uint64_t offset, void* buffer, size_t length) override;
+
+    void prepare(uint64_t size) override;
+    void writeAt(uint64_t offset, const void* data, size_t length) override;
+    void zeroRange(uint64_t offset, uint64_t length) override;
+    uint32_t getCompressedBlockSize() const override { return clusterSize; }
+    void writeCompressedAt(uint64_t offset, const void* frame, size_t length) override;
+    void flush() override;
+    uint64_t getSize() override { return diskSize; }
+    void setWriteBack(const WriteBackPolicy& policy) override { file.setWriteBack(policy); }
+    WriteBackStats getWriteBackStats() const override { return file.getWriteBackStats(); }
+
+private:
+    /**
+     * @brief Returns the L2 entry of a guest cluster, or null if its L2 table does not exist and `allocate` is false.
+     */
+    uint64_t* getL2Entry(uint64_t clusterIndex, bool allocate);
+
+    /**
+     * @brief Allocates clusters at the end of the file and returns the offset of the first.
+     */
+    uint64_t allocateClusters(uint64_t count);
+
+    /**
+     * @brief Allocates room for a compressed cluster, packed after the one before it.
+     */
+    uint64_t allocateCompressed(size_t length);
+
+    /**
+     * @brief Releases the host clusters an L2 entry refers to.
+     */
+    void releaseEntry(uint64_t entry);
+
+    void fillFromBackingFile();
+    void writeTables();
+    void writeRefcounts();
+    void writeHeader();
+
+    FileTarget file;
+    uint32_t clusterSize;
+    uint32_t clusterBits;
+    uint64_t diskSize = 0;
+    uint64_t l1Offset = 0;
+    uint64_t l1Clusters = 0;
+    // The L1 table, and the L2 tables by L1 index, in host byte order
+    std::vector<uint64_t> l1;
+    std::map<uint64_t, std::vector<uint64_t>> l2Tables;
+    // The reference count of each host cluster
+    std::vector<uint16_t> refcounts;
+    uint64_t fileEnd = 0;
+    // The end of the refcount structures last written, which the next allocations reuse
+    uint64_t staleEnd = 0;
+    uint64_t compressedOffset = 0;
+    uint64_t compressedEnd = 0;
+    bool hasCompressedClusters = false;
+    uint64_t refcountTableOffset = 0;
+    uint64_t refcountTableClusters = 0;
+    std::shared_ptr<QCOW2Writer> backing;
+    std::string backingFileName;
+    // The sectors written to clusters that are only partly written and have a backing file, by guest cluster
+    std::map<uint64_t, std::vector<bool>> partialClusters;
+    std::mutex mutex;
+};
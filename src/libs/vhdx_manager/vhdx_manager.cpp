@@ -10,6 +10,9 @@ Licensed under the MIT License.
 #include "pch.h"
 #include "vhdx_manager.h"
 
+// The virtual disk service is only available on Windows. VHDXWriter writes a VHDX on any platform.
+#ifdef _WIN32
+
 
 // Define the VIRTUAL_STORAGE_TYPE_VENDOR_MICROSOFT GUID
 EXTERN_C const GUID DECLSPEC_SELECTANY VIRTUAL_STORAGE_TYPE_VENDOR_MICROSOFT =
@@ -179,3 +182,5 @@ void VHDXManager::UpdateDiskProperties()
     // Close the handle to the target disk.
     CloseHandle(targetDiskHandle);
 }
+
+#endif
@@ -16,6 +16,10 @@ Licensed under the MIT License.
 * No other include files are necessary.
 **/
 
+#include "vhdx_writer.h"
+#include "qcow2_writer.h"
+
+#ifdef _WIN32
 // VHDXManager class provides methods to create and mount VHDX files.
 class VHDXManager {
 private:
@@ -70,3 +74,4 @@ public:
      */
     std::wstring  GetDiskPath() const { return diskPath; };
 };
+#endif
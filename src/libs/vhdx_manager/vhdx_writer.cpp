@@ -0,0 +1,615 @@
+#include "pch.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+
+This file implements a VHDX writer that lays out the file itself, following
+the [MS-VHDX] specification, so a VHDX can be written on any platform without
+creating and attaching it through the Windows virtual disk service.
+===============================================================================
+*/
+#include "vhdx_writer.h"
+#include "..\file_operations\file_operations.h"
+#include "..\restore\crc32.h"
+#include <filesystem>
+#include <random>
+
+namespace
+{
+    constexpr uint64_t KB = 1024;
+    constexpr uint64_t MB = 1024 * KB;
+
+    // The fixed layout of the start of the file. The headers and region tables are each held twice.
+    constexpr uint64_t FILE_IDENTIFIER_OFFSET = 0;
+    constexpr uint64_t HEADER_1_OFFSET = 64 * KB;
+    constexpr uint64_t HEADER_2_OFFSET = 128 * KB;
+    constexpr uint64_t REGION_TABLE_1_OFFSET = 192 * KB;
+    constexpr uint64_t REGION_TABLE_2_OFFSET = 256 * KB;
+    constexpr uint64_t HEADER_SIZE = 4 * KB;
+    constexpr uint64_t REGION_TABLE_SIZE = 64 * KB;
+
+    // The log is empty, but it must exist. The metadata and BAT regions follow it.
+    constexpr uint64_t LOG_OFFSET = 1 * MB;
+    constexpr uint32_t LOG_LENGTH = 1 * MB;
+    constexpr uint64_t METADATA_OFFSET = 2 * MB;
+    constexpr uint32_t METADATA_LENGTH = 1 * MB;
+    constexpr uint64_t METADATA_TABLE_SIZE = 64 * KB;
+    constexpr uint64_t BAT_OFFSET = 3 * MB;
+
+    constexpr uint64_t FILE_IDENTIFIER_SIGNATURE = 0x656C696678646876; // "vhdxfile"
+    constexpr uint32_t HEADER_SIGNATURE = 0x64616568;                   // "head"
+    constexpr uint32_t REGION_TABLE_SIGNATURE = 0x69676572;             // "regi"
+    constexpr uint64_t METADATA_TABLE_SIGNATURE = 0x617461646174656D;  // "metadata"
+
+    // BAT entry states
+    constexpr uint64_t PAYLOAD_BLOCK_NOT_PRESENT = 0;
+    constexpr uint64_t PAYLOAD_BLOCK_FULLY_PRESENT = 6;
+    constexpr uint64_t PAYLOAD_BLOCK_PARTIALLY_PRESENT = 7;
+    constexpr uint64_t SB_BLOCK_PRESENT = 6;
+    constexpr uint64_t BAT_STATE_MASK = 7;
+
+    // Metadata entry flags
+    constexpr uint32_t METADATA_IS_VIRTUAL_DISK = 2;
+    constexpr uint32_t METADATA_IS_REQUIRED = 4;
+
+    // File parameter flags
+    constexpr uint32_t FILE_PARAMETERS_LEAVE_BLOCKS_ALLOCATED = 1;
+    constexpr uint32_t FILE_PARAMETERS_HAS_PARENT = 2;
+
+    // Each sector bitmap block is 1 MB, one bit per sector, so it covers 2^23 sectors
+    constexpr uint64_t SECTOR_BITMAP_BLOCK_SIZE = 1 * MB;
+    constexpr uint64_t SECTORS_PER_BITMAP = SECTOR_BITMAP_BLOCK_SIZE * 8;
+
+    constexpr VHDXGuid BAT_REGION_GUID = { 0x2DC27766, 0xF623, 0x4200, { 0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 } };
+    constexpr VHDXGuid METADATA_REGION_GUID = { 0x8B7CA206, 0x4790, 0x4B9A, { 0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E } };
+    constexpr VHDXGuid FILE_PARAMETERS_GUID = { 0xCAA16737, 0xFA36, 0x4D43, { 0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B } };
+    constexpr VHDXGuid VIRTUAL_DISK_SIZE_GUID = { 0x2FA54224, 0xCD1B, 0x4876, { 0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 } };
+    constexpr VHDXGuid VIRTUAL_DISK_ID_GUID = { 0xBECA12AB, 0xB2E6, 0x4523, { 0x93, 0xEF, 0xC3, 0x09, 0xE0, 0x00, 0xC7, 0x46 } };
+    constexpr VHDXGuid LOGICAL_SECTOR_SIZE_GUID = { 0x8141BF1D, 0xA96F, 0x4709, { 0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F } };
+    constexpr VHDXGuid PHYSICAL_SECTOR_SIZE_GUID = { 0xCDA348C7, 0x445D, 0x4471, { 0x9C, 0xC9, 0xE9, 0x88, 0x52, 0x51, 0xC5, 0x56 } };
+    constexpr VHDXGuid PARENT_LOCATOR_GUID = { 0xA8D35F2D, 0xB30B, 0x454D, { 0xAB, 0xF7, 0xD3, 0xD8, 0x48, 0x34, 0xAB, 0x0C } };
+    constexpr VHDXGuid VHDX_PARENT_LOCATOR_TYPE = { 0xB04AEFB7, 0xD19E, 0x4A81, { 0xB7, 0x89, 0x25, 0xB8, 0xE9, 0x44, 0x59, 0x13 } };
+
+#pragma pack(push, 1)
+    struct VHDXHeader
+    {
+        uint32_t signature;
+        uint32_t checksum;
+        uint64_t sequence_number;
+        VHDXGuid file_write_guid;
+        VHDXGuid data_write_guid;
+        VHDXGuid log_guid;
+        uint16_t log_version;
+        uint16_t version;
+        uint32_t log_length;
+        uint64_t log_offset;
+    };
+
+    struct RegionTableHeader
+    {
+        uint32_t signature;
+        uint32_t checksum;
+        uint32_t entry_count;
+        uint32_t reserved;
+    };
+
+    struct RegionTableEntry
+    {
+        VHDXGuid guid;
+        uint64_t file_offset;
+        uint32_t length;
+        uint32_t required;
+    };
+
+    struct MetadataTableHeader
+    {
+        uint64_t signature;
+        uint16_t reserved;
+        uint16_t entry_count;
+        uint32_t reserved2[5];
+    };
+
+    struct MetadataTableEntry
+    {
+        VHDXGuid item_id;
+        uint32_t offset;
+        uint32_t length;
+        uint32_t flags;
+        uint32_t reserved;
+    };
+
+    struct FileParameters
+    {
+        uint32_t block_size;
+        uint32_t flags;
+    };
+
+    struct ParentLocatorHeader
+    {
+        VHDXGuid locator_type;
+        uint16_t reserved;
+        uint16_t key_value_count;
+    };
+
+    struct ParentLocatorEntry
+    {
+        uint32_t key_offset;
+        uint32_t value_offset;
+        uint16_t key_length;
+        uint16_t value_length;
+    };
+#pragma pack(pop)
+
+    /**
+     * @brief Generates a random (version 4) GUID.
+     */
+    VHDXGuid newGuid()
+    {
+        static std::mutex generatorMutex;
+        static std::mt19937_64 generator(std::random_device{}());
+        std::lock_guard<std::mutex> lock(generatorMutex);
+        uint64_t random[2] = { generator(), generator() };
+        VHDXGuid guid;
+        memcpy(&guid, random, sizeof(guid));
+        guid.data3 = static_cast<uint16_t>((guid.data3 & 0x0FFF) | 0x4000);
+        guid.data4[0] = static_cast<uint8_t>((guid.data4[0] & 0x3F) | 0x80);
+        return guid;
+    }
+
+    /**
+     * @brief Rounds a value up to a multiple of `alignment`.
+     */
+    uint64_t roundUp(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    /**
+     * @brief Appends a string to a buffer as UTF-16LE, the encoding of the parent locator.
+     */
+    void appendUTF16(std::vector<uint8_t>& buffer, const std::wstring& text)
+    {
+        for (wchar_t c : text) {
+            uint32_t codePoint = static_cast<uint32_t>(c);
+            if (codePoint > 0xFFFF) {
+                // Only reached where wchar_t is UTF-32
+                codePoint -= 0x10000;
+                uint16_t units[2] = { static_cast<uint16_t>(0xD800 | (codePoint >> 10)), static_cast<uint16_t>(0xDC00 | (codePoint & 0x3FF)) };
+                buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(units), reinterpret_cast<uint8_t*>(units) + sizeof(units));
+            }
+            else {
+                uint16_t unit = static_cast<uint16_t>(codePoint);
+                buffer.insert(buffer.end(), reinterpret_cast<uint8_t*>(&unit), reinterpret_cast<uint8_t*>(&unit) + sizeof(unit));
+            }
+        }
+    }
+
+    /**
+     * @brief Formats a GUID in the registry format, {XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX}.
+     */
+    std::wstring formatGuid(const VHDXGuid& guid)
+    {
+        char text[40];
+        snprintf(text, sizeof(text), "{%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}", guid.data1, guid.data2, guid.data3,
+            guid.data4[0], guid.data4[1], guid.data4[2], guid.data4[3], guid.data4[4], guid.data4[5], guid.data4[6], guid.data4[7]);
+        return std::wstring(text, text + strlen(text));
+    }
+}
+
+/**
+ * @brief Creates the VHDX file and checks the parameters.
+ *
+ * @param filePath The path of the VHDX file. An existing file is overwritten.
+ * @param sectorSize The logical and physical sector size of the virtual disk, 512 or 4096.
+ * @param fixed True to allocate every payload block up front.
+ * @param blockSize The payload block size.
+ * @throws std::invalid_argument if the sector or block size is not valid.
+ */
+VHDXWriter::VHDXWriter(const std::wstring& filePath, uint32_t sectorSize, bool fixed, uint32_t blockSize)
+    : file(filePath, fixed), sectorSize(sectorSize), blockSize(blockSize), fixed(fixed)
+{
+    if (sectorSize != 512 && sectorSize != 4096) {
+        throw std::invalid_argument("The VHDX sector size must be 512 or 4096 bytes.");
+    }
+    if (blockSize < MB || blockSize > 256 * MB || (blockSize & (blockSize - 1)) != 0) {
+        throw std::invalid_argument("The VHDX block size must be a power of two from 1 MB to 256 MB.");
+    }
+    name = filePath;
+    // The number of payload blocks described by one sector bitmap block
+    chunkRatio = static_cast<uint32_t>((uint64_t(1) << 23) * sectorSize / blockSize);
+    fileWriteGuid = newGuid();
+    dataWriteGuid = newGuid();
+    virtualDiskId = newGuid();
+}
+
+/**
+ * @brief Makes this VHDX a differencing disk of `parent`.
+ *
+ * The parent is recorded by its path relative to this file, and on Windows also by its absolute path.
+ *
+ * @param parent The parent VHDX.
+ * @throws std::invalid_argument if this VHDX is fixed or the sector sizes differ.
+ */
+void VHDXWriter::setParent(const VHDXWriter& parent)
+{
+    if (fixed) {
+        throw std::invalid_argument("A fixed VHDX cannot have a parent.");
+    }
+    if (parent.sectorSize != sectorSize) {
+        throw std::invalid_argument("A differencing VHDX must have the same sector size as its parent.");
+    }
+    hasParent = true;
+    parentDataWriteGuid = parent.dataWriteGuid;
+
+    // The relative path uses Windows separators and starts with .\ when the parent is in the same folder
+    std::filesystem::path childFolder = std::filesystem::absolute(std::filesystem::path(name)).parent_path();
+    std::filesystem::path parentPath = std::filesystem::absolute(std::filesystem::path(parent.getName()));
+    std::wstring relativePath = parentPath.lexically_relative(childFolder).wstring();
+    std::replace(relativePath.begin(), relativePath.end(), L'/', L'\\');
+    parentRelativePath = relativePath.rfind(L"..", 0) == 0 ? relativePath : L".\\" + relativePath;
+#ifdef _WIN32
+    parentAbsolutePath = parentPath.wstring();
+#endif
+}
+
+/**
+ * @brief Writes the layout of a VHDX file for a disk of `size` bytes.
+ *
+ * The size is rounded up to a whole number of sectors. For a fixed VHDX, every payload block is
+ * allocated and the file is extended to its final size.
+ *
+ * @param size The size of the virtual disk.
+ * @throws std::runtime_error if the layout could not be written.
+ */
+void VHDXWriter::prepare(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    diskSize = roundUp(size, sectorSize);
+
+    uint64_t payloadBlocks = (diskSize + blockSize - 1) / blockSize;
+    uint64_t batEntries;
+    if (hasParent) {
+        // A differencing VHDX has a sector bitmap entry after every chunk, including a partial last chunk
+        batEntries = (payloadBlocks + chunkRatio - 1) / chunkRatio * (static_cast<uint64_t>(chunkRatio) + 1);
+    }
+    else {
+        batEntries = payloadBlocks == 0 ? 0 : payloadBlocks + (payloadBlocks - 1) / chunkRatio;
+    }
+    bat.assign(batEntries, PAYLOAD_BLOCK_NOT_PRESENT);
+    batLength = roundUp(std::max<uint64_t>(batEntries * sizeof(uint64_t), 1), MB);
+    fileEnd = BAT_OFFSET + batLength;
+
+    if (fixed) {
+        for (uint64_t blockIndex = 0; blockIndex < payloadBlocks; blockIndex++) {
+            getBlockFileOffset(blockIndex, true);
+        }
+    }
+
+    writeFileIdentifier();
+    writeRegionTables();
+    writeMetadata();
+    writeHeaders();
+    file.prepare(fileEnd);
+}
+
+/**
+ * @brief Returns the file offset of a payload block.
+ *
+ * Must be called with the mutex held.
+ *
+ * @param blockIndex The index of the payload block.
+ * @param allocate True to allocate the block at the end of the file if it is not present.
+ * @return The file offset of the block, or 0 if it is not present and `allocate` is false.
+ */
+uint64_t VHDXWriter::getBlockFileOffset(uint64_t blockIndex, bool allocate)
+{
+    uint64_t& entry = bat[getBATIndex(blockIndex)];
+    if ((entry & BAT_STATE_MASK) == PAYLOAD_BLOCK_NOT_PRESENT) {
+        if (!allocate) {
+            return 0;
+        }
+        // The file offset is held in the BAT in megabytes, and payload blocks are whole megabytes.
+        // The sectors of a differencing disk's block that have not been written are read from the parent.
+        entry = fileEnd | (hasParent ? PAYLOAD_BLOCK_PARTIALLY_PRESENT : PAYLOAD_BLOCK_FULLY_PRESENT);
+        fileEnd += blockSize;
+    }
+    return entry & ~(MB - 1);
+}
+
+/**
+ * @brief Sets the sector bitmap bits of a range of sectors.
+ *
+ * @param firstSector The first sector.
+ * @param sectorCount The number of sectors.
+ */
+void VHDXWriter::markSectorsPresent(uint64_t firstSector, uint64_t sectorCount)
+{
+    for (uint64_t sector = firstSector; sector < firstSector + sectorCount; sector++) {
+        std::vector<uint8_t>& bitmap = sectorBitmaps[sector / SECTORS_PER_BITMAP];
+        if (bitmap.empty()) {
+            bitmap.resize(SECTOR_BITMAP_BLOCK_SIZE, 0);
+        }
+        uint64_t bit = sector % SECTORS_PER_BITMAP;
+        bitmap[bit / 8] |= static_cast<uint8_t>(1 << (bit % 8));
+    }
+}
+
+/**
+ * @brief Writes data to the virtual disk, allocating the payload blocks it falls in.
+ *
+ * The parts of a new block that are never written read as zeros, because the file is only
+ * extended over them. In a differencing VHDX the sectors written are marked as present, and a
+ * write that only covers part of a sector makes the rest of that sector read as zeros.
+ *
+ * @param offset The offset on the virtual disk.
+ * @param data The data to write.
+ * @param length The number of bytes to write.
+ * @throws std::runtime_error if the range is outside the disk or the write fails.
+ */
+void VHDXWriter::writeAt(uint64_t offset, const void* data, size_t length)
+{
+    if (offset + length > diskSize) {
+        throw std::runtime_error("Attempted to write past the end of the virtual disk.");
+    }
+    auto* in = static_cast<const uint8_t*>(data);
+    while (length > 0) {
+        uint64_t blockIndex = offset / blockSize;
+        uint64_t blockOffset = offset % blockSize;
+        size_t toWrite = static_cast<size_t>(std::min<uint64_t>(length, blockSize - blockOffset));
+        uint64_t fileOffset;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fileOffset = getBlockFileOffset(blockIndex, true);
+            if (hasParent) {
+                uint64_t firstSector = offset / sectorSize;
+                markSectorsPresent(firstSector, (offset + toWrite + sectorSize - 1) / sectorSize - firstSector);
+            }
+        }
+        file.writeAt(fileOffset + blockOffset, in, toWrite);
+        in += toWrite;
+        offset += toWrite;
+        length -= toWrite;
+    }
+}
+
+/**
+ * @brief Zeros a range of the virtual disk.
+ *
+ * Blocks that are not present already read as zeros, so only allocated blocks are written.
+ * In a differencing VHDX they read from the parent, so the zeros are always written.
+ *
+ * @param offset The offset on the virtual disk.
+ * @param length The number of bytes to zero.
+ * @throws std::runtime_error if the range cannot be zeroed.
+ */
+void VHDXWriter::zeroRange(uint64_t offset, uint64_t length)
+{
+    if (hasParent) {
+        RestoreTarget::zeroRange(offset, length);
+        return;
+    }
+    length = offset < diskSize ? std::min(length, diskSize - offset) : 0;
+    while (length > 0) {
+        uint64_t blockIndex = offset / blockSize;
+        uint64_t blockOffset = offset % blockSize;
+        uint64_t toZero = std::min<uint64_t>(length, blockSize - blockOffset);
+        uint64_t fileOffset;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fileOffset = getBlockFileOffset(blockIndex, false);
+        }
+        if (fileOffset != 0) {
+            file.zeroRange(fileOffset + blockOffset, toZero);
+        }
+        offset += toZero;
+        length -= toZero;
+    }
+}
+
+/**
+ * @brief Writes the sector bitmaps, the BAT and new headers, extends the file over the last block and flushes it.
+ *
+ * @throws std::runtime_error if the file could not be written or flushed.
+ */
+void VHDXWriter::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    writeSectorBitmaps();
+    writeBAT();
+    writeHeaders();
+    // Extend the file to the end of the last payload block, in case its end was never written
+    file.prepare(fileEnd);
+    file.flush();
+}
+
+/**
+ * @brief Writes the file type identifier at the start of the file.
+ */
+void VHDXWriter::writeFileIdentifier()
+{
+    std::vector<uint8_t> identifier(64 * KB, 0);
+    memcpy(identifier.data(), &FILE_IDENTIFIER_SIGNATURE, sizeof(FILE_IDENTIFIER_SIGNATURE));
+    // The creator is a UTF-16 string
+    const char creator[] = "img_to_vhdx";
+    for (size_t i = 0; i + 1 < sizeof(creator); i++) {
+        identifier[8 + i * 2] = static_cast<uint8_t>(creator[i]);
+    }
+    file.writeAt(FILE_IDENTIFIER_OFFSET, identifier.data(), identifier.size());
+}
+
+/**
+ * @brief Writes both copies of the region table, which locates the BAT and metadata regions.
+ */
+void VHDXWriter::writeRegionTables()
+{
+    std::vector<uint8_t> table(REGION_TABLE_SIZE, 0);
+    RegionTableHeader header = {};
+    header.signature = REGION_TABLE_SIGNATURE;
+    header.entry_count = 2;
+    RegionTableEntry entries[2] = {};
+    entries[0].guid = BAT_REGION_GUID;
+    entries[0].file_offset = BAT_OFFSET;
+    entries[0].length = static_cast<uint32_t>(batLength);
+    entries[0].required = 1;
+    entries[1].guid = METADATA_REGION_GUID;
+    entries[1].file_offset = METADATA_OFFSET;
+    entries[1].length = METADATA_LENGTH;
+    entries[1].required = 1;
+    memcpy(table.data() + sizeof(header), entries, sizeof(entries));
+
+    memcpy(table.data(), &header, sizeof(header));
+    header.checksum = computeCRC32C(table.data(), table.size());
+    memcpy(table.data(), &header, sizeof(header));
+
+    file.writeAt(REGION_TABLE_1_OFFSET, table.data(), table.size());
+    file.writeAt(REGION_TABLE_2_OFFSET, table.data(), table.size());
+}
+
+/**
+ * @brief Writes the metadata table and the items that describe the virtual disk.
+ */
+void VHDXWriter::writeMetadata()
+{
+    FileParameters fileParameters = {};
+    fileParameters.block_size = blockSize;
+    fileParameters.flags = (fixed ? FILE_PARAMETERS_LEAVE_BLOCKS_ALLOCATED : 0) | (hasParent ? FILE_PARAMETERS_HAS_PARENT : 0);
+    std::vector<uint8_t> parentLocator = hasParent ? buildParentLocator() : std::vector<uint8_t>();
+
+    struct MetadataItem
+    {
+        VHDXGuid id;
+        const void* data;
+        uint32_t length;
+        uint32_t flags;
+    };
+    std::vector<MetadataItem> items = {
+        { FILE_PARAMETERS_GUID, &fileParameters, sizeof(fileParameters), METADATA_IS_REQUIRED },
+        { VIRTUAL_DISK_SIZE_GUID, &diskSize, sizeof(diskSize), METADATA_IS_VIRTUAL_DISK | METADATA_IS_REQUIRED },
+        { VIRTUAL_DISK_ID_GUID, &virtualDiskId, sizeof(virtualDiskId), METADATA_IS_VIRTUAL_DISK | METADATA_IS_REQUIRED },
+        { LOGICAL_SECTOR_SIZE_GUID, &sectorSize, sizeof(sectorSize), METADATA_IS_VIRTUAL_DISK | METADATA_IS_REQUIRED },
+        { PHYSICAL_SECTOR_SIZE_GUID, &sectorSize, sizeof(sectorSize), METADATA_IS_VIRTUAL_DISK | METADATA_IS_REQUIRED },
+    };
+    if (hasParent) {
+        items.push_back({ PARENT_LOCATOR_GUID, parentLocator.data(), static_cast<uint32_t>(parentLocator.size()), METADATA_IS_REQUIRED });
+    }
+
+    size_t itemsLength = 0;
+    for (const auto& item : items) {
+        itemsLength += item.length;
+    }
+    if (METADATA_TABLE_SIZE + itemsLength > METADATA_LENGTH) {
+        throw std::runtime_error("The VHDX metadata does not fit in the metadata region.");
+    }
+    std::vector<uint8_t> metadata(METADATA_TABLE_SIZE + itemsLength, 0);
+
+    MetadataTableHeader header = {};
+    header.signature = METADATA_TABLE_SIGNATURE;
+    header.entry_count = static_cast<uint16_t>(items.size());
+    memcpy(metadata.data(), &header, sizeof(header));
+
+    // The items follow the table, packed one after another
+    uint32_t itemOffset = static_cast<uint32_t>(METADATA_TABLE_SIZE);
+    for (size_t i = 0; i < items.size(); i++) {
+        MetadataTableEntry entry = {};
+        entry.item_id = items[i].id;
+        entry.offset = itemOffset;
+        entry.length = items[i].length;
+        entry.flags = items[i].flags;
+        memcpy(metadata.data() + sizeof(header) + i * sizeof(entry), &entry, sizeof(entry));
+        memcpy(metadata.data() + itemOffset, items[i].data, items[i].length);
+        itemOffset += items[i].length;
+    }
+    file.writeAt(METADATA_OFFSET, metadata.data(), metadata.size());
+}
+
+/**
+ * @brief Builds the parent locator: a table of UTF-16 key-value pairs that link this VHDX to its parent.
+ *
+ * parent_linkage is the data write GUID of the parent, which must match when the chain is opened.
+ *
+ * @return The parent locator metadata item.
+ */
+std::vector<uint8_t> VHDXWriter::buildParentLocator() const
+{
+    std::vector<std::pair<std::wstring, std::wstring>> entries = {
+        { L"parent_linkage", formatGuid(parentDataWriteGuid) },
+        { L"relative_path", parentRelativePath },
+    };
+    if (!parentAbsolutePath.empty()) {
+        entries.push_back({ L"absolute_win32_path", parentAbsolutePath });
+    }
+
+    ParentLocatorHeader header = {};
+    header.locator_type = VHDX_PARENT_LOCATOR_TYPE;
+    header.key_value_count = static_cast<uint16_t>(entries.size());
+
+    // The header and entry table are followed by the keys and values
+    std::vector<uint8_t> locator(sizeof(header) + entries.size() * sizeof(ParentLocatorEntry), 0);
+    memcpy(locator.data(), &header, sizeof(header));
+    for (size_t i = 0; i < entries.size(); i++) {
+        ParentLocatorEntry entry = {};
+        entry.key_offset = static_cast<uint32_t>(locator.size());
+        appendUTF16(locator, entries[i].first);
+        entry.key_length = static_cast<uint16_t>(locator.size() - entry.key_offset);
+        entry.value_offset = static_cast<uint32_t>(locator.size());
+        appendUTF16(locator, entries[i].second);
+        entry.value_length = static_cast<uint16_t>(locator.size() - entry.value_offset);
+        memcpy(locator.data() + sizeof(header) + i * sizeof(entry), &entry, sizeof(entry));
+    }
+    return locator;
+}
+
+/**
+ * @brief Writes both headers, each with a new sequence number.
+ *
+ * The header with the highest sequence number is the current one, so the second header written
+ * is always the current header.
+ */
+void VHDXWriter::writeHeaders()
+{
+    for (uint64_t offset : { HEADER_1_OFFSET, HEADER_2_OFFSET }) {
+        std::vector<uint8_t> buffer(HEADER_SIZE, 0);
+        VHDXHeader header = {};
+        header.signature = HEADER_SIGNATURE;
+        header.sequence_number = ++sequenceNumber;
+        header.file_write_guid = fileWriteGuid;
+        header.data_write_guid = dataWriteGuid;
+        header.version = 1;
+        header.log_length = LOG_LENGTH;
+        header.log_offset = LOG_OFFSET;
+        memcpy(buffer.data(), &header, sizeof(header));
+        header.checksum = computeCRC32C(buffer.data(), buffer.size());
+        memcpy(buffer.data(), &header, sizeof(header));
+        file.writeAt(offset, buffer.data(), buffer.size());
+    }
+}
+
+/**
+ * @brief Writes the sector bitmaps of a differencing VHDX, allocating each at the end of the file the first time.
+ *
+ * Must be called with the mutex held.
+ */
+void VHDXWriter::writeSectorBitmaps()
+{
+    for (const auto& [chunk, bitmap] : sectorBitmaps) {
+        uint64_t& entry = bat[chunk * (static_cast<uint64_t>(chunkRatio) + 1) + chunkRatio];
+        if ((entry & BAT_STATE_MASK) != SB_BLOCK_PRESENT) {
+            entry = fileEnd | SB_BLOCK_PRESENT;
+            fileEnd += SECTOR_BITMAP_BLOCK_SIZE;
+        }
+        file.writeAt(entry & ~(MB - 1), bitmap.data(), bitmap.size());
+    }
+}
+
+/**
+ * @brief Writes the BAT.
+ */
+void VHDXWriter::writeBAT()
+{
+    if (!bat.empty()) {
+        file.writeAt(BAT_OFFSET, bat.data(), bat.size() * sizeof(uint64_t));
+    }
+}
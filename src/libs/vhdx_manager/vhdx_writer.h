@@ -0,0 +1,144 @@
+#pragma once
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief A native VHDX writer that does not need the Windows virtual disk service.
+ *
+ * The file is laid out as described in the [MS-VHDX] specification: the file identifier,
+ * two headers, two region tables, an empty log, the metadata region and the block allocation
+ * table (BAT), followed by the payload blocks. Payload blocks are allocated at the end of the
+ * file the first time they are written, so blocks the restore never writes stay NOT_PRESENT
+ * and take no space.
+ *
+ * A differencing VHDX records its parent in a parent locator and marks the sectors it holds in
+ * sector bitmaps. Sectors it does not hold are read from the parent.
+ */
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "..\file_operations\restore_target.h"
+
+/**
+ * @struct VHDXGuid
+ * @brief A GUID in the mixed-endian layout used on disk by VHDX.
+ */
+struct VHDXGuid
+{
+    uint32_t data1;
+    uint16_t data2;
+    uint16_t data3;
+    uint8_t data4[8];
+};
+
+/**
+ * @class VHDXWriter
+ * @brief A `RestoreTarget` that writes a dynamic, fixed or differencing VHDX file directly.
+ *
+ * Writes to different payload blocks, and to different ranges of the same payload block, may
+ * be made concurrently. The BAT and headers are written by `flush`, which must be called once
+ * the restore is complete.
+ */
+class VHDXWriter : public RestoreTarget {
+public:
+    // The payload block size used by Hyper-V for new disks
+    static constexpr uint32_t DEFAULT_BLOCK_SIZE = 32 * 1024 * 1024;
+
+    // The payload block size used by Hyper-V for differencing disks. Smaller blocks waste less space on small changes.
+    static constexpr uint32_t DIFFERENCING_BLOCK_SIZE = 2 * 1024 * 1024;
+
+    /**
+     * @brief Creates the VHDX file. The layout is written by `prepare`, once the disk size is known.
+     *
+     * @param filePath The path of the VHDX file. An existing file is overwritten.
+     * @param sectorSize The logical and physical sector size of the virtual disk, 512 or 4096.
+     * @param fixed True to allocate every payload block up front, false for a dynamic VHDX.
+     * @param blockSize The payload block size, a power of two from 1 MB to 256 MB.
+     * @throws std::invalid_argument if the sector or block size is not valid.
+     * @throws std::runtime_error if the file could not be created.
+     */
+    VHDXWriter(const std::wstring& filePath, uint32_t sectorSize, bool fixed = false, uint32_t blockSize = DEFAULT_BLOCK_SIZE);
+
+    /**
+     * @brief Makes this VHDX a differencing disk of `parent`.
+     *
+     * Must be called before `prepare`. The parent is located by its path relative to this file, and
+     * linked by its data write GUID, so it must not be modified after this file is written.
+     *
+     * @param parent The parent VHDX. Must have the same sector size.
+     * @throws std::invalid_argument if this VHDX is fixed or the sector sizes differ.
+     */
+    void setParent(const VHDXWriter& parent);
+
+    /**
+     * @brief Returns the GUID that identifies the data of this VHDX, which a child uses to link to it.
+     */
+    const VHDXGuid& getDataWriteGuid() const { return dataWriteGuid; }
+
+    void prepare(uint64_t size) override;
+    void writeAt(uint64_t offset, const void* data, size_t length) override;
+    void zeroRange(uint64_t offset, uint64_t length) override;
+    void flush() override;
+    uint64_t getSize() override { return diskSize; }
+    void setWriteBack(const WriteBackPolicy& policy) override { file.setWriteBack(policy); }
+    WriteBackStats getWriteBackStats() const override { return file.getWriteBackStats(); }
+
+private:
+    /**
+     * @brief Returns the file offset of a payload block, allocating it at the end of the file if needed.
+     */
+    uint64_t getBlockFileOffset(uint64_t blockIndex, bool allocate);
+
+    /**
+     * @brief Returns the index in the BAT of a payload block. A sector bitmap entry follows every `chunkRatio` payload entries.
+     */
+    uint64_t getBATIndex(uint64_t blockIndex) const { return blockIndex + blockIndex / chunkRatio; }
+
+    /**
+     * @brief Marks sectors as held by this differencing VHDX. Must be called with the mutex held.
+     */
+    void markSectorsPresent(uint64_t firstSector, uint64_t sectorCount);
+
+    /**
+     * @brief Returns the parent locator metadata item.
+     */
+    std::vector<uint8_t> buildParentLocator() const;
+
+    void writeFileIdentifier();
+    void writeRegionTables();
+    void writeMetadata();
+    void writeHeaders();
+    void writeSectorBitmaps();
+    void writeBAT();
+
+    FileTarget file;
+    uint32_t sectorSize;
+    uint32_t blockSize;
+    bool fixed;
+    uint32_t chunkRatio;
+    uint64_t diskSize = 0;
+    uint64_t batLength = 0;
+    uint64_t fileEnd = 0;
+    uint64_t sequenceNumber = 0;
+    VHDXGuid fileWriteGuid;
+    VHDXGuid dataWriteGuid;
+    VHDXGuid virtualDiskId;
+    bool hasParent = false;
+    VHDXGuid parentDataWriteGuid = {};
+    std::wstring parentRelativePath;
+    std::wstring parentAbsolutePath;
+    std::mutex mutex;
+    std::vector<uint64_t> bat;
+    // The sector bitmaps of a differencing VHDX, by chunk. Only chunks that have been written are held.
+    std::map<uint64_t, std::vector<uint8_t>> sectorBitmaps;
+};
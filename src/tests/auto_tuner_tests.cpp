@@ -0,0 +1,141 @@
+// auto_tuner_tests.cpp : Tests of the decisions the autotuner makes from the throughput of each interval.
+//
+
+#include "..\libs\restore\pch.h"
+#include "..\libs\restore\auto_tuner.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+using namespace std::chrono_literals;
+
+// An interval in which the workers spent the given share of their time reading
+static void adjust(AutoTuner& tuner, double bytesPerSecond, double readShare = 0.3)
+{
+    std::chrono::steady_clock::duration busy = 1s;
+    tuner.adjust(bytesPerSecond, std::chrono::duration_cast<std::chrono::steady_clock::duration>(busy * readShare), busy);
+}
+
+TEST(theTunerStartsAtHalfOfEachCap)
+{
+    AutoTuner tuner(16, 8);
+    CHECK(tuner.getActiveWorkers() == 8);
+    CHECK(tuner.getReadAhead() == 4);
+
+    // Never below one worker, or one batch of read-ahead when there is any
+    AutoTuner small(1, 1);
+    CHECK(small.getActiveWorkers() == 1);
+    CHECK(small.getReadAhead() == 1);
+    AutoTuner noReadAhead(3, 0);
+    CHECK(noReadAhead.getActiveWorkers() == 1);
+    CHECK(noReadAhead.getReadAhead() == 0);
+}
+
+TEST(aDropInThroughputTurnsBackWithASmallerStep)
+{
+    AutoTuner tuner(16, 0);
+    // The first interval has nothing to compare with, so the tuner adds a quarter of the cap
+    adjust(tuner, 100e6);
+    CHECK(tuner.getActiveWorkers() == 12);
+    adjust(tuner, 200e6);
+    CHECK(tuner.getActiveWorkers() == 16);
+
+    // More workers made it slower, so it backs off by half the step
+    adjust(tuner, 150e6);
+    CHECK(tuner.getActiveWorkers() == 14);
+    // Fewer workers made it faster, so it goes on down
+    adjust(tuner, 190e6);
+    CHECK(tuner.getActiveWorkers() == 12);
+    // Then slower again, so it turns back up a single worker at a time
+    adjust(tuner, 170e6);
+    CHECK(tuner.getActiveWorkers() == 13);
+}
+
+TEST(moreWorkersThatLeaveTheThroughputFlatAreGivenBack)
+{
+    AutoTuner tuner(16, 0);
+    adjust(tuner, 100e6);
+    CHECK(tuner.getActiveWorkers() == 12);
+    // Within the noise of the last interval
+    adjust(tuner, 102e6);
+    CHECK(tuner.getActiveWorkers() == 10);
+    // Fewer workers that keep the throughput are kept going down
+    adjust(tuner, 101e6);
+    CHECK(tuner.getActiveWorkers() == 8);
+}
+
+TEST(theWorkersStayWithinTheirCap)
+{
+    AutoTuner tuner(6, 0);
+    bool withinCap = true;
+    // A throughput that always rises keeps asking for more workers
+    double rate = 100e6;
+    for (int i = 0; i < 20; ++i) {
+        adjust(tuner, rate *= 1.5);
+        withinCap = withinCap && tuner.getActiveWorkers() >= 1 && tuner.getActiveWorkers() <= 6;
+    }
+    // A throughput that always falls keeps turning back
+    for (int i = 0; i < 20; ++i) {
+        adjust(tuner, rate /= 1.5);
+        withinCap = withinCap && tuner.getActiveWorkers() >= 1 && tuner.getActiveWorkers() <= 6;
+    }
+    CHECK(withinCap);
+}
+
+TEST(theReadAheadFollowsTheTimeSpentReading)
+{
+    AutoTuner tuner(4, 12);
+    CHECK(tuner.getReadAhead() == 6);
+    adjust(tuner, 100e6, 0.8);
+    CHECK(tuner.getReadAhead() == 12);
+    // Never past the cap
+    adjust(tuner, 100e6, 0.8);
+    CHECK(tuner.getReadAhead() == 12);
+
+    // Reads between a tenth and half of the time leave it as it is
+    adjust(tuner, 100e6, 0.3);
+    CHECK(tuner.getReadAhead() == 12);
+
+    adjust(tuner, 100e6, 0.05);
+    CHECK(tuner.getReadAhead() == 6);
+    for (int i = 0; i < 5; ++i) {
+        adjust(tuner, 100e6, 0.05);
+    }
+    CHECK(tuner.getReadAhead() == 1);
+
+    // An interval with no batches done says nothing about the reads
+    tuner.adjust(100e6, 0s, 0s);
+    CHECK(tuner.getReadAhead() == 1);
+}
+
+TEST(onlyTheActiveWorkersTakeTheirTurn)
+{
+    AutoTuner tuner(4, 0);
+    std::atomic<bool> ran{ false };
+    // Two of the four workers start active, so the last waits
+    std::thread waiting([&]() {
+        tuner.waitTurn(3);
+        ran = true;
+    });
+    tuner.waitTurn(1);
+    std::this_thread::sleep_for(100ms);
+    CHECK(!ran);
+
+    // One more worker each interval while the throughput rises
+    adjust(tuner, 100e6);
+    adjust(tuner, 200e6);
+    CHECK(tuner.getActiveWorkers() == 4);
+    waiting.join();
+    CHECK(ran);
+}
+
+int main()
+{
+    return runTests();
+}
@@ -0,0 +1,154 @@
+// bad_block_tests.cpp : Tests of the description of bad blocks, the JSON map a salvaged restore writes, and the restores
+// that refuse to salvage.
+//
+
+#include "..\libs\restore\pch.h"
+#include <filesystem>
+#include "..\libs\file_reader\file_reader.h"
+#include "..\libs\restore\restore.h"
+#include "..\libs\restore\verify.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+// A layout with one disk of two partitions, the second with 64 KB blocks
+static file_structs::fileLayout makeLayout()
+{
+    file_structs::fileLayout layout;
+    file_structs::Disk::DiskLayout disk;
+    disk._header.disk_number = 1;
+    file_structs::Partition::PartitionLayout partition;
+    partition._header.partition_number = 1;
+    partition._header.block_size = 1024 * 1024;
+    disk.partitions.push_back(partition);
+    partition._header.partition_number = 2;
+    partition._header.block_size = 65536;
+    disk.partitions.push_back(partition);
+    layout.disks.push_back(disk);
+    return layout;
+}
+
+TEST(aBadBlockIsPlacedOnTheDiskAndInItsFileSystem)
+{
+    file_structs::fileLayout layout = makeLayout();
+    DataBlockIndexElement element{};
+    element.file_number = 3;
+    element.file_position = 123456;
+    element.block_length = 2000;
+    BlockRef block;
+    block.element = &element;
+    block.layout = &layout;
+    block.disk_number = 1;
+    block.partition_number = 2;
+    block.iv_index = 5;
+    block.disk_offset = 1024 * 1024 + 5 * 65536;
+    block.bytes_per_sector = 4096;
+    block.write_limit = 6000;
+
+    BadBlock badBlock = describeBadBlock(block, "Block hash mismatch.");
+    CHECK(badBlock.file_name.empty());
+    CHECK(badBlock.file_number == 3);
+    CHECK(badBlock.file_position == 123456);
+    CHECK(badBlock.block_length == 2000);
+    CHECK(badBlock.disk_number == 1);
+    CHECK(badBlock.partition_number == 2);
+    CHECK(badBlock.disk_lba == (1024 * 1024 + 5 * 65536) / 4096);
+    // A part sector still fills a sector
+    CHECK(badBlock.sector_count == 2);
+    CHECK(!badBlock.reserved_sectors);
+    CHECK(badBlock.file_system_offset == 5 * 65536);
+    CHECK(badBlock.error == "Block hash mismatch.");
+}
+
+TEST(theMapListsEveryFieldOfEachBadBlock)
+{
+    BadBlock first;
+    first.file_name = L"backup-00-01.mrimgx";
+    first.file_number = 1;
+    first.file_position = 4096;
+    first.block_length = 512;
+    first.disk_number = 1;
+    first.partition_number = 2;
+    first.disk_lba = 2048;
+    first.sector_count = 128;
+    first.reserved_sectors = true;
+    first.file_system_offset = 0;
+    first.error = "Block hash mismatch.";
+    BadBlock second = first;
+    second.disk_lba = 4096;
+    second.reserved_sectors = false;
+    second.file_system_offset = 65536;
+    second.error = "Failed to decompress block.";
+
+    nlohmann::json map = nlohmann::json::parse(formatBadBlockMap({ first, second }));
+    CHECK(map["bad_blocks"].size() == 2);
+    const nlohmann::json& block = map["bad_blocks"][0];
+    CHECK(block["file_name"] == "backup-00-01.mrimgx");
+    CHECK(block["file_number"] == 1);
+    CHECK(block["file_position"] == 4096);
+    CHECK(block["block_length"] == 512);
+    CHECK(block["disk_number"] == 1);
+    CHECK(block["partition_number"] == 2);
+    CHECK(block["disk_lba"] == 2048);
+    CHECK(block["sector_count"] == 128);
+    CHECK(block["reserved_sectors"] == true);
+    CHECK(block["file_system_offset"] == 0);
+    CHECK(block["error"] == "Block hash mismatch.");
+    CHECK(map["bad_blocks"][1]["disk_lba"] == 4096);
+    CHECK(map["bad_blocks"][1]["file_system_offset"] == 65536);
+    CHECK(map["bad_blocks"][1]["error"] == "Failed to decompress block.");
+}
+
+TEST(aRestoreWithNoBadBlocksHasAnEmptyMap)
+{
+    nlohmann::json map = nlohmann::json::parse(formatBadBlockMap({}));
+    CHECK(map["bad_blocks"].is_array());
+    CHECK(map["bad_blocks"].empty());
+}
+
+TEST(onlyARestoreToOneTargetCanBeSalvaged)
+{
+    // The options are checked before the backup file, which does not exist, is read
+    std::wstring backup = (std::filesystem::temp_directory_path() / "bad_block_tests_missing.mrimgx").wstring();
+    RestoreOptions options;
+    options.continue_on_error = true;
+    bool opened = false;
+    auto rejects = [](const std::function<void()>& restore) {
+        try {
+            restore();
+        }
+        catch (const std::invalid_argument&) {
+            return true;
+        }
+        catch (const std::exception&) {
+        }
+        return false;
+    };
+
+    CHECK(rejects([&]() {
+        restoreAllDisks(backup, "", options, [&](const file_structs::Disk::DiskLayout&) -> SharedTarget {
+            opened = true;
+            return std::make_shared<MemoryTarget>();
+        });
+    }));
+    CHECK(rejects([&]() {
+        restoreChain(backup, "", options, [&](const file_structs::fileLayout&, const std::wstring&, bool) -> SharedTarget {
+            opened = true;
+            return std::make_shared<MemoryTarget>();
+        });
+    }));
+    std::vector<SharedTarget> targets{ std::make_shared<MemoryTarget>(), std::make_shared<MemoryTarget>() };
+    CHECK(rejects([&]() { restoreDiskToTargets(backup, "", targets, options); }));
+    CHECK(!opened);
+}
+
+int main()
+{
+    return runTests();
+}
@@ -0,0 +1,623 @@
+// block_pipeline_tests.cpp : Tests of block decoding and the block pipeline.
+//
+
+#include "..\libs\restore\pch.h"
+#include "zstd\zstd.h"
+#include "..\libs\encryption\encryption.h"
+#include "..\libs\file_operations\backup_source.h"
+#include "..\libs\restore\block_pipeline.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+// Data that compresses well but not to nothing
+static std::vector<uint8_t> makeData(size_t size, uint32_t seed = 1)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = static_cast<uint8_t>((i / 64) * seed + (i % 7));
+    }
+    return data;
+}
+
+// Compresses data as one zstd frame that records its content size
+static std::vector<uint8_t> compress(const std::vector<uint8_t>& data)
+{
+    std::vector<uint8_t> frame(ZSTD_compressBound(data.size()));
+    size_t length = ZSTD_compress(frame.data(), frame.size(), data.data(), data.size(), 3);
+    if (ZSTD_isError(length)) {
+        throw std::runtime_error("Failed to compress test data.");
+    }
+    frame.resize(length);
+    return frame;
+}
+
+// A compressed, unencrypted block of a partition with the given block size
+struct CompressedBlock
+{
+    file_structs::fileLayout layout;
+    DataBlockIndexElement element{};
+    BlockRef block;
+    std::vector<uint8_t> stored;
+
+    CompressedBlock(const std::vector<uint8_t>& data, uint32_t writeLimit, uint32_t blockSize)
+    {
+        layout._encryption.aes_type = ImageEnums::AES::eNone;
+        layout._compression.compression_level = ImageEnums::CompressionType::eMedium;
+        stored = compress(data);
+        element.block_length = static_cast<uint32_t>(stored.size());
+        block.element = &element;
+        block.layout = &layout;
+        block.write_limit = writeLimit;
+        block.block_size = blockSize;
+    }
+};
+
+// A backup file held in memory
+class MemorySource : public BackupSource {
+public:
+    std::vector<uint8_t> data;
+
+    void readAt(uint64_t offset, void* buffer, size_t length) override
+    {
+        if (offset + length > data.size()) {
+            throw std::runtime_error("Read past the end of the memory source.");
+        }
+        memcpy(buffer, data.data() + offset, length);
+    }
+
+    uint64_t getSize() override
+    {
+        return data.size();
+    }
+};
+
+/**
+ * @class RecordingSource
+ * @brief A backup file held in memory that records, in order, the reads and hints it is given and the blocks the
+ *        sink is passed.
+ */
+class RecordingSource : public MemorySource {
+public:
+    enum class Kind { eRead, ePrefetch, eRelease, eDecoded };
+
+    struct Event
+    {
+        Kind kind;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    void readAt(uint64_t offset, void* buffer, size_t length) override
+    {
+        MemorySource::readAt(offset, buffer, length);
+        record(Kind::eRead, offset, length);
+    }
+
+    void prefetch(uint64_t offset, uint64_t length) override
+    {
+        record(Kind::ePrefetch, offset, length);
+    }
+
+    void release(uint64_t offset, uint64_t length) override
+    {
+        record(Kind::eRelease, offset, length);
+    }
+
+    void record(Kind kind, uint64_t offset, uint64_t length)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back({ kind, offset, length });
+    }
+
+    // The events of one kind
+    std::vector<Event> find(Kind kind) const
+    {
+        std::vector<Event> found;
+        std::copy_if(events.begin(), events.end(), std::back_inserter(found), [&](const Event& event) { return event.kind == kind; });
+        return found;
+    }
+
+    // Whether ranges cover the whole file, each byte once
+    bool coverOnce(std::vector<Event> ranges) const
+    {
+        std::sort(ranges.begin(), ranges.end(), [](const Event& a, const Event& b) { return a.offset < b.offset; });
+        uint64_t end = 0;
+        for (const Event& range : ranges) {
+            if (range.offset != end) {
+                return false;
+            }
+            end = range.offset + range.length;
+        }
+        return end == data.size();
+    }
+
+    std::vector<Event> events;
+
+private:
+    std::mutex mutex;
+};
+
+// A backup file of blocks laid out one after another, with the block list that reads them
+struct BlockSet
+{
+    file_structs::fileLayout layout;
+    MemorySource source;
+    std::vector<std::vector<uint8_t>> data;
+    std::vector<DataBlockIndexElement> elements;
+    std::vector<BlockRef> blocks;
+
+    BlockSet(size_t count, uint32_t blockSize, bool compressed)
+        : data(count), elements(count), blocks(count)
+    {
+        layout._encryption.aes_type = ImageEnums::AES::eNone;
+        layout._compression.compression_level = compressed ? ImageEnums::CompressionType::eMedium : ImageEnums::CompressionType::eNone;
+        for (size_t i = 0; i < count; ++i) {
+            data[i] = makeData(blockSize, static_cast<uint32_t>(i + 1));
+            std::vector<uint8_t> stored = compressed ? compress(data[i]) : data[i];
+            elements[i].file_position = static_cast<int64_t>(source.data.size());
+            elements[i].block_length = static_cast<uint32_t>(stored.size());
+            auto hash = computeMD5Hash(data[i].data(), data[i].size());
+            memcpy(elements[i].md5_hash, hash.data(), hash.size());
+            source.data.insert(source.data.end(), stored.begin(), stored.end());
+
+            blocks[i].element = &elements[i];
+            blocks[i].source = &source;
+            blocks[i].layout = &layout;
+            blocks[i].disk_offset = static_cast<uint64_t>(i) * blockSize;
+            blocks[i].write_limit = blockSize;
+            blocks[i].block_size = blockSize;
+        }
+    }
+};
+
+TEST(decodeDecompressesAWholeBlock)
+{
+    std::vector<uint8_t> data = makeData(65536);
+    CompressedBlock compressed(data, 65536, 65536);
+    BlockDecoder decoder;
+    std::vector<uint8_t> output;
+    DecodedBlock decoded = decoder.decode(compressed.block, compressed.stored.data(), output);
+    CHECK(decoded.length == data.size());
+    CHECK(memcmp(decoded.data, data.data(), data.size()) == 0);
+}
+
+TEST(decodeAcceptsABlockLongerThanItsWriteLimit)
+{
+    // The last reserved sector block decompresses to a whole block, of which only part is written
+    std::vector<uint8_t> data = makeData(65536);
+    CompressedBlock compressed(data, 4096, 65536);
+    BlockDecoder decoder;
+    std::vector<uint8_t> output;
+    DecodedBlock decoded = decoder.decode(compressed.block, compressed.stored.data(), output);
+    CHECK(decoded.length == data.size());
+}
+
+TEST(decodeRejectsAFrameLargerThanTheBlockSize)
+{
+    // A frame header that claims more than a block must not size the output buffer
+    std::vector<uint8_t> data = makeData(4 * 65536);
+    CompressedBlock compressed(data, 65536, 65536);
+    BlockDecoder decoder;
+    std::vector<uint8_t> output;
+    CHECK_THROWS(decoder.decode(compressed.block, compressed.stored.data(), output));
+    CHECK(output.size() < data.size());
+
+    // The same frame into target memory, and kept compressed
+    std::vector<uint8_t> destination(65536);
+    CHECK_THROWS(decoder.decode(compressed.block, compressed.stored.data(), output, false, destination.data()));
+    CHECK_THROWS(decoder.decode(compressed.block, compressed.stored.data(), output, true));
+}
+
+TEST(reorderBufferPassesBlocksInListOrder)
+{
+    // Small batches on many threads, with room to hold back only a few blocks
+    BlockSet set(200, 4096, false);
+    set.elements[37].md5_hash[0] ^= 1;
+    set.elements[150].md5_hash[5] ^= 1;
+    PipelineOptions options;
+    options.thread_count = 8;
+    options.batch_bytes = 3 * 4096;
+    options.reorder_bytes = 4 * 4096;
+
+    std::vector<size_t> order;
+    std::vector<size_t> bad;
+    bool contentMatches = true;
+    runBlockPipeline(set.blocks, options,
+        [&](const BlockRef& block, const DecodedBlock& decoded) {
+            size_t index = &block - set.blocks.data();
+            order.push_back(index);
+            contentMatches = contentMatches && decoded.length == 4096 && memcmp(decoded.data, set.data[index].data(), 4096) == 0;
+        },
+        [&](const BlockRef& block, const std::string&) {
+            size_t index = &block - set.blocks.data();
+            order.push_back(index);
+            bad.push_back(index);
+        });
+
+    CHECK(order.size() == set.blocks.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        CHECK(order[i] == i);
+    }
+    CHECK(contentMatches);
+    CHECK(bad == std::vector<size_t>({ 37, 150 }));
+}
+
+TEST(reorderBufferStopsOnTheFirstErrorWithoutAHandler)
+{
+    BlockSet set(100, 4096, false);
+    set.elements[60].md5_hash[0] ^= 1;
+    PipelineOptions options;
+    options.thread_count = 4;
+    options.batch_bytes = 4096;
+    options.reorder_bytes = 2 * 4096;
+
+    size_t passed = 0;
+    CHECK_THROWS(runBlockPipeline(set.blocks, options, [&](const BlockRef&, const DecodedBlock&) { ++passed; }, nullptr));
+    // The blocks before the bad one are passed on in order, and none after it
+    CHECK(passed == 60);
+}
+
+TEST(progressCountsRestoredBytes)
+{
+    // Compressed blocks are stored in much less than they restore to
+    BlockSet set(64, 65536, true);
+    CHECK(set.source.data.size() < 64 * 65536 / 4);
+    PipelineOptions options;
+    options.thread_count = 4;
+    options.batch_bytes = 4 * 65536;
+
+    uint64_t reportedTotal = 0;
+    uint64_t reported = 0;
+    runBlockPipeline(set.blocks, options, [](const BlockRef&, const DecodedBlock&) {}, nullptr,
+        [&](const uint64_t totalBytes, uint64_t& bytesSoFar, std::chrono::steady_clock::time_point&) {
+            reportedTotal = totalBytes;
+            reported += bytesSoFar;
+            bytesSoFar = 0;
+        });
+    CHECK(reportedTotal == 64 * 65536);
+    CHECK(reported == 64 * 65536);
+}
+
+TEST(deferredChecksReportBadBlocksOnceEveryBlockIsPassedOn)
+{
+    // Compressed blocks hand their buffers to the verifier, and get recycled buffers back to decode into
+    BlockSet set(300, 4096, true);
+    set.elements[5].md5_hash[0] ^= 1;
+    set.elements[120].md5_hash[7] ^= 1;
+    set.elements[299].md5_hash[15] ^= 1;
+    PipelineOptions options;
+    options.thread_count = 8;
+    options.batch_bytes = 8 * 1024;
+    options.hash_check = HashCheck::eDeferred;
+
+    std::mutex mutex;
+    size_t passed = 0;
+    size_t passedAtFirstError = 0;
+    std::vector<size_t> bad;
+    bool contentMatches = true;
+    runBlockPipeline(set.blocks, options,
+        [&](const BlockRef& block, const DecodedBlock& decoded) {
+            size_t index = &block - set.blocks.data();
+            std::lock_guard<std::mutex> lock(mutex);
+            ++passed;
+            contentMatches = contentMatches && decoded.length == 4096 && memcmp(decoded.data, set.data[index].data(), 4096) == 0;
+        },
+        [&](const BlockRef& block, const std::string&) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (bad.empty()) {
+                passedAtFirstError = passed;
+            }
+            bad.push_back(&block - set.blocks.data());
+        });
+
+    // A bad block is passed on before it is found, so every block reaches the sink
+    CHECK(passed == set.blocks.size());
+    CHECK(passedAtFirstError == set.blocks.size());
+    CHECK(contentMatches);
+    // Only the bad blocks fail, so no buffer was decoded into while it was still being checked
+    CHECK(bad == std::vector<size_t>({ 5, 120, 299 }));
+}
+
+TEST(deferredChecksThrowAfterTheSinkWithoutAHandler)
+{
+    BlockSet set(100, 4096, false);
+    set.elements[60].md5_hash[0] ^= 1;
+    PipelineOptions options;
+    options.thread_count = 4;
+    options.batch_bytes = 4096;
+    options.hash_check = HashCheck::eDeferred;
+
+    std::atomic<size_t> passed = 0;
+    CHECK_THROWS(runBlockPipeline(set.blocks, options, [&](const BlockRef&, const DecodedBlock&) { ++passed; }, nullptr));
+    CHECK(passed == set.blocks.size());
+}
+
+TEST(deferredChecksHashBlocksDecodedInPlace)
+{
+    BlockSet set(64, 65536, true);
+    set.elements[10].md5_hash[0] ^= 1;
+    std::vector<uint8_t> disk(64 * 65536);
+    PipelineOptions options;
+    options.thread_count = 4;
+    options.batch_bytes = 4 * 65536;
+    options.hash_check = HashCheck::eDeferred;
+    options.write_pointer = [&](const BlockRef& block) { return disk.data() + block.disk_offset; };
+
+    std::atomic<size_t> inPlace = 0;
+    std::mutex mutex;
+    std::vector<size_t> bad;
+    runBlockPipeline(set.blocks, options,
+        [&](const BlockRef&, const DecodedBlock& decoded) {
+            if (decoded.in_place) {
+                ++inPlace;
+            }
+        },
+        [&](const BlockRef& block, const std::string&) {
+            std::lock_guard<std::mutex> lock(mutex);
+            bad.push_back(&block - set.blocks.data());
+        });
+
+    CHECK(inPlace == set.blocks.size());
+    CHECK(bad == std::vector<size_t>({ 10 }));
+    bool contentMatches = true;
+    for (size_t i = 0; i < set.blocks.size(); ++i) {
+        contentMatches = contentMatches && memcmp(disk.data() + i * 65536, set.data[i].data(), 65536) == 0;
+    }
+    CHECK(contentMatches);
+}
+
+TEST(sampledChecksOnlyCheckTheSampledBlocks)
+{
+    BlockSet set(100, 4096, false);
+    set.elements[3].md5_hash[0] ^= 1;
+    set.elements[32].md5_hash[0] ^= 1;
+    set.elements[64].md5_hash[0] ^= 1;
+    PipelineOptions options;
+    options.thread_count = 4;
+    options.batch_bytes = 4 * 4096;
+    options.hash_check = HashCheck::eSampled;
+    options.hash_sample = 32;
+
+    std::mutex mutex;
+    size_t passed = 0;
+    std::vector<size_t> bad;
+    runBlockPipeline(set.blocks, options,
+        [&](const BlockRef&, const DecodedBlock&) {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++passed;
+        },
+        [&](const BlockRef& block, const std::string&) {
+            std::lock_guard<std::mutex> lock(mutex);
+            bad.push_back(&block - set.blocks.data());
+        });
+
+    // A sampled block that fails is not passed on. An unsampled one is passed on unchecked.
+    std::sort(bad.begin(), bad.end());
+    CHECK(bad == std::vector<size_t>({ 32, 64 }));
+    CHECK(passed == set.blocks.size() - 2);
+}
+
+TEST(framesKeptCompressedAreHashChecked)
+{
+    BlockSet set(40, 65536, true);
+    set.elements[7].md5_hash[0] ^= 1;
+    set.elements[32].md5_hash[3] ^= 1;
+    PipelineOptions options;
+    options.thread_count = 4;
+    options.batch_bytes = 4 * 65536;
+    options.keep_compressed = [](const BlockRef&) { return true; };
+
+    for (HashCheck hashCheck : { HashCheck::eInline, HashCheck::eDeferred, HashCheck::eSampled }) {
+        options.hash_check = hashCheck;
+        options.hash_sample = 32;
+        std::mutex mutex;
+        size_t frames = 0;
+        bool framesMatch = true;
+        std::vector<size_t> bad;
+        runBlockPipeline(set.blocks, options,
+            [&](const BlockRef& block, const DecodedBlock& decoded) {
+                std::lock_guard<std::mutex> lock(mutex);
+                const DataBlockIndexElement& element = *block.element;
+                frames += decoded.compressed;
+                framesMatch = framesMatch && decoded.length == element.block_length &&
+                    memcmp(decoded.data, set.source.data.data() + element.file_position, decoded.length) == 0;
+            },
+            [&](const BlockRef& block, const std::string&) {
+                std::lock_guard<std::mutex> lock(mutex);
+                bad.push_back(&block - set.blocks.data());
+            });
+
+        // The stored frames are passed on, and only the bad ones that were checked are held back
+        std::sort(bad.begin(), bad.end());
+        CHECK(framesMatch);
+        CHECK(bad == (hashCheck == HashCheck::eSampled ? std::vector<size_t>({ 32 }) : std::vector<size_t>({ 7, 32 })));
+        CHECK(frames == set.blocks.size() - bad.size());
+    }
+}
+
+TEST(readCurrentPassesOnOnlyTheBlocksTheTargetDoesNotHold)
+{
+    // A restored disk with two damaged blocks, and one block that could not be read back
+    BlockSet set(50, 4096, true);
+    std::vector<uint8_t> disk;
+    for (const auto& data : set.data) {
+        disk.insert(disk.end(), data.begin(), data.end());
+    }
+    disk[7 * 4096 + 100] ^= 1;
+    disk[30 * 4096] ^= 1;
+    PipelineOptions options;
+    options.thread_count = 4;
+    options.batch_bytes = 4 * 4096;
+    std::atomic<size_t> readBack = 0;
+    options.read_current = [&](const BlockRef& block, uint8_t* buffer) {
+        ++readBack;
+        if (block.disk_offset == 44 * 4096) {
+            throw std::runtime_error("Read failed.");
+        }
+        memcpy(buffer, disk.data() + block.disk_offset, block.write_limit);
+    };
+
+    std::mutex mutex;
+    std::vector<size_t> passed;
+    bool contentMatches = true;
+    runBlockPipeline(set.blocks, options,
+        [&](const BlockRef& block, const DecodedBlock& decoded) {
+            size_t index = &block - set.blocks.data();
+            std::lock_guard<std::mutex> lock(mutex);
+            passed.push_back(index);
+            contentMatches = contentMatches && memcmp(decoded.data, set.data[index].data(), 4096) == 0;
+        },
+        nullptr);
+
+    CHECK(readBack == set.blocks.size());
+    std::sort(passed.begin(), passed.end());
+    CHECK(passed == std::vector<size_t>({ 7, 30, 44 }));
+    CHECK(contentMatches);
+}
+
+TEST(readCurrentPassesOnABlockThatDoesNotFillItsPlace)
+{
+    // The last reserved sector block is hashed whole, so the part of it on the disk never matches the hash
+    BlockSet set(4, 65536, true);
+    set.blocks[3].write_limit = 4096;
+    std::vector<uint8_t> disk;
+    for (const auto& data : set.data) {
+        disk.insert(disk.end(), data.begin(), data.end());
+    }
+    PipelineOptions options;
+    options.thread_count = 2;
+    options.read_current = [&](const BlockRef& block, uint8_t* buffer) {
+        memcpy(buffer, disk.data() + block.disk_offset, block.write_limit);
+    };
+
+    std::vector<size_t> passed;
+    std::mutex mutex;
+    runBlockPipeline(set.blocks, options,
+        [&](const BlockRef& block, const DecodedBlock& decoded) {
+            std::lock_guard<std::mutex> lock(mutex);
+            passed.push_back(&block - set.blocks.data());
+            CHECK(decoded.length == 65536);
+        },
+        nullptr);
+    CHECK(passed == std::vector<size_t>({ 3 }));
+}
+
+// A block set read from a recording source
+static std::unique_ptr<RecordingSource> recordReads(BlockSet& set)
+{
+    auto source = std::make_unique<RecordingSource>();
+    source->data = set.source.data;
+    for (BlockRef& block : set.blocks) {
+        block.source = source.get();
+    }
+    return source;
+}
+
+// Records each block passed to the sink as its stored range
+static BlockSink recordDecoded(RecordingSource& source)
+{
+    return [&](const BlockRef& block, const DecodedBlock&) {
+        source.record(RecordingSource::Kind::eDecoded, block.element->file_position, block.element->block_length);
+    };
+}
+
+TEST(prefetchedRangesStayWithinTheReadAheadOfTheNewestBatch)
+{
+    // Batches of four 4 KB blocks, with two batches of read-ahead
+    BlockSet set(40, 4096, false);
+    std::unique_ptr<RecordingSource> source = recordReads(set);
+    PipelineOptions options;
+    options.thread_count = 1;
+    options.batch_bytes = 4 * 4096;
+    options.read_ahead_bytes = 2 * 4 * 4096;
+    runBlockPipeline(set.blocks, options, recordDecoded(*source), nullptr);
+
+    // With one worker the next read is of the newest batch taken. Each prefetch ends at most the read-ahead
+    // past the end of that batch, and is of a batch not read yet.
+    bool withinReadAhead = true;
+    uint64_t readEnd = 0;
+    for (size_t i = 0; i < source->events.size(); ++i) {
+        const RecordingSource::Event& event = source->events[i];
+        if (event.kind == RecordingSource::Kind::eRead) {
+            readEnd = std::max(readEnd, event.offset + event.length);
+        }
+        if (event.kind != RecordingSource::Kind::ePrefetch) {
+            continue;
+        }
+        auto next = std::find_if(source->events.begin() + i, source->events.end(),
+            [](const RecordingSource::Event& later) { return later.kind == RecordingSource::Kind::eRead; });
+        withinReadAhead = withinReadAhead && next != source->events.end() && event.offset >= readEnd &&
+            event.offset + event.length <= next->offset + options.batch_bytes + options.read_ahead_bytes;
+    }
+    CHECK(withinReadAhead);
+    // Every batch is hinted once, as one range
+    CHECK(source->find(RecordingSource::Kind::ePrefetch).size() == 10);
+    CHECK(source->coverOnce(source->find(RecordingSource::Kind::ePrefetch)));
+    // No release hints without drop_behind
+    CHECK(source->find(RecordingSource::Kind::eRelease).empty());
+}
+
+TEST(eachBatchIsReleasedOnceItsBlocksAreDecoded)
+{
+    BlockSet set(40, 4096, true);
+    std::unique_ptr<RecordingSource> source = recordReads(set);
+    PipelineOptions options;
+    options.thread_count = 4;
+    options.batch_bytes = 4 * 4096;
+    options.read_ahead_bytes = 4 * 4096;
+    options.drop_behind = true;
+    runBlockPipeline(set.blocks, options, recordDecoded(*source), nullptr);
+
+    // Every block in a released range has been passed to the sink before the release
+    bool decodedFirst = true;
+    std::set<uint64_t> decoded;
+    for (const RecordingSource::Event& event : source->events) {
+        if (event.kind == RecordingSource::Kind::eDecoded) {
+            decoded.insert(event.offset);
+        }
+        if (event.kind != RecordingSource::Kind::eRelease) {
+            continue;
+        }
+        for (const DataBlockIndexElement& element : set.elements) {
+            uint64_t position = element.file_position;
+            if (position >= event.offset && position < event.offset + event.length) {
+                decodedFirst = decodedFirst && decoded.count(position) == 1;
+            }
+        }
+    }
+    CHECK(decodedFirst);
+    CHECK(decoded.size() == set.blocks.size());
+    // Each range is released once, and prefetched once, whichever worker took its batch
+    CHECK(source->coverOnce(source->find(RecordingSource::Kind::eRelease)));
+    CHECK(source->coverOnce(source->find(RecordingSource::Kind::ePrefetch)));
+}
+
+TEST(readCurrentIssuesNoReadAhead)
+{
+    BlockSet set(20, 4096, true);
+    std::unique_ptr<RecordingSource> source = recordReads(set);
+    PipelineOptions options;
+    options.thread_count = 2;
+    options.batch_bytes = 4 * 4096;
+    options.read_ahead_bytes = 8 * 4096;
+    // A target that holds none of the blocks, so every block is read from the backup after all
+    options.read_current = [](const BlockRef& block, uint8_t* buffer) {
+        memset(buffer, 0, block.write_limit);
+    };
+    runBlockPipeline(set.blocks, options, recordDecoded(*source), nullptr);
+
+    CHECK(source->find(RecordingSource::Kind::eDecoded).size() == set.blocks.size());
+    CHECK(source->find(RecordingSource::Kind::ePrefetch).empty());
+}
+
+int main()
+{
+    return runTests();
+}
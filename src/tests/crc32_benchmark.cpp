@@ -0,0 +1,70 @@
+// crc32_benchmark.cpp : Measures the throughput of CRC32 and CRC32C against a byte at a time table lookup.
+//
+// Usage: crc32_benchmark
+//
+
+#include <iomanip>
+#include "..\libs\restore\pch.h"
+#include "..\libs\restore\crc32.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+// The byte at a time table lookup that Calculate_CRC32 used before, as the baseline
+static uint32_t byteAtATimeCRC32(const uint8_t* data, size_t length)
+{
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+            }
+            table[i] = crc;
+        }
+    }
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; ++i) {
+        crc = (crc >> 8) ^ table[(crc ^ data[i]) & 0xFF];
+    }
+    return ~crc;
+}
+
+// Runs a function until at least half a second has passed and returns the throughput in MB/s
+template <typename Function>
+static double measure(size_t bytesPerRun, const Function& function)
+{
+    volatile uint32_t sink = function();
+    auto start = std::chrono::steady_clock::now();
+    uint64_t runs = 0;
+    std::chrono::duration<double> elapsed{ 0 };
+    do {
+        sink = sink + function();
+        ++runs;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed.count() < 0.5);
+    return static_cast<double>(bytesPerRun) * runs / elapsed.count() / (1024 * 1024);
+}
+
+int main()
+{
+    std::vector<uint8_t> data(1024 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(i * 131 + i / 4093);
+    }
+
+    std::cout << "Length      byte table     CRC32    CRC32C (MB/s)\n";
+    for (size_t length : { size_t(92), size_t(512), size_t(16384), data.size() }) {
+        double baseline = measure(length, [&]() { return byteAtATimeCRC32(data.data(), length); });
+        double crc32 = measure(length, [&]() { return computeCRC32(data.data(), length); });
+        double crc32c = measure(length, [&]() { return computeCRC32C(data.data(), length); });
+        std::cout << std::setw(7) << length << std::setw(14) << static_cast<uint64_t>(baseline) << std::setw(10)
+            << static_cast<uint64_t>(crc32) << std::setw(10) << static_cast<uint64_t>(crc32c) << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+// crc32_tests.cpp : Known answer tests of the CRC32 and CRC32C implementations.
+//
+
+#include "..\libs\restore\pch.h"
+#include "..\libs\encryption\cpu_features.h"
+#include "..\libs\restore\crc32.h"
+#include "..\libs\restore\crc32_kernels.h"
+#include "..\libs\file_reader\file_reader.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+// Defined in restore.cpp, which does not export it in a header
+void setNewDiskID(file_structs::Disk::DiskLayout& disk);
+
+// A bit at a time CRC with a reflected polynomial, as the reference for the fast implementations
+static uint32_t referenceCRC(uint32_t reflectedPolynomial, uint32_t crc, const uint8_t* data, size_t length)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (reflectedPolynomial & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t referenceCRC32(const uint8_t* data, size_t length)
+{
+    return referenceCRC(0xEDB88320, 0, data, length);
+}
+
+static uint32_t referenceCRC32C(const uint8_t* data, size_t length)
+{
+    return referenceCRC(0x82F63B78, 0, data, length);
+}
+
+static std::vector<uint8_t> makeData(size_t size)
+{
+    std::vector<uint8_t> data(size);
+    uint32_t seed = 2024;
+    for (auto& byte : data) {
+        seed = seed * 1664525 + 1013904223;
+        byte = static_cast<uint8_t>(seed >> 24);
+    }
+    return data;
+}
+
+static const uint8_t* bytes(const char* text)
+{
+    return reinterpret_cast<const uint8_t*>(text);
+}
+
+TEST(crc32MatchesKnownAnswers)
+{
+    CHECK(computeCRC32(nullptr, 0) == 0);
+    CHECK(computeCRC32(bytes("123456789"), 9) == 0xCBF43926);
+    CHECK(computeCRC32(bytes("The quick brown fox jumps over the lazy dog"), 43) == 0x414FA339);
+    // Calculate_CRC32 starts from an inverted register and returns the inverted result, as GPT expects
+    CHECK(Calculate_CRC32(bytes("123456789"), 9, 9) == 0xCBF43926);
+    CHECK(Calculate_CRC32(bytes("123456789"), 10, 9) == 0);
+}
+
+TEST(crc32cMatchesKnownAnswers)
+{
+    // The check value, and the test vectors in RFC 3720, appendix B.4
+    CHECK(computeCRC32C(bytes("123456789"), 9) == 0xE3069283);
+    std::vector<uint8_t> data(32, 0x00);
+    CHECK(computeCRC32C(data.data(), data.size()) == 0x8A9136AA);
+    std::fill(data.begin(), data.end(), 0xFF);
+    CHECK(computeCRC32C(data.data(), data.size()) == 0x62A8AB43);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(i);
+    }
+    CHECK(computeCRC32C(data.data(), data.size()) == 0x46DD794E);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(31 - i);
+    }
+    CHECK(computeCRC32C(data.data(), data.size()) == 0x113FDB5C);
+}
+
+TEST(fastPathsMatchReferenceAtEveryLengthAndAlignment)
+{
+    std::vector<uint8_t> data = makeData(5000);
+    for (size_t offset = 0; offset < 16; offset += 3) {
+        for (size_t length = 0; length + offset <= data.size(); length += length < 300 ? 1 : 97) {
+            const uint8_t* start = data.data() + offset;
+            CHECK(computeCRC32(start, length) == referenceCRC32(start, length));
+            CHECK(computeCRC32C(start, length) == referenceCRC32C(start, length));
+        }
+    }
+}
+
+TEST(updatesContinueACalculation)
+{
+    std::vector<uint8_t> data = makeData(4096);
+    uint32_t crc32 = referenceCRC32(data.data(), data.size());
+    uint32_t crc32c = referenceCRC32C(data.data(), data.size());
+    for (size_t split : { size_t(0), size_t(1), size_t(15), size_t(64), size_t(255), size_t(256), size_t(1000), size_t(4095), size_t(4096) }) {
+        CHECK(updateCRC32(computeCRC32(data.data(), split), data.data() + split, data.size() - split) == crc32);
+        CHECK(updateCRC32C(computeCRC32C(data.data(), split), data.data() + split, data.size() - split) == crc32c);
+    }
+}
+
+TEST(kernelsMatchReference)
+{
+    std::vector<uint8_t> data = makeData(8192);
+    const CpuFeatures& features = getCpuFeatures();
+    if (features.pclmul && features.sse42) {
+        // The PCLMULQDQ kernel takes whole 16 byte blocks, at least 64 bytes, and works on the uninverted register
+        for (size_t length = 64; length <= data.size(); length += 16 * 37) {
+            CHECK(~foldCRC32PCLMUL(0xFFFFFFFF, data.data() + 1, length) == referenceCRC32(data.data() + 1, length));
+        }
+    }
+    else {
+        std::cout << "PCLMULQDQ is not available, skipped.\n";
+    }
+    if (features.sse42) {
+        for (size_t length = 0; length <= 1000; length += 7) {
+            CHECK(~updateCRC32CSSE42(0xFFFFFFFF, data.data() + 3, length) == referenceCRC32C(data.data() + 3, length));
+        }
+    }
+    else {
+        std::cout << "SSE4.2 is not available, skipped.\n";
+    }
+}
+
+TEST(newGptDiskIdKeepsPartitionGuids)
+{
+    constexpr uint32_t SECTOR = 512;
+    file_structs::Disk::DiskLayout disk;
+    disk._header.disk_format = ImageEnums::DiskFormat::eGPT;
+    disk._geometry.bytes_per_sector = SECTOR;
+    disk.track0.assign(34 * SECTOR, 0);
+
+    gpt_header* header = reinterpret_cast<gpt_header*>(disk.track0.data() + SECTOR);
+    header->signature = 0x5452415020494645ULL;
+    header->header_size = 92;
+    header->my_lba = 1;
+    header->partition_entry_lba = 2;
+    header->num_partition_entries = 128;
+    header->sizeof_partition_entry = 128;
+    header->disk_guid.data1 = 0x11111111;
+    // A stale entry array checksum, which is recalculated
+    header->partition_entry_array_crc32 = 0x12345678;
+
+    gpt_entry* entries = reinterpret_cast<gpt_entry*>(disk.track0.data() + 2 * SECTOR);
+    for (uint32_t i = 0; i < 2; ++i) {
+        entries[i].partition_type_guid.data1 = 0xEBD0A0A2;
+        entries[i].unique_partition_guid.data1 = 0xABCD0000 + i;
+        entries[i].starting_lba = 2048 + i * 4096;
+        entries[i].ending_lba = entries[i].starting_lba + 4095;
+    }
+    std::vector<uint8_t> entryArray(disk.track0.begin() + 2 * SECTOR, disk.track0.end());
+
+    setNewDiskID(disk);
+
+    CHECK(header->disk_guid.data1 != 0x11111111);
+    CHECK(std::equal(entryArray.begin(), entryArray.end(), disk.track0.begin() + 2 * SECTOR));
+    CHECK(header->partition_entry_array_crc32 == referenceCRC32(entryArray.data(), 128 * 128));
+    uint32_t headerCRC = header->header_crc32;
+    header->header_crc32 = 0;
+    CHECK(headerCRC == referenceCRC32(reinterpret_cast<const uint8_t*>(header), 92));
+}
+
+int main()
+{
+    return runTests();
+}
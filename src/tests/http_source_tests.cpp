@@ -0,0 +1,445 @@
+// http_source_tests.cpp : Tests of the HTTP range-read backend against a mock object store.
+//
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "test_framework.h"
+#include "..\libs\file_operations\http_source.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET SocketHandle;
+#define closeSocket closesocket
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int SocketHandle;
+#define closeSocket close
+#define INVALID_SOCKET (-1)
+#endif
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @class MockObjectStore
+ * @brief A minimal S3-compatible server on the loopback interface, serving objects from memory.
+ *
+ * It answers GET requests with a Range header with 206 and a Content-Range, or with 200 and the whole object
+ * when `ignoreRanges` is set, and `?list-type=2` requests
+ * with a ListObjectsV2 result, paged `maxKeys` keys at a time. Connections are kept alive. Every
+ * connection is served by its own thread until the client closes it.
+ */
+class MockObjectStore {
+public:
+    MockObjectStore()
+    {
+#ifdef _WIN32
+        WSADATA data;
+        WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        if (listener == INVALID_SOCKET || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+            throw std::runtime_error("Unable to start the mock object store.");
+        }
+        socklen_t addressSize = sizeof(address);
+        getsockname(listener, reinterpret_cast<sockaddr*>(&address), &addressSize);
+        port = ntohs(address.sin_port);
+        acceptor = std::thread(&MockObjectStore::acceptConnections, this);
+    }
+
+    ~MockObjectStore()
+    {
+        stop = true;
+        // Wake the acceptor with a connection of our own
+        SocketHandle wake = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        connect(wake, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        closeSocket(wake);
+        acceptor.join();
+        closeSocket(listener);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (SocketHandle connection : connections) {
+            shutdown(connection, 2);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // The base URL of the server, without a trailing slash
+    std::wstring url() const
+    {
+        std::string text = "http://127.0.0.1:" + std::to_string(port);
+        return std::wstring(text.begin(), text.end());
+    }
+
+    void putObject(const std::string& key, const std::string& data)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        objects[key] = data;
+    }
+
+    // The next `count` object requests fail with 503
+    void failNext(uint32_t count)
+    {
+        failures = count;
+    }
+
+    std::atomic<uint32_t> requests{ 0 };
+    std::atomic<uint32_t> maxKeys{ 1000 };
+    // Answer range requests as a server without range support does
+    std::atomic<bool> ignoreRanges{ false };
+    // Moves the start of every range returned, as a faulty server or cache might
+    std::atomic<uint32_t> rangeShift{ 0 };
+
+private:
+    SocketHandle listener;
+    uint16_t port = 0;
+    std::atomic<bool> stop{ false };
+    std::atomic<uint32_t> failures{ 0 };
+    std::thread acceptor;
+    std::mutex mutex;
+    std::map<std::string, std::string> objects;
+    std::vector<SocketHandle> connections;
+    std::vector<std::thread> threads;
+
+    void acceptConnections()
+    {
+        for (;;) {
+            SocketHandle connection = accept(listener, nullptr, nullptr);
+            if (stop || connection == INVALID_SOCKET) {
+                if (connection != INVALID_SOCKET) {
+                    closeSocket(connection);
+                }
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            connections.push_back(connection);
+            threads.emplace_back(&MockObjectStore::serve, this, connection);
+        }
+    }
+
+    void serve(SocketHandle connection)
+    {
+        std::string pending;
+        char buffer[4096];
+        for (;;) {
+            size_t headerEnd = pending.find("\r\n\r\n");
+            if (headerEnd == std::string::npos) {
+                int received = recv(connection, buffer, sizeof(buffer), 0);
+                if (received <= 0) {
+                    break;
+                }
+                pending.append(buffer, received);
+                continue;
+            }
+            std::string header = pending.substr(0, headerEnd);
+            pending.erase(0, headerEnd + 4);
+            std::string response = respond(header);
+            if (send(connection, response.data(), static_cast<int>(response.size()), 0) != static_cast<int>(response.size())) {
+                break;
+            }
+        }
+        closeSocket(connection);
+    }
+
+    static std::string reply(int status, const std::string& reason, const std::string& body, const std::string& extraHeaders = "")
+    {
+        return "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\nContent-Length: " + std::to_string(body.size()) +
+            "\r\n" + extraHeaders + "Connection: keep-alive\r\n\r\n" + body;
+    }
+
+    static std::string queryValue(const std::string& query, const std::string& name)
+    {
+        size_t start = query.find(name + "=");
+        if (start == std::string::npos) {
+            return "";
+        }
+        start += name.size() + 1;
+        std::string encoded = query.substr(start, query.find('&', start) - start);
+        std::string decoded;
+        for (size_t i = 0; i < encoded.size(); ++i) {
+            if (encoded[i] == '%' && i + 2 < encoded.size()) {
+                decoded += static_cast<char>(std::stoi(encoded.substr(i + 1, 2), nullptr, 16));
+                i += 2;
+            }
+            else {
+                decoded += encoded[i];
+            }
+        }
+        return decoded;
+    }
+
+    std::string respond(const std::string& header)
+    {
+        ++requests;
+        size_t targetStart = header.find(' ') + 1;
+        std::string target = header.substr(targetStart, header.find(' ', targetStart) - targetStart);
+        size_t queryStart = target.find('?');
+        std::string path = target.substr(1, queryStart == std::string::npos ? std::string::npos : queryStart - 1);
+        std::string query = queryStart == std::string::npos ? "" : target.substr(queryStart + 1);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (query.find("list-type=2") != std::string::npos) {
+            return list(path, query);
+        }
+        for (uint32_t remaining = failures; remaining > 0; remaining = failures) {
+            if (failures.compare_exchange_weak(remaining, remaining - 1)) {
+                return reply(503, "Slow Down", "");
+            }
+        }
+        auto object = objects.find(path);
+        if (object == objects.end()) {
+            return reply(404, "Not Found", "<Error><Code>NoSuchKey</Code></Error>");
+        }
+        const std::string& data = object->second;
+        size_t rangeStart = header.find("Range: bytes=");
+        if (rangeStart == std::string::npos || ignoreRanges) {
+            return reply(200, "OK", data);
+        }
+        rangeStart += strlen("Range: bytes=");
+        size_t dash = header.find('-', rangeStart);
+        uint64_t first = std::stoull(header.substr(rangeStart, dash - rangeStart)) + rangeShift;
+        uint64_t last = std::min<uint64_t>(std::stoull(header.substr(dash + 1)), data.size() - 1);
+        if (first >= data.size()) {
+            return reply(416, "Range Not Satisfiable", "");
+        }
+        return reply(206, "Partial Content", data.substr(first, last - first + 1),
+            "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(data.size()) + "\r\n");
+    }
+
+    std::string list(const std::string& bucket, const std::string& query)
+    {
+        std::string prefix = bucket + "/" + queryValue(query, "prefix");
+        std::string token = queryValue(query, "continuation-token");
+        std::string body = "<ListBucketResult>";
+        uint32_t listed = 0;
+        std::string nextKey;
+        for (auto it = objects.lower_bound(token.empty() ? prefix : token); it != objects.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            if (listed == maxKeys) {
+                nextKey = it->first;
+                break;
+            }
+            body += "<Contents><Key>" + it->first.substr(bucket.size() + 1) + "</Key></Contents>";
+            ++listed;
+        }
+        body += nextKey.empty() ? "<IsTruncated>false</IsTruncated>" : "<IsTruncated>true</IsTruncated><NextContinuationToken>" + nextKey + "</NextContinuationToken>";
+        body += "</ListBucketResult>";
+        return reply(200, "OK", body);
+    }
+};
+
+// An object with a distinct byte at every offset
+static std::string makeObject(size_t size)
+{
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = static_cast<char>((i * 131 + i / 251) & 0xFF);
+    }
+    return data;
+}
+
+TEST(readAtReturnsTheRequestedRange)
+{
+    MockObjectStore store;
+    std::string data = makeObject(100000);
+    store.putObject("bucket/set/backup.mrimgx", data);
+    HttpRangeSource source(store.url() + L"/bucket/set/backup.mrimgx");
+
+    std::vector<char> buffer(5000);
+    source.readAt(12345, buffer.data(), buffer.size());
+    CHECK(memcmp(buffer.data(), data.data() + 12345, buffer.size()) == 0);
+    source.readAt(data.size() - 10, buffer.data(), 10);
+    CHECK(memcmp(buffer.data(), data.data() + data.size() - 10, 10) == 0);
+}
+
+TEST(readRangesCoalescesNeighbouringRanges)
+{
+    MockObjectStore store;
+    std::string data = makeObject(1 << 20);
+    store.putObject("bucket/backup.mrimgx", data);
+    HttpSourceOptions options;
+    options.coalesceGap = 4096;
+    HttpRangeSource source(store.url() + L"/bucket/backup.mrimgx", options);
+
+    // Two groups of ranges, each within the gap of its neighbour, far apart from each other
+    std::vector<uint64_t> offsets = { 1000, 3000, 6000, 9000, 600000, 602000 };
+    std::vector<std::vector<char>> buffers(offsets.size(), std::vector<char>(1000));
+    std::vector<ReadRange> ranges;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        ReadRange range;
+        range.offset = offsets[i];
+        range.length = 1000;
+        range.buffer = buffers[i].data();
+        ranges.push_back(range);
+    }
+    source.readRanges(ranges);
+    CHECK(store.requests == 2);
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        CHECK(memcmp(buffers[i].data(), data.data() + offsets[i], 1000) == 0);
+    }
+}
+
+TEST(getSizeSendsOneRequestForConcurrentCallers)
+{
+    MockObjectStore store;
+    store.putObject("bucket/backup.mrimgx", makeObject(123457));
+    HttpRangeSource source(store.url() + L"/bucket/backup.mrimgx");
+
+    std::vector<std::thread> threads;
+    std::atomic<uint32_t> correct{ 0 };
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&]() {
+            if (source.getSize() == 123457) {
+                ++correct;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CHECK(correct == 8);
+    CHECK(store.requests == 1);
+}
+
+TEST(transientErrorsAreRetried)
+{
+    MockObjectStore store;
+    std::string data = makeObject(4096);
+    store.putObject("bucket/backup.mrimgx", data);
+    HttpRangeSource source(store.url() + L"/bucket/backup.mrimgx");
+
+    store.failNext(2);
+    CHECK(source.getSize() == data.size());
+    CHECK(store.requests == 3);
+
+    store.failNext(2);
+    std::vector<char> buffer(100);
+    source.readAt(50, buffer.data(), buffer.size());
+    CHECK(memcmp(buffer.data(), data.data() + 50, buffer.size()) == 0);
+
+    // One failure more than the retries allowed
+    store.failNext(4);
+    CHECK_THROWS(source.readAt(0, buffer.data(), buffer.size()));
+}
+
+TEST(clientErrorsAreNotRetried)
+{
+    MockObjectStore store;
+    HttpRangeSource source(store.url() + L"/bucket/missing.mrimgx");
+
+    CHECK_THROWS(source.getSize());
+    CHECK(store.requests == 1);
+    std::vector<char> buffer(100);
+    CHECK_THROWS(source.readAt(0, buffer.data(), buffer.size()));
+    CHECK(store.requests == 2);
+}
+
+// Whether `action` throws an error that names the missing range support
+static bool failsForNoRangeSupport(const std::function<void()>& action)
+{
+    try {
+        action();
+    }
+    catch (const std::runtime_error& e) {
+        return std::string(e.what()).find("does not support range requests") != std::string::npos;
+    }
+    return false;
+}
+
+TEST(aServerWithoutRangeSupportIsRefused)
+{
+    MockObjectStore store;
+    store.putObject("bucket/backup.mrimgx", makeObject(1 << 20));
+    store.ignoreRanges = true;
+    HttpRangeSource source(store.url() + L"/bucket/backup.mrimgx");
+
+    CHECK(failsForNoRangeSupport([&]() { source.getSize(); }));
+    std::vector<char> buffer(100);
+    CHECK(failsForNoRangeSupport([&]() { source.readAt(0, buffer.data(), buffer.size()); }));
+    CHECK(failsForNoRangeSupport([&]() { source.readAt(5000, buffer.data(), buffer.size()); }));
+    // A retry would get the same answer
+    CHECK(store.requests == 3);
+}
+
+TEST(aWholeObjectIsAcceptedWhenItIsTheRange)
+{
+    MockObjectStore store;
+    std::string data = makeObject(1000);
+    store.putObject("bucket/backup.mrimgx", data);
+    store.putObject("bucket/byte.mrimgx", "b");
+    store.ignoreRanges = true;
+
+    HttpRangeSource source(store.url() + L"/bucket/backup.mrimgx");
+    std::vector<char> buffer(data.size());
+    source.readAt(0, buffer.data(), buffer.size());
+    CHECK(memcmp(buffer.data(), data.data(), data.size()) == 0);
+
+    HttpRangeSource byte(store.url() + L"/bucket/byte.mrimgx");
+    CHECK(byte.getSize() == 1);
+}
+
+TEST(aRangeOtherThanTheOneRequestedIsRejected)
+{
+    MockObjectStore store;
+    store.putObject("bucket/backup.mrimgx", makeObject(100000));
+    HttpRangeSource source(store.url() + L"/bucket/backup.mrimgx");
+
+    store.rangeShift = 1;
+    std::vector<char> buffer(100);
+    CHECK_THROWS(source.readAt(5000, buffer.data(), buffer.size()));
+    CHECK_THROWS(source.getSize());
+}
+
+TEST(listFilesMatchesExtensionUnderThePrefix)
+{
+    MockObjectStore store;
+    store.putObject("bucket/set/a.mrimgx", "a");
+    store.putObject("bucket/set/b.mrimgx", "b");
+    store.putObject("bucket/set/c.mrimgx", "c");
+    store.putObject("bucket/set/notes.txt", "n");
+    store.putObject("bucket/set/nested/d.mrimgx", "d");
+    store.putObject("bucket/other/e.mrimgx", "e");
+    // Page through the listing one key at a time
+    store.maxKeys = 1;
+
+    HttpBackupStore backupStore(store.url() + L"/bucket/set/a.mrimgx");
+    std::vector<std::wstring> files = backupStore.listFiles(L".mrimgx");
+    std::vector<std::wstring> expected = {
+        store.url() + L"/bucket/set/a.mrimgx",
+        store.url() + L"/bucket/set/b.mrimgx",
+        store.url() + L"/bucket/set/c.mrimgx" };
+    CHECK(files == expected);
+
+    auto source = backupStore.openSource(files[1]);
+    char byte = 0;
+    source->readAt(0, &byte, 1);
+    CHECK(byte == 'b');
+}
+
+int main()
+{
+    return runTests();
+}
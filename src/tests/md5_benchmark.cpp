@@ -0,0 +1,62 @@
+// md5_benchmark.cpp : Compares the throughput of batch MD5 hashing with OpenSSL, one block at a time.
+//
+// Usage: md5_benchmark [block size in KB] [block count]
+//
+
+#include "..\libs\encryption\pch.h"
+#include <chrono>
+#include <iostream>
+#include <string>
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+// Runs a function until at least a second has passed and returns the throughput in MB/s
+template <typename Function>
+static double measure(uint64_t bytesPerRun, const Function& function)
+{
+    function();
+    auto start = std::chrono::steady_clock::now();
+    uint64_t runs = 0;
+    std::chrono::duration<double> elapsed{ 0 };
+    do {
+        function();
+        ++runs;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed.count() < 1.0);
+    return static_cast<double>(bytesPerRun) * runs / elapsed.count() / (1024 * 1024);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t blockSize = (argc > 1 ? std::stoul(argv[1]) : 64) * 1024;
+    size_t blockCount = argc > 2 ? std::stoul(argv[2]) : 64;
+
+    std::vector<uint8_t> data(blockSize * blockCount);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(i * 131 + i / 4093);
+    }
+    std::vector<MD5Job> jobs(blockCount);
+    for (size_t i = 0; i < blockCount; ++i) {
+        jobs[i].data = data.data() + i * blockSize;
+        jobs[i].length = blockSize;
+    }
+
+    double openssl = measure(data.size(), [&]() {
+        for (auto& job : jobs) {
+            job.hash = computeMD5Hash(job.data, job.length);
+        }
+    });
+    double batch = measure(data.size(), [&]() { computeMD5HashBatch(jobs.data(), jobs.size()); });
+
+    std::cout << blockCount << " blocks of " << blockSize / 1024 << " KB, one thread\n";
+    std::cout << "OpenSSL, one block at a time: " << static_cast<uint64_t>(openssl) << " MB/s\n";
+    std::cout << "computeMD5HashBatch, " << getMD5BatchWidth() << " lanes: " << static_cast<uint64_t>(batch) << " MB/s ("
+        << static_cast<int>(batch / openssl * 100) << "%)\n";
+    return 0;
+}
@@ -0,0 +1,143 @@
+// md5_tests.cpp : Known answer tests of the MD5 hash and the multi-buffer MD5 kernels.
+//
+
+#include "..\libs\encryption\pch.h"
+#include "..\libs\encryption\cpu_features.h"
+#include "..\libs\encryption\md5_kernels.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @struct KnownAnswer
+ * @brief A message and its MD5 hash, from the test suite in RFC 1321.
+ */
+struct KnownAnswer
+{
+    std::string message;
+    const char* hash;
+};
+
+static const std::vector<KnownAnswer> knownAnswers = {
+    { "", "d41d8cd98f00b204e9800998ecf8427e" },
+    { "a", "0cc175b9c0f1b6a831c399e269772661" },
+    { "abc", "900150983cd24fb0d6963f7d28e17f72" },
+    { "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+    { "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+    { "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", "d174ab98d277d9f5a5611c2c9f419d9f" },
+    { "12345678901234567890123456789012345678901234567890123456789012345678901234567890", "57edf4a22be3c955ac49da2e2107b67a" } };
+
+static std::string toHex(const uint8_t* hash)
+{
+    static const char hex[] = "0123456789abcdef";
+    std::string text;
+    for (int i = 0; i < MD5_LENGTH; ++i) {
+        text += hex[hash[i] >> 4];
+        text += hex[hash[i] & 0x0F];
+    }
+    return text;
+}
+
+// Messages of every length around the padding boundaries and the lane batch sizes, with distinct content
+static std::vector<std::vector<uint8_t>> makeMixedMessages()
+{
+    std::vector<size_t> lengths = { 0, 1, 3, 55, 56, 57, 63, 64, 65, 119, 120, 127, 128, 129, 1000, 4096, 4097, 65536, 65535, 2, 300 };
+    std::vector<std::vector<uint8_t>> messages;
+    uint32_t seed = 12345;
+    for (size_t repeat = 0; repeat < 3; ++repeat) {
+        for (size_t length : lengths) {
+            std::vector<uint8_t> message(length + repeat * 7);
+            for (auto& byte : message) {
+                seed = seed * 1103515245 + 12345;
+                byte = static_cast<uint8_t>(seed >> 16);
+            }
+            messages.push_back(std::move(message));
+        }
+    }
+    return messages;
+}
+
+typedef void (*LaneKernel)(const MD5LaneJob* jobs, size_t count);
+
+// Checks a kernel against the known answers in every lane, and against OpenSSL on messages of mixed lengths
+static void checkKernel(LaneKernel kernel, size_t lanes)
+{
+    // Each known answer in each lane, with the other lanes busy with longer messages
+    std::vector<uint8_t> filler(1000, 0x5A);
+    for (const KnownAnswer& answer : knownAnswers) {
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            std::vector<MD5LaneJob> jobs(lanes);
+            std::vector<std::array<uint8_t, MD5_LENGTH>> hashes(lanes);
+            for (size_t i = 0; i < lanes; ++i) {
+                jobs[i] = { filler.data(), filler.size() - i, hashes[i].data() };
+            }
+            jobs[lane].data = reinterpret_cast<const uint8_t*>(answer.message.data());
+            jobs[lane].length = answer.message.size();
+            kernel(jobs.data(), jobs.size());
+            CHECK(toHex(hashes[lane].data()) == answer.hash);
+        }
+    }
+
+    // More messages than lanes, so lanes are refilled as their messages finish
+    std::vector<std::vector<uint8_t>> messages = makeMixedMessages();
+    std::vector<MD5LaneJob> jobs(messages.size());
+    std::vector<std::array<uint8_t, MD5_LENGTH>> hashes(messages.size());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        jobs[i] = { messages[i].data(), messages[i].size(), hashes[i].data() };
+    }
+    kernel(jobs.data(), jobs.size());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        CHECK(hashes[i] == computeMD5Hash(messages[i].data(), messages[i].size()));
+    }
+}
+
+TEST(scalarHashMatchesKnownAnswers)
+{
+    for (const KnownAnswer& answer : knownAnswers) {
+        auto hash = computeMD5Hash(reinterpret_cast<const uint8_t*>(answer.message.data()), answer.message.size());
+        CHECK(toHex(hash.data()) == answer.hash);
+    }
+}
+
+TEST(avx2KernelMatchesScalarHash)
+{
+    if (!getCpuFeatures().avx2) {
+        std::cout << "AVX2 is not available, skipped.\n";
+        return;
+    }
+    checkKernel(md5HashLanesAVX2, 8);
+}
+
+TEST(avx512KernelMatchesScalarHash)
+{
+    if (!getCpuFeatures().avx2 || !getCpuFeatures().avx512f) {
+        std::cout << "AVX-512 is not available, skipped.\n";
+        return;
+    }
+    checkKernel(md5HashLanesAVX512, 16);
+}
+
+TEST(batchMatchesScalarHash)
+{
+    std::vector<std::vector<uint8_t>> messages = makeMixedMessages();
+    std::vector<MD5Job> jobs(messages.size());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        jobs[i].data = messages[i].data();
+        jobs[i].length = messages[i].size();
+    }
+    computeMD5HashBatch(jobs.data(), jobs.size());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        CHECK(jobs[i].hash == computeMD5Hash(messages[i].data(), messages[i].size()));
+    }
+}
+
+int main()
+{
+    return runTests();
+}
@@ -0,0 +1,325 @@
+// qcow2_writer_tests.cpp : Checks the files written by QCOW2Writer against the layout in the qcow2 version 3 specification.
+//
+// The files are read back with offsets, flags and constants taken from the specification rather than
+// from the writer, so a mistake in the writer's structures is not repeated by the test.
+//
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include "..\libs\file_operations\pch.h"
+#include "..\libs\vhdx_manager\qcow2_writer.h"
+#include "zstd\zstd.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+constexpr uint64_t KB = 1024;
+constexpr uint64_t MB = 1024 * KB;
+
+// The L1 and L2 entry flags, and the host offset bits of a standard cluster
+constexpr uint64_t COPIED = 1ull << 63;
+constexpr uint64_t COMPRESSED = 1ull << 62;
+constexpr uint64_t READS_AS_ZEROS = 1;
+constexpr uint64_t HOST_OFFSET = 0x00FFFFFFFFFFFE00ull;
+
+/**
+ * @class Qcow2File
+ * @brief A qcow2 file read back into memory, with the guest clusters located through its L1 and L2 tables.
+ */
+class Qcow2File {
+public:
+    std::vector<uint8_t> bytes;
+    uint64_t clusterSize = 0;
+
+    explicit Qcow2File(const std::filesystem::path& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (bytes.size() < 112) {
+            throw std::runtime_error("The qcow2 file is too short.");
+        }
+        clusterSize = 1ull << be32(20);
+    }
+
+    uint64_t be(uint64_t offset, size_t length) const
+    {
+        if (offset + length > bytes.size()) {
+            throw std::runtime_error("A qcow2 structure is past the end of the file.");
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < length; ++i) {
+            value = value << 8 | bytes[offset + i];
+        }
+        return value;
+    }
+
+    uint32_t be32(uint64_t offset) const { return static_cast<uint32_t>(be(offset, 4)); }
+    uint64_t be64(uint64_t offset) const { return be(offset, 8); }
+
+    // The L2 entry of a guest cluster, or 0 if its L2 table is not allocated
+    uint64_t l2Entry(uint64_t guestCluster) const
+    {
+        uint64_t l2Entries = clusterSize / 8;
+        uint64_t l1Entry = be64(be64(40) + guestCluster / l2Entries * 8);
+        if ((l1Entry & HOST_OFFSET) == 0) {
+            return 0;
+        }
+        return be64((l1Entry & HOST_OFFSET) + guestCluster % l2Entries * 8);
+    }
+
+    // The reference count of a host cluster, from the refcount table and blocks
+    uint64_t refcount(uint64_t hostCluster) const
+    {
+        uint32_t bits = 1u << be32(96);
+        uint64_t entriesPerBlock = clusterSize * 8 / bits;
+        uint64_t block = be64(be64(48) + hostCluster / entriesPerBlock * 8);
+        if (block == 0) {
+            return 0;
+        }
+        uint64_t bitOffset = hostCluster % entriesPerBlock * bits;
+        return be(block + bitOffset / 8, bits / 8);
+    }
+};
+
+// A path in the temporary folder, removed when the test ends
+struct TemporaryPath
+{
+    std::filesystem::path path;
+
+    explicit TemporaryPath(const char* name) : path(std::filesystem::temp_directory_path() / name)
+    {
+        std::filesystem::remove(path);
+    }
+
+    ~TemporaryPath()
+    {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+    }
+};
+
+static std::vector<uint8_t> makeData(size_t size, uint8_t seed)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = static_cast<uint8_t>(i * 7 + seed + (i >> 12));
+    }
+    return data;
+}
+
+// Checks the header fields every image has, and that each host cluster in use is counted exactly once
+static void checkCommonLayout(const Qcow2File& qcow2, uint64_t clusterSize, uint64_t diskSize)
+{
+    CHECK(qcow2.be32(0) == 0x514649FB);
+    CHECK(qcow2.be32(4) == 3);
+    CHECK(qcow2.clusterSize == clusterSize);
+    CHECK(qcow2.be64(24) == diskSize);
+    CHECK(qcow2.be32(32) == 0);
+    // No snapshots, and the header length of version 3 with the compression type field, padded to 8 bytes
+    CHECK(qcow2.be32(60) == 0);
+    CHECK(qcow2.be32(96) == 4);
+    CHECK(qcow2.be32(100) == 104 || qcow2.be32(100) == 112);
+
+    // The L1 table has an entry for every L2 table needed to map the disk, and is cluster aligned
+    uint64_t l1Offset = qcow2.be64(40);
+    uint64_t l1Size = qcow2.be32(36);
+    uint64_t guestClusters = (diskSize + clusterSize - 1) / clusterSize;
+    CHECK(l1Size * (clusterSize / 8) >= guestClusters);
+    CHECK(l1Offset % clusterSize == 0 && l1Offset > 0);
+    uint64_t refcountTable = qcow2.be64(48);
+    CHECK(refcountTable % clusterSize == 0 && refcountTable > 0);
+    CHECK(qcow2.be32(56) > 0);
+
+    // Count the references to each host cluster: the header, the L1 table, the L2 tables, the data,
+    // the refcount table and the refcount blocks
+    std::map<uint64_t, uint64_t> references;
+    references[0]++;
+    for (uint64_t offset = l1Offset; offset < l1Offset + l1Size * 8; offset += clusterSize) {
+        references[offset / clusterSize]++;
+    }
+    for (uint64_t i = 0; i < l1Size; ++i) {
+        uint64_t l1Entry = qcow2.be64(l1Offset + i * 8);
+        if ((l1Entry & HOST_OFFSET) == 0) {
+            CHECK(l1Entry == 0);
+            continue;
+        }
+        // Every table is referenced once, so the COPIED flag is set
+        CHECK((l1Entry & COPIED) != 0);
+        references[(l1Entry & HOST_OFFSET) / clusterSize]++;
+    }
+    for (uint64_t cluster = 0; cluster < guestClusters; ++cluster) {
+        uint64_t entry = qcow2.l2Entry(cluster);
+        if (entry & COMPRESSED) {
+            uint32_t sectorShift = 62 - (qcow2.be32(20) - 8);
+            uint64_t hostOffset = entry & ((1ull << sectorShift) - 1);
+            uint64_t lastByte = (hostOffset / 512 + ((entry & ~COMPRESSED) >> sectorShift) + 1) * 512 - 1;
+            for (uint64_t host = hostOffset / clusterSize; host <= lastByte / clusterSize; ++host) {
+                references[host]++;
+            }
+        }
+        else if ((entry & HOST_OFFSET) != 0) {
+            CHECK((entry & COPIED) != 0);
+            CHECK((entry & HOST_OFFSET) % clusterSize == 0);
+            references[(entry & HOST_OFFSET) / clusterSize]++;
+        }
+    }
+    for (uint64_t i = 0; i < qcow2.be32(56) * clusterSize / 8; ++i) {
+        uint64_t block = qcow2.be64(refcountTable + i * 8);
+        if (block != 0) {
+            references[block / clusterSize]++;
+        }
+    }
+    for (uint64_t offset = refcountTable; offset < refcountTable + qcow2.be32(56) * clusterSize; offset += clusterSize) {
+        references[offset / clusterSize]++;
+    }
+
+    // The file holds whole clusters, and the refcounts match the references
+    CHECK(qcow2.bytes.size() % clusterSize == 0);
+    for (uint64_t host = 0; host < qcow2.bytes.size() / clusterSize; ++host) {
+        auto found = references.find(host);
+        uint64_t expected = found == references.end() ? 0 : found->second;
+        CHECK(qcow2.refcount(host) == expected);
+    }
+}
+
+TEST(qcow2MatchesTheSpecification)
+{
+    TemporaryPath path("qcow2_writer_tests_standard.qcow2");
+    std::vector<uint8_t> whole = makeData(64 * KB, 1);
+    std::vector<uint8_t> part = makeData(1000, 2);
+    {
+        QCOW2Writer writer(path.path.wstring());
+        writer.prepare(600 * MB + 100);
+        writer.writeAt(3 * 64 * KB, whole.data(), whole.size());
+        writer.writeAt(5 * 64 * KB + 100, part.data(), part.size());
+        // Past the first L2 table, which maps 512 MB with 64 KB clusters
+        writer.writeAt(550 * MB, whole.data(), whole.size());
+        writer.flush();
+    }
+
+    Qcow2File qcow2(path.path);
+    // The size is rounded up to whole sectors
+    checkCommonLayout(qcow2, 64 * KB, 600 * MB + 512);
+    CHECK(qcow2.be32(36) == 2);
+    // Nothing is compressed, so no incompatible feature is needed
+    CHECK(qcow2.be64(72) == 0);
+    CHECK(qcow2.be64(8) == 0);
+
+    uint64_t entry = qcow2.l2Entry(3);
+    CHECK(std::equal(whole.begin(), whole.end(), qcow2.bytes.begin() + (entry & HOST_OFFSET)));
+    entry = qcow2.l2Entry(550 * MB / (64 * KB));
+    CHECK(std::equal(whole.begin(), whole.end(), qcow2.bytes.begin() + (entry & HOST_OFFSET)));
+
+    // A partly written cluster without a backing file reads zeros around the write
+    entry = qcow2.l2Entry(5);
+    uint64_t host = entry & HOST_OFFSET;
+    CHECK(std::equal(part.begin(), part.end(), qcow2.bytes.begin() + host + 100));
+    CHECK(std::all_of(qcow2.bytes.begin() + host, qcow2.bytes.begin() + host + 100, [](uint8_t byte) { return byte == 0; }));
+    CHECK(std::all_of(qcow2.bytes.begin() + host + 1100, qcow2.bytes.begin() + host + 64 * KB, [](uint8_t byte) { return byte == 0; }));
+
+    for (uint64_t cluster : { uint64_t(0), uint64_t(4), uint64_t(6), uint64_t(9000) }) {
+        CHECK(qcow2.l2Entry(cluster) == 0);
+    }
+}
+
+TEST(compressedClustersUseZstdDescriptors)
+{
+    TemporaryPath path("qcow2_writer_tests_compressed.qcow2");
+    constexpr uint32_t CLUSTER = 4096;
+    std::vector<std::vector<uint8_t>> clusters;
+    std::vector<std::vector<uint8_t>> frames;
+    for (uint8_t i = 0; i < 6; ++i) {
+        clusters.push_back(makeData(CLUSTER, i));
+        // Some clusters compress well and some do not, so the frames cross host cluster boundaries
+        if (i % 2 == 0) {
+            std::fill(clusters.back().begin(), clusters.back().begin() + CLUSTER / 2, 0);
+        }
+        std::vector<uint8_t> frame(ZSTD_compressBound(CLUSTER));
+        frame.resize(ZSTD_compress(frame.data(), frame.size(), clusters.back().data(), CLUSTER, 1));
+        frames.push_back(std::move(frame));
+    }
+    {
+        QCOW2Writer writer(path.path.wstring(), CLUSTER);
+        writer.prepare(MB);
+        for (size_t i = 0; i < frames.size(); ++i) {
+            writer.writeCompressedAt((i * 3 + 1) * CLUSTER, frames[i].data(), frames[i].size());
+        }
+        writer.flush();
+    }
+
+    Qcow2File qcow2(path.path);
+    checkCommonLayout(qcow2, CLUSTER, MB);
+    // zstd needs the compression type incompatible feature bit and the compression type field
+    CHECK(qcow2.be64(72) == 1ull << 3);
+    CHECK(qcow2.be32(100) >= 105);
+    CHECK(qcow2.bytes[104] == 1);
+
+    uint32_t sectorShift = 62 - (12 - 8);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        uint64_t entry = qcow2.l2Entry(i * 3 + 1);
+        CHECK((entry & COMPRESSED) != 0);
+        CHECK((entry & COPIED) == 0);
+        uint64_t hostOffset = entry & ((1ull << sectorShift) - 1);
+        uint64_t sectors = ((entry & ~COMPRESSED) >> sectorShift) + 1;
+        CHECK(hostOffset + frames[i].size() <= (hostOffset / 512 + sectors) * 512);
+        CHECK(std::equal(frames[i].begin(), frames[i].end(), qcow2.bytes.begin() + hostOffset));
+
+        std::vector<uint8_t> decompressed(CLUSTER);
+        size_t length = ZSTD_decompress(decompressed.data(), decompressed.size(), qcow2.bytes.data() + hostOffset, frames[i].size());
+        CHECK(length == CLUSTER && decompressed == clusters[i]);
+    }
+}
+
+TEST(backingFileIsNamedInTheHeader)
+{
+    TemporaryPath basePath("qcow2_writer_tests_base.qcow2");
+    TemporaryPath overlayPath("qcow2_writer_tests_overlay.qcow2");
+    std::vector<uint8_t> data = makeData(64 * KB, 3);
+    auto base = std::make_shared<QCOW2Writer>(basePath.path.wstring());
+    base->prepare(8 * MB);
+    base->writeAt(2 * 64 * KB, data.data(), data.size());
+    base->flush();
+    {
+        QCOW2Writer overlay(overlayPath.path.wstring());
+        overlay.setBackingFile(base);
+        overlay.prepare(8 * MB);
+        overlay.writeAt(2 * 64 * KB + 512, data.data(), 512);
+        overlay.zeroRange(4 * 64 * KB, 64 * KB);
+        overlay.flush();
+    }
+
+    Qcow2File qcow2(overlayPath.path);
+    checkCommonLayout(qcow2, 64 * KB, 8 * MB);
+    uint64_t nameOffset = qcow2.be64(8);
+    uint32_t nameLength = qcow2.be32(16);
+    CHECK(nameOffset >= qcow2.be32(100) && nameOffset + nameLength <= 64 * KB);
+    CHECK(std::string(qcow2.bytes.begin() + nameOffset, qcow2.bytes.begin() + nameOffset + nameLength) == "qcow2_writer_tests_base.qcow2");
+
+    // The header extensions start after the header: the backing file format, then the end marker
+    uint64_t extension = qcow2.be32(100);
+    CHECK(qcow2.be32(extension) == 0xE2792ACA);
+    CHECK(qcow2.be32(extension + 4) == 5);
+    CHECK(memcmp(qcow2.bytes.data() + extension + 8, "qcow2", 5) == 0);
+    CHECK(qcow2.be32(extension + 16) == 0);
+
+    // The sectors of the partly written cluster that were not written are copied from the backing file
+    uint64_t host = qcow2.l2Entry(2) & HOST_OFFSET;
+    CHECK(std::equal(data.begin(), data.begin() + 512, qcow2.bytes.begin() + host));
+    CHECK(std::equal(data.begin(), data.begin() + 512, qcow2.bytes.begin() + host + 512));
+    CHECK(std::equal(data.begin() + 1024, data.end(), qcow2.bytes.begin() + host + 1024));
+
+    // A zeroed cluster that is not allocated hides the backing file with the zero flag
+    CHECK(qcow2.l2Entry(4) == READS_AS_ZEROS);
+}
+
+int main()
+{
+    return runTests();
+}
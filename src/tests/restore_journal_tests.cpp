@@ -0,0 +1,162 @@
+// restore_journal_tests.cpp : Tests of the checkpoint journal that lets a failed restore be resumed.
+//
+
+#include "..\libs\restore\pch.h"
+#include <filesystem>
+#include "..\libs\file_operations\restore_target.h"
+#include "..\libs\restore\restore.h"
+#include "..\libs\restore\restore_journal.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+// A path in the temporary folder, removed when the test ends
+struct TemporaryPath
+{
+    std::filesystem::path path;
+
+    explicit TemporaryPath(const char* name) : path(std::filesystem::temp_directory_path() / name)
+    {
+        std::filesystem::remove(path);
+    }
+
+    ~TemporaryPath()
+    {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+    }
+};
+
+static BlockRef makeBlock(int32_t partitionNumber, bool reservedSectors, uint32_t index)
+{
+    BlockRef block;
+    block.partition_number = partitionNumber;
+    block.reserved_sectors = reservedSectors;
+    block.iv_index = index;
+    return block;
+}
+
+static const char* IDENTITY = "D684BA87241263E2/0/1/1073741824";
+
+TEST(checkpointedBlocksAreLoadedByTheNextRun)
+{
+    TemporaryPath journalPath("restore_journal_tests.journal");
+    TemporaryPath targetPath("restore_journal_tests.img");
+    FileTarget target(targetPath.path.wstring(), false);
+    {
+        RestoreJournal journal(journalPath.path.wstring(), target, IDENTITY, std::chrono::seconds(3600));
+        CHECK(!journal.load());
+        int writes = 0;
+        for (uint32_t index : { 0u, 1u, 2u, 5u, 7u, 8u }) {
+            journal.write(makeBlock(1, false, index), [&]() { ++writes; });
+        }
+        journal.write(makeBlock(1, true, 0), [&]() { ++writes; });
+        journal.write(makeBlock(2, false, 3), [&]() { ++writes; });
+        CHECK(writes == 8);
+        // Nothing is saved before the interval has passed
+        CHECK(!std::filesystem::exists(journalPath.path));
+        journal.checkpoint();
+        CHECK(std::filesystem::exists(journalPath.path));
+    }
+
+    RestoreJournal resumed(journalPath.path.wstring(), target, IDENTITY, std::chrono::seconds(3600));
+    CHECK(resumed.load());
+    for (uint32_t index = 0; index < 12; ++index) {
+        bool expected = index <= 2 || index == 5 || index == 7 || index == 8;
+        CHECK(resumed.isComplete(makeBlock(1, false, index)) == expected);
+        CHECK(resumed.isComplete(makeBlock(1, true, index)) == (index == 0));
+        CHECK(resumed.isComplete(makeBlock(2, false, index)) == (index == 3));
+        CHECK(!resumed.isComplete(makeBlock(3, false, index)));
+    }
+
+    resumed.remove();
+    CHECK(!std::filesystem::exists(journalPath.path));
+}
+
+TEST(aFailedWriteIsNotRecorded)
+{
+    TemporaryPath journalPath("restore_journal_tests_failed.journal");
+    TemporaryPath targetPath("restore_journal_tests_failed.img");
+    FileTarget target(targetPath.path.wstring(), false);
+    {
+        RestoreJournal journal(journalPath.path.wstring(), target, IDENTITY, std::chrono::seconds(3600));
+        journal.write(makeBlock(1, false, 0), []() {});
+        CHECK_THROWS(journal.write(makeBlock(1, false, 1), []() { throw std::runtime_error("write failed"); }));
+        journal.checkpoint();
+    }
+    RestoreJournal resumed(journalPath.path.wstring(), target, IDENTITY, std::chrono::seconds(3600));
+    CHECK(resumed.load());
+    CHECK(resumed.isComplete(makeBlock(1, false, 0)));
+    CHECK(!resumed.isComplete(makeBlock(1, false, 1)));
+}
+
+TEST(aJournalOfAnotherRestoreOrTargetIsRefused)
+{
+    TemporaryPath journalPath("restore_journal_tests_identity.journal");
+    TemporaryPath targetPath("restore_journal_tests_identity.img");
+    TemporaryPath otherTargetPath("restore_journal_tests_other.img");
+    FileTarget target(targetPath.path.wstring(), false);
+    {
+        RestoreJournal journal(journalPath.path.wstring(), target, IDENTITY, std::chrono::seconds(3600));
+        journal.write(makeBlock(1, false, 0), []() {});
+        journal.checkpoint();
+    }
+
+    // Another backup, disk or disk size
+    RestoreJournal otherRestore(journalPath.path.wstring(), target, "D684BA87241263E2/0/1/2147483648", std::chrono::seconds(3600));
+    CHECK_THROWS(otherRestore.load());
+
+    // The same restore to another file
+    FileTarget otherTarget(otherTargetPath.path.wstring(), false);
+    RestoreJournal otherFile(journalPath.path.wstring(), otherTarget, IDENTITY, std::chrono::seconds(3600));
+    CHECK_THROWS(otherFile.load());
+
+    // The same file named by another path
+    std::filesystem::path sameFile = targetPath.path.parent_path() / "." / targetPath.path.filename();
+    FileTarget sameTarget(sameFile.wstring(), false, true);
+    RestoreJournal sameFileJournal(journalPath.path.wstring(), sameTarget, IDENTITY, std::chrono::seconds(3600));
+    CHECK(sameFileJournal.load());
+    CHECK(sameFileJournal.isComplete(makeBlock(1, false, 0)));
+}
+
+TEST(aResumeNeedsATargetThatKeptItsData)
+{
+    TemporaryPath journalPath("restore_journal_tests_resume.journal");
+    TemporaryPath targetPath("restore_journal_tests_resume.img");
+    std::wstring backup = (std::filesystem::temp_directory_path() / "restore_journal_tests_missing.mrimgx").wstring();
+    RestoreOptions options;
+    options.journal_path = journalPath.path.wstring();
+    options.resume = true;
+
+    auto rejects = [&](RestoreTarget& target) {
+        try {
+            restoreDisk(backup, "", target, options);
+        }
+        catch (const std::invalid_argument&) {
+            return true;
+        }
+        catch (const std::exception&) {
+        }
+        return false;
+    };
+    MemoryTarget memory;
+    CHECK(rejects(memory));
+    {
+        FileTarget truncated(targetPath.path.wstring(), false);
+        CHECK(rejects(truncated));
+    }
+    // A target that kept its data gets as far as reading the backup file, which does not exist
+    FileTarget kept(targetPath.path.wstring(), false, true);
+    CHECK(!rejects(kept));
+}
+
+int main()
+{
+    return runTests();
+}
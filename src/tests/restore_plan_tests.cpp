@@ -0,0 +1,294 @@
+// restore_plan_tests.cpp : Tests of the restore plan filter that finds the blocks changed since an earlier backup,
+// of the targets and partitions restoreDisk accepts for an update in place, and of the merged plan of a restore of all disks.
+//
+
+#include "..\libs\restore\pch.h"
+#include "..\libs\file_reader\file_reader.h"
+#include <filesystem>
+#include "..\libs\file_operations\restore_target.h"
+#include "..\libs\restore\restore.h"
+#include "..\libs\restore\restore_plan.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @struct SetFile
+ * @brief A file of a backup set: its number, its increment and the files merged into it.
+ */
+struct SetFile
+{
+    uint16_t file_number;
+    uint16_t increment_number;
+    std::vector<int32_t> merged_files;
+};
+
+static file_structs::Header makeHeader(uint16_t fileNumber, uint16_t incrementNumber)
+{
+    file_structs::Header header;
+    header.file_number = fileNumber;
+    header.increment_number = incrementNumber;
+    return header;
+}
+
+// A backup set of the given files, newest first as createBackupSet leaves them
+static BackupSet makeBackupSet(const std::vector<SetFile>& files)
+{
+    BackupSet backupSet;
+    for (auto file = files.rbegin(); file != files.rend(); ++file) {
+        auto layout = std::make_shared<file_structs::fileLayout>();
+        layout->_header = makeHeader(file->file_number, file->increment_number);
+        layout->_header.merged_files = file->merged_files;
+        backupSet.fileLayouts.push_back(layout);
+    }
+    return backupSet;
+}
+
+/**
+ * @struct BlockList
+ * @brief Blocks written by each of the given file numbers, one block per file, 4 KB each and stored in 1 KB.
+ */
+struct BlockList
+{
+    std::vector<DataBlockIndexElement> elements;
+    std::vector<BlockRef> blocks;
+
+    explicit BlockList(uint16_t fileCount) : elements(fileCount)
+    {
+        for (uint16_t file = 0; file < fileCount; ++file) {
+            elements[file] = {};
+            elements[file].file_number = file;
+            elements[file].block_length = 1024;
+        }
+        for (uint16_t file = 0; file < fileCount; ++file) {
+            BlockRef block;
+            block.element = &elements[file];
+            block.disk_offset = file * 4096ull;
+            block.write_limit = 4096;
+            blocks.push_back(block);
+        }
+    }
+};
+
+static std::vector<int32_t> fileNumbers(const std::vector<BlockRef>& blocks)
+{
+    std::vector<int32_t> numbers;
+    for (const auto& block : blocks) {
+        numbers.push_back(block.element->file_number);
+    }
+    return numbers;
+}
+
+TEST(keepsTheBlocksOfLaterIncrements)
+{
+    BackupSet backupSet = makeBackupSet({ { 0, 0, {} }, { 1, 1, {} }, { 2, 2, {} }, { 3, 3, {} } });
+    BlockList list(4);
+    keepBlocksChangedSince(list.blocks, backupSet, makeHeader(1, 1));
+    CHECK(fileNumbers(list.blocks) == std::vector<int32_t>({ 2, 3 }));
+}
+
+TEST(judgesBlocksMergedIntoTheFullBackupByTheFileThatWroteThem)
+{
+    // The increments after the earlier backup were merged into the full backup, which keeps increment 0
+    BackupSet backupSet = makeBackupSet({ { 0, 0, { 1, 2, 3, 4, 5 } }, { 6, 6, {} } });
+    BlockList list(7);
+    keepBlocksChangedSince(list.blocks, backupSet, makeHeader(3, 3));
+    CHECK(fileNumbers(list.blocks) == std::vector<int32_t>({ 4, 5, 6 }));
+}
+
+TEST(judgesBlocksMergedIntoANewerFileByTheFileThatWroteThem)
+{
+    // The earlier backup itself was merged into a newer file, whose blocks from before it are unchanged
+    BackupSet backupSet = makeBackupSet({ { 0, 0, {} }, { 5, 5, { 1, 2, 3, 4 } } });
+    BlockList list(6);
+    keepBlocksChangedSince(list.blocks, backupSet, makeHeader(2, 2));
+    CHECK(fileNumbers(list.blocks) == std::vector<int32_t>({ 3, 4, 5 }));
+}
+
+TEST(treatsSplitPartsAsPartOfTheirBackup)
+{
+    BackupSet backupSet = makeBackupSet({ { 0, 0, {} }, { 1, 1, {} }, { 2, 1, {} }, { 3, 2, {} } });
+    BlockList list(4);
+    keepBlocksChangedSince(list.blocks, backupSet, makeHeader(1, 1));
+    CHECK(fileNumbers(list.blocks) == std::vector<int32_t>({ 3 }));
+}
+
+TEST(failsWhenTheChainDoesNotShowTheEarlierBackup)
+{
+    BlockList list(4);
+
+    // Neither the earlier file nor a file that merged it is in the set
+    BackupSet missing = makeBackupSet({ { 0, 0, {} }, { 2, 2, {} }, { 3, 3, {} } });
+    CHECK_THROWS(keepBlocksChangedSince(list.blocks, missing, makeHeader(1, 1)));
+
+    // The file with the earlier backup's number belongs to another increment
+    BackupSet renumbered = makeBackupSet({ { 0, 0, {} }, { 1, 2, {} }, { 3, 3, {} } });
+    CHECK_THROWS(keepBlocksChangedSince(list.blocks, renumbered, makeHeader(1, 1)));
+
+    // A later increment is numbered before the earlier backup, so file numbers do not follow the chain
+    BackupSet outOfOrder = makeBackupSet({ { 0, 2, {} }, { 1, 1, {} }, { 3, 3, {} } });
+    CHECK_THROWS(keepBlocksChangedSince(list.blocks, outOfOrder, makeHeader(1, 1)));
+
+    CHECK(list.blocks.size() == 4);
+}
+
+TEST(updatesThePlanByteCounts)
+{
+    BackupSet backupSet = makeBackupSet({ { 0, 0, {} }, { 1, 1, {} }, { 2, 2, {} } });
+    BlockList list(3);
+    RestorePlan plan;
+    plan.blocks = list.blocks;
+    plan.stored_bytes = 3 * 1024;
+    plan.restored_bytes = 3 * 4096;
+    keepBlocksChangedSince(plan, backupSet, makeHeader(0, 0));
+    CHECK(plan.blocks.size() == 2);
+    CHECK(plan.stored_bytes == 2 * 1024);
+    CHECK(plan.restored_bytes == 2 * 4096);
+}
+
+// Runs a restore that is expected to fail, and returns true if it was turned down for its target
+static bool rejectsTarget(const std::wstring& backup, RestoreTarget& target, const RestoreOptions& options)
+{
+    try {
+        restoreDisk(backup, "", target, options);
+    }
+    catch (const std::invalid_argument&) {
+        return true;
+    }
+    catch (const std::exception&) {
+    }
+    return false;
+}
+
+TEST(updatesInPlaceNeedATargetThatKeptItsData)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "restore_plan_tests.img";
+    std::wstring backup = (std::filesystem::temp_directory_path() / "restore_plan_tests_missing.mrimgx").wstring();
+    RestoreOptions skip;
+    skip.skip_unchanged = true;
+    RestoreOptions update;
+    update.sync_from = backup;
+
+    for (const RestoreOptions* options : { &skip, &update }) {
+        MemoryTarget memory;
+        CHECK(rejectsTarget(backup, memory, *options));
+        {
+            FileTarget truncated(path.wstring(), false);
+            CHECK(rejectsTarget(backup, truncated, *options));
+        }
+        // A target that kept its data gets as far as reading the backup file, which does not exist
+        FileTarget kept(path.wstring(), false, true);
+        CHECK(!rejectsTarget(backup, kept, *options));
+    }
+    std::filesystem::remove(path);
+}
+
+// A disk of two partitions, each with its own start, file system and block size
+static file_structs::Disk::DiskLayout makePartitionedDisk()
+{
+    file_structs::Disk::DiskLayout disk;
+    for (int32_t number = 1; number <= 2; ++number) {
+        file_structs::Partition::PartitionLayout partition;
+        partition._header.partition_number = number;
+        partition._header.block_size = 1024 * 1024;
+        partition._geometry.start = number * 100 * 1024 * 1024;
+        partition._file_system.start = partition._geometry.start;
+        partition._file_system.lcn0_offset = partition._geometry.start + 4096;
+        disk.partitions.push_back(partition);
+    }
+    return disk;
+}
+
+TEST(anUpdateNeedsThePartitionsWhereTheyWere)
+{
+    file_structs::Disk::DiskLayout earlier = makePartitionedDisk();
+    CHECK(haveSameBlockPlacement(earlier, makePartitionedDisk()));
+
+    // The same partitions listed in another order
+    file_structs::Disk::DiskLayout reordered = makePartitionedDisk();
+    std::swap(reordered.partitions[0], reordered.partitions[1]);
+    CHECK(haveSameBlockPlacement(earlier, reordered));
+
+    file_structs::Disk::DiskLayout moved = makePartitionedDisk();
+    moved.partitions[1]._geometry.start += 1024 * 1024;
+    CHECK(!haveSameBlockPlacement(earlier, moved));
+
+    file_structs::Disk::DiskLayout reformatted = makePartitionedDisk();
+    reformatted.partitions[0]._file_system.lcn0_offset += 4096;
+    CHECK(!haveSameBlockPlacement(earlier, reformatted));
+    reformatted = makePartitionedDisk();
+    reformatted.partitions[0]._header.block_size = 65536;
+    CHECK(!haveSameBlockPlacement(earlier, reformatted));
+
+    file_structs::Disk::DiskLayout removed = makePartitionedDisk();
+    removed.partitions.pop_back();
+    CHECK(!haveSameBlockPlacement(earlier, removed));
+    file_structs::Disk::DiskLayout renumbered = makePartitionedDisk();
+    renumbered.partitions[1]._header.partition_number = 3;
+    CHECK(!haveSameBlockPlacement(earlier, renumbered));
+}
+
+TEST(interleavesTheDisksATurnAtATime)
+{
+    // Three disks of 6, 2 and 4 blocks, each stored in 1 KB, in turns of 2 KB
+    BlockList disk0(6);
+    BlockList disk1(2);
+    BlockList disk2(4);
+    std::vector<std::vector<BlockRef>> diskBlocks{ disk0.blocks, disk1.blocks, disk2.blocks };
+    for (uint32_t disk = 0; disk < diskBlocks.size(); ++disk) {
+        for (auto& block : diskBlocks[disk]) {
+            block.target_index = disk;
+        }
+    }
+
+    std::vector<BlockRef> blocks = interleaveDisks(diskBlocks, 2048);
+    std::vector<std::pair<uint32_t, int32_t>> order;
+    for (const auto& block : blocks) {
+        order.push_back({ block.target_index, block.element->file_number });
+    }
+    std::vector<std::pair<uint32_t, int32_t>> expected{
+        { 0, 0 }, { 0, 1 }, { 1, 0 }, { 1, 1 }, { 2, 0 }, { 2, 1 },
+        { 0, 2 }, { 0, 3 }, { 2, 2 }, { 2, 3 },
+        { 0, 4 }, { 0, 5 } };
+    CHECK(order == expected);
+}
+
+TEST(aRestoreOfAllDisksCannotBeBroughtUpToDateOrResumed)
+{
+    std::wstring backup = (std::filesystem::temp_directory_path() / "restore_plan_tests_missing.mrimgx").wstring();
+    bool opened = false;
+    DiskTargetFactory openTarget = [&](const file_structs::Disk::DiskLayout&) -> SharedTarget {
+        opened = true;
+        return std::make_shared<MemoryTarget>();
+    };
+    auto rejects = [&](const RestoreOptions& options) {
+        try {
+            restoreAllDisks(backup, "", options, openTarget);
+        }
+        catch (const std::invalid_argument&) {
+            return true;
+        }
+        catch (const std::exception&) {
+        }
+        return false;
+    };
+
+    RestoreOptions update;
+    update.sync_from = backup;
+    CHECK(rejects(update));
+    RestoreOptions journal;
+    journal.journal_path = (std::filesystem::temp_directory_path() / "restore_plan_tests.journal").wstring();
+    CHECK(rejects(journal));
+    CHECK(!opened);
+}
+
+int main()
+{
+    return runTests();
+}
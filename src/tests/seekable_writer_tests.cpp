@@ -0,0 +1,255 @@
+// seekable_writer_tests.cpp : Checks the files written by SeekableZstdWriter against the zstd seekable format.
+//
+// The seek table is read back with the magic numbers and field layout of the format description rather than
+// the writer's constants, and the whole file is decompressed with libzstd and compared with the disk.
+//
+
+#include "..\libs\restore\pch.h"
+#include <filesystem>
+#include <fstream>
+#include "..\libs\restore\seekable_writer.h"
+#include "zstd\zstd.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+constexpr uint64_t KB = 1024;
+constexpr uint64_t MB = 1024 * KB;
+
+/**
+ * @class SeekableFile
+ * @brief A seekable zstd file read back into memory, with its seek table parsed from the footer.
+ */
+class SeekableFile {
+public:
+    struct Frame
+    {
+        uint64_t file_offset;
+        uint32_t compressed_size;
+        uint32_t decompressed_size;
+    };
+
+    std::vector<uint8_t> bytes;
+    std::vector<Frame> frames;
+    // The file offset of the skippable frame that holds the seek table
+    uint64_t tableOffset = 0;
+    uint8_t descriptor = 0xFF;
+
+    explicit SeekableFile(const std::filesystem::path& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        // The footer is the number of frames, the descriptor and the seekable magic number
+        if (bytes.size() < 17 || le32(bytes.size() - 4) != 0x8F92EAB1) {
+            throw std::runtime_error("The file does not end with a seek table.");
+        }
+        uint32_t frameCount = le32(bytes.size() - 9);
+        descriptor = bytes[bytes.size() - 5];
+        // With no checksums, each entry is the compressed and the decompressed size
+        uint64_t tableSize = 8 + uint64_t(frameCount) * 8 + 9;
+        if (tableSize > bytes.size()) {
+            throw std::runtime_error("The seek table is longer than the file.");
+        }
+        tableOffset = bytes.size() - tableSize;
+        if (le32(tableOffset) != 0x184D2A5E || le32(tableOffset + 4) != tableSize - 8) {
+            throw std::runtime_error("The seek table is not a skippable frame of its own length.");
+        }
+        uint64_t fileOffset = 0;
+        for (uint32_t i = 0; i < frameCount; ++i) {
+            Frame frame{ fileOffset, le32(tableOffset + 8 + i * 8), le32(tableOffset + 12 + i * 8) };
+            frames.push_back(frame);
+            fileOffset += frame.compressed_size;
+        }
+    }
+
+    uint32_t le32(uint64_t offset) const
+    {
+        if (offset + 4 > bytes.size()) {
+            throw std::runtime_error("A seek table field is past the end of the file.");
+        }
+        return bytes[offset] | bytes[offset + 1] << 8 | bytes[offset + 2] << 16 | uint32_t(bytes[offset + 3]) << 24;
+    }
+
+    // Decompresses every frame of the file, which skips the seek table
+    std::vector<uint8_t> decompress(uint64_t diskSize) const
+    {
+        std::vector<uint8_t> disk(static_cast<size_t>(diskSize) + 1);
+        size_t length = ZSTD_decompress(disk.data(), disk.size(), bytes.data(), bytes.size());
+        if (ZSTD_isError(length)) {
+            throw std::runtime_error(ZSTD_getErrorName(length));
+        }
+        disk.resize(length);
+        return disk;
+    }
+};
+
+// Checks that the frames listed in the seek table are the zstd frames the file holds, end to end
+static void checkFrames(const SeekableFile& file)
+{
+    CHECK(file.descriptor == 0);
+    uint64_t end = 0;
+    bool framesMatch = true;
+    for (const SeekableFile::Frame& frame : file.frames) {
+        const uint8_t* data = file.bytes.data() + frame.file_offset;
+        size_t available = static_cast<size_t>(file.tableOffset - frame.file_offset);
+        framesMatch = framesMatch && frame.file_offset < file.tableOffset &&
+            ZSTD_findFrameCompressedSize(data, available) == frame.compressed_size &&
+            ZSTD_getFrameContentSize(data, available) == frame.decompressed_size;
+        end = frame.file_offset + frame.compressed_size;
+    }
+    CHECK(framesMatch);
+    CHECK(end == file.tableOffset);
+}
+
+// A path in the temporary folder, removed when the test ends
+struct TemporaryPath
+{
+    std::filesystem::path path;
+
+    explicit TemporaryPath(const char* name) : path(std::filesystem::temp_directory_path() / name)
+    {
+        std::filesystem::remove(path);
+    }
+
+    ~TemporaryPath()
+    {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+    }
+};
+
+static std::vector<uint8_t> makeData(size_t size, uint8_t seed)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = static_cast<uint8_t>(i * 7 + seed + (i >> 12));
+    }
+    return data;
+}
+
+static std::vector<uint8_t> compress(const std::vector<uint8_t>& data)
+{
+    std::vector<uint8_t> frame(ZSTD_compressBound(data.size()));
+    frame.resize(ZSTD_compress(frame.data(), frame.size(), data.data(), data.size(), 3));
+    return frame;
+}
+
+TEST(theSeekTableListsEveryFrame)
+{
+    TemporaryPath path("seekable_writer_tests_frames.zst");
+    std::vector<uint8_t> track0 = makeData(64 * KB, 1);
+    std::vector<uint8_t> first = makeData(64 * KB, 2);
+    std::vector<uint8_t> second = makeData(64 * KB, 3);
+    std::vector<uint8_t> firstFrame = compress(first);
+    std::vector<uint8_t> secondFrame = compress(second);
+    uint64_t diskSize = 5 * MB + 100;
+    {
+        SeekableZstdWriter writer(path.path.wstring());
+        writer.prepare(diskSize);
+        writer.writeAt(0, track0.data(), track0.size());
+        writer.writeCompressedAt(MB, firstFrame.data(), firstFrame.size());
+        writer.writeCompressedAt(MB + 64 * KB, secondFrame.data(), secondFrame.size());
+        writer.flush();
+    }
+
+    SeekableFile file(path.path);
+    checkFrames(file);
+    // Track 0, the zeros before the blocks, the two blocks and the zeros to the end of the disk
+    CHECK(file.frames.size() == 5);
+    std::vector<uint32_t> sizes;
+    for (const SeekableFile::Frame& frame : file.frames) {
+        sizes.push_back(frame.decompressed_size);
+    }
+    CHECK(sizes == std::vector<uint32_t>({ 64 * KB, MB - 64 * KB, 64 * KB, 64 * KB, static_cast<uint32_t>(diskSize - MB - 128 * KB) }));
+
+    // The stored frames are copied as they are
+    CHECK(file.frames[2].compressed_size == firstFrame.size());
+    CHECK(std::equal(firstFrame.begin(), firstFrame.end(), file.bytes.begin() + file.frames[2].file_offset));
+    CHECK(std::equal(secondFrame.begin(), secondFrame.end(), file.bytes.begin() + file.frames[3].file_offset));
+
+    std::vector<uint8_t> disk(static_cast<size_t>(diskSize), 0);
+    std::copy(track0.begin(), track0.end(), disk.begin());
+    std::copy(first.begin(), first.end(), disk.begin() + MB);
+    std::copy(second.begin(), second.end(), disk.begin() + MB + 64 * KB);
+    CHECK(file.decompress(diskSize) == disk);
+}
+
+TEST(dataFromWriteAtIsSplitIntoFrames)
+{
+    TemporaryPath path("seekable_writer_tests_split.zst");
+    std::vector<uint8_t> data = makeData(2 * SeekableZstdWriter::FRAME_SIZE + 5000, 4);
+    {
+        SeekableZstdWriter writer(path.path.wstring());
+        writer.prepare(data.size());
+        // Writes that do not line up with the frames
+        writer.writeAt(0, data.data(), 3000);
+        writer.writeAt(3000, data.data() + 3000, data.size() - 3000);
+        writer.flush();
+    }
+
+    SeekableFile file(path.path);
+    checkFrames(file);
+    CHECK(file.frames.size() == 3);
+    CHECK(file.frames[0].decompressed_size == SeekableZstdWriter::FRAME_SIZE);
+    CHECK(file.frames[2].decompressed_size == 5000);
+    CHECK(file.decompress(data.size()) == data);
+}
+
+TEST(aDiskOfZerosIsWrittenAsZeroFrames)
+{
+    TemporaryPath path("seekable_writer_tests_zeros.zst");
+    uint64_t diskSize = 2 * SeekableZstdWriter::ZERO_FRAME_SIZE + 12345;
+    {
+        SeekableZstdWriter writer(path.path.wstring());
+        writer.prepare(diskSize);
+        writer.flush();
+    }
+
+    SeekableFile file(path.path);
+    checkFrames(file);
+    CHECK(file.frames.size() == 3);
+    CHECK(file.frames[0].decompressed_size == SeekableZstdWriter::ZERO_FRAME_SIZE);
+    CHECK(file.frames[1].decompressed_size == SeekableZstdWriter::ZERO_FRAME_SIZE);
+    CHECK(file.frames[2].decompressed_size == 12345);
+    // The whole frames of zeros are the same frame
+    CHECK(file.frames[0].compressed_size == file.frames[1].compressed_size);
+    CHECK(std::equal(file.bytes.begin(), file.bytes.begin() + file.frames[0].compressed_size, file.bytes.begin() + file.frames[1].file_offset));
+    CHECK(file.decompress(diskSize) == std::vector<uint8_t>(static_cast<size_t>(diskSize), 0));
+}
+
+TEST(anEmptyDiskIsOnlyASeekTable)
+{
+    TemporaryPath path("seekable_writer_tests_empty.zst");
+    {
+        SeekableZstdWriter writer(path.path.wstring());
+        writer.prepare(0);
+        writer.flush();
+    }
+
+    SeekableFile file(path.path);
+    CHECK(file.frames.empty());
+    CHECK(file.tableOffset == 0);
+    CHECK(file.bytes.size() == 17);
+    CHECK(file.decompress(0).empty());
+}
+
+TEST(writesMustBeInDiskOrder)
+{
+    TemporaryPath path("seekable_writer_tests_order.zst");
+    std::vector<uint8_t> data = makeData(4096, 5);
+    SeekableZstdWriter writer(path.path.wstring());
+    writer.prepare(MB);
+    writer.writeAt(8192, data.data(), data.size());
+    CHECK_THROWS(writer.writeAt(0, data.data(), data.size()));
+}
+
+int main()
+{
+    return runTests();
+}
@@ -0,0 +1,113 @@
+// stream_target_tests.cpp : Tests of the stream target when the reader of its pipe goes away.
+//
+
+#include "..\libs\restore\pch.h"
+#include <filesystem>
+#include "..\libs\file_operations\restore_target.h"
+#include "test_framework.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @class ClosablePipe
+ * @brief A named pipe with a reader, which the test can close to make the writer's next write fail.
+ */
+class ClosablePipe {
+public:
+    ClosablePipe()
+    {
+#ifdef _WIN32
+        path = L"\\\\.\\pipe\\stream_target_tests";
+        reader = CreateNamedPipeW(path.c_str(), PIPE_ACCESS_INBOUND, PIPE_TYPE_BYTE | PIPE_WAIT, 1, 0, 65536, 0, NULL);
+        if (reader == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Unable to create the pipe.");
+        }
+#else
+        std::filesystem::path fifo = std::filesystem::temp_directory_path() / "stream_target_tests.fifo";
+        std::filesystem::remove(fifo);
+        if (mkfifo(fifo.string().c_str(), 0600) != 0) {
+            throw std::runtime_error("Unable to create the pipe.");
+        }
+        path = fifo.wstring();
+        // The reader opens first without blocking, so the writer's open does not wait for it
+        reader = open(fifo.string().c_str(), O_RDONLY | O_NONBLOCK);
+        if (reader < 0) {
+            throw std::runtime_error("Unable to open the pipe.");
+        }
+#endif
+    }
+
+    ~ClosablePipe()
+    {
+        closeReader();
+#ifndef _WIN32
+        std::error_code error;
+        std::filesystem::remove(std::filesystem::path(path), error);
+#endif
+    }
+
+    void closeReader()
+    {
+#ifdef _WIN32
+        if (reader != INVALID_HANDLE_VALUE) {
+            CloseHandle(reader);
+            reader = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (reader >= 0) {
+            close(reader);
+            reader = -1;
+        }
+#endif
+    }
+
+    std::wstring path;
+
+private:
+#ifdef _WIN32
+    HANDLE reader = INVALID_HANDLE_VALUE;
+#else
+    int reader = -1;
+#endif
+};
+
+TEST(aReaderThatGoesAwayFailsTheWrite)
+{
+    ClosablePipe pipe;
+    StreamTarget target(pipe.path);
+    target.prepare(1024 * 1024);
+    pipe.closeReader();
+
+    std::vector<uint8_t> data(4096, 0x5A);
+    CHECK_THROWS(target.writeAt(0, data.data(), data.size()));
+    CHECK_THROWS(target.flush());
+#ifndef _WIN32
+    // The process still ends on SIGPIPE from anything else it writes to
+    struct sigaction action;
+    sigaction(SIGPIPE, nullptr, &action);
+    CHECK(action.sa_handler == SIG_DFL);
+    sigset_t pending;
+    sigpending(&pending);
+    CHECK(sigismember(&pending, SIGPIPE) == 0);
+#endif
+}
+
+int main()
+{
+    return runTests();
+}
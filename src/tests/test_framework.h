@@ -0,0 +1,115 @@
+#pragma once
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+/**
+ * @file
+ * @brief A minimal test runner for the library tests, so the tests need no third party framework.
+ *
+ * Each test is a function defined with `TEST`. `CHECK` records a failure and lets the test carry on, and
+ * an exception thrown out of a test fails it. `runTests` runs every test of the executable and returns
+ * the number that failed, which CTest takes as the result of the executable.
+ */
+
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @struct TestCase
+ * @brief A test registered with `TEST`.
+ *
+ * @var name The name of the test.
+ * @var body The test.
+ */
+struct TestCase
+{
+    const char* name;
+    std::function<void()> body;
+};
+
+// The tests of the executable, in the order they are defined
+inline std::vector<TestCase>& testCases()
+{
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+// The number of checks that have failed so far
+inline int& failedChecks()
+{
+    static int count = 0;
+    return count;
+}
+
+// Registers a test when the executable starts
+struct TestRegistrar
+{
+    TestRegistrar(const char* name, std::function<void()> body)
+    {
+        testCases().push_back({ name, std::move(body) });
+    }
+};
+
+// Defines a test
+#define TEST(name) \
+    static void name(); \
+    static TestRegistrar name##Registrar(#name, name); \
+    static void name()
+
+// Fails the current test if the condition is false
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            ++failedChecks(); \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed\n"; \
+        } \
+    } while (0)
+
+// Fails the current test unless the expression throws an exception derived from std::exception
+#define CHECK_THROWS(expression) \
+    do { \
+        bool thrown = false; \
+        try { \
+            expression; \
+        } \
+        catch (const std::exception&) { \
+            thrown = true; \
+        } \
+        if (!thrown) { \
+            ++failedChecks(); \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_THROWS(" #expression ") did not throw\n"; \
+        } \
+    } while (0)
+
+/**
+ * @brief Runs every registered test and prints a line for each.
+ *
+ * @return The number of tests that failed.
+ */
+inline int runTests()
+{
+    int failedTests = 0;
+    for (const auto& test : testCases()) {
+        int failedBefore = failedChecks();
+        try {
+            test.body();
+        }
+        catch (const std::exception& e) {
+            ++failedChecks();
+            std::cerr << test.name << ": unexpected exception: " << e.what() << "\n";
+        }
+        bool passed = failedChecks() == failedBefore;
+        std::cout << (passed ? "[ PASS ] " : "[ FAIL ] ") << test.name << "\n";
+        failedTests += passed ? 0 : 1;
+    }
+    std::cout << testCases().size() - failedTests << " of " << testCases().size() << " tests passed.\n";
+    return failedTests;
+}
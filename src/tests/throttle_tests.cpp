@@ -0,0 +1,167 @@
+// throttle_tests.cpp : Tests of the rate limiters, and of the control file watcher that changes the limits and
+// priority of a running job.
+//
+
+#include "..\libs\restore\pch.h"
+#include <filesystem>
+#include <fstream>
+#include "..\libs\restore\throttle.h"
+#include "test_framework.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#include <sys/resource.h>
+#endif
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+static void writeControlFile(const std::filesystem::path& path, const std::string& text)
+{
+    std::ofstream file(path, std::ios::trunc);
+    file << text;
+}
+
+// Waits up to `timeout` for a condition, and returns whether it came true
+static bool waitFor(const std::function<bool()>& condition, std::chrono::milliseconds timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return true;
+}
+
+constexpr uint64_t MB = 1024 * 1024;
+
+// The seconds an action takes
+static double secondsFor(const std::function<void()>& action)
+{
+    auto start = std::chrono::steady_clock::now();
+    action();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+TEST(aFullBucketLetsABurstThroughThenPacesTheBytes)
+{
+    RateLimiter limiter(MB);
+    // A new bucket holds a quarter of a second's worth
+    CHECK(secondsFor([&]() { limiter.acquire(MB / 4); }) < 0.1);
+    // The next half second's worth is waited for
+    double wait = secondsFor([&]() { limiter.acquire(MB / 2); });
+    CHECK(wait > 0.4 && wait < 0.8);
+    // A request bigger than the bucket waits for its own bytes
+    wait = secondsFor([&]() { limiter.acquire(MB / 2); });
+    CHECK(wait > 0.4 && wait < 0.8);
+}
+
+TEST(aNewRateAppliesToTheNextBytes)
+{
+    RateLimiter limiter;
+    CHECK(secondsFor([&]() { limiter.acquire(100 * MB); }) < 0.1);
+
+    // A limit set on an unlimited bucket starts full
+    limiter.setRate(MB);
+    CHECK(limiter.getRate() == MB);
+    CHECK(secondsFor([&]() { limiter.acquire(MB / 4); }) < 0.1);
+
+    // The empty bucket refills at the new rate
+    limiter.setRate(4 * MB);
+    double wait = secondsFor([&]() { limiter.acquire(2 * MB); });
+    CHECK(wait > 0.4 && wait < 0.8);
+
+    limiter.setRate(0);
+    CHECK(secondsFor([&]() { limiter.acquire(100 * MB); }) < 0.1);
+}
+
+TEST(theParentLimitsItsChildren)
+{
+    RateLimiter parent(MB);
+    RateLimiter first(0, &parent);
+    RateLimiter second(0, &parent);
+    // The two unlimited children share the parent's bucket
+    first.acquire(MB / 4);
+    double wait = secondsFor([&]() { second.acquire(MB / 2); });
+    CHECK(wait > 0.4 && wait < 0.8);
+}
+
+TEST(aRequestedReloadReadsAnUnchangedFileAgain)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "throttle_tests.control";
+    writeControlFile(path, "write=10\n");
+    {
+        JobLimiters limiters;
+        ThrottleControl control(path.wstring(), limiters);
+        CHECK(waitFor([&]() { return limiters.writes.getRate() != 0; }, std::chrono::milliseconds(3000)));
+        uint64_t firstRate = limiters.writes.getRate();
+
+        // New contents under the old modification time are not noticed by the watcher's polling
+        auto writeTime = std::filesystem::last_write_time(path);
+        writeControlFile(path, "write=20\n");
+        std::filesystem::last_write_time(path, writeTime);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+        CHECK(limiters.writes.getRate() == firstRate);
+
+        ThrottleControl::requestReload();
+        CHECK(waitFor([&]() { return limiters.writes.getRate() == 2 * firstRate; }, std::chrono::milliseconds(1000)));
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(aPriorityFromTheControlFileReachesThreadsAlreadyRunning)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "throttle_tests_priority.control";
+    writeControlFile(path, "priority=below_normal\n");
+    std::atomic<bool> stop{ false };
+    std::atomic<bool> lowered{ false };
+    // A worker started before the control file is read, as a job's workers are
+    std::thread worker([&]() {
+        while (!stop) {
+#ifdef _WIN32
+            lowered = GetPriorityClass(GetCurrentProcess()) == BELOW_NORMAL_PRIORITY_CLASS;
+#else
+            lowered = getpriority(PRIO_PROCESS, 0) >= 10;
+#endif
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    });
+    {
+        JobLimiters limiters;
+        ThrottleControl control(path.wstring(), limiters);
+        CHECK(waitFor([&]() { return lowered.load(); }, std::chrono::milliseconds(3000)));
+    }
+    stop = true;
+    worker.join();
+#ifndef _WIN32
+    // The thread that started the job, and the workers it starts next, have it as well
+    CHECK(getpriority(PRIO_PROCESS, 0) >= 10);
+#endif
+    std::filesystem::remove(path);
+}
+
+#ifndef _WIN32
+TEST(watchingAControlFileLeavesSignalsAlone)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "throttle_tests_signals.control";
+    JobLimiters limiters;
+    ThrottleControl control(path.wstring(), limiters);
+    struct sigaction action;
+    sigaction(SIGHUP, nullptr, &action);
+    CHECK(action.sa_handler == SIG_DFL);
+}
+#endif
+
+int main()
+{
+    return runTests();
+}
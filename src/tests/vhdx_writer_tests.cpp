@@ -0,0 +1,266 @@
+// vhdx_writer_tests.cpp : Checks the files written by VHDXWriter against the layout in the [MS-VHDX] specification.
+//
+// The files are read back with offsets, signatures and GUIDs taken from the specification rather than
+// from the writer, so a mistake in the writer's structures is not repeated by the test.
+//
+
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include "..\libs\file_operations\pch.h"
+#include "..\libs\restore\crc32.h"
+#include "..\libs\vhdx_manager\vhdx_writer.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+constexpr uint64_t MB = 1024 * 1024;
+
+// The GUIDs of the specification, in their on-disk byte order
+typedef std::array<uint8_t, 16> GuidBytes;
+static const GuidBytes BAT_REGION = { 0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42, 0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 };
+static const GuidBytes METADATA_REGION = { 0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B, 0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E };
+static const GuidBytes FILE_PARAMETERS = { 0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D, 0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B };
+static const GuidBytes VIRTUAL_DISK_SIZE = { 0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48, 0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 };
+static const GuidBytes LOGICAL_SECTOR_SIZE = { 0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47, 0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F };
+static const GuidBytes PHYSICAL_SECTOR_SIZE = { 0xC7, 0x48, 0xA3, 0xCD, 0x5D, 0x44, 0x71, 0x44, 0x9C, 0xC9, 0xE9, 0x88, 0x52, 0x51, 0xC5, 0x56 };
+static const GuidBytes PARENT_LOCATOR = { 0x2D, 0x5F, 0xD3, 0xA8, 0x0B, 0xB3, 0x4D, 0x45, 0xAB, 0xF7, 0xD3, 0xD8, 0x48, 0x34, 0xAB, 0x0C };
+
+/**
+ * @class VhdxFile
+ * @brief A VHDX file read back into memory, with the regions and metadata items located from its region table.
+ */
+class VhdxFile {
+public:
+    std::vector<uint8_t> bytes;
+    uint64_t batOffset = 0;
+    uint64_t metadataOffset = 0;
+    std::map<GuidBytes, std::pair<uint32_t, uint32_t>> metadataItems;
+
+    explicit VhdxFile(const std::filesystem::path& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (bytes.size() < 4 * MB) {
+            throw std::runtime_error("The VHDX file is too short.");
+        }
+        for (uint32_t i = 0; i < le32(192 * 1024 + 8); ++i) {
+            uint64_t entry = 192 * 1024 + 16 + i * 32;
+            if (guid(entry) == BAT_REGION) {
+                batOffset = le64(entry + 16);
+            }
+            else if (guid(entry) == METADATA_REGION) {
+                metadataOffset = le64(entry + 16);
+            }
+        }
+        for (uint16_t i = 0; i < le16(metadataOffset + 10); ++i) {
+            uint64_t entry = metadataOffset + 32 + i * 32;
+            metadataItems[guid(entry)] = { le32(entry + 16), le32(entry + 20) };
+        }
+    }
+
+    uint16_t le16(uint64_t offset) const { return static_cast<uint16_t>(bytes[offset] | bytes[offset + 1] << 8); }
+    uint32_t le32(uint64_t offset) const { return le16(offset) | static_cast<uint32_t>(le16(offset + 2)) << 16; }
+    uint64_t le64(uint64_t offset) const { return le32(offset) | static_cast<uint64_t>(le32(offset + 4)) << 32; }
+
+    GuidBytes guid(uint64_t offset) const
+    {
+        GuidBytes value;
+        std::copy(bytes.begin() + offset, bytes.begin() + offset + 16, value.begin());
+        return value;
+    }
+
+    // The file offset of a metadata item's data, or 0 if the item is missing
+    uint64_t item(const GuidBytes& id) const
+    {
+        auto found = metadataItems.find(id);
+        return found == metadataItems.end() ? 0 : metadataOffset + found->second.first;
+    }
+
+    // Checks a structure whose CRC32C is stored at offset 4 and is calculated with that field set to zero
+    bool checksumValid(uint64_t offset, size_t length) const
+    {
+        std::vector<uint8_t> copy(bytes.begin() + offset, bytes.begin() + offset + length);
+        memset(copy.data() + 4, 0, 4);
+        return computeCRC32C(copy.data(), copy.size()) == le32(offset + 4);
+    }
+};
+
+// A path in the temporary folder, removed when the test ends
+struct TemporaryPath
+{
+    std::filesystem::path path;
+
+    explicit TemporaryPath(const char* name) : path(std::filesystem::temp_directory_path() / name)
+    {
+        std::filesystem::remove(path);
+    }
+
+    ~TemporaryPath()
+    {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+    }
+};
+
+static std::vector<uint8_t> makeData(size_t size, uint8_t seed)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = static_cast<uint8_t>(i * 7 + seed + (i >> 12));
+    }
+    return data;
+}
+
+// Checks the parts of the layout that every VHDX has
+static void checkCommonLayout(const VhdxFile& vhdx)
+{
+    // The file type identifier
+    CHECK(memcmp(vhdx.bytes.data(), "vhdxfile", 8) == 0);
+
+    // Two headers, with valid checksums, version 1 and a log of whole megabytes
+    uint64_t sequence[2];
+    for (int i = 0; i < 2; ++i) {
+        uint64_t header = (i + 1) * 64 * 1024;
+        CHECK(memcmp(vhdx.bytes.data() + header, "head", 4) == 0);
+        CHECK(vhdx.checksumValid(header, 4096));
+        CHECK(vhdx.le16(header + 66) == 1);
+        CHECK(vhdx.le32(header + 68) % MB == 0 && vhdx.le32(header + 68) > 0);
+        CHECK(vhdx.le64(header + 72) % MB == 0 && vhdx.le64(header + 72) >= MB);
+        sequence[i] = vhdx.le64(header + 8);
+    }
+    CHECK(sequence[0] != sequence[1]);
+
+    // Two identical region tables, each locating a required BAT region and metadata region
+    CHECK(memcmp(vhdx.bytes.data() + 192 * 1024, vhdx.bytes.data() + 256 * 1024, 64 * 1024) == 0);
+    CHECK(memcmp(vhdx.bytes.data() + 192 * 1024, "regi", 4) == 0);
+    CHECK(vhdx.checksumValid(192 * 1024, 64 * 1024));
+    CHECK(vhdx.le32(192 * 1024 + 8) == 2);
+    for (uint32_t i = 0; i < 2; ++i) {
+        uint64_t entry = 192 * 1024 + 16 + i * 32;
+        CHECK(vhdx.le64(entry + 16) % MB == 0);
+        CHECK(vhdx.le32(entry + 24) % MB == 0);
+        CHECK((vhdx.le32(entry + 28) & 1) == 1);
+    }
+    CHECK(vhdx.batOffset >= MB);
+    CHECK(vhdx.metadataOffset >= MB);
+
+    // The metadata table, with the items every VHDX must have
+    CHECK(memcmp(vhdx.bytes.data() + vhdx.metadataOffset, "metadata", 8) == 0);
+    for (const GuidBytes* id : { &FILE_PARAMETERS, &VIRTUAL_DISK_SIZE, &LOGICAL_SECTOR_SIZE, &PHYSICAL_SECTOR_SIZE }) {
+        CHECK(vhdx.item(*id) >= vhdx.metadataOffset + 64 * 1024);
+    }
+}
+
+TEST(dynamicVhdxMatchesTheSpecification)
+{
+    TemporaryPath path("vhdx_writer_tests_dynamic.vhdx");
+    std::vector<uint8_t> first = makeData(4096, 1);
+    std::vector<uint8_t> second = makeData(static_cast<size_t>(MB), 2);
+    {
+        VHDXWriter writer(path.path.wstring(), 512, false, static_cast<uint32_t>(MB));
+        writer.prepare(64 * MB - 512);
+        writer.writeAt(3 * MB + 512, first.data(), first.size());
+        writer.writeAt(10 * MB, second.data(), second.size());
+        writer.flush();
+    }
+
+    VhdxFile vhdx(path.path);
+    checkCommonLayout(vhdx);
+    CHECK(vhdx.le32(vhdx.item(FILE_PARAMETERS)) == MB);
+    CHECK((vhdx.le32(vhdx.item(FILE_PARAMETERS) + 4) & 2) == 0);
+    CHECK(vhdx.le64(vhdx.item(VIRTUAL_DISK_SIZE)) == 64 * MB - 512);
+    CHECK(vhdx.le32(vhdx.item(LOGICAL_SECTOR_SIZE)) == 512);
+    CHECK(vhdx.le32(vhdx.item(PHYSICAL_SECTOR_SIZE)) == 512);
+
+    // With 1 MB blocks and 512 byte sectors, a chunk is 4096 blocks, so the 64 blocks need no sector bitmap entry
+    for (uint64_t block = 0; block < 64; ++block) {
+        uint64_t entry = vhdx.le64(vhdx.batOffset + block * 8);
+        uint64_t state = entry & 7;
+        if (block == 3 || block == 10) {
+            CHECK(state == 6);
+            uint64_t fileOffset = (entry >> 20) * MB;
+            CHECK(fileOffset % MB == 0 && fileOffset + MB <= vhdx.bytes.size());
+            const std::vector<uint8_t>& data = block == 3 ? first : second;
+            uint64_t start = fileOffset + (block == 3 ? 512 : 0);
+            CHECK(std::equal(data.begin(), data.end(), vhdx.bytes.begin() + start));
+        }
+        else {
+            CHECK(state == 0);
+        }
+    }
+}
+
+TEST(fixedVhdxAllocatesEveryBlock)
+{
+    TemporaryPath path("vhdx_writer_tests_fixed.vhdx");
+    {
+        VHDXWriter writer(path.path.wstring(), 4096, true, static_cast<uint32_t>(2 * MB));
+        writer.prepare(16 * MB);
+        writer.flush();
+    }
+
+    VhdxFile vhdx(path.path);
+    checkCommonLayout(vhdx);
+    CHECK(vhdx.le32(vhdx.item(FILE_PARAMETERS)) == 2 * MB);
+    // Fixed disks set LeaveBlocksAllocated
+    CHECK((vhdx.le32(vhdx.item(FILE_PARAMETERS) + 4) & 1) == 1);
+    CHECK(vhdx.le32(vhdx.item(LOGICAL_SECTOR_SIZE)) == 4096);
+    std::set<uint64_t> offsets;
+    for (uint64_t block = 0; block < 8; ++block) {
+        uint64_t entry = vhdx.le64(vhdx.batOffset + block * 8);
+        CHECK((entry & 7) == 6);
+        offsets.insert((entry >> 20) * MB);
+        CHECK((entry >> 20) * MB + 2 * MB <= vhdx.bytes.size());
+    }
+    CHECK(offsets.size() == 8);
+}
+
+TEST(differencingVhdxLinksItsParent)
+{
+    TemporaryPath parentPath("vhdx_writer_tests_parent.vhdx");
+    TemporaryPath childPath("vhdx_writer_tests_child.vhdx");
+    std::vector<uint8_t> data = makeData(1024, 3);
+    VHDXWriter parent(parentPath.path.wstring(), 512);
+    parent.prepare(64 * MB);
+    parent.flush();
+    {
+        VHDXWriter child(childPath.path.wstring(), 512, false, static_cast<uint32_t>(2 * MB));
+        child.setParent(parent);
+        child.prepare(64 * MB);
+        child.writeAt(5 * MB + 1024, data.data(), data.size());
+        child.flush();
+    }
+
+    VhdxFile vhdx(childPath.path);
+    checkCommonLayout(vhdx);
+    CHECK((vhdx.le32(vhdx.item(FILE_PARAMETERS) + 4) & 2) == 2);
+    CHECK(vhdx.item(PARENT_LOCATOR) != 0);
+
+    // Block 2 holds the write, only partly, so its sectors are marked in the sector bitmap that follows the chunk.
+    // With 2 MB blocks, a chunk is 2048 blocks.
+    uint64_t entry = vhdx.le64(vhdx.batOffset + 2 * 8);
+    CHECK((entry & 7) == 7);
+    CHECK(std::equal(data.begin(), data.end(), vhdx.bytes.begin() + (entry >> 20) * MB + MB + 1024));
+    uint64_t bitmapEntry = vhdx.le64(vhdx.batOffset + 2048 * 8);
+    CHECK((bitmapEntry & 7) == 6);
+    uint64_t bitmap = (bitmapEntry >> 20) * MB;
+    uint64_t firstSector = (5 * MB + 1024) / 512;
+    for (uint64_t sector = firstSector - 1; sector <= firstSector + 2; ++sector) {
+        bool present = (vhdx.bytes[bitmap + sector / 8] >> (sector % 8)) & 1;
+        CHECK(present == (sector >= firstSector && sector < firstSector + 2));
+    }
+}
+
+int main()
+{
+    return runTests();
+}
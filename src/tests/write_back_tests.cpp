@@ -0,0 +1,112 @@
+// write_back_tests.cpp : Tests of the periodic write-back of file targets.
+//
+
+#include "..\libs\restore\pch.h"
+#include <filesystem>
+#include "..\libs\file_operations\restore_target.h"
+#include "test_framework.h"
+
+/*
+===============================================================================
+Copyright (c) 2024 Paramount Software UK Limited. All rights reserved.
+
+Licensed under the MIT License.
+===============================================================================
+*/
+
+using Ranges = std::map<uint64_t, uint64_t>;
+
+static WriteBackPolicy periodic(uint64_t intervalBytes)
+{
+    WriteBackPolicy policy;
+    policy.durability = Durability::ePeriodic;
+    policy.interval_bytes = intervalBytes;
+    return policy;
+}
+
+TEST(intervalsKeepTheRangesWrittenInThem)
+{
+    WriteBackTracker tracker;
+    tracker.setPolicy(periodic(4096));
+    WriteBackTracker::Span start;
+    WriteBackTracker::Span wait;
+
+    // Two ranges far apart, and one that meets the first
+    CHECK(!tracker.record(0, 1024, start, wait));
+    CHECK(!tracker.record(1024 * 1024, 1024, start, wait));
+    CHECK(tracker.record(1024, 2048, start, wait));
+    CHECK(start.bytes == 4096);
+    CHECK(start.ranges == Ranges({ { 0, 3072 }, { 1024 * 1024, 1024 * 1024 + 1024 } }));
+    CHECK(wait.ranges.empty());
+
+    // The next interval hands back the one before it to wait for
+    CHECK(tracker.record(8192, 4096, start, wait));
+    CHECK(start.ranges == Ranges({ { 8192, 12288 } }));
+    CHECK(wait.bytes == 4096);
+    CHECK(wait.ranges.size() == 2);
+    CHECK(tracker.getStats().write_backs == 2);
+}
+
+TEST(aRangeWrittenTwiceInAnIntervalIsCountedOnce)
+{
+    WriteBackTracker tracker;
+    tracker.setPolicy(periodic(1024 * 1024));
+    WriteBackTracker::Span start;
+    WriteBackTracker::Span wait;
+
+    tracker.record(4096, 4096, start, wait);
+    tracker.record(4096, 4096, start, wait);
+    // Overlaps both ends of the ranges around it, and bridges them
+    tracker.record(12288, 4096, start, wait);
+    tracker.record(6144, 8192, start, wait);
+    CHECK(tracker.getStats().dirty_bytes == 12288);
+
+    tracker.completed(wait);
+    tracker.flushed();
+    CHECK(tracker.getStats().dirty_bytes == 0);
+    CHECK(tracker.getStats().peak_dirty_bytes == 12288);
+}
+
+TEST(completedIntervalsLeaveTheDirtyData)
+{
+    WriteBackTracker tracker;
+    tracker.setPolicy(periodic(4096));
+    WriteBackTracker::Span start;
+    WriteBackTracker::Span wait;
+
+    CHECK(tracker.record(0, 4096, start, wait));
+    CHECK(tracker.record(4096, 4096, start, wait));
+    tracker.completed(wait);
+    CHECK(tracker.getStats().dirty_bytes == 4096);
+    CHECK(tracker.getStats().peak_dirty_bytes == 8192);
+}
+
+TEST(mappedWritesCountOnceTheyAreCommitted)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "write_back_tests.img";
+    {
+        MappedFileTarget target(path.wstring());
+        target.setWriteBack(periodic(1024 * 1024));
+        target.prepare(4 * 1024 * 1024);
+
+        // Handing out the memory is not a write. The data is only there once the decode into it is done.
+        uint8_t* destination = target.getWritePointer(65536, 65536);
+        CHECK(destination != nullptr);
+        CHECK(target.getWriteBackStats().dirty_bytes == 0);
+        memset(destination, 0x5A, 65536);
+        target.commitWrite(65536, 65536);
+        CHECK(target.getWriteBackStats().dirty_bytes == 65536);
+
+        std::vector<uint8_t> data(65536, 0xA5);
+        target.writeAt(0, data.data(), data.size());
+        CHECK(target.getWriteBackStats().dirty_bytes == 2 * 65536);
+        target.flush();
+        CHECK(target.getWriteBackStats().dirty_bytes == 0);
+    }
+    std::filesystem::remove(path);
+}
+
+int main()
+{
+    return runTests();
+}